@@ -99,6 +99,26 @@ const config_item_t CONFIG_ITEMS[] = {
                 .type = CONFIG_ITEM_TYPE_STRING,
                 .secret = true,
                 .def.str = ""
+        }, {
+                .key = KEY_CONFIG_NTRIP_SERVER_V2,
+                .type = CONFIG_ITEM_TYPE_BOOL,
+                .def.bool1 = true
+        }, {
+                .key = KEY_CONFIG_NTRIP_SERVER_FILTER,
+                .type = CONFIG_ITEM_TYPE_STRING,
+                .def.str = ""
+        }, {
+                .key = KEY_CONFIG_NTRIP_SERVER_TARGETS,
+                .type = CONFIG_ITEM_TYPE_STRING,
+                .def.str = ""
+        }, {
+                .key = KEY_CONFIG_NTRIP_SERVER_SHED,
+                .type = CONFIG_ITEM_TYPE_STRING,
+                .def.str = "1019,1020,1042,1044,1045,1046,1230"
+        }, {
+                .key = KEY_CONFIG_NTRIP_SERVER_MAX_AGE,
+                .type = CONFIG_ITEM_TYPE_UINT16,
+                .def.uint16 = 3000
         },
 
         {
@@ -130,6 +150,34 @@ const config_item_t CONFIG_ITEMS[] = {
                 .type = CONFIG_ITEM_TYPE_STRING,
                 .secret = true,
                 .def.str = ""
+        }, {
+                .key = KEY_CONFIG_NTRIP_CLIENT_BACKUPS,
+                .type = CONFIG_ITEM_TYPE_STRING,
+                .def.str = ""
+        }, {
+                .key = KEY_CONFIG_NTRIP_CLIENT_NEAREST,
+                .type = CONFIG_ITEM_TYPE_BOOL,
+                .def.bool1 = false
+        }, {
+                .key = KEY_CONFIG_NTRIP_CLIENT_NEAREST_DISTANCE,
+                .type = CONFIG_ITEM_TYPE_UINT16,
+                .def.uint16 = 10000
+        }, {
+                .key = KEY_CONFIG_NTRIP_CLIENT_V2,
+                .type = CONFIG_ITEM_TYPE_BOOL,
+                .def.bool1 = true
+        }, {
+                .key = KEY_CONFIG_NTRIP_CLIENT_GGA_INTERVAL,
+                .type = CONFIG_ITEM_TYPE_UINT16,
+                .def.uint16 = 15
+        }, {
+                .key = KEY_CONFIG_NTRIP_CLIENT_GGA_DISTANCE,
+                .type = CONFIG_ITEM_TYPE_UINT16,
+                .def.uint16 = 0
+        }, {
+                .key = KEY_CONFIG_NTRIP_CLIENT_STALL,
+                .type = CONFIG_ITEM_TYPE_UINT16,
+                .def.uint16 = 10
         },
 
         {
@@ -157,6 +205,29 @@ const config_item_t CONFIG_ITEMS[] = {
                 .type = CONFIG_ITEM_TYPE_STRING,
                 .secret = true,
                 .def.str = ""
+        }, {
+                .key = KEY_CONFIG_NTRIP_CASTER_RELAY,
+                .type = CONFIG_ITEM_TYPE_BOOL,
+                .def.bool1 = false
+        }, {
+                .key = KEY_CONFIG_NTRIP_CASTER_SOURCE_USERNAME,
+                .type = CONFIG_ITEM_TYPE_STRING,
+                .def.str = ""
+        }, {
+                .key = KEY_CONFIG_NTRIP_CASTER_SOURCE_PASSWORD,
+                .type = CONFIG_ITEM_TYPE_STRING,
+                .secret = true,
+                .def.str = ""
+        },
+
+        // Routing
+        {
+                .key = KEY_CONFIG_ROUTES,
+                .type = CONFIG_ITEM_TYPE_STRING,
+                .def.str = "uart>ntrip_server,ntrip_caster,ntrip_client,socket_server,socket_client\n"
+                        "ntrip_client>uart\n"
+                        "socket_server>uart\n"
+                        "socket_client>uart"
         },
 
         // Socket
@@ -176,6 +247,14 @@ const config_item_t CONFIG_ITEMS[] = {
                 .key = KEY_CONFIG_SOCKET_SERVER_UDP_PORT,
                 .type = CONFIG_ITEM_TYPE_UINT16,
                 .def.uint16 = 23
+        }, {
+                .key = KEY_CONFIG_SOCKET_SERVER_TUNNEL,
+                .type = CONFIG_ITEM_TYPE_BOOL,
+                .def.bool1 = false
+        }, {
+                .key = KEY_CONFIG_SOCKET_SERVER_FEC,
+                .type = CONFIG_ITEM_TYPE_UINT8,
+                .def.uint8 = 0
         },
 
         {
@@ -202,6 +281,33 @@ const config_item_t CONFIG_ITEMS[] = {
                 .key = KEY_CONFIG_SOCKET_CLIENT_CONNECT_MESSAGE,
                 .type = CONFIG_ITEM_TYPE_STRING,
                 .def.str = "\n"
+        }, {
+                .key = KEY_CONFIG_SOCKET_CLIENT_TUNNEL,
+                .type = CONFIG_ITEM_TYPE_BOOL,
+                .def.bool1 = false
+        }, {
+                .key = KEY_CONFIG_SOCKET_CLIENT_FEC,
+                .type = CONFIG_ITEM_TYPE_UINT8,
+                .def.uint8 = 0
+        },
+
+        // TCP
+        {
+                .key = KEY_CONFIG_TCP_KEEPALIVE_IDLE,
+                .type = CONFIG_ITEM_TYPE_UINT16,
+                .def.uint16 = 30
+        }, {
+                .key = KEY_CONFIG_TCP_KEEPALIVE_INTERVAL,
+                .type = CONFIG_ITEM_TYPE_UINT16,
+                .def.uint16 = 5
+        }, {
+                .key = KEY_CONFIG_TCP_KEEPALIVE_COUNT,
+                .type = CONFIG_ITEM_TYPE_UINT8,
+                .def.uint8 = 3
+        }, {
+                .key = KEY_CONFIG_TCP_STALL_TIMEOUT,
+                .type = CONFIG_ITEM_TYPE_UINT16,
+                .def.uint16 = 20
         },
 
         // UART
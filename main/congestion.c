@@ -0,0 +1,186 @@
+/*
+ * This file is part of the ESP32-XBee distribution (https://github.com/nebkat/esp32-xbee).
+ * Copyright (c) 2020 Nebojsa Cvetkovic.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <freertos/FreeRTOS.h>
+#include <esp_timer.h>
+#include "congestion.h"
+
+#define LOW_PRIORITY_TYPES_MAX 16
+
+// Milliseconds of backlog at which each priority starts being shed
+#define SHED_DELAY_LOW 1000
+#define SHED_DELAY_NORMAL 2500
+
+// Drain rate is measured over periods while data is backlogged
+#define MEASUREMENT_PERIOD 1000000
+#define BANDWIDTH_ALPHA 0.7
+
+// Messages are admitted from the UART handler and shed again when stale in sender tasks
+static portMUX_TYPE shed_lock = portMUX_INITIALIZER_UNLOCKED;
+
+struct congestion {
+    uint16_t low_priority[LOW_PRIORITY_TYPES_MAX];
+    uint8_t low_priority_count;
+    int64_t max_age;
+
+    // Bytes per second, 0 while the uplink keeps up, a single word read from other tasks without locking
+    uint32_t bandwidth;
+    int64_t period_start;
+    size_t period_sent;
+
+    congestion_shed_t shed[CONGESTION_TYPES_MAX];
+    uint8_t shed_count;
+    uint32_t shed_other;
+};
+
+congestion_handle_t congestion_init(const char *low_priority, uint32_t max_age) {
+    congestion_handle_t handle = calloc(1, sizeof(struct congestion));
+    if (handle == NULL) return NULL;
+
+    handle->max_age = (int64_t) max_age * 1000;
+
+    const char *type = low_priority;
+    while (type != NULL && *type != '\0' && handle->low_priority_count < LOW_PRIORITY_TYPES_MAX) {
+        uint16_t value = strtoul(type, NULL, 10);
+        if (value != 0) handle->low_priority[handle->low_priority_count++] = value;
+
+        type = strchr(type, ',');
+        if (type != NULL) type++;
+    }
+
+    return handle;
+}
+
+congestion_priority_t congestion_priority(congestion_handle_t handle, uint16_t type) {
+    for (int i = 0; i < handle->low_priority_count; i++) {
+        if (handle->low_priority[i] == type) return CONGESTION_PRIORITY_LOW;
+    }
+
+    // Observations (legacy and MSM) and station position
+    if ((type >= 1001 && type <= 1004) || (type >= 1009 && type <= 1012) ||
+            (type >= 1071 && type <= 1127) || type == 1005 || type == 1006) {
+        return CONGESTION_PRIORITY_HIGH;
+    }
+
+    return CONGESTION_PRIORITY_NORMAL;
+}
+
+static void congestion_shed(congestion_handle_t handle, uint16_t type) {
+    portENTER_CRITICAL(&shed_lock);
+
+    int i;
+    for (i = 0; i < handle->shed_count; i++) {
+        if (handle->shed[i].type == type) break;
+    }
+
+    if (i < handle->shed_count) {
+        handle->shed[i].count++;
+    } else if (type == 0 || handle->shed_count == CONGESTION_TYPES_MAX) {
+        handle->shed_other++;
+    } else {
+        handle->shed[handle->shed_count++] = (congestion_shed_t) {
+                .type = type,
+                .count = 1
+        };
+    }
+
+    portEXIT_CRITICAL(&shed_lock);
+}
+
+bool congestion_admit(congestion_handle_t handle, uint16_t type, size_t length, size_t backlog) {
+    if (handle == NULL) return true;
+
+    uint32_t bandwidth = handle->bandwidth;
+    if (bandwidth == 0) return true;
+
+    // Time until this message would be sent at the current drain rate
+    double delay = (double) (backlog + length) * 1000 / bandwidth;
+
+    congestion_priority_t priority = congestion_priority(handle, type);
+    if ((priority == CONGESTION_PRIORITY_LOW && delay > SHED_DELAY_LOW) ||
+            (priority == CONGESTION_PRIORITY_NORMAL && delay > SHED_DELAY_NORMAL)) {
+        congestion_shed(handle, type);
+        return false;
+    }
+
+    return true;
+}
+
+bool congestion_fresh(congestion_handle_t handle, uint16_t type, int64_t time) {
+    if (handle == NULL || handle->max_age == 0 || esp_timer_get_time() - time <= handle->max_age) return true;
+
+    // Late corrections are worse than none
+    congestion_shed(handle, type);
+    return false;
+}
+
+void congestion_sent(congestion_handle_t handle, size_t length, size_t backlog) {
+    if (handle == NULL) return;
+
+    int64_t now = esp_timer_get_time();
+
+    // Queue emptied, drain rate only reflects capacity while data is waiting
+    if (backlog == 0) {
+        handle->period_start = 0;
+        return;
+    }
+
+    if (handle->period_start == 0) {
+        handle->period_start = now;
+        handle->period_sent = 0;
+    }
+
+    handle->period_sent += length;
+
+    int64_t elapsed = now - handle->period_start;
+    if (elapsed < MEASUREMENT_PERIOD) return;
+
+    double rate = (double) handle->period_sent * 1000000 / elapsed;
+    if (handle->bandwidth != 0) rate = handle->bandwidth * BANDWIDTH_ALPHA + rate * (1.0 - BANDWIDTH_ALPHA);
+    handle->bandwidth = rate < 1 ? 1 : (uint32_t) rate;
+
+    handle->period_start = now;
+    handle->period_sent = 0;
+}
+
+uint32_t congestion_bandwidth(congestion_handle_t handle) {
+    return handle == NULL ? 0 : handle->bandwidth;
+}
+
+int congestion_shed_counts(congestion_handle_t handle, congestion_shed_t *counts, int max) {
+    if (handle == NULL) return 0;
+
+    portENTER_CRITICAL(&shed_lock);
+
+    int count = 0;
+    for (int i = 0; i < handle->shed_count && count < max; i++) {
+        counts[count++] = handle->shed[i];
+    }
+
+    if (handle->shed_other > 0 && count < max) {
+        counts[count++] = (congestion_shed_t) {
+                .type = 0,
+                .count = handle->shed_other
+        };
+    }
+
+    portEXIT_CRITICAL(&shed_lock);
+
+    return count;
+}
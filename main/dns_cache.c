@@ -0,0 +1,321 @@
+/*
+ * This file is part of the ESP32-XBee distribution (https://github.com/nebkat/esp32-xbee).
+ * Copyright (c) 2020 Nebojsa Cvetkovic.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/semphr.h>
+#include <lwip/netdb.h>
+#include <nvs_flash.h>
+#include <tasks.h>
+
+#include "dns_cache.h"
+
+static const char *TAG = "DNS_CACHE";
+
+#define STORAGE "dns_cache"
+#define STORAGE_KEY "entries"
+
+// Background lookups for callers that can't wait, failures are kept for the caller to collect
+#define PENDING_MAX 4
+#define PENDING_FAILED_LIFETIME 10000
+
+typedef struct dns_cache_entry {
+    char host[64];
+    uint8_t count;
+    struct sockaddr_storage addrs[DNS_CACHE_ADDRESSES];
+
+    // Not persisted
+    int64_t resolved_at;
+    int64_t used_at;
+    bool refreshing;
+} dns_cache_entry_t;
+
+static dns_cache_entry_t entries[DNS_CACHE_SIZE];
+static SemaphoreHandle_t dns_lock = NULL;
+static TaskHandle_t refresh_task = NULL;
+static nvs_handle_t storage_handle;
+static bool storage_open = false;
+
+static dns_cache_stats_t stats;
+
+static struct dns_cache_pending {
+    char host[64];
+    int socktype;
+
+    bool failed;
+    int64_t failed_at;
+} pending[PENDING_MAX];
+
+// Only the addresses survive a restart, restored entries are stale until refreshed
+static void dns_cache_save() {
+    if (!storage_open) return;
+
+    nvs_set_blob(storage_handle, STORAGE_KEY, entries, sizeof(entries));
+    nvs_commit(storage_handle);
+}
+
+static void dns_cache_load() {
+    size_t length = sizeof(entries);
+    if (nvs_get_blob(storage_handle, STORAGE_KEY, entries, &length) != ESP_OK || length != sizeof(entries)) {
+        memset(entries, 0, sizeof(entries));
+        return;
+    }
+
+    int64_t now = esp_timer_get_time();
+    for (int i = 0; i < DNS_CACHE_SIZE; i++) {
+        dns_cache_entry_t *entry = &entries[i];
+        entry->host[sizeof(entry->host) - 1] = '\0';
+        if (entry->count > DNS_CACHE_ADDRESSES) entry->count = 0;
+        if (entry->count == 0) entry->host[0] = '\0';
+
+        entry->resolved_at = now - (int64_t) DNS_CACHE_TTL * 1000000;
+        entry->used_at = 0;
+        entry->refreshing = false;
+    }
+}
+
+static int dns_cache_lookup(const char *host, int socktype, struct sockaddr_storage *addrs, int max) {
+    struct addrinfo addr_hints = {
+            .ai_family = AF_UNSPEC,
+            .ai_socktype = socktype
+    };
+    struct addrinfo *addr_results;
+
+    int err = getaddrinfo(host, NULL, &addr_hints, &addr_results);
+    if (err != 0 || addr_results == NULL) return -1;
+
+    int count = 0;
+    for (struct addrinfo *addr_result = addr_results; addr_result != NULL && count < max; addr_result = addr_result->ai_next) {
+        if (addr_result->ai_addrlen > sizeof(struct sockaddr_storage)) continue;
+
+        memset(&addrs[count], 0, sizeof(struct sockaddr_storage));
+        memcpy(&addrs[count], addr_result->ai_addr, addr_result->ai_addrlen);
+        count++;
+    }
+
+    freeaddrinfo(addr_results);
+
+    return count > 0 ? count : -1;
+}
+
+static dns_cache_entry_t *dns_cache_find(const char *host) {
+    for (int i = 0; i < DNS_CACHE_SIZE; i++) {
+        if (entries[i].count > 0 && strcasecmp(entries[i].host, host) == 0) return &entries[i];
+    }
+
+    return NULL;
+}
+
+// Stores a result, replacing the least recently used entry for new hosts
+static void dns_cache_store(const char *host, struct sockaddr_storage *addrs, int count) {
+    dns_cache_entry_t *entry = dns_cache_find(host);
+    if (entry == NULL) {
+        entry = &entries[0];
+        for (int i = 1; i < DNS_CACHE_SIZE && entry->count > 0; i++) {
+            if (entries[i].count == 0 || entries[i].used_at < entry->used_at) entry = &entries[i];
+        }
+
+        memset(entry, 0, sizeof(dns_cache_entry_t));
+        strlcpy(entry->host, host, sizeof(entry->host));
+        entry->used_at = esp_timer_get_time();
+    }
+
+    bool changed = entry->count != count || memcmp(entry->addrs, addrs, count * sizeof(struct sockaddr_storage)) != 0;
+
+    entry->count = count;
+    memcpy(entry->addrs, addrs, count * sizeof(struct sockaddr_storage));
+    entry->resolved_at = esp_timer_get_time();
+
+    // Avoid flash writes when a refresh returns the same addresses
+    if (changed) dns_cache_save();
+}
+
+static bool dns_cache_numeric(const char *host) {
+    struct in6_addr addr;
+    return inet_pton(AF_INET, host, &addr) == 1 || inet_pton(AF_INET6, host, &addr) == 1;
+}
+
+// Copies cached addresses while holding the lock, returns 0 if host is not cached
+static int dns_cache_cached(const char *host, struct sockaddr_storage *addrs, int max) {
+    dns_cache_entry_t *entry = dns_cache_find(host);
+    if (entry == NULL) return 0;
+
+    int64_t now = esp_timer_get_time();
+
+    int count = entry->count < max ? entry->count : max;
+    memcpy(addrs, entry->addrs, count * sizeof(struct sockaddr_storage));
+    entry->used_at = now;
+
+    // Expired results are still returned, the refresh happens in the background
+    bool stale = now - entry->resolved_at >= (int64_t) DNS_CACHE_TTL * 1000000;
+    if (stale) {
+        stats.stale_hits++;
+        if (!entry->refreshing) {
+            entry->refreshing = true;
+            xTaskNotifyGive(refresh_task);
+        }
+    } else {
+        stats.hits++;
+    }
+
+    return count;
+}
+
+int dns_cache_resolve_nowait(const char *host, int socktype, struct sockaddr_storage *addrs, int max) {
+    if (dns_lock == NULL || dns_cache_numeric(host)) return dns_cache_lookup(host, socktype, addrs, max);
+
+    int64_t now = esp_timer_get_time();
+
+    xSemaphoreTake(dns_lock, portMAX_DELAY);
+    int count = dns_cache_cached(host, addrs, max);
+
+    struct dns_cache_pending *lookup = NULL, *free_lookup = NULL;
+    for (int i = 0; i < PENDING_MAX && count == 0; i++) {
+        if (pending[i].host[0] != '\0' && strcasecmp(pending[i].host, host) == 0) {
+            lookup = &pending[i];
+            break;
+        }
+
+        bool expired = pending[i].failed && now - pending[i].failed_at > PENDING_FAILED_LIFETIME * 1000;
+        if (free_lookup == NULL && (pending[i].host[0] == '\0' || expired)) free_lookup = &pending[i];
+    }
+
+    if (lookup != NULL && lookup->failed) {
+        // Failure is reported once, the next call starts a new lookup
+        lookup->host[0] = '\0';
+        count = -1;
+    } else if (count == 0 && lookup == NULL && free_lookup != NULL) {
+        stats.misses++;
+        strlcpy(free_lookup->host, host, sizeof(free_lookup->host));
+        free_lookup->socktype = socktype;
+        free_lookup->failed = false;
+        xTaskNotifyGive(refresh_task);
+    }
+    xSemaphoreGive(dns_lock);
+
+    return count;
+}
+
+static void dns_cache_refresh_task(void *ctx) {
+    char host[sizeof(entries[0].host)];
+
+    while (true) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+        // Refresh one entry at a time so lookups are never blocked on the resolver
+        while (true) {
+            xSemaphoreTake(dns_lock, portMAX_DELAY);
+            dns_cache_entry_t *entry = NULL;
+            for (int i = 0; i < DNS_CACHE_SIZE; i++) {
+                if (entries[i].count > 0 && entries[i].refreshing) {
+                    entry = &entries[i];
+                    break;
+                }
+            }
+            if (entry != NULL) strcpy(host, entry->host);
+            xSemaphoreGive(dns_lock);
+
+            if (entry == NULL) break;
+
+            struct sockaddr_storage results[DNS_CACHE_ADDRESSES];
+            int count = dns_cache_lookup(host, 0, results, DNS_CACHE_ADDRESSES);
+
+            xSemaphoreTake(dns_lock, portMAX_DELAY);
+            // Entry may have been replaced by another host while resolving
+            if (strcasecmp(entry->host, host) == 0) {
+                entry->refreshing = false;
+                if (count > 0) {
+                    dns_cache_store(host, results, count);
+                    stats.refreshes++;
+                } else {
+                    // Keep serving the old addresses, try again on the next use
+                    stats.failures++;
+                }
+            }
+            xSemaphoreGive(dns_lock);
+
+            if (count <= 0) ESP_LOGW(TAG, "Could not refresh %s, using previous result", host);
+        }
+
+        // Lookups for hosts not in the cache yet
+        while (true) {
+            xSemaphoreTake(dns_lock, portMAX_DELAY);
+            struct dns_cache_pending *lookup = NULL;
+            for (int i = 0; i < PENDING_MAX; i++) {
+                if (pending[i].host[0] != '\0' && !pending[i].failed) {
+                    lookup = &pending[i];
+                    break;
+                }
+            }
+            int socktype = 0;
+            if (lookup != NULL) {
+                strcpy(host, lookup->host);
+                socktype = lookup->socktype;
+            }
+            xSemaphoreGive(dns_lock);
+
+            if (lookup == NULL) break;
+
+            struct sockaddr_storage results[DNS_CACHE_ADDRESSES];
+            int count = dns_cache_lookup(host, socktype, results, DNS_CACHE_ADDRESSES);
+
+            xSemaphoreTake(dns_lock, portMAX_DELAY);
+            if (count > 0) {
+                // Caller picks the result up from the cache
+                dns_cache_store(host, results, count);
+                lookup->host[0] = '\0';
+            } else {
+                stats.failures++;
+                lookup->failed = true;
+                lookup->failed_at = esp_timer_get_time();
+            }
+            xSemaphoreGive(dns_lock);
+        }
+    }
+}
+
+void dns_cache_stats(dns_cache_stats_t *out) {
+    if (dns_lock == NULL) {
+        *out = (dns_cache_stats_t) {0};
+        return;
+    }
+
+    xSemaphoreTake(dns_lock, portMAX_DELAY);
+    *out = stats;
+    out->entries = 0;
+    for (int i = 0; i < DNS_CACHE_SIZE; i++) {
+        if (entries[i].count > 0) out->entries++;
+    }
+    xSemaphoreGive(dns_lock);
+}
+
+void dns_cache_init() {
+    esp_err_t err = nvs_open(STORAGE, NVS_READWRITE, &storage_handle);
+    if (err == ESP_OK) {
+        storage_open = true;
+        dns_cache_load();
+    } else {
+        ESP_LOGW(TAG, "Could not open storage, results will not be persisted: %s", esp_err_to_name(err));
+    }
+
+    dns_lock = xSemaphoreCreateMutex();
+    xTaskCreatePinnedToCore(dns_cache_refresh_task, "dns_cache_task", 3072, NULL, TASK_PRIORITY_INTERFACE, &refresh_task,
+            TASK_CORE_NETWORK);
+}
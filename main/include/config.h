@@ -77,6 +77,11 @@ typedef struct config_item {
 #define KEY_CONFIG_NTRIP_SERVER_MOUNTPOINT "ntr_srv_mp"
 #define KEY_CONFIG_NTRIP_SERVER_USERNAME "ntr_srv_user"
 #define KEY_CONFIG_NTRIP_SERVER_PASSWORD "ntr_srv_pass"
+#define KEY_CONFIG_NTRIP_SERVER_V2 "ntr_srv_v2"
+#define KEY_CONFIG_NTRIP_SERVER_FILTER "ntr_srv_filter"
+#define KEY_CONFIG_NTRIP_SERVER_TARGETS "ntr_srv_targets"
+#define KEY_CONFIG_NTRIP_SERVER_SHED "ntr_srv_shed"
+#define KEY_CONFIG_NTRIP_SERVER_MAX_AGE "ntr_srv_max_age"
 
 #define KEY_CONFIG_NTRIP_CLIENT_ACTIVE "ntr_cli_active"
 #define KEY_CONFIG_NTRIP_CLIENT_COLOR "ntr_cli_color"
@@ -85,6 +90,13 @@ typedef struct config_item {
 #define KEY_CONFIG_NTRIP_CLIENT_MOUNTPOINT "ntr_cli_mp"
 #define KEY_CONFIG_NTRIP_CLIENT_USERNAME "ntr_cli_user"
 #define KEY_CONFIG_NTRIP_CLIENT_PASSWORD "ntr_cli_pass"
+#define KEY_CONFIG_NTRIP_CLIENT_V2 "ntr_cli_v2"
+#define KEY_CONFIG_NTRIP_CLIENT_BACKUPS "ntr_cli_backups"
+#define KEY_CONFIG_NTRIP_CLIENT_NEAREST "ntr_cli_nearest"
+#define KEY_CONFIG_NTRIP_CLIENT_NEAREST_DISTANCE "ntr_cli_near_dst"
+#define KEY_CONFIG_NTRIP_CLIENT_GGA_INTERVAL "ntr_cli_gga_int"
+#define KEY_CONFIG_NTRIP_CLIENT_GGA_DISTANCE "ntr_cli_gga_dst"
+#define KEY_CONFIG_NTRIP_CLIENT_STALL "ntr_cli_stall"
 
 #define KEY_CONFIG_NTRIP_CASTER_ACTIVE "ntr_cst_active"
 #define KEY_CONFIG_NTRIP_CASTER_COLOR "ntr_cst_color"
@@ -92,12 +104,20 @@ typedef struct config_item {
 #define KEY_CONFIG_NTRIP_CASTER_MOUNTPOINT "ntr_cst_mp"
 #define KEY_CONFIG_NTRIP_CASTER_USERNAME "ntr_cst_user"
 #define KEY_CONFIG_NTRIP_CASTER_PASSWORD "ntr_cst_pass"
+#define KEY_CONFIG_NTRIP_CASTER_RELAY "ntr_cst_relay"
+#define KEY_CONFIG_NTRIP_CASTER_SOURCE_USERNAME "ntr_cst_s_user"
+#define KEY_CONFIG_NTRIP_CASTER_SOURCE_PASSWORD "ntr_cst_s_pass"
+
+// Routing
+#define KEY_CONFIG_ROUTES "routes"
 
 // Socket
 #define KEY_CONFIG_SOCKET_SERVER_ACTIVE "sck_srv_active"
 #define KEY_CONFIG_SOCKET_SERVER_COLOR "sck_srv_color"
 #define KEY_CONFIG_SOCKET_SERVER_TCP_PORT "sck_srv_t_port"
 #define KEY_CONFIG_SOCKET_SERVER_UDP_PORT "sck_srv_u_port"
+#define KEY_CONFIG_SOCKET_SERVER_TUNNEL "sck_srv_tunnel"
+#define KEY_CONFIG_SOCKET_SERVER_FEC "sck_srv_fec"
 
 #define KEY_CONFIG_SOCKET_CLIENT_ACTIVE "sck_cli_active"
 #define KEY_CONFIG_SOCKET_CLIENT_COLOR "sck_cli_color"
@@ -105,6 +125,14 @@ typedef struct config_item {
 #define KEY_CONFIG_SOCKET_CLIENT_PORT "sck_cli_port"
 #define KEY_CONFIG_SOCKET_CLIENT_TYPE_TCP_UDP "sck_cli_type"
 #define KEY_CONFIG_SOCKET_CLIENT_CONNECT_MESSAGE "sck_cli_msg"
+#define KEY_CONFIG_SOCKET_CLIENT_TUNNEL "sck_cli_tunnel"
+#define KEY_CONFIG_SOCKET_CLIENT_FEC "sck_cli_fec"
+
+// TCP
+#define KEY_CONFIG_TCP_KEEPALIVE_IDLE "tcp_ka_idle"
+#define KEY_CONFIG_TCP_KEEPALIVE_INTERVAL "tcp_ka_intvl"
+#define KEY_CONFIG_TCP_KEEPALIVE_COUNT "tcp_ka_count"
+#define KEY_CONFIG_TCP_STALL_TIMEOUT "tcp_stall"
 
 // UART
 #define KEY_CONFIG_UART_NUM "uart_num"
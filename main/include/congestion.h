@@ -0,0 +1,41 @@
+#ifndef ESP32_XBEE_CONGESTION_H
+#define ESP32_XBEE_CONGESTION_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Message types with their own shed counters, the rest are counted together as type 0
+#define CONGESTION_TYPES_MAX 16
+
+typedef enum {
+    CONGESTION_PRIORITY_HIGH = 0,
+    CONGESTION_PRIORITY_NORMAL,
+    CONGESTION_PRIORITY_LOW
+} congestion_priority_t;
+
+typedef struct congestion_shed {
+    uint16_t type;
+    uint32_t count;
+} congestion_shed_t;
+
+typedef struct congestion *congestion_handle_t;
+
+// Low priority types are a comma separated list, shed before anything else
+// Returns NULL when out of memory, a NULL handle admits everything and never sheds
+congestion_handle_t congestion_init(const char *low_priority, uint32_t max_age);
+
+congestion_priority_t congestion_priority(congestion_handle_t handle, uint16_t type);
+
+// Whether a message should be queued given the bytes already waiting to be sent
+bool congestion_admit(congestion_handle_t handle, uint16_t type, size_t length, size_t backlog);
+// Whether a queued message is still fresh enough to be sent, time is when it was queued
+bool congestion_fresh(congestion_handle_t handle, uint16_t type, int64_t time);
+// Bytes sent, backlog is what is still waiting after the send
+void congestion_sent(congestion_handle_t handle, size_t length, size_t backlog);
+
+// Estimated uplink bandwidth in bytes per second, 0 until the uplink has fallen behind
+uint32_t congestion_bandwidth(congestion_handle_t handle);
+int congestion_shed_counts(congestion_handle_t handle, congestion_shed_t *counts, int max);
+
+#endif //ESP32_XBEE_CONGESTION_H
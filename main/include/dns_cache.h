@@ -0,0 +1,32 @@
+#ifndef ESP32_XBEE_DNS_CACHE_H
+#define ESP32_XBEE_DNS_CACHE_H
+
+#include <stdint.h>
+#include <lwip/sockets.h>
+
+// Hosts remembered, and addresses kept per host
+#define DNS_CACHE_SIZE 8
+#define DNS_CACHE_ADDRESSES 2
+
+// Seconds a result is used before it is refreshed in the background
+#define DNS_CACHE_TTL 300
+
+typedef struct dns_cache_stats {
+    uint32_t hits;
+    // Expired results returned while being refreshed
+    uint32_t stale_hits;
+    uint32_t misses;
+    uint32_t failures;
+    uint32_t refreshes;
+    uint8_t entries;
+} dns_cache_stats_t;
+
+void dns_cache_init();
+
+// Resolves host to at most max addresses with port 0, returns the number of addresses or -1 on failure.
+// A miss returns 0 and is looked up in the background, call again for the result.
+int dns_cache_resolve_nowait(const char *host, int socktype, struct sockaddr_storage *addrs, int max);
+
+void dns_cache_stats(dns_cache_stats_t *stats);
+
+#endif //ESP32_XBEE_DNS_CACHE_H
@@ -1,6 +1,15 @@
 #ifndef ESP32_XBEE_NTRIP_H
 #define ESP32_XBEE_NTRIP_H
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stream_stats.h>
+#include <congestion.h>
+#include <protocol/http.h>
+#include <socket_budget.h>
+#include <util.h>
+
 #define NTRIP_GENERIC_NAME "ESP32-XBee"
 #define NTRIP_CLIENT_NAME NTRIP_GENERIC_NAME "_Client"
 #define NTRIP_SERVER_NAME NTRIP_GENERIC_NAME "_Server"
@@ -17,7 +26,139 @@ void ntrip_server_init();
 void ntrip_client_init();
 void ntrip_caster_init();
 
-bool ntrip_response_ok(void *response);
-bool ntrip_response_sourcetable_ok(void *response);
+typedef struct ntrip_caster_relay_status {
+    bool active;
+    bool upstream_connected;
+
+    uint32_t packets;
+    uint32_t hits;
+
+    uint32_t outages;
+    uint32_t outage_time;
+} ntrip_caster_relay_status_t;
+
+void ntrip_caster_relay(const void *buffer, size_t length);
+void ntrip_caster_relay_upstream(bool connected);
+void ntrip_caster_relay_status(ntrip_caster_relay_status_t *status);
+
+#define NTRIP_SERVER_TARGETS_MAX 3
+
+typedef struct ntrip_server_target_status {
+    char host[64];
+    uint16_t port;
+    char mountpoint[33];
+    bool connected;
+
+    uint32_t queued;
+    uint32_t drops;
+    congestion_handle_t congestion;
+    stream_stats_handle_t stream_stats;
+} ntrip_server_target_status_t;
+
+bool ntrip_server_target_status(int index, ntrip_server_target_status_t *status);
+
+// Local mountpoint followed by mountpoints uploaded by sources
+#define NTRIP_CASTER_MAX_SOURCES 4
+#define NTRIP_CASTER_MOUNTPOINTS (1 + NTRIP_CASTER_MAX_SOURCES)
+
+typedef struct ntrip_caster_mountpoint_status {
+    char name[33];
+    char source[64];
+    bool upload;
+
+    uint32_t clients;
+    uint32_t stalled;
+    stream_stats_handle_t stream_stats;
+} ntrip_caster_mountpoint_status_t;
+
+// Sourcetable lines are truncated, the fields of interest are near the start
+#define NTRIP_SOURCETABLE_LINE_MAX 192
+
+typedef struct ntrip_sourcetable_stream {
+    char mountpoint[33];
+    char format[24];
+    float latitude;
+    float longitude;
+    bool nmea;
+} ntrip_sourcetable_stream_t;
+
+typedef void (*ntrip_sourcetable_stream_handler_t)(void *ctx, const ntrip_sourcetable_stream_t *stream);
+
+typedef struct ntrip_sourcetable_parser {
+    char line[NTRIP_SOURCETABLE_LINE_MAX];
+    uint16_t length;
+    bool done;
+} ntrip_sourcetable_parser_t;
+
+void ntrip_sourcetable_parser_init(ntrip_sourcetable_parser_t *parser);
+// Calls handler for every STR record, returns true once ENDSOURCETABLE is received
+bool ntrip_sourcetable_parse(ntrip_sourcetable_parser_t *parser, const char *data, size_t length,
+        ntrip_sourcetable_stream_handler_t handler, void *ctx);
+
+#define NTRIP_CLIENT_SOURCES_MAX 4
+
+typedef struct ntrip_client_status {
+    int active;
+    int sources;
+    uint32_t failovers;
+
+    // Mountpoints cached from the caster sourcetable
+    int sourcetable;
+} ntrip_client_status_t;
+
+typedef struct ntrip_client_source_status {
+    char host[64];
+    uint16_t port;
+    char mountpoint[33];
+    bool active;
+
+    uint32_t connections;
+    uint32_t failures;
+
+    // Milliseconds, time since the last RTCM frame is -1 if no data has been received
+    uint32_t resolve_time;
+    uint32_t connect_time;
+    uint32_t first_byte_time;
+    int32_t last_frame_age;
+
+    // Addresses tried before connecting
+    uint8_t connect_attempts;
+
+    // Seconds until source is tried again after failing
+    uint32_t retry_in;
+} ntrip_client_source_status_t;
+
+void ntrip_client_status(ntrip_client_status_t *status);
+bool ntrip_client_source_status(int index, ntrip_client_source_status_t *status);
+
+bool ntrip_caster_mountpoint_status(int index, ntrip_caster_mountpoint_status_t *status);
+
+// Source addresses tracked for authentication failures
+#define NTRIP_CASTER_AUTH_FAILURES 8
+
+typedef struct ntrip_caster_auth_failure_status {
+    char address[48];
+
+    uint32_t failures;
+    uint32_t age;
+} ntrip_caster_auth_failure_status_t;
+
+bool ntrip_caster_auth_failure_status(int index, ntrip_caster_auth_failure_status_t *status);
+
+// Milliseconds to wait for response headers
+#define NTRIP_RESPONSE_TIMEOUT 10000
+
+// Socket is one of CONNECT_SOCKET_ERROR_* if the connection failed, otherwise it belongs to the callback.
+// Length is -1 if the request could not be sent or no complete response was received.
+typedef void (*ntrip_request_callback_t)(void *ctx, int sock, int length, const connect_socket_timing_t *timing);
+typedef struct ntrip_request *ntrip_request_handle_t;
+
+void ntrip_request_init();
+// Connects, sends request and reads the response into buffer on the reactor, request may be in buffer
+// Returns NULL without calling back when out of memory
+ntrip_request_handle_t ntrip_request_start(const char *host, uint16_t port, socket_budget_owner_t owner, char *request,
+        char *buffer, size_t size, http_parser_t *response, ntrip_request_callback_t callback, void *ctx);
+bool ntrip_response_ok(const http_parser_t *response, const char *buffer);
+bool ntrip_response_sourcetable(const http_parser_t *response, const char *buffer);
 
 #endif //ESP32_XBEE_NTRIP_H
@@ -1,9 +1,27 @@
 #ifndef ESP32_XBEE_SOCKET_CLIENT_H
 #define ESP32_XBEE_SOCKET_CLIENT_H
 
+#include <stdbool.h>
 #include <stdint.h>
 #include <esp_event_base.h>
+#include <congestion.h>
+#include <protocol/tunnel.h>
+
+typedef struct socket_client_status {
+    bool active;
+    bool connected;
+
+    uint32_t queued;
+    uint32_t backlog;
+    uint32_t drops;
+    uint32_t reconnects;
+    congestion_handle_t congestion;
+
+    bool tunnel;
+    tunnel_stats_t tunnel_stats;
+} socket_client_status_t;
 
 void socket_client_init();
+void socket_client_status(socket_client_status_t *status);
 
 #endif //ESP32_XBEE_SOCKET_CLIENT_H
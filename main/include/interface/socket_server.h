@@ -1,8 +1,14 @@
 #ifndef ESP32_XBEE_SOCKET_SERVER_H
 #define ESP32_XBEE_SOCKET_SERVER_H
 
+#include <stdbool.h>
 #include <esp_event_base.h>
+#include <protocol/tunnel.h>
 
 void socket_server_init();
 
+bool socket_server_tunnel_active();
+// Totals over current and past UDP tunnel clients
+void socket_server_tunnel_stats(tunnel_stats_t *stats);
+
 #endif //ESP32_XBEE_SOCKET_SERVER_H
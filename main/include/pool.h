@@ -0,0 +1,35 @@
+#ifndef ESP32_XBEE_POOL_H
+#define ESP32_XBEE_POOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct pool_stats {
+    const char *name;
+    size_t size;
+    uint16_t count;
+
+    uint16_t used;
+    uint16_t peak;
+    // Allocations that fell back to the heap because the pool was empty or the block too small, and those that failed
+    uint32_t exhausted;
+    uint32_t failures;
+} pool_stats_t;
+
+typedef struct pool *pool_handle_t;
+
+// Blocks are carved from a single allocation made up front, so hot paths do not fragment the heap
+pool_handle_t pool_new(const char *name, size_t size, uint16_t count);
+
+// Starts with one reference, falls back to the heap when no block fits, NULL only if that fails too
+void *pool_alloc(pool_handle_t pool, size_t size);
+void pool_retain(void *block);
+// Block goes back to its pool when the last reference is released
+void pool_release(void *block);
+
+void pool_stats(pool_handle_t pool, pool_stats_t *stats);
+
+pool_handle_t pool_first();
+pool_handle_t pool_next(pool_handle_t pool);
+
+#endif //ESP32_XBEE_POOL_H
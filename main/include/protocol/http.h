@@ -0,0 +1,101 @@
+#ifndef ESP32_XBEE_HTTP_H
+#define ESP32_XBEE_HTTP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Offsets into the receive buffer, which may grow between calls to http_parser_parse
+typedef struct http_span {
+    uint16_t offset;
+    uint16_t length;
+} http_span_t;
+
+typedef struct http_header {
+    http_span_t name;
+    http_span_t value;
+} http_header_t;
+
+#define HTTP_HEADERS_MAX 12
+
+typedef enum {
+    HTTP_PARSER_REQUEST = 0,
+    HTTP_PARSER_RESPONSE
+} http_parser_type_t;
+
+typedef enum {
+    HTTP_PARSER_START_LINE = 0,
+    HTTP_PARSER_HEADERS,
+    HTTP_PARSER_DONE,
+    HTTP_PARSER_ERROR
+} http_parser_state_t;
+
+// Request line "method target version" or status line "version status reason"
+#define HTTP_REQUEST_METHOD 0
+#define HTTP_REQUEST_TARGET 1
+#define HTTP_REQUEST_VERSION 2
+#define HTTP_RESPONSE_VERSION 0
+#define HTTP_RESPONSE_STATUS 1
+#define HTTP_RESPONSE_REASON 2
+
+typedef struct http_parser {
+    http_parser_type_t type;
+    http_parser_state_t state;
+
+    size_t position;
+    size_t line_start;
+
+    http_span_t start_line[3];
+    int status;
+    // Status line without an HTTP version, such as "ICY 200 OK", headers are optional and data may follow directly
+    bool headerless;
+
+    uint8_t header_count;
+    http_header_t headers[HTTP_HEADERS_MAX];
+
+    // Offset of the first byte after the headers
+    size_t body;
+} http_parser_t;
+
+#define HTTP_PARSER_RESULT_ERROR -1
+#define HTTP_PARSER_RESULT_MORE 0
+#define HTTP_PARSER_RESULT_DONE 1
+
+void http_parser_init(http_parser_t *parser, http_parser_type_t type);
+int http_parser_parse(http_parser_t *parser, const char *buffer, size_t length);
+http_span_t http_parser_start_line(const http_parser_t *parser);
+const http_span_t *http_parser_header(const http_parser_t *parser, const char *buffer, const char *name);
+
+bool http_span_equals(const char *buffer, const http_span_t *span, const char *str);
+bool http_span_contains(const char *buffer, const http_span_t *span, const char *str);
+size_t http_span_copy(const char *buffer, const http_span_t *span, char *dest, size_t size);
+
+typedef enum {
+    HTTP_CHUNKED_SIZE = 0,
+    HTTP_CHUNKED_EXTENSION,
+    HTTP_CHUNKED_SIZE_LF,
+    HTTP_CHUNKED_DATA,
+    HTTP_CHUNKED_DATA_CR,
+    HTTP_CHUNKED_DATA_LF,
+    HTTP_CHUNKED_TRAILER,
+    HTTP_CHUNKED_TRAILER_LINE,
+    HTTP_CHUNKED_TRAILER_LF,
+    HTTP_CHUNKED_DONE,
+    HTTP_CHUNKED_ERROR
+} http_chunked_state_t;
+
+typedef struct http_chunked {
+    http_chunked_state_t state;
+    uint32_t remaining;
+} http_chunked_t;
+
+#define HTTP_CHUNKED_RESULT_ERROR -1
+#define HTTP_CHUNKED_RESULT_MORE 0
+#define HTTP_CHUNKED_RESULT_DONE 1
+
+typedef void (*http_chunked_data_handler_t)(void *ctx, char *data, size_t length);
+
+void http_chunked_init(http_chunked_t *chunked);
+int http_chunked_decode(http_chunked_t *chunked, char *buffer, size_t length, http_chunked_data_handler_t handler, void *ctx);
+
+#endif //ESP32_XBEE_HTTP_H
@@ -1,7 +1,29 @@
 #ifndef ESP32_XBEE_NMEA_H
 #define ESP32_XBEE_NMEA_H
 
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Standard limit is 82, some receivers exceed it with extra precision
+#define NMEA_SENTENCE_LENGTH_MAX 128
+
+typedef struct nmea_gga {
+    uint8_t fix_quality;
+    uint8_t satellites;
+
+    // Decimal degrees, positive north and east
+    double latitude;
+    double longitude;
+} nmea_gga_t;
+
 int nmea_asprintf(char **strp, const char *fmt, ...);
 int nmea_vasprintf(char **strp, const char *fmt, va_list args);
+// Returns the length of the whole sentence as vsnprintf does, str is only complete if it is less than size
+int nmea_vsnprintf(char *str, size_t size, const char *fmt, va_list args);
+
+bool nmea_gga_parse(const char *sentence, size_t length, nmea_gga_t *gga);
+double nmea_distance(double latitude1, double longitude1, double latitude2, double longitude2);
 
 #endif //ESP32_XBEE_NMEA_H
@@ -0,0 +1,54 @@
+#ifndef ESP32_XBEE_RTCM_H
+#define ESP32_XBEE_RTCM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define RTCM_PREAMBLE 0xD3
+#define RTCM_HEADER_LENGTH 3
+#define RTCM_CRC_LENGTH 3
+#define RTCM_PAYLOAD_LENGTH_MAX 1023
+#define RTCM_FRAME_LENGTH_MAX (RTCM_HEADER_LENGTH + RTCM_PAYLOAD_LENGTH_MAX + RTCM_CRC_LENGTH)
+
+#define RTCM_PAYLOAD_HEAD_LENGTH 8
+
+#define RTCM_GPS_LEAP_SECONDS 18
+
+typedef enum {
+    RTCM_PARSER_PREAMBLE = 0,
+    RTCM_PARSER_LENGTH_1,
+    RTCM_PARSER_LENGTH_2,
+    RTCM_PARSER_PAYLOAD,
+    RTCM_PARSER_CRC
+} rtcm_parser_state_t;
+
+typedef struct rtcm_parser {
+    rtcm_parser_state_t state;
+
+    // Bytes of the current frame seen so far
+    uint16_t index;
+    uint16_t length;
+    uint16_t type;
+    uint32_t crc;
+    uint32_t crc_received;
+
+    // Start of the current payload, enough to decode message headers
+    uint8_t head[RTCM_PAYLOAD_HEAD_LENGTH];
+} rtcm_parser_t;
+
+// Called for every frame that passed the CRC check, end is the offset just past the frame in the parsed data
+typedef void (*rtcm_frame_handler_t)(void *ctx, uint16_t type, size_t frame_length, size_t end);
+
+uint32_t rtcm_crc24q(uint32_t crc, const uint8_t *data, size_t length);
+
+void rtcm_parser_init(rtcm_parser_t *parser);
+void rtcm_parser_parse(rtcm_parser_t *parser, const uint8_t *data, size_t length, rtcm_frame_handler_t handler, void *ctx);
+
+// Observation epoch in milliseconds since the start of the UTC day, false for messages without one
+bool rtcm_epoch_utc(uint16_t type, const uint8_t *head, uint32_t *epoch);
+
+// Number of trailing bytes that belong to a frame that is not yet complete
+size_t rtcm_parser_pending(const rtcm_parser_t *parser);
+
+#endif //ESP32_XBEE_RTCM_H
@@ -0,0 +1,61 @@
+#ifndef ESP32_XBEE_TUNNEL_H
+#define ESP32_XBEE_TUNNEL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Datagram encapsulation with sequence numbers, reordering, NACK retransmission and optional XOR parity.
+// Pure logic without sockets or clocks so it can be exercised on a host.
+
+#define TUNNEL_HEADER_LENGTH 8
+#define TUNNEL_PAYLOAD_MAX 512
+#define TUNNEL_PACKET_MAX (TUNNEL_HEADER_LENGTH + 2 + TUNNEL_PAYLOAD_MAX)
+
+// Packets kept for retransmission and reordering, power of two
+#define TUNNEL_WINDOW 16
+#define TUNNEL_FEC_GROUP_MAX (TUNNEL_WINDOW / 2)
+
+typedef void (*tunnel_output_t)(void *ctx, const uint8_t *packet, size_t length);
+typedef void (*tunnel_deliver_t)(void *ctx, const uint8_t *data, size_t length);
+
+typedef struct tunnel_config {
+    // Data packets per parity packet, 0 disables FEC
+    uint8_t fec_group;
+
+    // Milliseconds to wait for a missing packet before skipping it, and before and between NACKs for it
+    uint16_t reorder_timeout;
+    uint16_t nack_interval;
+} tunnel_config_t;
+
+typedef struct tunnel_stats {
+    uint32_t sent;
+    uint32_t retransmitted;
+
+    uint32_t delivered;
+    uint32_t recovered_fec;
+    uint32_t recovered_nack;
+    uint32_t lost;
+    uint32_t duplicates;
+
+    // Milliseconds above the fastest packet seen, clocks of both ends are not synchronised
+    uint32_t latency;
+    uint32_t latency_max;
+} tunnel_stats_t;
+
+typedef struct tunnel *tunnel_handle_t;
+
+tunnel_handle_t tunnel_create(const tunnel_config_t *config, tunnel_output_t output, tunnel_deliver_t deliver, void *ctx);
+void tunnel_destroy(tunnel_handle_t tunnel);
+
+void tunnel_send(tunnel_handle_t tunnel, const uint8_t *data, size_t length, uint32_t now);
+// Returns false if the datagram is not a tunnel packet
+bool tunnel_receive(tunnel_handle_t tunnel, const uint8_t *packet, size_t length, uint32_t now);
+// Handles timeouts, returns milliseconds until it should be called again or -1 if nothing is pending
+int tunnel_poll(tunnel_handle_t tunnel, uint32_t now);
+
+void tunnel_stats(tunnel_handle_t tunnel, tunnel_stats_t *stats);
+// Accumulates counters of several tunnels, latency is the worst of both
+void tunnel_stats_add(tunnel_stats_t *total, const tunnel_stats_t *stats);
+
+#endif //ESP32_XBEE_TUNNEL_H
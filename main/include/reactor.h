@@ -0,0 +1,48 @@
+#ifndef ESP32_XBEE_REACTOR_H
+#define ESP32_XBEE_REACTOR_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <socket_budget.h>
+#include <util.h>
+
+#define REACTOR_READ 0x01
+#define REACTOR_WRITE 0x02
+
+// Functions waiting to be run on the reactor task
+#define REACTOR_CALL_QUEUE_LENGTH 16
+
+typedef void (*reactor_callback_t)(void *ctx);
+typedef void (*reactor_socket_callback_t)(void *ctx, int sock, uint8_t events);
+// Socket is non-blocking and counted against the budget, or one of CONNECT_SOCKET_ERROR_* if the connection failed
+typedef void (*reactor_connect_callback_t)(void *ctx, int sock, const connect_socket_timing_t *timing);
+
+typedef struct reactor_watch *reactor_watch_handle_t;
+typedef struct reactor_timer *reactor_timer_handle_t;
+typedef struct reactor_connect *reactor_connect_handle_t;
+
+void reactor_init();
+
+// Runs callback on the reactor task, the only reactor function that may be used from other tasks or handlers
+bool reactor_call(reactor_callback_t callback, void *ctx);
+
+// Constructors return NULL when out of memory, timer functions ignore a NULL timer
+// Callback is run whenever the socket is ready for any of events, until the watch is deleted
+reactor_watch_handle_t reactor_watch_new(int sock, uint8_t events, reactor_socket_callback_t callback, void *ctx);
+void reactor_watch_events(reactor_watch_handle_t watch, uint8_t events);
+// Safe from within any callback, including the watch's own
+void reactor_watch_delete(reactor_watch_handle_t watch);
+
+reactor_timer_handle_t reactor_timer_new(reactor_callback_t callback, void *ctx);
+// Milliseconds, a running timer is restarted
+void reactor_timer_start(reactor_timer_handle_t timer, uint32_t delay);
+void reactor_timer_stop(reactor_timer_handle_t timer);
+bool reactor_timer_active(reactor_timer_handle_t timer);
+void reactor_timer_delete(reactor_timer_handle_t timer);
+
+// Resolves and connects without blocking, callback is always run later and never if cancelled first or NULL is returned
+reactor_connect_handle_t reactor_connect(const char *host, uint16_t port, int socktype, socket_budget_owner_t owner,
+        reactor_connect_callback_t callback, void *ctx);
+void reactor_connect_cancel(reactor_connect_handle_t connect);
+
+#endif //ESP32_XBEE_REACTOR_H
@@ -24,6 +24,8 @@ typedef struct retry_delay *retry_delay_handle_t;
 
 retry_delay_handle_t retry_init(bool first_instant, uint8_t short_count, int short_delay, int max_delay);
 int retry_delay(retry_delay_handle_t handle);
+// Milliseconds to wait before the next attempt, for callers that can't block
+int retry_next(retry_delay_handle_t handle);
 void retry_reset(retry_delay_handle_t handle);
 
 #endif //ESP32_XBEE_RETRY_H
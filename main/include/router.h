@@ -0,0 +1,56 @@
+#ifndef ESP32_XBEE_ROUTER_H
+#define ESP32_XBEE_ROUTER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef enum {
+    ROUTER_SOURCE_UART = 0,
+    ROUTER_SOURCE_NTRIP_CLIENT,
+    ROUTER_SOURCE_NTRIP_CASTER,
+    ROUTER_SOURCE_SOCKET_SERVER,
+    ROUTER_SOURCE_SOCKET_CLIENT,
+    ROUTER_SOURCES
+} router_source_t;
+
+typedef enum {
+    ROUTER_SINK_UART = 0,
+    ROUTER_SINK_NTRIP_SERVER,
+    ROUTER_SINK_NTRIP_CASTER,
+    ROUTER_SINK_NTRIP_CLIENT,
+    ROUTER_SINK_SOCKET_SERVER,
+    ROUTER_SINK_SOCKET_CLIENT,
+    ROUTER_SINKS
+} router_sink_t;
+
+typedef enum {
+    ROUTER_FILTER_NONE = 0,
+    ROUTER_FILTER_RTCM,
+    ROUTER_FILTER_NMEA,
+    ROUTER_FILTERS
+} router_filter_t;
+
+typedef void (*router_sink_handler_t)(const void *data, size_t length);
+
+typedef struct router_context *router_context_handle_t;
+
+// Builds the sink lists of every source from config, must be called before sinks are registered
+void router_init();
+
+// Sinks without a handler are skipped, sinks fed by several sources are serialised except for UART.
+// Handlers are run on the dispatching task, which may be the UART task, and must never block.
+void router_register_sink(router_sink_t sink, router_sink_handler_t handler);
+
+// Filter state of one connection of source, as partial frames and sentences must not continue on another.
+// Returns NULL when out of memory.
+router_context_handle_t router_context_new(router_source_t source);
+void router_context_delete(router_context_handle_t context);
+
+// Delivers to every sink routed from the context's source, all contexts of a source must be dispatched from
+// the same task. A NULL context is ignored.
+void router_dispatch(router_context_handle_t context, const void *data, size_t length);
+
+// Deliveries from source dropped because a shared sink was busy for too long
+uint32_t router_dropped(router_source_t source);
+
+#endif //ESP32_XBEE_ROUTER_H
@@ -0,0 +1,54 @@
+/*
+ * This file is part of the ESP32-XBee distribution (https://github.com/nebkat/esp32-xbee).
+ * Copyright (c) 2020 Nebojsa Cvetkovic.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ESP32_XBEE_SEND_BUFFER_H
+#define ESP32_XBEE_SEND_BUFFER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+// Data a non-blocking socket has not taken yet, the caller serialises access
+typedef struct send_buffer {
+    // Allocated the first time the socket falls behind and kept until freed
+    uint8_t *data;
+    size_t size;
+
+    size_t offset;
+    size_t length;
+
+    // Writes that did not fit and were dropped whole
+    uint32_t dropped;
+} send_buffer_t;
+
+// Nothing is allocated until data has to be queued
+void send_buffer_init(send_buffer_t *buffer, size_t size);
+void send_buffer_free(send_buffer_t *buffer);
+
+// Sends what the socket takes without waiting and queues the rest behind earlier data. A write is never split:
+// one that does not fit is dropped whole, or fails if part of it was already sent. Returns bytes sent, or -1 on error.
+int send_buffer_write(send_buffer_t *buffer, int sock, const struct iovec *iov, int iovcnt);
+
+// Sends as much queued data as the socket takes without waiting, returns bytes sent or -1 on error
+int send_buffer_flush(send_buffer_t *buffer, int sock);
+
+static inline bool send_buffer_pending(const send_buffer_t *buffer) {
+    return buffer->length > 0;
+}
+
+#endif //ESP32_XBEE_SEND_BUFFER_H
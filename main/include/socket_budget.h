@@ -0,0 +1,46 @@
+#ifndef ESP32_XBEE_SOCKET_BUDGET_H
+#define ESP32_XBEE_SOCKET_BUDGET_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Web server client connections, the server also needs its listening and control sockets
+#define SOCKET_BUDGET_WEB_SERVER_CLIENTS 3
+
+// Kept free for refusing connections that are over budget
+#define SOCKET_BUDGET_SPARE 1
+
+typedef enum {
+    SOCKET_BUDGET_WEB_SERVER = 0,
+    SOCKET_BUDGET_NTRIP_CASTER,
+    SOCKET_BUDGET_NTRIP_SERVER,
+    SOCKET_BUDGET_NTRIP_CLIENT,
+    SOCKET_BUDGET_SOCKET_SERVER,
+    SOCKET_BUDGET_SOCKET_CLIENT,
+    SOCKET_BUDGET_REACTOR,
+    SOCKET_BUDGET_OWNERS
+} socket_budget_owner_t;
+
+typedef struct socket_budget_owner_status {
+    const char *name;
+    bool enabled;
+
+    uint8_t used;
+    uint8_t reserved;
+    uint8_t cap;
+    uint32_t denied;
+} socket_budget_owner_status_t;
+
+// Enables the reservation of an interface, sockets are only admitted for enabled owners
+void socket_budget_enable(socket_budget_owner_t owner);
+
+// Counts a new socket against the owner's budget, false if it is over budget and must be closed
+bool socket_budget_acquire(int sock, socket_budget_owner_t owner);
+// Called when any socket is closed, sockets that were not acquired are ignored
+void socket_budget_release(int sock);
+
+void socket_budget_owner_status(socket_budget_owner_t owner, socket_budget_owner_status_t *status);
+// Owner of a socket, or -1 if it is not counted
+int socket_budget_socket_owner(int sock);
+
+#endif //ESP32_XBEE_SOCKET_BUDGET_H
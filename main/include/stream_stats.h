@@ -28,6 +28,9 @@ typedef struct stream_stats_values {
 
     uint32_t rate_in;
     uint32_t rate_out;
+
+    // Milliseconds since the last correction epoch, -1 if unknown
+    int32_t correction_age;
 } stream_stats_values_t;
 
 typedef struct stream_stats *stream_stats_handle_t;
@@ -36,6 +39,8 @@ void stream_stats_init();
 stream_stats_handle_t stream_stats_new(const char *name);
 
 void stream_stats_increment(stream_stats_handle_t stats, uint32_t in, uint32_t out);
+// Age of the correction epoch just received, in milliseconds
+void stream_stats_correction(stream_stats_handle_t stats, int32_t age);
 void stream_stats_values(stream_stats_handle_t stats, stream_stats_values_t *values);
 
 stream_stats_handle_t stream_stats_first();
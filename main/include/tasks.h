@@ -1,12 +1,27 @@
 #ifndef ESP32_XBEE_TASKS_H
 #define ESP32_XBEE_TASKS_H
 
+#include <sdkconfig.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
 #define TASK_PRIORITY_STATUS_LED 0
 #define TASK_PRIORITY_RESET_BUTTON 0
 #define TASK_PRIORITY_WIFI_STATUS 0
 #define TASK_PRIORITY_STATS 0
+// Below the interfaces so web UI requests never hold up data
+#define TASK_PRIORITY_WEB_SERVER 4
 #define TASK_PRIORITY_INTERFACE 5
 #define TASK_PRIORITY_UART 10
 #define TASK_PRIORITY_MAX 100
 
+// WiFi and lwIP run on the protocol core, UART ingest and framing get the application core to themselves
+#ifdef CONFIG_XBEE_TASK_AFFINITY
+#define TASK_CORE_NETWORK 0
+#define TASK_CORE_UART 1
+#else
+#define TASK_CORE_NETWORK tskNO_AFFINITY
+#define TASK_CORE_UART tskNO_AFFINITY
+#endif
+
 #endif //ESP32_XBEE_TASKS_H
@@ -1,6 +1,7 @@
 #ifndef ESP32_XBEE_UART_H
 #define ESP32_XBEE_UART_H
 
+#include <stdint.h>
 #include <esp_event.h>
 
 ESP_EVENT_DECLARE_BASE(UART_EVENT_READ);
@@ -15,7 +16,20 @@ int uart_log(char *buffer, size_t len);
 int uart_nmea(const char *fmt, ...);
 int uart_write(char *buffer, size_t len);
 
+// Read handlers are run in turn on the UART task, never concurrently
 void uart_register_read_handler(esp_event_handler_t event_handler);
 void uart_register_write_handler(esp_event_handler_t event_handler);
 
+typedef struct uart_dispatch_stats {
+    int core;
+    uint32_t reads;
+
+    // Microseconds from a read returning until every read handler has run, smoothed except for max
+    uint32_t average;
+    uint32_t jitter;
+    uint32_t max;
+} uart_dispatch_stats_t;
+
+void uart_dispatch_stats(uart_dispatch_stats_t *stats);
+
 #endif //ESP32_XBEE_UART_H
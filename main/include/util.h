@@ -1,6 +1,7 @@
 #ifndef ESP32_XBEE_UTIL_H
 #define ESP32_XBEE_UTIL_H
 
+#include <stdbool.h>
 #include <esp_transport.h>
 #include <sys/socket.h>
 
@@ -20,12 +21,30 @@
 #define CONNECT_SOCKET_ERROR_RESOLVE -2
 #define CONNECT_SOCKET_ERROR_CONNECT -1
 
+// Resolved addresses tried in parallel, each started this many milliseconds after the previous
+#define CONNECT_SOCKET_ATTEMPTS_MAX 4
+#define CONNECT_SOCKET_ATTEMPT_DELAY 250
+// Milliseconds before a single connection attempt is given up
+#define CONNECT_SOCKET_TIMEOUT 5000
+
+typedef struct connect_socket_timing {
+    // Milliseconds
+    uint32_t resolve;
+    uint32_t connect;
+
+    uint8_t attempts;
+    int family;
+} connect_socket_timing_t;
+
 void destroy_socket(int *socket);
 char *sockaddrtostr(struct sockaddr *a);
 
-char *extract_http_header(const char *buffer, const char *key);
+// Building blocks of reactor_connect
+int connect_socket_order(struct sockaddr_storage *resolved, int resolved_count, struct sockaddr_storage **addrs);
+int connect_socket_start(struct sockaddr_storage *addr, int port, int socktype, bool *connected);
 
-int connect_socket(char *host, int port, int socktype);
+// Enables TCP keepalive on an accepted client using the configured idle time, interval and count
+void socket_keepalive(int sock);
 char *http_auth_basic_header(const char *username, const char *password);
 
 #endif //ESP32_XBEE_UTIL_H
@@ -37,6 +37,7 @@ void wifi_ap_status(wifi_ap_status_t *status);
 void wifi_sta_status(wifi_sta_status_t *status);
 
 void wait_for_ip();
+bool wifi_has_ip();
 void wait_for_network();
 
 const char *esp_netif_name(esp_netif_t *esp_netif);
@@ -16,36 +16,175 @@
  */
 
 #include <stdbool.h>
+#include <ctype.h>
+#include <string.h>
 #include <esp_log.h>
 #include <esp_event_base.h>
 #include <sys/socket.h>
+#include <sys/param.h>
+#include <sys/uio.h>
 #include <mdns.h>
-#include <tasks.h>
 #include <status_led.h>
 #include <stream_stats.h>
 #include <esp_ota_ops.h>
+#include <esp_timer.h>
+#include <freertos/semphr.h>
+#include <mbedtls/base64.h>
+#include <protocol/http.h>
+#include <protocol/rtcm.h>
 #include "interface/ntrip.h"
 #include "config.h"
+#include "pool.h"
+#include "reactor.h"
+#include "router.h"
+#include "send_buffer.h"
+#include "socket_budget.h"
 #include "util.h"
 #include "uart.h"
 
 static const char *TAG = "NTRIP_CASTER";
 
-#define BUFFER_SIZE 512
+#define BUFFER_SIZE 1024
+
+#define MOUNTPOINT_NAME_LENGTH 32
+
+// Milliseconds
+#define REQUEST_TIMEOUT 5000
+#define RESTART_DELAY 5000
+
+// As many clients as the socket budget allows, requests are only pending until their headers arrive
+#define CLIENT_POOL_COUNT 8
+#define REQUEST_POOL_COUNT 2
+
+// Output a client has not taken yet, only allocated once it falls behind, larger writes are dropped
+#define CLIENT_OUTPUT_SIZE 4096
 
 static int sock = -1;
+static reactor_watch_handle_t listen_watch = NULL;
+static reactor_timer_handle_t restart_timer = NULL;
+
+// Upload data is received into a single buffer on the reactor
+static char *buffer;
+
+static char *mountpoint;
 
 static status_led_handle_t status_led = NULL;
 static stream_stats_handle_t stream_stats = NULL;
 
 typedef struct ntrip_caster_client_t {
     int socket;
+    struct ntrip_caster_mountpoint_t *mountpoint;
+
+    // Writable while output is queued, only changed on the reactor
+    reactor_watch_handle_t watch;
+    bool armed;
+    bool closed;
+
+    // NTRIP v2 clients receive whole frames in HTTP chunks
+    bool chunked;
+    send_buffer_t output;
+
+    // When the client last accepted data while output was queued, 0 while it keeps up
+    int64_t stalled_since;
     SLIST_ENTRY(ntrip_caster_client_t) next;
 } ntrip_caster_client_t;
 
-static SLIST_HEAD(caster_clients_list_t, ntrip_caster_client_t) caster_clients_list;
+typedef struct ntrip_caster_mountpoint_t {
+    bool active;
+    char name[MOUNTPOINT_NAME_LENGTH + 1];
+
+    // Upload socket, or -1 for the local mountpoint
+    int source;
+    reactor_watch_handle_t source_watch;
+    router_context_handle_t source_router;
+    struct sockaddr_in6 source_addr;
+
+    bool chunked;
+    http_chunked_t chunked_state;
+
+    // Trailing partial frame held back from chunked clients
+    rtcm_parser_t parser;
+    uint8_t carry[RTCM_FRAME_LENGTH_MAX];
+    size_t carry_length;
+
+    char stream_stats_name[24];
+    stream_stats_handle_t stream_stats;
+
+    // Clients disconnected for not accepting data
+    uint32_t stalled;
+
+    SLIST_HEAD(caster_clients_list_t, ntrip_caster_client_t) clients;
+} ntrip_caster_mountpoint_t;
+
+// Connection waiting for its request headers
+typedef struct ntrip_caster_request {
+    int socket;
+    struct sockaddr_in6 addr;
+
+    char buffer[BUFFER_SIZE];
+    int length;
+    http_parser_t parser;
 
-static void ntrip_caster_client_remove(ntrip_caster_client_t *caster_client) {
+    reactor_watch_handle_t watch;
+    reactor_timer_handle_t timer;
+} ntrip_caster_request_t;
+
+// Local mountpoint (UART or relay) followed by upload mountpoints
+static ntrip_caster_mountpoint_t mountpoints[NTRIP_CASTER_MOUNTPOINTS];
+#define LOCAL_MOUNTPOINT (&mountpoints[0])
+
+static unsigned int client_count = 0;
+
+// Clients not accepting any data for this long are disconnected, 0 waits for TCP to give up
+static int64_t stall_timeout = 0;
+
+// Longest "username:password" accepted
+#define CREDENTIAL_LENGTH_MAX 128
+
+typedef enum {
+    CREDENTIAL_CLIENT = 0,
+    CREDENTIAL_SOURCE,
+    CREDENTIALS
+} ntrip_caster_credential_type_t;
+
+// Decoded once at config load, compared against without allocating
+static struct ntrip_caster_credential {
+    bool required;
+
+    uint16_t length;
+    uint8_t username_length;
+    uint8_t value[CREDENTIAL_LENGTH_MAX];
+} credentials[CREDENTIALS];
+
+static struct auth_failure {
+    struct in6_addr addr;
+    uint32_t count;
+    int64_t last;
+} auth_failures[NTRIP_CASTER_AUTH_FAILURES];
+
+// Clients are written to from the UART event loop and the reactor (relay and uploads)
+static SemaphoreHandle_t clients_lock = NULL;
+
+// Clients closed or newly behind while writing, updated on the reactor
+static volatile bool update_pending = false;
+static pool_handle_t client_pool, request_pool;
+
+// Serve corrections received by the NTRIP client instead of UART data
+static bool relay = false;
+
+static struct relay_stats {
+    bool upstream_connected;
+
+    uint32_t packets;
+    uint32_t hits;
+
+    uint32_t outages;
+    int64_t outage_time;
+    int64_t outage_start;
+} relay_stats;
+
+// Only on the reactor, holding the clients lock
+static void ntrip_caster_client_remove(ntrip_caster_mountpoint_t *caster_mountpoint, ntrip_caster_client_t *caster_client) {
     struct sockaddr_in6 client_addr;
     socklen_t socklen = sizeof(client_addr);
     int err = getpeername(caster_client->socket, (struct sockaddr *) &client_addr, &socklen);
@@ -53,24 +192,678 @@ static void ntrip_caster_client_remove(ntrip_caster_client_t *caster_client) {
 
     uart_nmea("$PESP,NTRIP,CST,CLIENT,DISCONNECTED,%s", addr_str);
 
+    reactor_watch_delete(caster_client->watch);
     destroy_socket(&caster_client->socket);
+    send_buffer_free(&caster_client->output);
 
-    SLIST_REMOVE(&caster_clients_list, caster_client, ntrip_caster_client_t, next);
-    free(caster_client);
+    SLIST_REMOVE(&caster_mountpoint->clients, caster_client, ntrip_caster_client_t, next);
+    pool_release(caster_client);
 
-    if (status_led != NULL && SLIST_EMPTY(&caster_clients_list)) status_led->flashing_mode = STATUS_LED_STATIC;
+    client_count--;
+    if (status_led != NULL && client_count == 0) status_led->flashing_mode = STATUS_LED_STATIC;
 }
 
-static void ntrip_caster_uart_handler(void* handler_args, esp_event_base_t base, int32_t length, void* buffer) {
-    ntrip_caster_client_t *client, *client_tmp;
-    SLIST_FOREACH_SAFE(client, &caster_clients_list, next, client_tmp) {
-        int sent = write(client->socket, buffer, length);
+// Removes closed clients and watches those with queued output for space to send it
+static void ntrip_caster_clients_update(void *ctx) {
+    update_pending = false;
+
+    xSemaphoreTake(clients_lock, portMAX_DELAY);
+    for (int i = 0; i < NTRIP_CASTER_MOUNTPOINTS; i++) {
+        ntrip_caster_client_t *client, *client_tmp;
+        SLIST_FOREACH_SAFE(client, &mountpoints[i].clients, next, client_tmp) {
+            if (client->closed) {
+                ntrip_caster_client_remove(&mountpoints[i], client);
+                continue;
+            }
+
+            client->armed = send_buffer_pending(&client->output);
+            reactor_watch_events(client->watch, client->armed ? REACTOR_WRITE : 0);
+        }
+    }
+    xSemaphoreGive(clients_lock);
+}
+
+static void ntrip_caster_clients_update_schedule() {
+    if (update_pending) return;
+    update_pending = true;
+    if (!reactor_call(ntrip_caster_clients_update, NULL)) update_pending = false;
+}
+
+// Watches can only be changed on the reactor, the client is skipped until it is removed there
+static void ntrip_caster_client_close(ntrip_caster_client_t *client) {
+    client->closed = true;
+    ntrip_caster_clients_update_schedule();
+}
+
+static void ntrip_caster_client_writable(void *ctx, int sock, uint8_t events) {
+    ntrip_caster_client_t *client = ctx;
+
+    xSemaphoreTake(clients_lock, portMAX_DELAY);
+
+    int sent = send_buffer_flush(&client->output, client->socket);
+    if (sent < 0 || client->closed) {
+        ntrip_caster_client_remove(client->mountpoint, client);
+    } else if (!send_buffer_pending(&client->output)) {
+        client->stalled_since = 0;
+        client->armed = false;
+        reactor_watch_events(client->watch, 0);
+    } else if (sent > 0) {
+        client->stalled_since = esp_timer_get_time();
+    }
+
+    xSemaphoreGive(clients_lock);
+}
+
+static int ntrip_caster_write(ntrip_caster_mountpoint_t *caster_mountpoint, const void *buffer, size_t length) {
+    int delivered = 0;
+
+    xSemaphoreTake(clients_lock, portMAX_DELAY);
+
+    // Chunk ends at the last complete frame, carried over bytes come first
+    size_t carry_length = caster_mountpoint->carry_length;
+    rtcm_parser_parse(&caster_mountpoint->parser, buffer, length, NULL, NULL);
+    size_t pending = MIN(rtcm_parser_pending(&caster_mountpoint->parser), carry_length + length);
+    size_t chunk_length = carry_length + length - pending;
+
+    char size_line[12];
+    struct iovec iov[4];
+    int iovcnt = 0;
+    if (chunk_length > 0) {
+        size_t carry_part = MIN(carry_length, chunk_length);
+
+        iov[iovcnt++] = (struct iovec) {size_line, snprintf(size_line, sizeof(size_line), "%x" NEWLINE, chunk_length)};
+        if (carry_part > 0) iov[iovcnt++] = (struct iovec) {caster_mountpoint->carry, carry_part};
+        if (chunk_length > carry_part) iov[iovcnt++] = (struct iovec) {(void *) buffer, chunk_length - carry_part};
+        iov[iovcnt++] = (struct iovec) {NEWLINE, NEWLINE_LENGTH};
+    }
+
+    struct iovec raw_iov = {(void *) buffer, length};
+    int64_t now = esp_timer_get_time();
+
+    ntrip_caster_client_t *client;
+    SLIST_FOREACH(client, &caster_mountpoint->clients, next) {
+        if (client->closed || (client->chunked && chunk_length == 0)) continue;
+
+        // Never waits, what a client does not take is queued and sent once its socket is writable
+        uint32_t dropped = client->output.dropped;
+        int sent = client->chunked ? send_buffer_write(&client->output, client->socket, iov, iovcnt) :
+                send_buffer_write(&client->output, client->socket, &raw_iov, 1);
         if (sent < 0) {
-            ntrip_caster_client_remove(client);
-        } else {
-            stream_stats_increment(stream_stats, 0, sent);
+            ntrip_caster_client_close(client);
+            continue;
+        }
+
+        if (!send_buffer_pending(&client->output)) {
+            client->stalled_since = 0;
+        } else if (sent > 0 || client->stalled_since == 0) {
+            client->stalled_since = now;
+        } else if (stall_timeout > 0 && now - client->stalled_since > stall_timeout) {
+            ESP_LOGW(TAG, "Client has not accepted data for %llds, disconnecting", (now - client->stalled_since) / 1000000);
+            caster_mountpoint->stalled++;
+            ntrip_caster_client_close(client);
+            continue;
+        }
+
+        if (send_buffer_pending(&client->output) && !client->armed) ntrip_caster_clients_update_schedule();
+
+        if (client->output.dropped == dropped) {
+            stream_stats_increment(stream_stats, 0, client->chunked ? chunk_length : length);
+            delivered++;
+        }
+    }
+
+    // Keep partial frame for the next chunk
+    if (pending > length) {
+        memmove(caster_mountpoint->carry, caster_mountpoint->carry + carry_length + length - pending, pending - length);
+        memcpy(caster_mountpoint->carry + pending - length, buffer, length);
+    } else {
+        memcpy(caster_mountpoint->carry, (const uint8_t *) buffer + length - pending, pending);
+    }
+    caster_mountpoint->carry_length = pending;
+
+    xSemaphoreGive(clients_lock);
+
+    return delivered;
+}
+
+static void ntrip_caster_uart_handler(const void *buffer, size_t length) {
+    // UART data is not served while relaying
+    if (relay) return;
+
+    ntrip_caster_write(LOCAL_MOUNTPOINT, buffer, length);
+}
+
+void ntrip_caster_relay(const void *buffer, size_t length) {
+    if (!relay || length == 0) return;
+
+    // Written straight from the NTRIP client receive buffer, bypassing UART
+    int delivered = ntrip_caster_write(LOCAL_MOUNTPOINT, buffer, length);
+
+    stream_stats_increment(stream_stats, length, 0);
+
+    relay_stats.packets++;
+    relay_stats.hits += delivered;
+}
+
+void ntrip_caster_relay_upstream(bool connected) {
+    if (!relay || relay_stats.upstream_connected == connected) return;
+
+    int64_t now = esp_timer_get_time();
+    if (connected) {
+        relay_stats.outage_time += now - relay_stats.outage_start;
+    } else {
+        relay_stats.outage_start = now;
+        relay_stats.outages++;
+    }
+
+    relay_stats.upstream_connected = connected;
+
+    uart_nmea("$PESP,NTRIP,CST,RELAY,%s", connected ? "CONNECTED" : "DISCONNECTED");
+}
+
+void ntrip_caster_relay_status(ntrip_caster_relay_status_t *status) {
+    int64_t outage_time = relay_stats.outage_time;
+    if (relay && !relay_stats.upstream_connected) outage_time += esp_timer_get_time() - relay_stats.outage_start;
+
+    *status = (ntrip_caster_relay_status_t) {
+            .active = relay,
+            .upstream_connected = relay_stats.upstream_connected,
+            .packets = relay_stats.packets,
+            .hits = relay_stats.hits,
+            .outages = relay_stats.outages,
+            .outage_time = outage_time / 1000
+    };
+}
+
+bool ntrip_caster_mountpoint_status(int index, ntrip_caster_mountpoint_status_t *status) {
+    if (index < 0 || index >= NTRIP_CASTER_MOUNTPOINTS) return false;
+
+    ntrip_caster_mountpoint_t *caster_mountpoint = &mountpoints[index];
+    if (!caster_mountpoint->active) return false;
+
+    *status = (ntrip_caster_mountpoint_status_t) {
+            .upload = caster_mountpoint->source >= 0,
+            .clients = 0,
+            .stalled = caster_mountpoint->stalled,
+            .stream_stats = caster_mountpoint->stream_stats
+    };
+
+    strcpy(status->name, caster_mountpoint->name);
+    strcpy(status->source, status->upload ? sockaddrtostr((struct sockaddr *) &caster_mountpoint->source_addr) : "");
+
+    xSemaphoreTake(clients_lock, portMAX_DELAY);
+    ntrip_caster_client_t *client;
+    SLIST_FOREACH(client, &caster_mountpoint->clients, next) {
+        status->clients++;
+    }
+    xSemaphoreGive(clients_lock);
+
+    return true;
+}
+
+static void ntrip_caster_credential_load(ntrip_caster_credential_type_t type, const char *username, const char *password, bool required) {
+    struct ntrip_caster_credential *credential = &credentials[type];
+    memset(credential, 0, sizeof(*credential));
+
+    credential->required = required;
+
+    size_t username_length = strlen(username);
+    size_t length = username_length + 1 + strlen(password);
+    if (length > CREDENTIAL_LENGTH_MAX || username_length > UINT8_MAX) {
+        // Never matches, as decoded credentials are limited to CREDENTIAL_LENGTH_MAX
+        ESP_LOGE(TAG, "Credentials too long, maximum length is %d", CREDENTIAL_LENGTH_MAX);
+        credential->length = CREDENTIAL_LENGTH_MAX + 1;
+        return;
+    }
+
+    credential->length = length;
+    credential->username_length = username_length;
+    memcpy(credential->value, username, username_length);
+    credential->value[username_length] = ':';
+    memcpy(credential->value + username_length + 1, password, length - username_length - 1);
+}
+
+static bool ntrip_caster_credential_match(ntrip_caster_credential_type_t type, const uint8_t *value, size_t length) {
+    struct ntrip_caster_credential *credential = &credentials[type];
+    if (!credential->required) return true;
+
+    // Constant time, every byte is compared regardless of where the first difference is
+    uint8_t diff = credential->length != length;
+    for (int i = 0; i < CREDENTIAL_LENGTH_MAX; i++) {
+        diff |= credential->value[i] ^ value[i];
+    }
+
+    return diff == 0;
+}
+
+static bool ntrip_caster_authenticate_basic(ntrip_caster_credential_type_t type, const http_parser_t *request, const char *buffer) {
+    uint8_t decoded[CREDENTIAL_LENGTH_MAX] = {0};
+    size_t decoded_length = 0;
+
+    const http_span_t *authorization = http_parser_header(request, buffer, "Authorization");
+    if (authorization != NULL && authorization->length > 6 && strncasecmp(buffer + authorization->offset, "Basic ", 6) == 0) {
+        const unsigned char *token = (const unsigned char *) buffer + authorization->offset + 6;
+        int err = mbedtls_base64_decode(decoded, sizeof(decoded), &decoded_length, token, authorization->length - 6);
+        if (err != 0) {
+            memset(decoded, 0, sizeof(decoded));
+            decoded_length = 0;
+        }
+    }
+
+    return ntrip_caster_credential_match(type, decoded, decoded_length);
+}
+
+static bool ntrip_caster_authenticate_password(ntrip_caster_credential_type_t type, const char *password) {
+    struct ntrip_caster_credential *credential = &credentials[type];
+    uint8_t value[CREDENTIAL_LENGTH_MAX] = {0};
+
+    // NTRIP v1 sources only send the password, match against configured username
+    size_t username_length = credential->username_length;
+    size_t password_length = strnlen(password, CREDENTIAL_LENGTH_MAX);
+    size_t length = username_length + 1 + password_length;
+    if (length > CREDENTIAL_LENGTH_MAX) return ntrip_caster_credential_match(type, value, 0);
+
+    memcpy(value, credential->value, username_length + 1);
+    memcpy(value + username_length + 1, password, password_length);
+
+    return ntrip_caster_credential_match(type, value, length);
+}
+
+static void ntrip_caster_auth_failure(struct sockaddr_in6 *addr) {
+    struct auth_failure *failure = NULL;
+
+    // Find existing entry for address, or replace least recent
+    for (int i = 0; i < NTRIP_CASTER_AUTH_FAILURES; i++) {
+        if (auth_failures[i].count > 0 && memcmp(&auth_failures[i].addr, &addr->sin6_addr, sizeof(addr->sin6_addr)) == 0) {
+            failure = &auth_failures[i];
+            break;
+        }
+
+        if (failure == NULL || auth_failures[i].last < failure->last) failure = &auth_failures[i];
+    }
+
+    if (failure->count == 0 || memcmp(&failure->addr, &addr->sin6_addr, sizeof(addr->sin6_addr)) != 0) {
+        failure->addr = addr->sin6_addr;
+        failure->count = 0;
+    }
+
+    failure->count++;
+    failure->last = esp_timer_get_time();
+
+    char *addr_str = sockaddrtostr((struct sockaddr *) addr);
+    ESP_LOGW(TAG, "Authentication failed for %s (%d failures)", addr_str, failure->count);
+    uart_nmea("$PESP,NTRIP,CST,AUTH,FAILED,%s,%d", addr_str, failure->count);
+}
+
+bool ntrip_caster_auth_failure_status(int index, ntrip_caster_auth_failure_status_t *status) {
+    if (index < 0 || index >= NTRIP_CASTER_AUTH_FAILURES) return false;
+
+    struct auth_failure *failure = &auth_failures[index];
+    if (failure->count == 0) return false;
+
+    struct sockaddr_in6 addr = {
+            .sin6_family = PF_INET6,
+            .sin6_addr = failure->addr
+    };
+
+    // Address without port
+    strlcpy(status->address, sockaddrtostr((struct sockaddr *) &addr), sizeof(status->address));
+    char *port = strrchr(status->address, ':');
+    if (port != NULL) *port = '\0';
+
+    status->failures = failure->count;
+    status->age = (esp_timer_get_time() - failure->last) / 1000000;
+
+    return true;
+}
+
+static ntrip_caster_mountpoint_t *ntrip_caster_mountpoint_find(const char *name) {
+    for (int i = 0; i < NTRIP_CASTER_MOUNTPOINTS; i++) {
+        if (mountpoints[i].active && strcasecmp(mountpoints[i].name, name) == 0) return &mountpoints[i];
+    }
+
+    return NULL;
+}
+
+static void ntrip_caster_source_remove(ntrip_caster_mountpoint_t *caster_mountpoint) {
+    char *addr_str = sockaddrtostr((struct sockaddr *) &caster_mountpoint->source_addr);
+    ESP_LOGI(TAG, "Source %s disconnected from mountpoint %s", addr_str, caster_mountpoint->name);
+    uart_nmea("$PESP,NTRIP,CST,SOURCE,DISCONNECTED,%s,%s", caster_mountpoint->name, addr_str);
+
+    reactor_watch_delete(caster_mountpoint->source_watch);
+    caster_mountpoint->source_watch = NULL;
+    router_context_delete(caster_mountpoint->source_router);
+    caster_mountpoint->source_router = NULL;
+    destroy_socket(&caster_mountpoint->source);
+
+    // Rovers subscribed to the upload have nothing left to receive
+    xSemaphoreTake(clients_lock, portMAX_DELAY);
+    ntrip_caster_client_t *client, *client_tmp;
+    SLIST_FOREACH_SAFE(client, &caster_mountpoint->clients, next, client_tmp) {
+        // Terminate chunked stream if nothing is queued before it, without waiting for space
+        if (client->chunked && !send_buffer_pending(&client->output)) {
+            send(client->socket, "0" NEWLINE NEWLINE, 1 + 2 * NEWLINE_LENGTH, MSG_DONTWAIT);
         }
+
+        ntrip_caster_client_remove(caster_mountpoint, client);
     }
+    caster_mountpoint->active = false;
+    xSemaphoreGive(clients_lock);
+}
+
+static void ntrip_caster_source_data(void *ctx, char *data, size_t length) {
+    ntrip_caster_mountpoint_t *caster_mountpoint = ctx;
+
+    stream_stats_increment(caster_mountpoint->stream_stats, length, 0);
+    stream_stats_increment(stream_stats, length, 0);
+
+    ntrip_caster_write(caster_mountpoint, data, length);
+
+    router_dispatch(caster_mountpoint->source_router, data, length);
+}
+
+static esp_err_t ntrip_caster_source_ingest(ntrip_caster_mountpoint_t *caster_mountpoint, char *data, size_t length) {
+    if (!caster_mountpoint->chunked) {
+        ntrip_caster_source_data(caster_mountpoint, data, length);
+        return ESP_OK;
+    }
+
+    // De-chunked payload is fanned out directly from the receive buffer, final chunk ends the upload
+    int ret = http_chunked_decode(&caster_mountpoint->chunked_state, data, length, ntrip_caster_source_data, caster_mountpoint);
+    return ret == HTTP_CHUNKED_RESULT_MORE ? ESP_OK : ESP_FAIL;
+}
+
+static void ntrip_caster_source_receive(void *ctx, int sock_source, uint8_t events) {
+    ntrip_caster_mountpoint_t *caster_mountpoint = ctx;
+
+    // Receive until nothing left to receive
+    int len;
+    while ((len = recv(sock_source, buffer, BUFFER_SIZE, MSG_DONTWAIT)) > 0) {
+        if (ntrip_caster_source_ingest(caster_mountpoint, buffer, len) != ESP_OK) {
+            ntrip_caster_source_remove(caster_mountpoint);
+            return;
+        }
+    }
+
+    // Remove on close or error
+    if (len == 0 || errno != EWOULDBLOCK) {
+        ntrip_caster_source_remove(caster_mountpoint);
+    }
+}
+
+static bool ntrip_caster_mountpoint_name_valid(const char *name) {
+    size_t length = strlen(name);
+    if (length == 0 || length > MOUNTPOINT_NAME_LENGTH) return false;
+
+    for (size_t i = 0; i < length; i++) {
+        if (!isalnum((unsigned char) name[i]) && name[i] != '-' && name[i] != '_') return false;
+    }
+
+    return true;
+}
+
+// Copies mountpoint name from request path, empty if too long
+static void ntrip_caster_request_mountpoint(const char *buffer, const http_span_t *path, char *name) {
+    name[0] = '\0';
+    if (path->length > MOUNTPOINT_NAME_LENGTH + 1) return;
+
+    // Treat /mountpoint and mountpoint the same
+    http_span_t span = *path;
+    if (span.length > 0 && buffer[span.offset] == '/') {
+        span.offset++;
+        span.length--;
+    }
+
+    http_span_copy(buffer, &span, name, MOUNTPOINT_NAME_LENGTH + 1);
+}
+
+static esp_err_t ntrip_caster_source_accept(int sock_client, struct sockaddr_in6 *source_addr, char *buffer, int len, http_parser_t *request) {
+    char *response;
+    char *addr_str = sockaddrtostr((struct sockaddr *) source_addr);
+
+    // NTRIP v1 "SOURCE password /mountpoint" or NTRIP v2 "POST /mountpoint HTTP/1.1"
+    bool v2 = http_span_equals(buffer, &request->start_line[HTTP_REQUEST_METHOD], "POST");
+
+    char request_password[65] = "", name[MOUNTPOINT_NAME_LENGTH + 1];
+    if (!v2) http_span_copy(buffer, &request->start_line[HTTP_REQUEST_TARGET], request_password, sizeof(request_password));
+    ntrip_caster_request_mountpoint(buffer, &request->start_line[v2 ? HTTP_REQUEST_TARGET : HTTP_REQUEST_VERSION], name);
+    if (!ntrip_caster_mountpoint_name_valid(name)) goto _invalid;
+
+    // Uploads are disabled without a source password
+    bool authenticated = v2 ? ntrip_caster_authenticate_basic(CREDENTIAL_SOURCE, request, buffer) :
+            ntrip_caster_authenticate_password(CREDENTIAL_SOURCE, request_password);
+    if (!authenticated) {
+        ntrip_caster_auth_failure(source_addr);
+
+        response = v2 ? "HTTP/1.1 401 Unauthorized" NEWLINE \
+                "Ntrip-Version: Ntrip/2.0" NEWLINE \
+                "WWW-Authenticate: Basic realm=\"/" NTRIP_CASTER_NAME "\"" NEWLINE \
+                "Connection: close" NEWLINE \
+                NEWLINE : "ERROR - Bad Password" NEWLINE;
+        ESP_LOGW(TAG, "Source %s failed to authenticate for mountpoint %s", addr_str, name);
+        goto _respond;
+    }
+
+    if (ntrip_caster_mountpoint_find(name) != NULL) goto _invalid;
+
+    ntrip_caster_mountpoint_t *caster_mountpoint = NULL;
+    for (int i = 1; i < NTRIP_CASTER_MOUNTPOINTS && caster_mountpoint == NULL; i++) {
+        if (!mountpoints[i].active) caster_mountpoint = &mountpoints[i];
+    }
+    if (caster_mountpoint == NULL) {
+        response = v2 ? "HTTP/1.1 503 Service Unavailable" NEWLINE \
+                "Ntrip-Version: Ntrip/2.0" NEWLINE \
+                "Connection: close" NEWLINE \
+                NEWLINE : "ERROR - Too Many Sources" NEWLINE;
+        ESP_LOGW(TAG, "Source %s rejected for mountpoint %s, no free slots", addr_str, name);
+        goto _respond;
+    }
+
+    bool chunked = v2 && http_span_contains(buffer, http_parser_header(request, buffer, "Transfer-Encoding"), "chunked");
+
+    // Data received along with the request
+    char *body = buffer + request->body;
+    int body_length = len - (int) request->body;
+
+    response = v2 ? "HTTP/1.1 200 OK" NEWLINE \
+            "Ntrip-Version: Ntrip/2.0" NEWLINE \
+            "Server: NTRIP " NTRIP_CASTER_NAME NEWLINE \
+            "Connection: close" NEWLINE \
+            NEWLINE : "ICY 200 OK" NEWLINE NEWLINE;
+    int err = write(sock_client, response, strlen(response));
+    ERROR_ACTION(TAG, err < 0, return ESP_FAIL, "Could not send response to source: %d %s", errno, strerror(errno))
+
+    xSemaphoreTake(clients_lock, portMAX_DELAY);
+    caster_mountpoint->source = sock_client;
+    caster_mountpoint->source_addr = *source_addr;
+    caster_mountpoint->chunked = chunked;
+    caster_mountpoint->stalled = 0;
+    http_chunked_init(&caster_mountpoint->chunked_state);
+    rtcm_parser_init(&caster_mountpoint->parser);
+    caster_mountpoint->carry_length = 0;
+    strcpy(caster_mountpoint->name, name);
+    SLIST_INIT(&caster_mountpoint->clients);
+    caster_mountpoint->active = true;
+    xSemaphoreGive(clients_lock);
+
+    // Uploads are routed separately, so frames split across reads are not completed with another upload's data
+    caster_mountpoint->source_router = router_context_new(ROUTER_SOURCE_NTRIP_CASTER);
+    ERROR_ACTION(TAG, caster_mountpoint->source_router == NULL, ntrip_caster_source_remove(caster_mountpoint); return ESP_OK,
+            "Could not allocate routing context for source")
+
+    caster_mountpoint->source_watch = reactor_watch_new(sock_client, REACTOR_READ, ntrip_caster_source_receive, caster_mountpoint);
+    ERROR_ACTION(TAG, caster_mountpoint->source_watch == NULL, ntrip_caster_source_remove(caster_mountpoint); return ESP_OK,
+            "Could not watch source socket")
+
+    ESP_LOGI(TAG, "Source %s connected to mountpoint %s", addr_str, name);
+    uart_nmea("$PESP,NTRIP,CST,SOURCE,CONNECTED,%s,%s", name, addr_str);
+
+    if (body_length > 0 && ntrip_caster_source_ingest(caster_mountpoint, body, body_length) != ESP_OK) {
+        ntrip_caster_source_remove(caster_mountpoint);
+    }
+
+    return ESP_OK;
+
+    _invalid:
+    response = v2 ? "HTTP/1.1 409 Conflict" NEWLINE \
+            "Ntrip-Version: Ntrip/2.0" NEWLINE \
+            "Connection: close" NEWLINE \
+            NEWLINE : "ERROR - Mount Point Taken or Invalid" NEWLINE;
+    ESP_LOGW(TAG, "Source %s requested mountpoint that is taken or invalid", addr_str);
+
+    _respond:
+    err = write(sock_client, response, strlen(response));
+    if (err < 0) ESP_LOGE(TAG, "Could not send response to source: %d %s", errno, strerror(errno));
+
+    return ESP_FAIL;
+}
+
+static int ntrip_caster_sourcetable(char *stream, size_t size) {
+    int length = 0;
+    for (int i = 0; i < NTRIP_CASTER_MOUNTPOINTS; i++) {
+        if (!mountpoints[i].active) continue;
+
+        length += snprintf(stream + length, size - length, "STR;%s;;;;;;;;0.00;0.00;0;0;;none;%c;N;0;" NEWLINE,
+                mountpoints[i].name, credentials[CREDENTIAL_CLIENT].required ? 'B' : 'N');
+        if (length >= size) return size - 1;
+    }
+
+    length += snprintf(stream + length, size - length, "ENDSOURCETABLE");
+    return MIN(length, size - 1);
+}
+
+// Takes ownership of the socket, responds and either keeps it as a client or source or closes it
+static void ntrip_caster_request_handle(int sock_client, struct sockaddr_in6 *source_addr, char *buffer, int len, http_parser_t *request) {
+    // Upload from a base station
+    const http_span_t *method = &request->start_line[HTTP_REQUEST_METHOD];
+    if (http_span_equals(buffer, method, "SOURCE") || http_span_equals(buffer, method, "POST")) {
+        if (ntrip_caster_source_accept(sock_client, source_addr, buffer, len, request) != ESP_OK) goto _error;
+        return;
+    }
+
+    ERROR_ACTION(TAG, !http_span_equals(buffer, method, "GET"), {
+        char *response = "HTTP/1.1 405 Method Not Allowed" NEWLINE \
+                "Allow: GET, POST, SOURCE" NEWLINE \
+                NEWLINE;
+
+        int err = write(sock_client, response, strlen(response));
+        if (err < 0) ESP_LOGE(TAG, "Could not send response to client: %d %s", errno, strerror(errno));
+
+        goto _error;
+    }, "Client did not send GET request")
+
+    // Name of mountpoint, or empty string if sourcetable request
+    char mountpoint_name[MOUNTPOINT_NAME_LENGTH + 1];
+    ntrip_caster_request_mountpoint(buffer, &request->start_line[HTTP_REQUEST_TARGET], mountpoint_name);
+
+    // Print sourcetable if an active mountpoint was not requested
+    ntrip_caster_mountpoint_t *caster_mountpoint = ntrip_caster_mountpoint_find(mountpoint_name);
+    bool print_sourcetable = caster_mountpoint == NULL;
+
+    // Ensure authenticated
+    bool authenticated = ntrip_caster_authenticate_basic(CREDENTIAL_CLIENT, request, buffer);
+
+    // Use HTTP response if not an NTRIP client
+    const http_span_t *user_agent = http_parser_header(request, buffer, "User-Agent");
+    bool ntrip_agent = user_agent == NULL || http_span_contains(buffer, user_agent, "NTRIP");
+
+    // NTRIP v2 clients announce themselves with Ntrip-Version header
+    bool ntrip_v2 = http_span_contains(buffer, http_parser_header(request, buffer, "Ntrip-Version"), "Ntrip/2.0");
+
+    // Unknown mountpoint or sourcetable requested
+    if (print_sourcetable) {
+        char stream[512];
+        ntrip_caster_sourcetable(stream, sizeof(stream));
+
+        snprintf(buffer, BUFFER_SIZE, "%s 200 OK" NEWLINE \
+                "%s" \
+                "Server: NTRIP %s/%s" NEWLINE \
+                "Content-Type: %s" NEWLINE \
+                "Content-Length: %d" NEWLINE \
+                "Connection: close" NEWLINE \
+                NEWLINE \
+                "%s",
+                ntrip_v2 ? "HTTP/1.1" : ntrip_agent ? "SOURCETABLE" : "HTTP/1.0",
+                ntrip_v2 ? "Ntrip-Version: Ntrip/2.0" NEWLINE : "",
+                NTRIP_CASTER_NAME, &esp_ota_get_app_description()->version[1],
+                ntrip_v2 ? "gnss/sourcetable" : "text/plain",
+                strlen(stream), stream);
+
+        int err = write(sock_client, buffer, strlen(buffer));
+        if (err < 0) ESP_LOGE(TAG, "Could not send response to client: %d %s", errno, strerror(errno));
+
+        goto _error;
+    }
+
+    // Request basic authentication header
+    if (!authenticated) {
+        ntrip_caster_auth_failure(source_addr);
+
+        char *message = "Authorization Required";
+        snprintf(buffer, BUFFER_SIZE, "%s 401 Unauthorized" NEWLINE \
+                "%s" \
+                "Server: %s/1.0" NEWLINE \
+                "WWW-Authenticate: Basic realm=\"/%s\"" NEWLINE
+                "Content-Type: text/plain" NEWLINE \
+                "Content-Length: %d" NEWLINE \
+                "Connection: close" NEWLINE \
+                NEWLINE \
+                "%s",
+                ntrip_v2 ? "HTTP/1.1" : "HTTP/1.0",
+                ntrip_v2 ? "Ntrip-Version: Ntrip/2.0" NEWLINE : "",
+                NTRIP_CASTER_NAME, caster_mountpoint->name, strlen(message), message);
+
+        int err = write(sock_client, buffer, strlen(buffer));
+        if (err < 0) ESP_LOGE(TAG, "Could not send response to client: %d %s", errno, strerror(errno));
+
+        goto _error;
+    }
+
+    if (ntrip_v2) {
+        snprintf(buffer, BUFFER_SIZE, "HTTP/1.1 200 OK" NEWLINE \
+                "Ntrip-Version: Ntrip/2.0" NEWLINE \
+                "Server: NTRIP %s/%s" NEWLINE \
+                "Content-Type: gnss/data" NEWLINE \
+                "Transfer-Encoding: chunked" NEWLINE \
+                "Cache-Control: no-store, no-cache, max-age=0" NEWLINE \
+                "Connection: close" NEWLINE \
+                NEWLINE,
+                NTRIP_CASTER_NAME, &esp_ota_get_app_description()->version[1]);
+    } else {
+        strcpy(buffer, "ICY 200 OK" NEWLINE NEWLINE);
+    }
+
+    int err = write(sock_client, buffer, strlen(buffer));
+    ERROR_ACTION(TAG, err < 0, goto _error, "Could not send response to client: %d %s", errno, strerror(errno))
+
+    ntrip_caster_client_t *client = pool_alloc(client_pool, sizeof(ntrip_caster_client_t));
+    ERROR_ACTION(TAG, client == NULL, goto _error, "Could not allocate client")
+    *client = (ntrip_caster_client_t) {
+            .socket = sock_client,
+            .mountpoint = caster_mountpoint,
+            .chunked = ntrip_v2
+    };
+    send_buffer_init(&client->output, CLIENT_OUTPUT_SIZE);
+
+    // Only watched for writing while output is queued
+    client->watch = reactor_watch_new(sock_client, 0, ntrip_caster_client_writable, client);
+    ERROR_ACTION(TAG, client->watch == NULL, pool_release(client); goto _error, "Could not watch client")
+
+    xSemaphoreTake(clients_lock, portMAX_DELAY);
+    SLIST_INSERT_HEAD(&caster_mountpoint->clients, client, next);
+    client_count++;
+    xSemaphoreGive(clients_lock);
+
+    // Socket will now be dealt with by ntrip_caster_write
+    if (status_led != NULL) status_led->flashing_mode = STATUS_LED_FADE;
+
+    char *addr_str = sockaddrtostr((struct sockaddr *) source_addr);
+    uart_nmea("$PESP,NTRIP,CST,CLIENT,CONNECTED,%s", addr_str);
+
+    return;
+
+    _error:
+    destroy_socket(&sock_client);
 }
 
 static int ntrip_caster_socket_init() {
@@ -92,6 +885,8 @@ static int ntrip_caster_socket_init() {
     err = bind(sock, (struct sockaddr *)&srv_addr, sizeof(srv_addr));
     ERROR_ACTION(TAG, err != 0, destroy_socket(&sock); return err, "Could not bind TCP socket: %d %s", errno, strerror(errno))
 
+    socket_budget_acquire(sock, SOCKET_BUDGET_NTRIP_CASTER);
+
     err = listen(sock, 1);
     ERROR_ACTION(TAG, err != 0, destroy_socket(&sock); return err, "Could not listen on TCP socket: %d %s", errno, strerror(errno))
 
@@ -101,145 +896,166 @@ static int ntrip_caster_socket_init() {
     return 0;
 }
 
-static void ntrip_caster_task(void *ctx) {
-    uart_register_read_handler(ntrip_caster_uart_handler);
+static void ntrip_caster_stop() {
+    reactor_watch_delete(listen_watch);
+    listen_watch = NULL;
+    destroy_socket(&sock);
 
-    config_color_t status_led_color = config_get_color(CONF_ITEM(KEY_CONFIG_NTRIP_CASTER_COLOR));
-    if (status_led_color.rgba != 0) status_led = status_led_add(status_led_color.rgba, STATUS_LED_STATIC, 500, 2000, 0);
+    for (int i = 1; i < NTRIP_CASTER_MOUNTPOINTS; i++) {
+        if (mountpoints[i].active) ntrip_caster_source_remove(&mountpoints[i]);
+    }
 
-    stream_stats = stream_stats_new("ntrip_caster");
+    free(mountpoint);
+    mountpoint = NULL;
 
-    while (true) {
-        ntrip_caster_socket_init();
+    reactor_timer_start(restart_timer, RESTART_DELAY);
+}
 
-        char *mountpoint, *username, *password;
-        config_get_str_blob_alloc(CONF_ITEM(KEY_CONFIG_NTRIP_CASTER_USERNAME), (void **) &username);
-        config_get_str_blob_alloc(CONF_ITEM(KEY_CONFIG_NTRIP_CASTER_PASSWORD), (void **) &password);
-        config_get_str_blob_alloc(CONF_ITEM(KEY_CONFIG_NTRIP_CASTER_MOUNTPOINT), (void **) &mountpoint);
+static void ntrip_caster_request_free(ntrip_caster_request_t *request) {
+    reactor_watch_delete(request->watch);
+    reactor_timer_delete(request->timer);
+    pool_release(request);
+}
 
-        // Wait for client connections
-        int sock_client = -1;
-        char *buffer = malloc(BUFFER_SIZE);
-        while (true) {
-            destroy_socket(&sock_client);
+static void ntrip_caster_request_timeout(void *ctx) {
+    ntrip_caster_request_t *request = ctx;
 
-            struct sockaddr_in6 source_addr;
-            size_t addr_len = sizeof(source_addr);
-            sock_client = accept(sock, (struct sockaddr *)&source_addr, &addr_len);
-            ERROR_ACTION(TAG, sock_client < 0, goto _error, "Could not accept connection: %d %s", errno, strerror(errno))
+    ESP_LOGW(TAG, "Client %s did not send request in time", sockaddrtostr((struct sockaddr *) &request->addr));
 
-            int len = read(sock_client, buffer, BUFFER_SIZE - 1);
-            ERROR_ACTION(TAG, len <= 0, continue, "Could not receive from client: %d %s", errno, strerror(errno))
-            buffer[len] = '\0';
+    destroy_socket(&request->socket);
+    ntrip_caster_request_free(request);
+}
 
-            // Find mountpoint requested by looking for GET /(%s)?
-            char *mountpoint_path = extract_http_header(buffer, "GET ");
-            ERROR_ACTION(TAG, mountpoint_path == NULL, {
-                char *response = "HTTP/1.1 405 Method Not Allowed" NEWLINE \
-                        "Allow: GET" NEWLINE \
-                        NEWLINE;
+static void ntrip_caster_request_receive(void *ctx, int sock_client, uint8_t events) {
+    ntrip_caster_request_t *request = ctx;
 
-                int err = write(sock_client, response, strlen(response));
-                if (err < 0) ESP_LOGE(TAG, "Could not send response to client: %d %s", errno, strerror(errno));
+    // Read until end of request headers
+    int received = recv(sock_client, request->buffer + request->length, BUFFER_SIZE - 1 - request->length, MSG_DONTWAIT);
+    if (received < 0 && errno == EWOULDBLOCK) return;
+    ERROR_ACTION(TAG, received <= 0, goto _error, "Could not receive from client: %d %s", errno, strerror(errno))
 
-                continue;
-            }, "Client did not send GET request")
-
-            // Move pointer to name of mountpoint, or empty string if sourcetable request
-            char *mountpoint_name = mountpoint_path;
-
-            // Treat GET /mountpoint and GET mountpoint the same
-            if (mountpoint_name[0] == '/') mountpoint_name++;
-
-            // Move to space or end of string (removing HTTP/1.1 from line)
-            char *space = strstr(mountpoint_name, " ");
-            if (space != NULL) *space = '\0';
-
-            // Print sourcetable if exact mountpoint was not requested
-            bool print_sourcetable = strcasecmp(mountpoint, mountpoint_name) != 0;
-            free(mountpoint_path);
-
-            // Ensure authenticated
-            char *basic_authentication = strlen(username) == 0 ? NULL : http_auth_basic_header(username, password);
-            char *authorization_header = extract_http_header(buffer, "Authorization:");
-            bool authenticated = basic_authentication == NULL ||
-                    (authorization_header != NULL && strcasecmp(basic_authentication, authorization_header) == 0);
-            free(basic_authentication);
-            free(authorization_header);
-
-            // Use HTTP response if not an NTRIP client
-            char *user_agent_header = extract_http_header(buffer, "User-Agent:");
-            bool ntrip_agent = user_agent_header == NULL || strcasestr(user_agent_header, "NTRIP") != NULL;
-            free(user_agent_header);
-
-            // Unknown mountpoint or sourcetable requested
-            if (print_sourcetable) {
-                char stream[256] = "";
-                snprintf(stream, sizeof(stream), "STR;%s;;;;;;;;0.00;0.00;0;0;;none;%c;N;0;" NEWLINE "ENDSOURCETABLE",
-                        mountpoint, strlen(username) == 0 ? 'N' : 'B');
-
-                snprintf(buffer, BUFFER_SIZE, "%s 200 OK" NEWLINE \
-                        "Server: NTRIP %s/%s" NEWLINE \
-                        "Content-Type: text/plain" NEWLINE \
-                        "Content-Length: %d" NEWLINE \
-                        "Connection: close" NEWLINE \
-                        NEWLINE \
-                        "%s",
-                        ntrip_agent ? "SOURCETABLE" : "HTTP/1.0",
-                        NTRIP_CASTER_NAME, &esp_ota_get_app_description()->version[1],
-                        strlen(stream), stream);
-
-                int err = write(sock_client, buffer, strlen(buffer));
-                if (err < 0) ESP_LOGE(TAG, "Could not send response to client: %d %s", errno, strerror(errno));
+    request->length += received;
+    int ret = http_parser_parse(&request->parser, request->buffer, request->length);
+    if (ret == HTTP_PARSER_RESULT_MORE && request->length < BUFFER_SIZE - 1) return;
 
-                continue;
-            }
+    request->buffer[request->length] = '\0';
+    ERROR_ACTION(TAG, ret != HTTP_PARSER_RESULT_DONE, goto _error, "Client sent malformed or oversized request")
 
-            // Request basic authentication header
-            if (!authenticated) {
-                char *message = "Authorization Required";
-                snprintf(buffer, BUFFER_SIZE, "HTTP/1.0 401 Unauthorized" NEWLINE \
-                        "Server: %s/1.0" NEWLINE \
-                        "WWW-Authenticate: Basic realm=\"/%s\"" NEWLINE
-                        "Content-Type: text/plain" NEWLINE \
-                        "Content-Length: %d" NEWLINE \
-                        "Connection: close" NEWLINE \
-                        NEWLINE \
-                        "%s",
-                        NTRIP_CASTER_NAME, mountpoint, strlen(message), message);
-
-                int err = write(sock_client, buffer, strlen(buffer));
-                if (err < 0) ESP_LOGE(TAG, "Could not send response to client: %d %s", errno, strerror(errno));
+    ntrip_caster_request_handle(request->socket, &request->addr, request->buffer, request->length, &request->parser);
+    ntrip_caster_request_free(request);
+    return;
 
-                continue;
-            }
+    _error:
+    destroy_socket(&request->socket);
+    ntrip_caster_request_free(request);
+}
 
-            char response[] = "ICY 200 OK" NEWLINE NEWLINE;
-            int err = write(sock_client, response, sizeof(response));
-            ERROR_ACTION(TAG, err < 0, continue, "Could not send response to client: %d %s", errno, strerror(errno))
+static void ntrip_caster_accept(void *ctx, int sock_listen, uint8_t events) {
+    struct sockaddr_in6 source_addr;
+    socklen_t addr_len = sizeof(source_addr);
+    int sock_client = accept(sock_listen, (struct sockaddr *)&source_addr, &addr_len);
+    ERROR_ACTION(TAG, sock_client < 0, ntrip_caster_stop(); return, "Could not accept connection: %d %s", errno, strerror(errno))
 
-            ntrip_caster_client_t *client = malloc(sizeof(ntrip_caster_client_t));
-            client->socket = sock_client;
-            SLIST_INSERT_HEAD(&caster_clients_list, client, next);
+    // Refuse straight away rather than starving other interfaces of sockets
+    ERROR_ACTION(TAG, !socket_budget_acquire(sock_client, SOCKET_BUDGET_NTRIP_CASTER), {
+        char *response = "HTTP/1.1 503 Service Unavailable" NEWLINE \
+                "Connection: close" NEWLINE \
+                NEWLINE;
 
-            // Socket will now be dealt with by ntrip_caster_uart_handler, set to -1 so it doesn't get destroyed
-            sock_client = -1;
+        send(sock_client, response, strlen(response), MSG_DONTWAIT);
+        destroy_socket(&sock_client);
+        return;
+    }, "Connection from %s refused, no sockets available", sockaddrtostr((struct sockaddr *) &source_addr))
 
-            if (status_led != NULL) status_led->flashing_mode = STATUS_LED_FADE;
+    // Detect rovers and bases that disappear without closing the connection
+    socket_keepalive(sock_client);
 
-            char *addr_str = sockaddrtostr((struct sockaddr *) &source_addr);
-            uart_nmea("$PESP,NTRIP,CST,CLIENT,CONNECTED,%s", addr_str);
-        }
+    // Don't let a slow client hold up the caster, the request is read as it arrives
+    ntrip_caster_request_t *request = pool_alloc(request_pool, sizeof(ntrip_caster_request_t));
+    ERROR_ACTION(TAG, request == NULL, destroy_socket(&sock_client); return, "Could not allocate request")
+    request->socket = sock_client;
+    request->addr = source_addr;
+    request->length = 0;
+    http_parser_init(&request->parser, HTTP_PARSER_REQUEST);
+
+    request->watch = reactor_watch_new(sock_client, REACTOR_READ, ntrip_caster_request_receive, request);
+    request->timer = reactor_timer_new(ntrip_caster_request_timeout, request);
+    ERROR_ACTION(TAG, request->watch == NULL || request->timer == NULL,
+            destroy_socket(&request->socket); ntrip_caster_request_free(request); return, "Could not watch request")
+
+    reactor_timer_start(request->timer, REQUEST_TIMEOUT);
+}
 
-        _error:
-        destroy_socket(&sock);
+static void ntrip_caster_start(void *ctx) {
+    if (restart_timer == NULL) restart_timer = reactor_timer_new(ntrip_caster_start, NULL);
+    ERROR_ACTION(TAG, restart_timer == NULL, return, "Could not create restart timer")
 
-        free(buffer);
+    if (ntrip_caster_socket_init() != 0) {
+        reactor_timer_start(restart_timer, RESTART_DELAY);
+        return;
     }
+
+    config_get_str_blob_alloc(CONF_ITEM(KEY_CONFIG_NTRIP_CASTER_MOUNTPOINT), (void **) &mountpoint);
+
+    char *username, *password;
+    config_get_str_blob_alloc(CONF_ITEM(KEY_CONFIG_NTRIP_CASTER_USERNAME), (void **) &username);
+    config_get_str_blob_alloc(CONF_ITEM(KEY_CONFIG_NTRIP_CASTER_PASSWORD), (void **) &password);
+    ntrip_caster_credential_load(CREDENTIAL_CLIENT, username, password, strlen(username) > 0);
+    free(username);
+    free(password);
+
+    config_get_str_blob_alloc(CONF_ITEM(KEY_CONFIG_NTRIP_CASTER_SOURCE_USERNAME), (void **) &username);
+    config_get_str_blob_alloc(CONF_ITEM(KEY_CONFIG_NTRIP_CASTER_SOURCE_PASSWORD), (void **) &password);
+    ntrip_caster_credential_load(CREDENTIAL_SOURCE, username, password, true);
+
+    // Uploads are disabled without a source password
+    if (strlen(password) == 0) credentials[CREDENTIAL_SOURCE].length = CREDENTIAL_LENGTH_MAX + 1;
+    free(username);
+    free(password);
+
+    xSemaphoreTake(clients_lock, portMAX_DELAY);
+    strlcpy(LOCAL_MOUNTPOINT->name, mountpoint, sizeof(LOCAL_MOUNTPOINT->name));
+    LOCAL_MOUNTPOINT->source = -1;
+    LOCAL_MOUNTPOINT->active = true;
+    xSemaphoreGive(clients_lock);
+
+    // Wait for client connections, upload sources are watched as they connect
+    listen_watch = reactor_watch_new(sock, REACTOR_READ, ntrip_caster_accept, NULL);
+    ERROR_ACTION(TAG, listen_watch == NULL, ntrip_caster_stop(), "Could not watch listening socket")
 }
 
 void ntrip_caster_init() {
     if (!config_get_bool1(CONF_ITEM(KEY_CONFIG_NTRIP_CASTER_ACTIVE))) return;
 
-    xTaskCreate(ntrip_caster_task, "ntrip_caster_task", 4096, NULL, TASK_PRIORITY_INTERFACE, NULL);
-}
\ No newline at end of file
+    clients_lock = xSemaphoreCreateMutex();
+    socket_budget_enable(SOCKET_BUDGET_NTRIP_CASTER);
+
+    stall_timeout = config_get_u16(CONF_ITEM(KEY_CONFIG_TCP_STALL_TIMEOUT)) * 1000000LL;
+
+    relay = config_get_bool1(CONF_ITEM(KEY_CONFIG_NTRIP_CASTER_RELAY));
+    if (relay) {
+        // Upstream is considered down until the NTRIP client first connects
+        relay_stats.outage_start = esp_timer_get_time();
+        relay_stats.outages = 1;
+    }
+
+    router_register_sink(ROUTER_SINK_NTRIP_CASTER, ntrip_caster_uart_handler);
+
+    config_color_t status_led_color = config_get_color(CONF_ITEM(KEY_CONFIG_NTRIP_CASTER_COLOR));
+    if (status_led_color.rgba != 0) status_led = status_led_add(status_led_color.rgba, STATUS_LED_STATIC, 500, 2000, 0);
+
+    stream_stats = stream_stats_new("ntrip_caster");
+
+    // Per source input rates
+    for (int i = 1; i < NTRIP_CASTER_MOUNTPOINTS; i++) {
+        snprintf(mountpoints[i].stream_stats_name, sizeof(mountpoints[i].stream_stats_name), "ntrip_caster_source_%d", i);
+        mountpoints[i].stream_stats = stream_stats_new(mountpoints[i].stream_stats_name);
+        mountpoints[i].source = -1;
+    }
+
+    buffer = malloc(BUFFER_SIZE);
+    client_pool = pool_new("ntrip_caster_clients", sizeof(ntrip_caster_client_t), CLIENT_POOL_COUNT);
+    request_pool = pool_new("ntrip_caster_requests", sizeof(ntrip_caster_request_t), REQUEST_POOL_COUNT);
+
+    ERROR_ACTION(TAG, !reactor_call(ntrip_caster_start, NULL), return, "Could not start on reactor")
+}
@@ -16,18 +16,26 @@
  */
 
 #include <stdbool.h>
+#include <ctype.h>
+#include <sys/param.h>
 #include <esp_log.h>
 #include <esp_event_base.h>
 #include <sys/socket.h>
 #include <wifi.h>
-#include <tasks.h>
 #include <status_led.h>
-#include <retry.h>
 #include <stream_stats.h>
 #include <freertos/event_groups.h>
 #include <esp_ota_ops.h>
+#include <esp_timer.h>
+#include <protocol/http.h>
+#include <protocol/nmea.h>
+#include <protocol/rtcm.h>
+#include <sys/time.h>
 #include "interface/ntrip.h"
 #include "config.h"
+#include "reactor.h"
+#include "router.h"
+#include "socket_budget.h"
 #include "util.h"
 #include "uart.h"
 
@@ -35,170 +43,904 @@ static const char *TAG = "NTRIP_CLIENT";
 
 #define BUFFER_SIZE 512
 
-#define GPGGA_HEADER "$GPGGA"
-#define GNGGA_HEADER "$GNGGA"
-#define GGA_END "\r\n"
+// Milliseconds
+#define NTRIP_CLIENT_POLL_INTERVAL 1000
+#define NTRIP_CLIENT_FAILBACK_INTERVAL 30000
+#define NTRIP_CLIENT_COOLDOWN_MIN 2000
+#define NTRIP_CLIENT_COOLDOWN_MAX 300000
+#define NTRIP_CLIENT_PRIORITY_WEIGHT 1000
+#define NTRIP_CLIENT_SOURCETABLE_LIFETIME 3600000
+
+#define NTRIP_CLIENT_SOURCETABLE_MAX 128
+
+// Clock is not synced by SNTP before 2020-01-01
+#define NTRIP_CLIENT_TIME_VALID 1577836800
 
 static const int CASTER_READY_BIT = BIT0;
 
+// Stream of the active source, received into buffer on the reactor
 static int sock = -1;
+static reactor_watch_handle_t stream_watch = NULL;
+static router_context_handle_t stream_router = NULL;
+static char *buffer;
+static http_chunked_t chunked_state;
+static bool chunked;
+static int64_t failback_check;
 
-static TaskHandle_t nmea_gga_send_task = NULL;
+static reactor_timer_handle_t poll_timer;
 
 static EventGroupHandle_t client_event_group;
 
 static status_led_handle_t status_led = NULL;
 static stream_stats_handle_t stream_stats = NULL;
 
-static char nmea_gga_latest[128] = "";
+// Stall is measured from the last valid RTCM frame, not the last byte
+static rtcm_parser_t rtcm_parser;
+static int64_t stall_timeout;
+
+// Partial NMEA sentence carried between UART reads
+static char nmea_line[NMEA_SENTENCE_LENGTH_MAX];
+static size_t nmea_line_length = 0;
+
+// Only used on the reactor, which owns the socket
+static struct gga_upload {
+    int64_t interval;
+    uint16_t distance;
+
+    bool sent;
+    int64_t time;
+    double latitude;
+    double longitude;
+
+    // Sentence being sent, the rest is sent from offset once the socket is writable
+    char sentence[NMEA_SENTENCE_LENGTH_MAX];
+    size_t length;
+    size_t offset;
+} gga_upload;
+
+// Last valid fix, written by the UART task and read on the reactor under position_lock
+static portMUX_TYPE position_lock = portMUX_INITIALIZER_UNLOCKED;
+static struct position {
+    bool valid;
+    double latitude;
+    double longitude;
+
+    // Sentence of the fix, handed to the reactor to be sent to the caster
+    char sentence[NMEA_SENTENCE_LENGTH_MAX];
+    size_t length;
+    bool send_pending;
+} position;
+
+// Compact copy of the sourcetable, only streams with a position are kept
+typedef struct ntrip_client_mountpoint {
+    char name[33];
+    float latitude;
+    float longitude;
+} ntrip_client_mountpoint_t;
+
+static struct nearest {
+    bool active;
+    uint16_t distance;
+
+    ntrip_client_mountpoint_t *mountpoints;
+    int count;
+    int64_t fetched;
+
+    // Position the current mountpoint was selected at
+    bool anchored;
+    double latitude;
+    double longitude;
+} nearest;
+
+// Copy of the last fix, false if there is none
+static bool ntrip_client_position(double *latitude, double *longitude) {
+    portENTER_CRITICAL(&position_lock);
+    bool valid = position.valid;
+    *latitude = position.latitude;
+    *longitude = position.longitude;
+    portEXIT_CRITICAL(&position_lock);
+
+    return valid;
+}
+
+static void ntrip_client_disconnect(bool reselect, bool stalled);
+
+// Sends what the socket takes, and watches for space to send the rest
+static bool ntrip_client_gga_flush() {
+    int sent = send(sock, gga_upload.sentence + gga_upload.offset, gga_upload.length - gga_upload.offset, MSG_DONTWAIT);
+    if (sent < 0 && errno != EWOULDBLOCK) return false;
+
+    if (sent > 0) {
+        gga_upload.offset += sent;
+        stream_stats_increment(stream_stats, 0, sent);
+    }
+
+    reactor_watch_events(stream_watch, REACTOR_READ | (gga_upload.offset < gga_upload.length ? REACTOR_WRITE : 0));
+
+    return true;
+}
+
+static void ntrip_client_gga_send(void *ctx) {
+    char sentence[NMEA_SENTENCE_LENGTH_MAX];
+
+    portENTER_CRITICAL(&position_lock);
+    position.send_pending = false;
+    size_t length = position.length;
+    memcpy(sentence, position.sentence, length);
+    double latitude = position.latitude;
+    double longitude = position.longitude;
+    portEXIT_CRITICAL(&position_lock);
+
+    // Caster connected, and done with the previous sentence
+    if (sock < 0 || gga_upload.offset < gga_upload.length) return;
+
+    // Rate limit, and only re-anchor once moved far enough
+    int64_t now = esp_timer_get_time();
+    if (gga_upload.sent) {
+        if (now - gga_upload.time < gga_upload.interval) return;
+        if (gga_upload.distance > 0 && nmea_distance(gga_upload.latitude, gga_upload.longitude,
+                latitude, longitude) < gga_upload.distance) return;
+    }
+
+    memcpy(gga_upload.sentence, sentence, length);
+    gga_upload.length = length;
+    gga_upload.offset = 0;
 
-static void nmea_gga_extract(int32_t length, void *buffer) {
-    void *start = memmem(buffer, length, GPGGA_HEADER, strlen(GPGGA_HEADER));
-    if (start == NULL) start = memmem(buffer, length, GNGGA_HEADER, strlen(GNGGA_HEADER));
-    if (start == NULL) return;
-    void *zero = memmem(start, length - (start - buffer), "\0", 1);
-    void *end = memmem(start, length - (start - buffer), GGA_END, strlen(GGA_END));
+    gga_upload.sent = true;
+    gga_upload.time = now;
+    gga_upload.latitude = latitude;
+    gga_upload.longitude = longitude;
 
-    if (end == NULL || (zero != NULL && zero < end)) return;
+    if (!ntrip_client_gga_flush()) ntrip_client_disconnect(false, false);
+}
 
-    unsigned int size = (end - start) + strlen(GGA_END);
-    if (size > (sizeof(nmea_gga_latest) - 1)) return;
+static void ntrip_client_gga(const char *sentence, size_t length) {
+    // Nothing to send until there is a valid fix
+    nmea_gga_t gga;
+    if (!nmea_gga_parse(sentence, length, &gga) || gga.fix_quality == 0) return;
 
-    memcpy(nmea_gga_latest, start, size);
-    nmea_gga_latest[size] = '\0';
+    // Caster connected and ready for data
+    bool ready = (xEventGroupGetBits(client_event_group) & CASTER_READY_BIT) != 0;
+
+    portENTER_CRITICAL(&position_lock);
+    position.latitude = gga.latitude;
+    position.longitude = gga.longitude;
+    position.valid = true;
+    memcpy(position.sentence, sentence, length);
+    position.length = length;
+    bool schedule = ready && !position.send_pending;
+    if (schedule) position.send_pending = true;
+    portEXIT_CRITICAL(&position_lock);
+
+    // Socket is only written on the reactor, a sentence arriving before the call runs replaces this one
+    if (schedule && !reactor_call(ntrip_client_gga_send, NULL)) {
+        portENTER_CRITICAL(&position_lock);
+        position.send_pending = false;
+        portEXIT_CRITICAL(&position_lock);
+    }
 }
 
-static void ntrip_client_nmea_gga_send_task(void *ctx) {
-    vTaskDelay(pdMS_TO_TICKS(1000));
+static void ntrip_client_uart_handler(const void *buffer, size_t length) {
+    // Caster connected and ready for data, or position needed for mountpoint selection
+    if (!nearest.active && (xEventGroupGetBits(client_event_group) & CASTER_READY_BIT) == 0) return;
+
+    // Assemble NMEA sentences which may be split across reads
+    const char *data = buffer, *end = data + length;
+    while (data < end) {
+        if (nmea_line_length == 0) {
+            data = memchr(data, '$', end - data);
+            if (data == NULL) return;
+        }
+
+        const char *lf = memchr(data, '\n', end - data);
+        size_t size = (lf == NULL ? end : lf + 1) - data;
 
-    while (true) {
-        int sent = send(sock, nmea_gga_latest, strlen(nmea_gga_latest), 0);
-        if (sent < 0) {
-            destroy_socket(&sock);
-        } else {
-            stream_stats_increment(stream_stats, 0, sent);
+        // Too long to be a sentence, look for the next start
+        if (nmea_line_length + size > sizeof(nmea_line)) {
+            nmea_line_length = 0;
+            data++;
+            continue;
         }
 
-        vTaskDelay(pdMS_TO_TICKS(15000));
+        memcpy(nmea_line + nmea_line_length, data, size);
+        nmea_line_length += size;
+        data += size;
+
+        if (lf != NULL) {
+            ntrip_client_gga(nmea_line, nmea_line_length);
+            nmea_line_length = 0;
+        }
     }
 }
 
-static void ntrip_client_uart_handler(void* handler_args, esp_event_base_t base, int32_t length, void* buffer) {
-    // Caster connected and ready for data
-    if ((xEventGroupGetBits(client_event_group) & CASTER_READY_BIT) == 0) return;
+typedef struct ntrip_client_source {
+    char host[64];
+    uint16_t port;
+    char mountpoint[33];
+    char username[33];
+    char password[33];
 
-    nmea_gga_extract(length, buffer);
+    bool ntrip_v2;
+    bool nearest;
 
-    /*int sent = send(sock, buffer, length, 0);
-    if (sent < 0) {
-        destroy_socket(&sock);
+    uint32_t connections;
+    uint32_t failures;
+    uint8_t consecutive_failures;
+
+    // Milliseconds
+    uint32_t resolve_time;
+    uint32_t connect_time;
+    uint32_t first_byte_time;
+    uint32_t latency;
+    uint8_t connect_attempts;
+
+    int64_t last_frame;
+    int64_t retry_at;
+} ntrip_client_source_t;
+
+static ntrip_client_source_t sources[NTRIP_CLIENT_SOURCES_MAX];
+static int source_count = 0;
+static int active_source = -1;
+static uint32_t failovers = 0;
+
+static void ntrip_client_frame(void *ctx, uint16_t type, size_t frame_length, size_t end) {
+    if (active_source >= 0) sources[active_source].last_frame = esp_timer_get_time();
+
+    uint32_t epoch;
+    if (!rtcm_epoch_utc(type, rtcm_parser.head, &epoch)) return;
+
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    if (now.tv_sec < NTRIP_CLIENT_TIME_VALID) return;
+
+    // Both are times of day, take the shortest way around midnight
+    int32_t age = (int32_t) (((now.tv_sec % 86400) * 1000 + now.tv_usec / 1000 + 86400000 - epoch) % 86400000);
+    if (age > 43200000) age -= 86400000;
+
+    stream_stats_correction(stream_stats, MAX(age, 0));
+}
+
+static void ntrip_client_forward(void *ctx, char *buffer, size_t length) {
+    rtcm_parser_parse(&rtcm_parser, (uint8_t *) buffer, length, ntrip_client_frame, NULL);
+
+    ntrip_caster_relay(buffer, length);
+    router_dispatch(stream_router, buffer, length);
+
+    stream_stats_increment(stream_stats, length, 0);
+}
+
+static bool ntrip_client_receive(http_chunked_t *chunked, char *buffer, size_t length) {
+    if (chunked == NULL) {
+        ntrip_client_forward(NULL, buffer, length);
+        return true;
+    }
+
+    // De-chunked payload is forwarded in place, final chunk ends the stream
+    return http_chunked_decode(chunked, buffer, length, ntrip_client_forward, NULL) == HTTP_CHUNKED_RESULT_MORE;
+}
+
+static void ntrip_client_source_add(const char *host, uint16_t port, const char *mountpoint,
+        const char *username, const char *password) {
+    if (source_count >= NTRIP_CLIENT_SOURCES_MAX || strlen(host) == 0) return;
+
+    ntrip_client_source_t *source = &sources[source_count++];
+    memset(source, 0, sizeof(*source));
+    strlcpy(source->host, host, sizeof(source->host));
+    source->port = port;
+    strlcpy(source->mountpoint, mountpoint, sizeof(source->mountpoint));
+    strlcpy(source->username, username, sizeof(source->username));
+    strlcpy(source->password, password, sizeof(source->password));
+    source->ntrip_v2 = config_get_bool1(CONF_ITEM(KEY_CONFIG_NTRIP_CLIENT_V2));
+}
+
+// Backup casters, one per line as [username:password@]host[:port]/mountpoint
+static void ntrip_client_sources_parse(char *list, const char *username, const char *password) {
+    char *line, *save = NULL;
+    for (line = strtok_r(list, "\r\n", &save); line != NULL; line = strtok_r(NULL, "\r\n", &save)) {
+        while (isspace((unsigned char) *line)) line++;
+        if (*line == '\0') continue;
+
+        const char *source_username = username, *source_password = password;
+        char *at = strrchr(line, '@');
+        if (at != NULL) {
+            *at = '\0';
+            char *colon = strchr(line, ':');
+            if (colon != NULL) *colon = '\0';
+            source_username = line;
+            source_password = colon != NULL ? colon + 1 : "";
+            line = at + 1;
+        }
+
+        char *slash = strchr(line, '/');
+        ERROR_ACTION(TAG, slash == NULL, continue, "Backup caster %s has no mountpoint", line)
+        *slash = '\0';
+
+        uint16_t port = NTRIP_PORT_DEFAULT;
+        char *colon = strchr(line, ':');
+        if (colon != NULL) {
+            *colon = '\0';
+            port = strtoul(colon + 1, NULL, 10);
+        }
+
+        ntrip_client_source_add(line, port, slash + 1, source_username, source_password);
+    }
+}
+
+// Lower is better, each step in priority is worth NTRIP_CLIENT_PRIORITY_WEIGHT of latency
+static uint32_t ntrip_client_source_score(int index) {
+    return index * NTRIP_CLIENT_PRIORITY_WEIGHT + sources[index].latency;
+}
+
+static void ntrip_client_source_failed(int index) {
+    ntrip_client_source_t *source = &sources[index];
+    source->failures++;
+
+    // Exponential cooldown before this source is tried again
+    int64_t cooldown = (int64_t) NTRIP_CLIENT_COOLDOWN_MIN << MIN(source->consecutive_failures, 6);
+    source->retry_at = esp_timer_get_time() + MIN(cooldown, (int64_t) NTRIP_CLIENT_COOLDOWN_MAX) * 1000;
+    if (source->consecutive_failures < UINT8_MAX) source->consecutive_failures++;
+}
+
+// Best ranked source not cooling down, optionally only those better than current
+static int ntrip_client_source_select(int current) {
+    int64_t now = esp_timer_get_time();
+    int best = -1;
+    for (int i = 0; i < source_count; i++) {
+        if (i == current || sources[i].retry_at > now) continue;
+        if (current >= 0 && ntrip_client_source_score(i) >= ntrip_client_source_score(current)) continue;
+        if (best < 0 || ntrip_client_source_score(i) < ntrip_client_source_score(best)) best = i;
+    }
+
+    return best;
+}
+
+static void ntrip_client_request(ntrip_client_source_t *source, const char *mountpoint, char *buffer) {
+    int request_length = snprintf(buffer, BUFFER_SIZE, "GET /%s HTTP/1.1" NEWLINE, mountpoint);
+    if (source->ntrip_v2) {
+        request_length += snprintf(buffer + request_length, BUFFER_SIZE - request_length, "Host: %s:%d" NEWLINE \
+                "Ntrip-Version: Ntrip/2.0" NEWLINE \
+                "Connection: close" NEWLINE, source->host, source->port);
+    }
+
+    char *authorization = http_auth_basic_header(source->username, source->password);
+    snprintf(buffer + request_length, BUFFER_SIZE - request_length, "User-Agent: NTRIP %s/%s" NEWLINE \
+            "Authorization: %s" NEWLINE
+            NEWLINE
+            , NTRIP_CLIENT_NAME, &esp_ota_get_app_description()->version[1], authorization);
+    free(authorization);
+}
+
+static void ntrip_client_sourcetable_stream(void *ctx, const ntrip_sourcetable_stream_t *stream) {
+    if (strstr(stream->format, "RTCM") == NULL || (stream->latitude == 0 && stream->longitude == 0)) return;
+
+    int index = nearest.count;
+    if (index == NTRIP_CLIENT_SOURCETABLE_MAX) {
+        // Table full, replace the furthest stream if this one is nearer
+        double latitude, longitude;
+        if (!ntrip_client_position(&latitude, &longitude)) return;
+
+        double furthest = 0;
+        for (int i = 0; i < nearest.count; i++) {
+            double distance = nmea_distance(latitude, longitude, nearest.mountpoints[i].latitude, nearest.mountpoints[i].longitude);
+            if (distance > furthest) {
+                furthest = distance;
+                index = i;
+            }
+        }
+
+        if (index == nearest.count || nmea_distance(latitude, longitude, stream->latitude, stream->longitude) >= furthest) return;
     } else {
-        stream_stats_increment(stream_stats, 0, sent);
-    }*/
+        nearest.count++;
+    }
+
+    ntrip_client_mountpoint_t *mountpoint = &nearest.mountpoints[index];
+    strlcpy(mountpoint->name, stream->mountpoint, sizeof(mountpoint->name));
+    mountpoint->latitude = stream->latitude;
+    mountpoint->longitude = stream->longitude;
 }
 
-static void ntrip_client_task(void *ctx) {
-    client_event_group = xEventGroupCreate();
-    uart_register_read_handler(ntrip_client_uart_handler);
+static void ntrip_client_sourcetable_data(void *ctx, char *buffer, size_t length) {
+    ntrip_sourcetable_parse(ctx, buffer, length, ntrip_client_sourcetable_stream, NULL);
+}
 
-    config_color_t status_led_color = config_get_color(CONF_ITEM(KEY_CONFIG_NTRIP_CLIENT_COLOR));
-    if (status_led_color.rgba != 0) status_led = status_led_add(status_led_color.rgba, STATUS_LED_FADE, 500, 2000, 0);
-    if (status_led != NULL) status_led->active = false;
+// Nearest cached mountpoint to a position
+static const char *ntrip_client_nearest_mountpoint(double latitude, double longitude) {
+    double best = 0;
+    const char *name = NULL;
+    for (int i = 0; i < nearest.count; i++) {
+        double distance = nmea_distance(latitude, longitude, nearest.mountpoints[i].latitude, nearest.mountpoints[i].longitude);
+        if (name == NULL || distance < best) {
+            best = distance;
+            name = nearest.mountpoints[i].name;
+        }
+    }
 
-    stream_stats = stream_stats_new("ntrip_client");
+    return name;
+}
 
-    retry_delay_handle_t delay_handle = retry_init(true, 5, 2000, 0);
+static bool ntrip_client_nearest_select(ntrip_client_source_t *source) {
+    // Without a fix fall back to the configured mountpoint
+    double latitude, longitude;
+    if (!ntrip_client_position(&latitude, &longitude)) return strlen(source->mountpoint) > 0;
 
-    while (true) {
-        retry_delay(delay_handle);
+    const char *name = ntrip_client_nearest_mountpoint(latitude, longitude);
+    if (name == NULL) return strlen(source->mountpoint) > 0;
 
-        wait_for_ip();
+    strlcpy(source->mountpoint, name, sizeof(source->mountpoint));
 
-        char *buffer = NULL;
+    nearest.anchored = true;
+    nearest.latitude = latitude;
+    nearest.longitude = longitude;
 
-        char *host, *mountpoint, *username, *password;
-        uint16_t port = config_get_u16(CONF_ITEM(KEY_CONFIG_NTRIP_CLIENT_PORT));
-        config_get_str_blob_alloc(CONF_ITEM(KEY_CONFIG_NTRIP_CLIENT_HOST), (void **) &host);
-        config_get_str_blob_alloc(CONF_ITEM(KEY_CONFIG_NTRIP_CLIENT_USERNAME), (void **) &username);
-        config_get_str_blob_alloc(CONF_ITEM(KEY_CONFIG_NTRIP_CLIENT_PASSWORD), (void **) &password);
-        config_get_str_blob_alloc(CONF_ITEM(KEY_CONFIG_NTRIP_CLIENT_MOUNTPOINT), (void **) &mountpoint);
+    return true;
+}
 
-        ESP_LOGI(TAG, "Connecting to %s:%d/%s", host, port, mountpoint);
-        uart_nmea("$PESP,NTRIP,CLI,CONNECTING,%s:%d,%s", host, port, mountpoint);
-        sock = connect_socket(host, port, SOCK_STREAM);
-        ERROR_ACTION(TAG, sock == CONNECT_SOCKET_ERROR_RESOLVE, goto _error, "Could not resolve host");
-        ERROR_ACTION(TAG, sock == CONNECT_SOCKET_ERROR_CONNECT, goto _error, "Could not connect to host");
+// Moved far enough from where the mountpoint was selected that a nearer one may exist
+static bool ntrip_client_nearest_moved(ntrip_client_source_t *source) {
+    double latitude, longitude;
+    if (!source->nearest || nearest.distance == 0 || !ntrip_client_position(&latitude, &longitude)) return false;
+    if (nearest.anchored && nmea_distance(nearest.latitude, nearest.longitude, latitude, longitude) < nearest.distance) return false;
 
-        buffer = malloc(BUFFER_SIZE);
+    nearest.anchored = true;
+    nearest.latitude = latitude;
+    nearest.longitude = longitude;
 
-        char *authorization = http_auth_basic_header(username, password);
-        snprintf(buffer, BUFFER_SIZE, "GET /%s HTTP/1.1" NEWLINE \
-                "User-Agent: NTRIP %s/%s" NEWLINE \
-                "Authorization: %s" NEWLINE
-                NEWLINE
-                , mountpoint, NTRIP_CLIENT_NAME, &esp_ota_get_app_description()->version[1], authorization);
-        free(authorization);
+    const char *name = ntrip_client_nearest_mountpoint(latitude, longitude);
+    if (name == NULL || strcmp(name, source->mountpoint) == 0) return false;
 
-        int err = write(sock, buffer, strlen(buffer));
-        ERROR_ACTION(TAG, err < 0, goto _error, "Could not send request to caster: %d %s", errno, strerror(errno));
+    ESP_LOGI(TAG, "Moved closer to mountpoint %s", name);
+    return true;
+}
 
-        int len = read(sock, buffer, BUFFER_SIZE - 1);
-        ERROR_ACTION(TAG, len <= 0, goto _error, "Could not receive response from caster: %d %s", errno, strerror(errno));
-        buffer[len] = '\0';
+void ntrip_client_status(ntrip_client_status_t *status) {
+    *status = (ntrip_client_status_t) {
+            .active = active_source,
+            .sources = source_count,
+            .failovers = failovers,
+            .sourcetable = nearest.count
+    };
+}
 
-        char *status = extract_http_header(buffer, "");
-        ERROR_ACTION(TAG, status == NULL || !ntrip_response_ok(status), free(status); goto _error,
-                "Could not connect to mountpoint: %s",
-                status == NULL ? "HTTP response malformed" :
-                        (ntrip_response_sourcetable_ok(status) ? "Mountpoint not found" : status))
-        free(status);
+bool ntrip_client_source_status(int index, ntrip_client_source_status_t *status) {
+    if (index < 0 || index >= source_count) return false;
+
+    ntrip_client_source_t *source = &sources[index];
+    int64_t now = esp_timer_get_time();
+
+    *status = (ntrip_client_source_status_t) {
+            .port = source->port,
+            .active = index == active_source,
+            .connections = source->connections,
+            .failures = source->failures,
+            .resolve_time = source->resolve_time,
+            .connect_time = source->connect_time,
+            .connect_attempts = source->connect_attempts,
+            .first_byte_time = source->first_byte_time,
+            .last_frame_age = source->last_frame == 0 ? -1 : (now - source->last_frame) / 1000,
+            .retry_in = source->retry_at > now ? (source->retry_at - now) / 1000000 : 0
+    };
+
+    strcpy(status->host, source->host);
+    strcpy(status->mountpoint, source->mountpoint);
+
+    return true;
+}
+
+// Connection being set up, either to start streaming or to fail back to a better source
+static struct attempt {
+    bool active;
+    int index;
+    bool failback;
+
+    ntrip_request_handle_t request;
+    http_parser_t response;
+    int64_t started;
+    char buffer[BUFFER_SIZE];
+
+    // Sourcetable streamed into the mountpoint cache without buffering it whole
+    int sock;
+    reactor_watch_handle_t watch;
+    reactor_timer_handle_t timer;
+    http_chunked_t chunked_state;
+    bool chunked;
+    ntrip_sourcetable_parser_t sourcetable;
+} attempt = {
+        .sock = -1
+};
+
+static void ntrip_client_stream_receive(char *data, size_t length);
+static void ntrip_client_stream_ready(void *ctx, int stream_sock, uint8_t events);
+static void ntrip_client_connect_next();
+
+static void ntrip_client_stream_start(int index, int source_sock, int len, bool failback) {
+    ntrip_client_source_t *source = &sources[index];
+    http_parser_t *response = &attempt.response;
+
+    // Keep any current stream if the new one cannot be watched, each stream is routed from a fresh filter state
+    reactor_watch_handle_t new_watch = reactor_watch_new(source_sock, REACTOR_READ, ntrip_client_stream_ready, NULL);
+    router_context_handle_t new_router = router_context_new(ROUTER_SOURCE_NTRIP_CLIENT);
+    ERROR_ACTION(TAG, new_watch == NULL || new_router == NULL, {
+        reactor_watch_delete(new_watch);
+        router_context_delete(new_router);
+        destroy_socket(&source_sock);
+        ntrip_client_source_failed(index);
+        return;
+    }, "Could not watch and route stream socket");
+
+    if (failback) {
+        ESP_LOGI(TAG, "Failing back to %s:%d/%s", source->host, source->port, source->mountpoint);
+        uart_nmea("$PESP,NTRIP,CLI,FAILOVER,%s:%d,%s", source->host, source->port, source->mountpoint);
+        failovers++;
+
+        reactor_watch_delete(stream_watch);
+        router_context_delete(stream_router);
+        destroy_socket(&sock);
+    }
+
+    sock = source_sock;
+    active_source = index;
+    source->last_frame = esp_timer_get_time();
+    rtcm_parser_init(&rtcm_parser);
+
+    // NTRIP 2.0 casters send chunked data, NTRIP 1.0 casters raw data
+    http_chunked_init(&chunked_state);
+    chunked = http_span_contains(attempt.buffer, http_parser_header(response, attempt.buffer, "Transfer-Encoding"), "chunked");
 
-        ESP_LOGI(TAG, "Successfully connected to %s:%d/%s", host, port, mountpoint);
-        uart_nmea("$PESP,NTRIP,CLI,CONNECTED,%s:%d,%s", host, port, mountpoint);
+    // Send GGA to caster on the next valid fix, nothing of it went to the previous socket
+    gga_upload.sent = false;
+    gga_upload.length = 0;
+    gga_upload.offset = 0;
 
-        retry_reset(delay_handle);
+    if (!failback) {
+        bool response_v2 = http_span_contains(attempt.buffer, http_parser_header(response, attempt.buffer, "Ntrip-Version"), "Ntrip/2.0");
+
+        ESP_LOGI(TAG, "Successfully connected to %s:%d/%s using NTRIP %s", source->host, source->port, source->mountpoint, response_v2 ? "2.0" : "1.0");
+        uart_nmea("$PESP,NTRIP,CLI,CONNECTED,%s:%d,%s", source->host, source->port, source->mountpoint);
 
         if (status_led != NULL) status_led->active = true;
 
-        // Start sending GGA to caster
-        xTaskCreate(ntrip_client_nmea_gga_send_task, "ntrip_client_gga", 2048, NULL, TASK_PRIORITY_INTERFACE, &nmea_gga_send_task);
+        failback_check = esp_timer_get_time();
 
         // Connected
         xEventGroupSetBits(client_event_group, CASTER_READY_BIT);
+        ntrip_caster_relay_upstream(true);
+    }
+
+    stream_watch = new_watch;
+    stream_router = new_router;
+
+    // Data received along with the response
+    if (len > (int) response->body) {
+        ntrip_client_stream_receive(attempt.buffer + response->body, len - response->body);
+    }
+}
+
+static void ntrip_client_response(void *ctx, int source_sock, int len, const connect_socket_timing_t *timing) {
+    attempt.request = NULL;
+
+    int index = attempt.index;
+    ntrip_client_source_t *source = &sources[index];
+    http_parser_t *response = &attempt.response;
+    char *buffer = attempt.buffer;
+
+    ERROR_ACTION(TAG, source_sock == CONNECT_SOCKET_ERROR_RESOLVE, goto _error, "Could not resolve host");
+    ERROR_ACTION(TAG, source_sock == CONNECT_SOCKET_ERROR_CONNECT, goto _error, "Could not connect to host");
+
+    source->resolve_time = timing->resolve;
+    source->connect_time = timing->connect;
+    source->connect_attempts = timing->attempts;
+
+    // Casters without NTRIP 2.0 support may reject the request or close the connection
+    if (source->ntrip_v2 && (len < 0 || response->status == 400 || response->status == 501 || response->status == 505)) {
+        ESP_LOGW(TAG, "Caster did not accept NTRIP 2.0 request, falling back to NTRIP 1.0");
+        source->ntrip_v2 = false;
+        goto _error;
+    }
+
+    ERROR_ACTION(TAG, len < 0, goto _error, "Could not receive response from caster");
+
+    ERROR_ACTION(TAG, ntrip_response_sourcetable(response, buffer), goto _error,
+            "Could not connect to mountpoint: Mountpoint not found")
+
+    http_span_t status = http_parser_start_line(response);
+    ERROR_ACTION(TAG, !ntrip_response_ok(response, buffer), goto _error,
+            "Could not connect to mountpoint: %.*s", status.length, buffer + status.offset)
+
+    // Time from the connection being established to the response
+    int64_t elapsed = (esp_timer_get_time() - attempt.started) / 1000;
+    source->first_byte_time = MAX(elapsed - timing->resolve - timing->connect, 0);
+
+    // Smoothed latency used for ranking
+    uint32_t latency = source->resolve_time + source->connect_time + source->first_byte_time;
+    source->latency = source->connections == 0 ? latency : (source->latency * 3 + latency) / 4;
 
-        // Read from socket until disconnected
-        while (sock != -1 && (len = read(sock, buffer, BUFFER_SIZE)) >= 0) {
-            uart_write(buffer, len);
+    source->connections++;
+    source->consecutive_failures = 0;
 
-            stream_stats_increment(stream_stats, len, 0);
+    attempt.active = false;
+    ntrip_client_stream_start(index, source_sock, len, attempt.failback);
+    return;
+
+    _error:
+    destroy_socket(&source_sock);
+    ntrip_client_source_failed(index);
+
+    attempt.active = false;
+    if (!attempt.failback) ntrip_client_connect_next();
+}
+
+// Requests the mountpoint, unless a nearest source is still waiting for a fix or sourcetable
+static void ntrip_client_attempt_connect() {
+    ntrip_client_source_t *source = &sources[attempt.index];
+
+    // Wait for a fix or sourcetable without counting it as a failure
+    if (source->nearest && !ntrip_client_nearest_select(source)) {
+        source->retry_at = esp_timer_get_time() + NTRIP_CLIENT_POLL_INTERVAL * 1000;
+        attempt.active = false;
+        return;
+    }
+
+    ESP_LOGI(TAG, "Connecting to %s:%d/%s", source->host, source->port, source->mountpoint);
+    uart_nmea("$PESP,NTRIP,CLI,CONNECTING,%s:%d,%s", source->host, source->port, source->mountpoint);
+
+    ntrip_client_request(source, source->mountpoint, attempt.buffer);
+    attempt.started = esp_timer_get_time();
+    attempt.request = ntrip_request_start(source->host, source->port, SOCKET_BUDGET_NTRIP_CLIENT, attempt.buffer,
+            attempt.buffer, BUFFER_SIZE, &attempt.response, ntrip_client_response, NULL);
+    ERROR_ACTION(TAG, attempt.request == NULL, ntrip_client_source_failed(attempt.index); attempt.active = false,
+            "Could not start request");
+}
+
+static void ntrip_client_sourcetable_done(bool received) {
+    reactor_watch_delete(attempt.watch);
+    attempt.watch = NULL;
+    reactor_timer_stop(attempt.timer);
+    destroy_socket(&attempt.sock);
+
+    if (received) {
+        ESP_LOGI(TAG, "Received sourcetable with %d mountpoints", nearest.count);
+        nearest.fetched = esp_timer_get_time();
+    }
+
+    ntrip_client_attempt_connect();
+}
+
+// Returns false once the sourcetable is complete
+static bool ntrip_client_sourcetable_receive(char *data, size_t length) {
+    if (attempt.chunked) {
+        int ret = http_chunked_decode(&attempt.chunked_state, data, length, ntrip_client_sourcetable_data, &attempt.sourcetable);
+        if (ret != HTTP_CHUNKED_RESULT_MORE) return false;
+    } else {
+        ntrip_client_sourcetable_data(&attempt.sourcetable, data, length);
+    }
+
+    return !attempt.sourcetable.done;
+}
+
+static void ntrip_client_sourcetable_ready(void *ctx, int fetch_sock, uint8_t events) {
+    int len = recv(fetch_sock, attempt.buffer, BUFFER_SIZE, MSG_DONTWAIT);
+    if (len < 0 && errno == EWOULDBLOCK) return;
+
+    if (len > 0 && ntrip_client_sourcetable_receive(attempt.buffer, len)) {
+        reactor_timer_start(attempt.timer, NTRIP_RESPONSE_TIMEOUT);
+        return;
+    }
+
+    ntrip_client_sourcetable_done(true);
+}
+
+static void ntrip_client_sourcetable_timeout(void *ctx) {
+    ESP_LOGW(TAG, "Sourcetable was not received in time");
+    ntrip_client_sourcetable_done(true);
+}
+
+static void ntrip_client_sourcetable_response(void *ctx, int fetch_sock, int len, const connect_socket_timing_t *timing) {
+    attempt.request = NULL;
+    attempt.sock = fetch_sock;
+
+    ERROR_ACTION(TAG, fetch_sock < 0, ntrip_client_sourcetable_done(false); return, "Could not connect to host to fetch sourcetable");
+    ERROR_ACTION(TAG, len < 0 || !ntrip_response_sourcetable(&attempt.response, attempt.buffer),
+            ntrip_client_sourcetable_done(false); return, "Could not receive sourcetable from caster")
+
+    http_chunked_init(&attempt.chunked_state);
+    attempt.chunked = http_span_contains(attempt.buffer, http_parser_header(&attempt.response, attempt.buffer, "Transfer-Encoding"), "chunked");
+    ntrip_sourcetable_parser_init(&attempt.sourcetable);
+
+    nearest.count = 0;
+
+    // Data received along with the response
+    if (!ntrip_client_sourcetable_receive(attempt.buffer + attempt.response.body, len - attempt.response.body)) {
+        ntrip_client_sourcetable_done(true);
+        return;
+    }
+
+    attempt.watch = reactor_watch_new(fetch_sock, REACTOR_READ, ntrip_client_sourcetable_ready, NULL);
+    ERROR_ACTION(TAG, attempt.watch == NULL, ntrip_client_sourcetable_done(false); return, "Could not watch sourcetable socket");
+
+    reactor_timer_start(attempt.timer, NTRIP_RESPONSE_TIMEOUT);
+}
+
+static void ntrip_client_attempt_start(int index, bool failback) {
+    ntrip_client_source_t *source = &sources[index];
+
+    attempt.active = true;
+    attempt.index = index;
+    attempt.failback = failback;
+
+    // Mountpoint of a nearest source is selected from a fresh sourcetable
+    int64_t now = esp_timer_get_time();
+    if (source->nearest && (nearest.count == 0 || now - nearest.fetched > (int64_t) NTRIP_CLIENT_SOURCETABLE_LIFETIME * 1000)) {
+        ntrip_client_request(source, "", attempt.buffer);
+        attempt.request = ntrip_request_start(source->host, source->port, SOCKET_BUDGET_NTRIP_CLIENT, attempt.buffer,
+                attempt.buffer, BUFFER_SIZE, &attempt.response, ntrip_client_sourcetable_response, NULL);
+        ERROR_ACTION(TAG, attempt.request == NULL, ntrip_client_source_failed(index); attempt.active = false,
+                "Could not start sourcetable request");
+        return;
+    }
+
+    ntrip_client_attempt_connect();
+}
+
+// Best source not cooling down, otherwise the poll timer tries again
+static void ntrip_client_connect_next() {
+    if (!wifi_has_ip()) return;
+
+    int index = ntrip_client_source_select(-1);
+    if (index >= 0) ntrip_client_attempt_start(index, false);
+}
+
+static void ntrip_client_disconnect(bool reselect, bool stalled) {
+    int index = active_source;
+    ntrip_client_source_t *source = &sources[index];
+
+    // Disconnected
+    xEventGroupClearBits(client_event_group, CASTER_READY_BIT);
+    ntrip_caster_relay_upstream(false);
+
+    if (status_led != NULL) status_led->active = false;
+
+    ESP_LOGW(TAG, "Disconnected from %s:%d/%s", source->host, source->port, source->mountpoint);
+    uart_nmea("$PESP,NTRIP,CLI,DISCONNECTED,%s:%d,%s", source->host, source->port, source->mountpoint);
+
+    reactor_watch_delete(stream_watch);
+    stream_watch = NULL;
+    router_context_delete(stream_router);
+    stream_router = NULL;
+    destroy_socket(&sock);
+    active_source = -1;
+
+    gga_upload.length = 0;
+    gga_upload.offset = 0;
+
+    // Cool down before reconnecting to the same source, unless switching to a nearer mountpoint
+    if (!reselect) {
+        ntrip_client_source_failed(index);
+
+        // Fail over to the next source straight away, or reconnect a stalled source without backoff
+        if (attempt.active || ntrip_client_source_select(-1) >= 0) {
+            failovers++;
+            uart_nmea("$PESP,NTRIP,CLI,FAILOVER");
+        } else if (stalled) {
+            source->retry_at = 0;
+            uart_nmea("$PESP,NTRIP,CLI,STALLED,%s:%d,%s", source->host, source->port, source->mountpoint);
         }
+    }
 
-        // Disconnected
-        xEventGroupSetBits(client_event_group, CASTER_READY_BIT);
+    // Better source being connected to becomes the active one
+    if (attempt.active) {
+        attempt.failback = false;
+        return;
+    }
 
-        // Stop sending GGA to caster
-        vTaskDelete(nmea_gga_send_task);
+    ntrip_client_connect_next();
+}
 
-        if (status_led != NULL) status_led->active = false;
+static void ntrip_client_stream_receive(char *data, size_t length) {
+    if (!ntrip_client_receive(chunked ? &chunked_state : NULL, data, length)) ntrip_client_disconnect(false, false);
+}
 
-        ESP_LOGW(TAG, "Disconnected from %s:%d/%s", host, port, mountpoint);
-        uart_nmea("$PESP,NTRIP,CLI,DISCONNECTED,%s:%d,%s", host, port, mountpoint);
+static void ntrip_client_stream_ready(void *ctx, int stream_sock, uint8_t events) {
+    if ((events & REACTOR_WRITE) && !ntrip_client_gga_flush()) {
+        ntrip_client_disconnect(false, false);
+        return;
+    }
+    if ((events & REACTOR_READ) == 0) return;
 
-        _error:
-        destroy_socket(&sock);
+    int len = recv(stream_sock, buffer, BUFFER_SIZE, MSG_DONTWAIT);
+    if (len < 0 && errno == EWOULDBLOCK) return;
+
+    if (len <= 0) {
+        ntrip_client_disconnect(false, false);
+        return;
+    }
+
+    ntrip_client_stream_receive(buffer, len);
+}
 
-        free(buffer);
-        free(host);
-        free(mountpoint);
-        free(username);
-        free(password);
+// Checks the active source for stalls and better sources, or connects if there is none
+static void ntrip_client_poll(void *ctx) {
+    reactor_timer_start(poll_timer, NTRIP_CLIENT_POLL_INTERVAL);
+
+    if (active_source < 0) {
+        if (!attempt.active) ntrip_client_connect_next();
+        return;
+    }
+
+    ntrip_client_source_t *source = &sources[active_source];
+    int64_t now = esp_timer_get_time();
+    if (stall_timeout > 0 && now - source->last_frame > stall_timeout) {
+        ESP_LOGW(TAG, "No RTCM received from %s:%d/%s in %d seconds", source->host, source->port,
+                source->mountpoint, (int) (stall_timeout / 1000000));
+        ntrip_client_disconnect(false, true);
+        return;
+    }
+
+    if (attempt.active) return;
+
+    if (ntrip_client_nearest_moved(source)) {
+        ntrip_client_disconnect(true, false);
+        return;
     }
 
-    vTaskDelete(NULL);
+    if (now - failback_check < NTRIP_CLIENT_FAILBACK_INTERVAL * 1000) return;
+    failback_check = now;
+
+    // Connect to better source before dropping the current one
+    int better = ntrip_client_source_select(active_source);
+    if (better >= 0) ntrip_client_attempt_start(better, true);
+}
+
+static void ntrip_client_start(void *ctx) {
+    poll_timer = reactor_timer_new(ntrip_client_poll, NULL);
+    attempt.timer = reactor_timer_new(ntrip_client_sourcetable_timeout, NULL);
+    ERROR_ACTION(TAG, poll_timer == NULL || attempt.timer == NULL, return, "Could not create timers");
+
+    ntrip_client_poll(NULL);
 }
 
 void ntrip_client_init() {
     if (!config_get_bool1(CONF_ITEM(KEY_CONFIG_NTRIP_CLIENT_ACTIVE))) return;
 
-    xTaskCreate(ntrip_client_task, "ntrip_client_task", 4096, NULL, TASK_PRIORITY_INTERFACE, NULL);
-}
\ No newline at end of file
+    socket_budget_enable(SOCKET_BUDGET_NTRIP_CLIENT);
+
+    client_event_group = xEventGroupCreate();
+    router_register_sink(ROUTER_SINK_NTRIP_CLIENT, ntrip_client_uart_handler);
+
+    config_color_t status_led_color = config_get_color(CONF_ITEM(KEY_CONFIG_NTRIP_CLIENT_COLOR));
+    if (status_led_color.rgba != 0) status_led = status_led_add(status_led_color.rgba, STATUS_LED_FADE, 500, 2000, 0);
+    if (status_led != NULL) status_led->active = false;
+
+    stream_stats = stream_stats_new("ntrip_client");
+
+    gga_upload.interval = (int64_t) config_get_u16(CONF_ITEM(KEY_CONFIG_NTRIP_CLIENT_GGA_INTERVAL)) * 1000000;
+    gga_upload.distance = config_get_u16(CONF_ITEM(KEY_CONFIG_NTRIP_CLIENT_GGA_DISTANCE));
+    stall_timeout = (int64_t) config_get_u16(CONF_ITEM(KEY_CONFIG_NTRIP_CLIENT_STALL)) * 1000000;
+
+    // Primary caster followed by backups in order of priority
+    char *host, *mountpoint, *username, *password, *backups;
+    uint16_t port = config_get_u16(CONF_ITEM(KEY_CONFIG_NTRIP_CLIENT_PORT));
+    config_get_str_blob_alloc(CONF_ITEM(KEY_CONFIG_NTRIP_CLIENT_HOST), (void **) &host);
+    config_get_str_blob_alloc(CONF_ITEM(KEY_CONFIG_NTRIP_CLIENT_USERNAME), (void **) &username);
+    config_get_str_blob_alloc(CONF_ITEM(KEY_CONFIG_NTRIP_CLIENT_PASSWORD), (void **) &password);
+    config_get_str_blob_alloc(CONF_ITEM(KEY_CONFIG_NTRIP_CLIENT_MOUNTPOINT), (void **) &mountpoint);
+    config_get_str_blob_alloc(CONF_ITEM(KEY_CONFIG_NTRIP_CLIENT_BACKUPS), (void **) &backups);
+    ntrip_client_source_add(host, port, mountpoint, username, password);
+    ntrip_client_sources_parse(backups, username, password);
+    free(host);
+    free(mountpoint);
+    free(username);
+    free(password);
+    free(backups);
+
+    // Primary caster mountpoint can be selected from its sourcetable
+    nearest.active = source_count > 0 && config_get_bool1(CONF_ITEM(KEY_CONFIG_NTRIP_CLIENT_NEAREST));
+    if (nearest.active) {
+        nearest.distance = config_get_u16(CONF_ITEM(KEY_CONFIG_NTRIP_CLIENT_NEAREST_DISTANCE));
+        nearest.mountpoints = calloc(NTRIP_CLIENT_SOURCETABLE_MAX, sizeof(ntrip_client_mountpoint_t));
+        sources[0].nearest = true;
+    }
+
+    buffer = malloc(BUFFER_SIZE);
+
+    ERROR_ACTION(TAG, !reactor_call(ntrip_client_start, NULL), return, "Could not start on reactor");
+}
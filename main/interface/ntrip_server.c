@@ -16,18 +16,26 @@
  */
 
 #include <stdbool.h>
+#include <ctype.h>
 #include <esp_log.h>
 #include <esp_event_base.h>
+#include <esp_timer.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <wifi.h>
-#include <tasks.h>
 #include <status_led.h>
 #include <retry.h>
 #include <stream_stats.h>
-#include <freertos/event_groups.h>
+#include <congestion.h>
+#include <freertos/queue.h>
 #include <esp_ota_ops.h>
+#include <protocol/rtcm.h>
 #include "interface/ntrip.h"
 #include "config.h"
+#include "pool.h"
+#include "reactor.h"
+#include "router.h"
+#include "socket_budget.h"
 #include "util.h"
 #include "uart.h"
 
@@ -35,157 +43,655 @@ static const char *TAG = "NTRIP_SERVER";
 
 #define BUFFER_SIZE 512
 
-static const int CASTER_READY_BIT = BIT0;
-static const int DATA_READY_BIT = BIT1;
-static const int DATA_SENT_BIT = BIT2;
+// Chunks waiting to be sent per target, oldest are dropped when full
+#define QUEUE_LENGTH 32
+
+// Milliseconds
+#define SEND_TIMEOUT 5000
+#define POLL_INTERVAL 1000
+
+// Message types per target filter, excluded types are marked with the top bit
+#define FILTER_TYPES_MAX 16
+#define FILTER_EXCLUDE 0x8000
+
+// Data outside of RTCM frames
+#define CHUNK_TYPE_OTHER 0
+
+// Station, ephemeris and bias frames and MSM of a few satellites fit a small chunk, the rest a large one.
+// Every target can fill its queue with small chunks and hold one more being sent, large chunks cover an eighth of it.
+// Anything longer than an RTCM frame, or beyond the pools, comes from the heap.
+#define CHUNK_SMALL_LENGTH 128
+#define CHUNK_SMALL_SIZE (sizeof(ntrip_server_chunk_t) + CHUNK_SMALL_LENGTH)
+#define CHUNK_SMALL_COUNT (QUEUE_LENGTH + 1)
+#define CHUNK_LARGE_SIZE (sizeof(ntrip_server_chunk_t) + RTCM_FRAME_LENGTH_MAX)
+#define CHUNK_LARGE_COUNT (QUEUE_LENGTH / 8 + 1)
+
+typedef enum {
+    NTRIP_SERVER_STATE_WAITING = 0,
+    NTRIP_SERVER_STATE_CONNECTING,
+    NTRIP_SERVER_STATE_CONNECTED,
+    NTRIP_SERVER_STATE_DISCONNECTED
+} ntrip_server_state_t;
+
+// Shared between all targets the chunk is queued to, released by each of them
+typedef struct ntrip_server_chunk {
+    uint16_t type;
+    int64_t time;
+    size_t length;
+    char data[];
+} ntrip_server_chunk_t;
+
+typedef struct ntrip_server_target {
+    char host[64];
+    uint16_t port;
+    char mountpoint[33];
+    char username[33];
+    char password[65];
+
+    // Falls back to NTRIP 1.0 for the rest of the session if the caster rejects NTRIP 2.0
+    bool ntrip_v2;
+    bool chunked;
+
+    uint16_t filter[FILTER_TYPES_MAX];
+    uint8_t filter_count;
+    bool filter_include;
+
+    int sock;
+    volatile ntrip_server_state_t state;
+    QueueHandle_t queue;
+
+    retry_delay_handle_t retry;
+    reactor_timer_handle_t connect_timer, send_timer;
+    reactor_watch_handle_t watch;
+    ntrip_request_handle_t request;
+    http_parser_t response;
+    char buffer[BUFFER_SIZE];
+
+    // Chunk being sent, with its NTRIP 2.0 size line, resumed once the socket has space
+    ntrip_server_chunk_t *chunk;
+    char chunk_size[8];
+    size_t chunk_size_length;
+    size_t chunk_sent;
+
+    // Calls queued on the reactor by the UART handler
+    volatile bool wake_pending;
+    volatile bool send_pending;
+
+    // Bytes waiting in the queue, used to estimate delay under congestion
+    size_t backlog;
+    congestion_handle_t congestion;
+
+    uint32_t drops;
+    char stream_stats_name[24];
+    stream_stats_handle_t stream_stats;
+} ntrip_server_target_t;
+
+static ntrip_server_target_t targets[NTRIP_SERVER_TARGETS_MAX];
+static int target_count = 0;
+
+static volatile int64_t data_time = 0;
+static portMUX_TYPE chunk_lock = portMUX_INITIALIZER_UNLOCKED;
+static pool_handle_t chunk_pool_small, chunk_pool_large;
+
+// UART data is split into RTCM frames, frames may span multiple reads
+static rtcm_parser_t rtcm_parser;
+static uint8_t carry[RTCM_FRAME_LENGTH_MAX];
+static size_t carry_length = 0;
 
-static int sock = -1;
+static status_led_handle_t status_led = NULL;
 
-static int data_keep_alive;
-static EventGroupHandle_t server_event_group;
+static void ntrip_server_send_queued(void *ctx);
 
-static status_led_handle_t status_led = NULL;
-static stream_stats_handle_t stream_stats = NULL;
+static bool ntrip_server_dequeue(ntrip_server_target_t *target, ntrip_server_chunk_t **chunk, TickType_t timeout) {
+    if (xQueueReceive(target->queue, chunk, timeout) != pdTRUE) return false;
+
+    portENTER_CRITICAL(&chunk_lock);
+    target->backlog -= (*chunk)->length;
+    portEXIT_CRITICAL(&chunk_lock);
+
+    return true;
+}
+
+static void ntrip_server_queue_flush(ntrip_server_target_t *target) {
+    ntrip_server_chunk_t *chunk;
+    while (ntrip_server_dequeue(target, &chunk, 0)) pool_release(chunk);
+}
 
-static TaskHandle_t server_task = NULL;
-static TaskHandle_t sleep_task = NULL;
+static bool ntrip_server_filter_accepts(ntrip_server_target_t *target, uint16_t type) {
+    bool included = !target->filter_include;
+    for (int i = 0; i < target->filter_count; i++) {
+        if (target->filter[i] == (type | FILTER_EXCLUDE)) return false;
+        if (target->filter[i] == type) included = true;
+    }
+
+    return included;
+}
+
+static void ntrip_server_enqueue(ntrip_server_target_t *target, ntrip_server_chunk_t *chunk) {
+    // Shed lower priority messages first when the uplink cannot keep up
+    if (!congestion_admit(target->congestion, chunk->type, chunk->length, target->backlog)) return;
 
-static void ntrip_server_uart_handler(void* handler_args, esp_event_base_t base, int32_t length, void* buffer) {
-    EventBits_t event_bits = xEventGroupGetBits(server_event_group);
+    pool_retain(chunk);
 
-    // Reset data availability bit
-    if ((event_bits & DATA_READY_BIT) == 0) {
-        xEventGroupSetBits(server_event_group, DATA_READY_BIT);
+    portENTER_CRITICAL(&chunk_lock);
+    target->backlog += chunk->length;
+    portEXIT_CRITICAL(&chunk_lock);
 
-        if (event_bits & DATA_SENT_BIT)
-            ESP_LOGI(TAG, "Data received by UART, will now reconnect to caster if disconnected");
+    // Never block the event loop, make room by dropping the oldest chunk
+    if (xQueueSend(target->queue, &chunk, 0) != pdTRUE) {
+        ntrip_server_chunk_t *oldest;
+        if (ntrip_server_dequeue(target, &oldest, 0)) {
+            pool_release(oldest);
+            target->drops++;
+        }
+        if (xQueueSend(target->queue, &chunk, 0) != pdTRUE) {
+            portENTER_CRITICAL(&chunk_lock);
+            target->backlog -= chunk->length;
+            portEXIT_CRITICAL(&chunk_lock);
+
+            pool_release(chunk);
+            target->drops++;
+            return;
+        }
     }
-    data_keep_alive = 0;
 
-    // Ignore if caster is not connected and ready for data
-    if ((event_bits & CASTER_READY_BIT) == 0) return;
+    if (target->send_pending) return;
+    target->send_pending = true;
+    if (!reactor_call(ntrip_server_send_queued, target)) target->send_pending = false;
+}
+
+// One block per chunk, shared by all targets that accept it
+static void ntrip_server_dispatch(uint16_t type, const uint8_t *head, size_t head_length, const uint8_t *data, size_t length) {
+    if (head_length + length == 0) return;
+
+    ntrip_server_chunk_t *chunk = NULL;
+    for (int i = 0; i < target_count; i++) {
+        ntrip_server_target_t *target = &targets[i];
+        if (target->state != NTRIP_SERVER_STATE_CONNECTED || !ntrip_server_filter_accepts(target, type)) continue;
+
+        if (chunk == NULL) {
+            size_t size = sizeof(ntrip_server_chunk_t) + head_length + length;
+            chunk = pool_alloc(size <= CHUNK_SMALL_SIZE ? chunk_pool_small : chunk_pool_large, size);
+            if (chunk == NULL) return;
+
+            chunk->type = type;
+            chunk->time = esp_timer_get_time();
+            chunk->length = head_length + length;
+            memcpy(chunk->data, head, head_length);
+            memcpy(chunk->data + head_length, data, length);
+        }
+
+        ntrip_server_enqueue(target, chunk);
+    }
+
+    if (chunk != NULL) pool_release(chunk);
+}
+
+typedef struct ntrip_server_frames {
+    const uint8_t *data;
+    size_t consumed;
+} ntrip_server_frames_t;
+
+static void ntrip_server_frame(void *ctx, uint16_t type, size_t frame_length, size_t end) {
+    ntrip_server_frames_t *frames = ctx;
+
+    // Frame started in a previous read
+    if (frame_length > end) {
+        size_t head_length = frame_length - end;
+        ntrip_server_dispatch(type, carry + carry_length - head_length, head_length, frames->data, end);
+    } else {
+        ntrip_server_dispatch(CHUNK_TYPE_OTHER, NULL, 0, frames->data + frames->consumed, end - frame_length - frames->consumed);
+        ntrip_server_dispatch(type, NULL, 0, frames->data + end - frame_length, frame_length);
+    }
+
+    carry_length = 0;
+    frames->consumed = end;
+}
+
+static void ntrip_server_wake(void *ctx);
+
+static void ntrip_server_uart_handler(const void *buffer, size_t length) {
+    // Wake targets waiting for data
+    data_time = esp_timer_get_time();
+    for (int i = 0; i < target_count; i++) {
+        ntrip_server_target_t *target = &targets[i];
+        if (target->state != NTRIP_SERVER_STATE_WAITING || target->wake_pending) continue;
 
-    // Caster is connected and some data will be sent
-    if ((event_bits & DATA_SENT_BIT) == 0) xEventGroupSetBits(server_event_group, DATA_SENT_BIT);
+        target->wake_pending = true;
+        if (!reactor_call(ntrip_server_wake, target)) target->wake_pending = false;
+    }
 
-    int sent = write(sock, buffer, length);
-    if (sent < 0) {
-        destroy_socket(&sock);
-        vTaskResume(server_task);
+    ntrip_server_frames_t frames = {
+            .data = buffer,
+            .consumed = 0
+    };
+    rtcm_parser_parse(&rtcm_parser, buffer, length, ntrip_server_frame, &frames);
+
+    // Anything before an incomplete trailing frame is not RTCM, the rest is kept for the next read
+    size_t pending = rtcm_parser_pending(&rtcm_parser);
+    if (pending > length - frames.consumed) {
+        // Frame started in an earlier read and is still incomplete
+        memcpy(carry + carry_length, frames.data + frames.consumed, length - frames.consumed);
+        carry_length += length - frames.consumed;
     } else {
-        stream_stats_increment(stream_stats, 0, sent);
+        carry_length = 0;
+        ntrip_server_dispatch(CHUNK_TYPE_OTHER, NULL, 0, frames.data + frames.consumed, length - frames.consumed - pending);
+        memcpy(carry, frames.data + length - pending, pending);
+        carry_length = pending;
+    }
+}
+
+static void ntrip_server_request(ntrip_server_target_t *target, char *buffer) {
+    if (!target->ntrip_v2) {
+        snprintf(buffer, BUFFER_SIZE, "SOURCE %s /%s" NEWLINE \
+                "Source-Agent: NTRIP %s/%s" NEWLINE \
+                NEWLINE, target->password, target->mountpoint, NTRIP_SERVER_NAME, &esp_ota_get_app_description()->version[1]);
+        return;
     }
+
+    char *authorization = http_auth_basic_header(target->username, target->password);
+    snprintf(buffer, BUFFER_SIZE, "POST /%s HTTP/1.1" NEWLINE \
+            "Host: %s:%d" NEWLINE \
+            "Ntrip-Version: Ntrip/2.0" NEWLINE \
+            "User-Agent: NTRIP %s/%s" NEWLINE \
+            "Authorization: %s" NEWLINE \
+            "Content-Type: gnss/data" NEWLINE \
+            "Transfer-Encoding: chunked" NEWLINE \
+            "Connection: close" NEWLINE \
+            NEWLINE, target->mountpoint, target->host, target->port,
+            NTRIP_SERVER_NAME, &esp_ota_get_app_description()->version[1], authorization);
+    free(authorization);
 }
 
-static void ntrip_server_sleep_task(void *ctx) {
-    vTaskSuspend(NULL);
+static bool ntrip_server_connected(ntrip_server_target_t *target, int len, const connect_socket_timing_t *timing) {
+    ERROR_ACTION(TAG, target->sock == CONNECT_SOCKET_ERROR_RESOLVE, return false, "Could not resolve host");
+    ERROR_ACTION(TAG, target->sock == CONNECT_SOCKET_ERROR_CONNECT, return false, "Could not connect to host");
+
+    ESP_LOGD(TAG, "Connected to %s:%d in %ums (resolve %ums, %d attempts)", target->host, target->port,
+            timing->connect, timing->resolve, timing->attempts);
+
+    http_parser_t *response = &target->response;
+    char *buffer = target->buffer;
+
+    // Casters without NTRIP 2.0 support may reject the request or close the connection
+    if (target->ntrip_v2 && (len < 0 || response->status == 400 || response->status == 405 ||
+            response->status == 501 || response->status == 505)) {
+        ESP_LOGW(TAG, "Caster did not accept NTRIP 2.0 request, falling back to NTRIP 1.0");
+        target->ntrip_v2 = false;
+        return false;
+    }
+
+    ERROR_ACTION(TAG, len < 0, return false, "Could not receive response from caster");
 
+    http_span_t status = http_parser_start_line(response);
+    ERROR_ACTION(TAG, !ntrip_response_ok(response, buffer), return false,
+            "Could not connect to mountpoint: %.*s", status.length, buffer + status.offset);
+
+    // Casters do not send data to servers, anything following the response is discarded
+    if (len > response->body) ESP_LOGD(TAG, "Ignoring %d bytes received after response", len - (int) response->body);
+
+    target->chunked = target->ntrip_v2;
+
+    return true;
+}
+
+static void ntrip_server_status_led_update() {
+    if (status_led == NULL) return;
+
+    bool connected = false;
+    for (int i = 0; i < target_count; i++) {
+        if (targets[i].state == NTRIP_SERVER_STATE_CONNECTED) connected = true;
+    }
+    status_led->active = connected;
+}
+
+static void ntrip_server_schedule(ntrip_server_target_t *target) {
+    target->state = NTRIP_SERVER_STATE_CONNECTING;
+    reactor_timer_start(target->connect_timer, retry_next(target->retry));
+}
+
+static void ntrip_server_wait(ntrip_server_target_t *target) {
+    target->state = NTRIP_SERVER_STATE_WAITING;
+
+    // Only (re)connect to caster while UART data is being received
+    if (esp_timer_get_time() - data_time > NTRIP_KEEP_ALIVE_THRESHOLD * 1000) {
+        ESP_LOGI(TAG, "Waiting for UART input to connect to caster %s", target->host);
+        uart_nmea("$PESP,NTRIP,SRV,WAITING,%s:%d,%s", target->host, target->port, target->mountpoint);
+        return;
+    }
+
+    ntrip_server_schedule(target);
+}
+
+static void ntrip_server_wake(void *ctx) {
+    ntrip_server_target_t *target = ctx;
+    target->wake_pending = false;
+
+    if (target->state == NTRIP_SERVER_STATE_WAITING) ntrip_server_schedule(target);
+}
+
+static void ntrip_server_disconnect(ntrip_server_target_t *target) {
+    // Stop UART handler queueing before clearing out what is left
+    target->state = NTRIP_SERVER_STATE_WAITING;
+    reactor_watch_delete(target->watch);
+    target->watch = NULL;
+    reactor_timer_stop(target->send_timer);
+
+    if (target->chunk != NULL) {
+        pool_release(target->chunk);
+        target->chunk = NULL;
+    }
+    ntrip_server_queue_flush(target);
+    ntrip_server_status_led_update();
+
+    ESP_LOGW(TAG, "Disconnected from %s:%d/%s", target->host, target->port, target->mountpoint);
+    uart_nmea("$PESP,NTRIP,SRV,DISCONNECTED,%s:%d,%s", target->host, target->port, target->mountpoint);
+
+    if (target->drops > 0) ESP_LOGW(TAG, "Dropped %u chunks while uplink was congested", target->drops);
+
+    destroy_socket(&target->sock);
+    ntrip_server_wait(target);
+}
+
+// Sends queued chunks until the socket is full, waiting for space up to SEND_TIMEOUT
+static void ntrip_server_send(ntrip_server_target_t *target) {
     while (true) {
-        // If wait time exceeded, clear data ready bit
-        if (data_keep_alive == NTRIP_KEEP_ALIVE_THRESHOLD) {
-            xEventGroupClearBits(server_event_group, DATA_READY_BIT);
-            ESP_LOGW(TAG, "No data received by UART in %d seconds, will not reconnect to caster if disconnected", NTRIP_KEEP_ALIVE_THRESHOLD / 1000);
+        if (target->chunk == NULL) {
+            if (!ntrip_server_dequeue(target, &target->chunk, 0)) break;
+
+            // Stale epochs are dropped rather than delivered late
+            if (!congestion_fresh(target->congestion, target->chunk->type, target->chunk->time)) {
+                pool_release(target->chunk);
+                target->chunk = NULL;
+                continue;
+            }
+
+            // NTRIP 2.0 chunks are aligned to RTCM frames
+            target->chunk_size_length = !target->chunked ? 0 : snprintf(target->chunk_size, sizeof(target->chunk_size),
+                    "%x" NEWLINE, (unsigned int) target->chunk->length);
+            target->chunk_sent = 0;
         }
-        data_keep_alive += NTRIP_KEEP_ALIVE_THRESHOLD / 10;
-        vTaskDelay(pdMS_TO_TICKS(NTRIP_KEEP_ALIVE_THRESHOLD / 10));
+
+        ntrip_server_chunk_t *chunk = target->chunk;
+        struct iovec iov[3] = {
+                {target->chunk_size, target->chunk_size_length},
+                {chunk->data, chunk->length},
+                {NEWLINE, target->chunked ? NEWLINE_LENGTH : 0}
+        };
+        size_t total = iov[0].iov_len + iov[1].iov_len + iov[2].iov_len;
+
+        // Skip what has been sent
+        size_t skip = target->chunk_sent;
+        int first = 0;
+        while (skip >= iov[first].iov_len) skip -= iov[first++].iov_len;
+        iov[first].iov_base = (char *) iov[first].iov_base + skip;
+        iov[first].iov_len -= skip;
+
+        struct msghdr msg = {
+                .msg_iov = &iov[first],
+                .msg_iovlen = 3 - first
+        };
+        int sent = sendmsg(target->sock, &msg, MSG_DONTWAIT);
+        if (sent < 0) {
+            if (errno != EWOULDBLOCK) {
+                ntrip_server_disconnect(target);
+                return;
+            }
+
+            // Resumed when the socket is writable
+            reactor_watch_events(target->watch, REACTOR_READ | REACTOR_WRITE);
+            if (!reactor_timer_active(target->send_timer)) reactor_timer_start(target->send_timer, SEND_TIMEOUT);
+            return;
+        }
+
+        reactor_timer_stop(target->send_timer);
+        stream_stats_increment(target->stream_stats, 0, sent);
+
+        target->chunk_sent += sent;
+        if (target->chunk_sent < total) continue;
+
+        congestion_sent(target->congestion, chunk->length, target->backlog);
+        pool_release(chunk);
+        target->chunk = NULL;
     }
+
+    reactor_watch_events(target->watch, REACTOR_READ);
 }
 
-static void ntrip_server_task(void *ctx) {
-    server_event_group = xEventGroupCreate();
-    uart_register_read_handler(ntrip_server_uart_handler);
-    xTaskCreate(ntrip_server_sleep_task, "ntrip_server_sleep_task", 2048, NULL, TASK_PRIORITY_INTERFACE, &sleep_task);
+static void ntrip_server_send_queued(void *ctx) {
+    ntrip_server_target_t *target = ctx;
+    target->send_pending = false;
 
-    config_color_t status_led_color = config_get_color(CONF_ITEM(KEY_CONFIG_NTRIP_SERVER_COLOR));
-    if (status_led_color.rgba != 0) status_led = status_led_add(status_led_color.rgba, STATUS_LED_FADE, 500, 2000, 0);
-    if (status_led != NULL) status_led->active = false;
+    if (target->state == NTRIP_SERVER_STATE_CONNECTED) ntrip_server_send(target);
+}
 
-    stream_stats = stream_stats_new("ntrip_server");
+static void ntrip_server_send_timeout(void *ctx) {
+    ntrip_server_target_t *target = ctx;
 
-    retry_delay_handle_t delay_handle = retry_init(true, 5, 2000, 0);
+    ESP_LOGW(TAG, "Caster %s has not accepted data for %ds", target->host, SEND_TIMEOUT / 1000);
+    ntrip_server_disconnect(target);
+}
 
-    while (true) {
-        retry_delay(delay_handle);
+static void ntrip_server_ready(void *ctx, int sock, uint8_t events) {
+    ntrip_server_target_t *target = ctx;
 
-        // Wait for data to be available
-        if ((xEventGroupGetBits(server_event_group) & DATA_READY_BIT) == 0) {
-            ESP_LOGI(TAG, "Waiting for UART input to connect to caster");
-            uart_nmea("$PESP,NTRIP,SRV,WAITING");
-            xEventGroupWaitBits(server_event_group, DATA_READY_BIT, true, false, portMAX_DELAY);
+    // Caster closed the connection, servers never expect data from the caster
+    if (events & REACTOR_READ) {
+        int len = recv(sock, target->buffer, BUFFER_SIZE, MSG_DONTWAIT);
+        if (len == 0 || (len < 0 && errno != EWOULDBLOCK)) {
+            ntrip_server_disconnect(target);
+            return;
         }
+    }
 
-        vTaskResume(sleep_task);
+    if (events & REACTOR_WRITE) ntrip_server_send(target);
+}
 
-        wait_for_ip();
+static void ntrip_server_response(void *ctx, int sock, int len, const connect_socket_timing_t *timing) {
+    ntrip_server_target_t *target = ctx;
+    target->request = NULL;
+    target->sock = sock;
 
-        char *buffer = NULL;
+    if (!ntrip_server_connected(target, len, timing)) {
+        destroy_socket(&target->sock);
+        ntrip_server_wait(target);
+        return;
+    }
 
-        char *host, *mountpoint, *password;
-        uint16_t port = config_get_u16(CONF_ITEM(KEY_CONFIG_NTRIP_SERVER_PORT));
-        config_get_primitive(CONF_ITEM(KEY_CONFIG_NTRIP_SERVER_PORT), &port);
-        config_get_str_blob_alloc(CONF_ITEM(KEY_CONFIG_NTRIP_SERVER_HOST), (void **) &host);
-        config_get_str_blob_alloc(CONF_ITEM(KEY_CONFIG_NTRIP_SERVER_PASSWORD), (void **) &password);
-        config_get_str_blob_alloc(CONF_ITEM(KEY_CONFIG_NTRIP_SERVER_MOUNTPOINT), (void **) &mountpoint);
+    ESP_LOGI(TAG, "Successfully connected to %s:%d/%s using NTRIP %s", target->host, target->port,
+            target->mountpoint, target->chunked ? "2.0" : "1.0");
+    uart_nmea("$PESP,NTRIP,SRV,CONNECTED,%s:%d,%s", target->host, target->port, target->mountpoint);
 
-        ESP_LOGI(TAG, "Connecting to %s:%d/%s", host, port, mountpoint);
-        uart_nmea("$PESP,NTRIP,SRV,CONNECTING,%s:%d,%s", host, port, mountpoint);
-        sock = connect_socket(host, port, SOCK_STREAM);
-        ERROR_ACTION(TAG, sock == CONNECT_SOCKET_ERROR_RESOLVE, goto _error, "Could not resolve host");
-        ERROR_ACTION(TAG, sock == CONNECT_SOCKET_ERROR_CONNECT, goto _error, "Could not connect to host");
+    retry_reset(target->retry);
 
-        buffer = malloc(BUFFER_SIZE);
+    // Connected
+    ntrip_server_queue_flush(target);
+    target->watch = reactor_watch_new(target->sock, REACTOR_READ, ntrip_server_ready, target);
+    if (target->watch == NULL) {
+        ESP_LOGE(TAG, "Could not watch socket for %s", target->host);
+        destroy_socket(&target->sock);
+        ntrip_server_wait(target);
+        return;
+    }
 
-        snprintf(buffer, BUFFER_SIZE, "SOURCE %s /%s" NEWLINE \
-                "Source-Agent: NTRIP %s/%s" NEWLINE \
-                NEWLINE, password, mountpoint, NTRIP_SERVER_NAME, &esp_ota_get_app_description()->version[1]);
+    target->state = NTRIP_SERVER_STATE_CONNECTED;
+    ntrip_server_status_led_update();
+}
 
-        int err = write(sock, buffer, strlen(buffer));
-        ERROR_ACTION(TAG, err < 0, goto _error, "Could not send request to caster: %d %s", errno, strerror(errno));
+static void ntrip_server_connect(void *ctx) {
+    ntrip_server_target_t *target = ctx;
 
-        int len = read(sock, buffer, BUFFER_SIZE - 1);
-        ERROR_ACTION(TAG, len <= 0, goto _error, "Could not receive response from caster: %d %s", errno, strerror(errno));
-        buffer[len] = '\0';
+    if (!wifi_has_ip()) {
+        reactor_timer_start(target->connect_timer, POLL_INTERVAL);
+        return;
+    }
 
-        char *status = extract_http_header(buffer, "");
-        ERROR_ACTION(TAG, status == NULL || !ntrip_response_ok(status), free(status); goto _error,
-                "Could not connect to mountpoint: %s", status == NULL ? "HTTP response malformed" : status);
-        free(status);
+    ESP_LOGI(TAG, "Connecting to %s:%d/%s", target->host, target->port, target->mountpoint);
+    uart_nmea("$PESP,NTRIP,SRV,CONNECTING,%s:%d,%s", target->host, target->port, target->mountpoint);
 
-        ESP_LOGI(TAG, "Successfully connected to %s:%d/%s", host, port, mountpoint);
-        uart_nmea("$PESP,NTRIP,SRV,CONNECTED,%s:%d,%s", host, port, mountpoint);
+    ntrip_server_request(target, target->buffer);
+    target->request = ntrip_request_start(target->host, target->port, SOCKET_BUDGET_NTRIP_SERVER, target->buffer,
+            target->buffer, BUFFER_SIZE, &target->response, ntrip_server_response, target);
+    ERROR_ACTION(TAG, target->request == NULL, ntrip_server_schedule(target), "Could not start request");
+}
 
-        retry_reset(delay_handle);
+static void ntrip_server_start(void *ctx) {
+    ntrip_server_target_t *target = ctx;
 
-        if (status_led != NULL) status_led->active = true;
+    target->retry = retry_init(true, 5, 2000, 0);
+    target->connect_timer = reactor_timer_new(ntrip_server_connect, target);
+    target->send_timer = reactor_timer_new(ntrip_server_send_timeout, target);
+    ERROR_ACTION(TAG, target->connect_timer == NULL || target->send_timer == NULL, return,
+            "Could not create timers for %s", target->host);
 
-        // Connected
-        xEventGroupSetBits(server_event_group, CASTER_READY_BIT);
+    ntrip_server_wait(target);
+}
+
+// Comma separated message types, types prefixed with ! are excluded
+static void ntrip_server_filter_parse(ntrip_server_target_t *target, char *filter) {
+    char *type, *save = NULL;
+    for (type = strtok_r(filter, ", ", &save); type != NULL; type = strtok_r(NULL, ", ", &save)) {
+        if (target->filter_count == FILTER_TYPES_MAX) break;
+
+        bool exclude = *type == '!';
+        uint16_t value = strtoul(type + exclude, NULL, 10);
+        if (value == 0) continue;
 
-        // Await disconnect from UART handler
-        vTaskSuspend(NULL);
+        if (!exclude) target->filter_include = true;
+        target->filter[target->filter_count++] = exclude ? value | FILTER_EXCLUDE : value;
+    }
+}
 
-        // Disconnected
-        xEventGroupClearBits(server_event_group, CASTER_READY_BIT | DATA_SENT_BIT);
+static char *shed_types;
+static uint16_t max_age;
+
+static ntrip_server_target_t *ntrip_server_target_add(const char *host, uint16_t port, const char *mountpoint,
+        const char *username, const char *password) {
+    if (target_count >= NTRIP_SERVER_TARGETS_MAX || strlen(host) == 0) return NULL;
+
+    int index = target_count++;
+    ntrip_server_target_t *target = &targets[index];
+    *target = (ntrip_server_target_t) {
+            .port = port,
+            .sock = -1,
+            .state = NTRIP_SERVER_STATE_WAITING,
+            .ntrip_v2 = config_get_bool1(CONF_ITEM(KEY_CONFIG_NTRIP_SERVER_V2)),
+            .queue = xQueueCreate(QUEUE_LENGTH, sizeof(ntrip_server_chunk_t *)),
+            .congestion = congestion_init(shed_types, max_age)
+    };
+    strlcpy(target->host, host, sizeof(target->host));
+    strlcpy(target->mountpoint, mountpoint, sizeof(target->mountpoint));
+    strlcpy(target->username, username, sizeof(target->username));
+    strlcpy(target->password, password, sizeof(target->password));
+
+    // First target keeps the original stream name
+    if (index == 0) {
+        strcpy(target->stream_stats_name, "ntrip_server");
+    } else {
+        snprintf(target->stream_stats_name, sizeof(target->stream_stats_name), "ntrip_server_%d", index + 1);
+    }
+    target->stream_stats = stream_stats_new(target->stream_stats_name);
 
-        if (status_led != NULL) status_led->active = false;
+    return target;
+}
 
-        ESP_LOGW(TAG, "Disconnected from %s:%d/%s", host, port, mountpoint);
-        uart_nmea("$PESP,NTRIP,SRV,DISCONNECTED,%s:%d,%s", host, port, mountpoint);
+// Additional casters, one per line as [username:]password@host[:port]/mountpoint[ filter]
+static void ntrip_server_targets_parse(char *list) {
+    char *line, *save = NULL;
+    for (line = strtok_r(list, "\r\n", &save); line != NULL; line = strtok_r(NULL, "\r\n", &save)) {
+        while (isspace((unsigned char) *line)) line++;
+        if (*line == '\0') continue;
+
+        char *filter = strchr(line, ' ');
+        if (filter != NULL) *filter++ = '\0';
+
+        char *at = strrchr(line, '@');
+        ERROR_ACTION(TAG, at == NULL, continue, "Additional caster %s has no password", line)
+        *at = '\0';
+
+        const char *username = "", *password = line;
+        char *colon = strchr(line, ':');
+        if (colon != NULL) {
+            *colon = '\0';
+            username = line;
+            password = colon + 1;
+        }
 
-        _error:
-        vTaskSuspend(sleep_task);
+        char *host = at + 1;
+        char *slash = strchr(host, '/');
+        ERROR_ACTION(TAG, slash == NULL, continue, "Additional caster %s has no mountpoint", host)
+        *slash = '\0';
 
-        destroy_socket(&sock);
+        uint16_t port = NTRIP_PORT_DEFAULT;
+        colon = strchr(host, ':');
+        if (colon != NULL) {
+            *colon = '\0';
+            port = strtoul(colon + 1, NULL, 10);
+        }
 
-        free(buffer);
-        free(host);
-        free(mountpoint);
-        free(password);
+        ntrip_server_target_t *target = ntrip_server_target_add(host, port, slash + 1, username, password);
+        if (target != NULL && filter != NULL) ntrip_server_filter_parse(target, filter);
     }
 }
 
+bool ntrip_server_target_status(int index, ntrip_server_target_status_t *status) {
+    if (index < 0 || index >= target_count) return false;
+
+    ntrip_server_target_t *target = &targets[index];
+    *status = (ntrip_server_target_status_t) {
+            .port = target->port,
+            .connected = target->state == NTRIP_SERVER_STATE_CONNECTED,
+            .queued = uxQueueMessagesWaiting(target->queue),
+            .drops = target->drops,
+            .congestion = target->congestion,
+            .stream_stats = target->stream_stats
+    };
+    strcpy(status->host, target->host);
+    strcpy(status->mountpoint, target->mountpoint);
+
+    return true;
+}
+
 void ntrip_server_init() {
     if (!config_get_bool1(CONF_ITEM(KEY_CONFIG_NTRIP_SERVER_ACTIVE))) return;
 
-    xTaskCreate(ntrip_server_task, "ntrip_server_task", 4096, NULL, TASK_PRIORITY_INTERFACE, &server_task);
+    socket_budget_enable(SOCKET_BUDGET_NTRIP_SERVER);
+
+    config_color_t status_led_color = config_get_color(CONF_ITEM(KEY_CONFIG_NTRIP_SERVER_COLOR));
+    if (status_led_color.rgba != 0) status_led = status_led_add(status_led_color.rgba, STATUS_LED_FADE, 500, 2000, 0);
+    if (status_led != NULL) status_led->active = false;
+
+    char *host, *mountpoint, *username, *password, *filter, *list;
+    uint16_t port = config_get_u16(CONF_ITEM(KEY_CONFIG_NTRIP_SERVER_PORT));
+    config_get_str_blob_alloc(CONF_ITEM(KEY_CONFIG_NTRIP_SERVER_HOST), (void **) &host);
+    config_get_str_blob_alloc(CONF_ITEM(KEY_CONFIG_NTRIP_SERVER_USERNAME), (void **) &username);
+    config_get_str_blob_alloc(CONF_ITEM(KEY_CONFIG_NTRIP_SERVER_PASSWORD), (void **) &password);
+    config_get_str_blob_alloc(CONF_ITEM(KEY_CONFIG_NTRIP_SERVER_MOUNTPOINT), (void **) &mountpoint);
+    config_get_str_blob_alloc(CONF_ITEM(KEY_CONFIG_NTRIP_SERVER_FILTER), (void **) &filter);
+    config_get_str_blob_alloc(CONF_ITEM(KEY_CONFIG_NTRIP_SERVER_TARGETS), (void **) &list);
+    config_get_str_blob_alloc(CONF_ITEM(KEY_CONFIG_NTRIP_SERVER_SHED), (void **) &shed_types);
+    max_age = config_get_u16(CONF_ITEM(KEY_CONFIG_NTRIP_SERVER_MAX_AGE));
+
+    ntrip_server_target_t *target = ntrip_server_target_add(host, port, mountpoint, username, password);
+    if (target != NULL) ntrip_server_filter_parse(target, filter);
+    ntrip_server_targets_parse(list);
+
+    free(host);
+    free(mountpoint);
+    free(username);
+    free(password);
+    free(filter);
+    free(list);
+    free(shed_types);
+
+    rtcm_parser_init(&rtcm_parser);
+    chunk_pool_small = pool_new("ntrip_server_chunks_small", CHUNK_SMALL_SIZE, target_count * CHUNK_SMALL_COUNT);
+    chunk_pool_large = pool_new("ntrip_server_chunks_large", CHUNK_LARGE_SIZE, target_count * CHUNK_LARGE_COUNT);
+
+    for (int i = 0; i < target_count; i++) {
+        ERROR_ACTION(TAG, !reactor_call(ntrip_server_start, &targets[i]), continue,
+                "Could not start %s on reactor", targets[i].host);
+    }
+
+    router_register_sink(ROUTER_SINK_NTRIP_SERVER, ntrip_server_uart_handler);
 }
@@ -15,18 +15,221 @@
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#include <lwip/sockets.h>
+#include <protocol/http.h>
+#include <pool.h>
+#include <reactor.h>
+#include "interface/ntrip.h"
 
-static bool str_starts_with(const char *a, const char *b) {
-    return strncmp(a, b, strlen(b)) == 0;
+// One per NTRIP server target, and one for the NTRIP client which requests either a sourcetable or its stream
+#define REQUEST_POOL_COUNT (NTRIP_SERVER_TARGETS_MAX + 1)
+
+static pool_handle_t request_pool;
+
+struct ntrip_request {
+    char *request;
+    char *buffer;
+    size_t size;
+    size_t length;
+    http_parser_t *response;
+
+    ntrip_request_callback_t callback;
+    void *ctx;
+
+    reactor_connect_handle_t connect;
+    connect_socket_timing_t timing;
+
+    int sock;
+    reactor_watch_handle_t watch;
+    reactor_timer_handle_t timer;
+};
+
+static void ntrip_request_free(ntrip_request_handle_t request) {
+    reactor_watch_delete(request->watch);
+    reactor_timer_delete(request->timer);
+    pool_release(request);
+}
+
+static void ntrip_request_finish(ntrip_request_handle_t request, int length) {
+    ntrip_request_callback_t callback = request->callback;
+    void *ctx = request->ctx;
+    int sock = request->sock;
+    connect_socket_timing_t timing = request->timing;
+
+    ntrip_request_free(request);
+
+    callback(ctx, sock, length, &timing);
+}
+
+static void ntrip_request_timeout(void *ctx) {
+    ntrip_request_finish(ctx, -1);
+}
+
+static void ntrip_request_receive(void *ctx, int sock, uint8_t events) {
+    ntrip_request_handle_t request = ctx;
+
+    // Keep reading until headers are complete, data received with them is left in the buffer
+    int len = recv(sock, request->buffer + request->length, request->size - 1 - request->length, MSG_DONTWAIT);
+    if (len < 0 && errno == EWOULDBLOCK) return;
+    if (len <= 0) {
+        ntrip_request_finish(request, -1);
+        return;
+    }
+
+    request->length += len;
+    int ret = http_parser_parse(request->response, request->buffer, request->length);
+    if (ret == HTTP_PARSER_RESULT_MORE && request->length < request->size - 1) return;
+
+    request->buffer[request->length] = '\0';
+    ntrip_request_finish(request, ret == HTTP_PARSER_RESULT_DONE ? (int) request->length : -1);
+}
+
+static void ntrip_request_connected(void *ctx, int sock, const connect_socket_timing_t *timing) {
+    ntrip_request_handle_t request = ctx;
+    request->connect = NULL;
+    request->sock = sock;
+    request->timing = *timing;
+
+    if (sock < 0) {
+        ntrip_request_finish(request, -1);
+        return;
+    }
+
+    // Fits in the send buffer of a new connection
+    size_t length = strlen(request->request);
+    if (send(sock, request->request, length, MSG_DONTWAIT) != (int) length) {
+        ntrip_request_finish(request, -1);
+        return;
+    }
+
+    http_parser_init(request->response, HTTP_PARSER_RESPONSE);
+    request->watch = reactor_watch_new(sock, REACTOR_READ, ntrip_request_receive, request);
+    request->timer = reactor_timer_new(ntrip_request_timeout, request);
+    if (request->watch == NULL || request->timer == NULL) {
+        ntrip_request_finish(request, -1);
+        return;
+    }
+
+    reactor_timer_start(request->timer, NTRIP_RESPONSE_TIMEOUT);
+}
+
+ntrip_request_handle_t ntrip_request_start(const char *host, uint16_t port, socket_budget_owner_t owner, char *request,
+        char *buffer, size_t size, http_parser_t *response, ntrip_request_callback_t callback, void *ctx) {
+    ntrip_request_handle_t handle = pool_alloc(request_pool, sizeof(struct ntrip_request));
+    if (handle == NULL) return NULL;
+
+    *handle = (struct ntrip_request) {
+            .request = request,
+            .buffer = buffer,
+            .size = size,
+            .response = response,
+            .callback = callback,
+            .ctx = ctx,
+            .sock = -1
+    };
+
+    handle->connect = reactor_connect(host, port, SOCK_STREAM, owner, ntrip_request_connected, handle);
+    if (handle->connect == NULL) {
+        pool_release(handle);
+        return NULL;
+    }
+
+    return handle;
+}
+
+void ntrip_request_init() {
+    request_pool = pool_new("ntrip_requests", sizeof(struct ntrip_request), REQUEST_POOL_COUNT);
+}
+
+bool ntrip_response_sourcetable(const http_parser_t *response, const char *buffer) {
+    return http_span_equals(buffer, &response->start_line[HTTP_RESPONSE_VERSION], "SOURCETABLE") ||
+           http_span_contains(buffer, http_parser_header(response, buffer, "Content-Type"), "sourcetable");
+}
+
+bool ntrip_response_ok(const http_parser_t *response, const char *buffer) {
+    // Some casters reply with only "OK"
+    bool ok = response->status == 200 || http_span_equals(buffer, &response->start_line[HTTP_RESPONSE_VERSION], "OK");
+    return ok && !ntrip_response_sourcetable(response, buffer);
+}
+
+// STR;mountpoint;identifier;format;format-details;carrier;nav-system;network;country;latitude;longitude;nmea;...
+#define SOURCETABLE_STR_MOUNTPOINT 1
+#define SOURCETABLE_STR_FORMAT 3
+#define SOURCETABLE_STR_LATITUDE 9
+#define SOURCETABLE_STR_LONGITUDE 10
+#define SOURCETABLE_STR_NMEA 11
+
+void ntrip_sourcetable_parser_init(ntrip_sourcetable_parser_t *parser) {
+    parser->length = 0;
+    parser->done = false;
 }
 
-bool ntrip_response_ok(void *response) {
-    return str_starts_with(response, "OK") || str_starts_with(response, "ICY 200 OK") ||
-           str_starts_with(response, "HTTP/1.1 200 OK");
+static void ntrip_sourcetable_line(char *line, ntrip_sourcetable_stream_handler_t handler, void *ctx) {
+    if (strncmp(line, "STR;", 4) != 0) return;
+
+    ntrip_sourcetable_stream_t stream = {0};
+
+    // Fields may be empty so strtok can't be used
+    char *field = line;
+    for (int i = 0; field != NULL && i <= SOURCETABLE_STR_NMEA; i++) {
+        char *next = strchr(field, ';');
+        if (next != NULL) *next++ = '\0';
+
+        switch (i) {
+            case SOURCETABLE_STR_MOUNTPOINT:
+                strlcpy(stream.mountpoint, field, sizeof(stream.mountpoint));
+                break;
+            case SOURCETABLE_STR_FORMAT:
+                strlcpy(stream.format, field, sizeof(stream.format));
+                break;
+            case SOURCETABLE_STR_LATITUDE:
+                stream.latitude = strtof(field, NULL);
+                break;
+            case SOURCETABLE_STR_LONGITUDE:
+                stream.longitude = strtof(field, NULL);
+                break;
+            case SOURCETABLE_STR_NMEA:
+                stream.nmea = *field == '1';
+                break;
+        }
+
+        field = next;
+    }
+
+    if (stream.mountpoint[0] != '\0') handler(ctx, &stream);
 }
 
-bool ntrip_response_sourcetable_ok(void *response) {
-    return str_starts_with(response, "HTTP/1.1 200 OK") || str_starts_with(response, "SOURCETABLE 200 OK");
-}
\ No newline at end of file
+bool ntrip_sourcetable_parse(ntrip_sourcetable_parser_t *parser, const char *data, size_t length,
+        ntrip_sourcetable_stream_handler_t handler, void *ctx) {
+    const char *end = data + length;
+    while (data < end && !parser->done) {
+        const char *lf = memchr(data, '\n', end - data);
+        size_t size = (lf == NULL ? end : lf) - data;
+
+        // Keep the start of long lines, drop the rest
+        size_t copy = size;
+        if (copy > sizeof(parser->line) - 1 - parser->length) copy = sizeof(parser->line) - 1 - parser->length;
+        memcpy(parser->line + parser->length, data, copy);
+        parser->length += copy;
+
+        if (lf == NULL) break;
+        data = lf + 1;
+
+        if (parser->length > 0 && parser->line[parser->length - 1] == '\r') parser->length--;
+        parser->line[parser->length] = '\0';
+        parser->length = 0;
+
+        if (strcmp(parser->line, "ENDSOURCETABLE") == 0) {
+            parser->done = true;
+        } else {
+            ntrip_sourcetable_line(parser->line, handler, ctx);
+        }
+    }
+
+    return parser->done;
+}
@@ -17,105 +17,413 @@
 
 #include <sys/param.h>
 #include <freertos/FreeRTOS.h>
-#include <freertos/task.h>
+#include <freertos/queue.h>
+#include <freertos/semphr.h>
 #include <uart.h>
 #include <util.h>
 #include <status_led.h>
 #include <wifi.h>
 #include <esp_log.h>
+#include <esp_timer.h>
 #include <sys/socket.h>
 #include "interface/socket_client.h"
 
 #include <config.h>
+#include <congestion.h>
+#include <protocol/tunnel.h>
+#include <reactor.h>
+#include <pool.h>
 #include <retry.h>
+#include <router.h>
+#include <socket_budget.h>
 #include <stream_stats.h>
-#include <tasks.h>
 
 static const char *TAG = "SOCKET_CLIENT";
 
 #define BUFFER_SIZE 1024
 
+// UART reads waiting to be sent, oldest are dropped when full
+#define QUEUE_LENGTH 32
+
+// Typical reads come from the pool, long bursts from the heap
+#define CHUNK_POOL_SIZE (sizeof(socket_client_chunk_t) + 1024)
+#define CHUNK_POOL_COUNT 8
+
+// Milliseconds
+#define SEND_TIMEOUT 5000
+#define POLL_INTERVAL 1000
+#define MAX_AGE 3000
+#define TUNNEL_REORDER_TIMEOUT 200
+#define TUNNEL_NACK_INTERVAL 50
+
+typedef struct socket_client_chunk {
+    int64_t time;
+    size_t length;
+    char data[];
+} socket_client_chunk_t;
+
+// Socket is only used on the reactor
 static int sock = -1;
+static volatile bool connected = false;
+
+static char *host, *connect_message;
+static uint16_t port;
+static int socktype;
+static bool tunnel_enabled;
+static tunnel_config_t tunnel_config;
+
+// UDP tunnel of the current connection, status is read by the web server while holding the lock
+static tunnel_handle_t tunnel = NULL;
+static SemaphoreHandle_t tunnel_lock;
+
+static retry_delay_handle_t retry;
+static reactor_timer_handle_t connect_timer, send_timer, tunnel_timer;
+static reactor_watch_handle_t watch = NULL;
+// Filter state starts afresh with every connection
+static router_context_handle_t router = NULL;
+static char *buffer;
+
+static QueueHandle_t queue;
+static pool_handle_t chunk_pool;
+static size_t backlog = 0;
+static portMUX_TYPE backlog_lock = portMUX_INITIALIZER_UNLOCKED;
+static congestion_handle_t congestion;
+
+// Chunk being sent, resumed once the socket has space
+static socket_client_chunk_t *sending = NULL;
+static size_t sending_offset;
+static volatile bool send_pending = false;
+
+static uint32_t drops = 0;
+static uint32_t reconnects = 0;
 
 static status_led_handle_t status_led = NULL;
 static stream_stats_handle_t stream_stats = NULL;
 
-static void socket_client_uart_handler(void* handler_args, esp_event_base_t base, int32_t length, void* buffer) {
-    if (sock == -1) return;
+static void socket_client_send_queued(void *ctx);
+
+static bool socket_client_dequeue(socket_client_chunk_t **chunk, TickType_t timeout) {
+    if (xQueueReceive(queue, chunk, timeout) != pdTRUE) return false;
 
-    stream_stats_increment(stream_stats, 0, length);
+    portENTER_CRITICAL(&backlog_lock);
+    backlog -= (*chunk)->length;
+    portEXIT_CRITICAL(&backlog_lock);
 
-    int err = write(sock, buffer, length);
-    if (err < 0) destroy_socket(&sock);
+    return true;
 }
 
-static void socket_client_task(void *ctx) {
-    uart_register_read_handler(socket_client_uart_handler);
+static void socket_client_uart_handler(const void *buffer, size_t length) {
+    if (!connected) return;
+
+    // Serial data has no priorities, only the backlog limits what is queued
+    if (!congestion_admit(congestion, 0, length, backlog)) return;
+
+    socket_client_chunk_t *chunk = pool_alloc(chunk_pool, sizeof(socket_client_chunk_t) + length);
+    if (chunk == NULL) return;
+    chunk->time = esp_timer_get_time();
+    chunk->length = length;
+    memcpy(chunk->data, buffer, length);
+
+    portENTER_CRITICAL(&backlog_lock);
+    backlog += length;
+    portEXIT_CRITICAL(&backlog_lock);
+
+    // Never block the event loop, make room by dropping the oldest chunk
+    if (xQueueSend(queue, &chunk, 0) != pdTRUE) {
+        socket_client_chunk_t *oldest;
+        if (socket_client_dequeue(&oldest, 0)) {
+            pool_release(oldest);
+            drops++;
+        }
+        if (xQueueSend(queue, &chunk, 0) != pdTRUE) {
+            portENTER_CRITICAL(&backlog_lock);
+            backlog -= length;
+            portEXIT_CRITICAL(&backlog_lock);
+
+            pool_release(chunk);
+            drops++;
+            return;
+        }
+    }
+
+    if (send_pending) return;
+    send_pending = true;
+    if (!reactor_call(socket_client_send_queued, NULL)) send_pending = false;
+}
+
+static uint32_t socket_client_now() {
+    return esp_timer_get_time() / 1000;
+}
+
+static void socket_client_tunnel_output(void *ctx, const uint8_t *packet, size_t length) {
+    // Lost datagrams are recovered by the tunnel, never wait for buffer space
+    int sent = send(sock, packet, length, MSG_DONTWAIT);
+    if (sent > 0) stream_stats_increment(stream_stats, 0, sent);
+}
+
+static void socket_client_tunnel_deliver(void *ctx, const uint8_t *data, size_t length) {
+    router_dispatch(router, data, length);
+
+    stream_stats_increment(stream_stats, length, 0);
+}
+
+// Wake up in time for tunnel retransmission requests and reordering timeouts
+static void socket_client_tunnel_schedule() {
+    xSemaphoreTake(tunnel_lock, portMAX_DELAY);
+    int next = tunnel_poll(tunnel, socket_client_now());
+    xSemaphoreGive(tunnel_lock);
+
+    if (next >= 0) {
+        reactor_timer_start(tunnel_timer, next);
+    } else {
+        reactor_timer_stop(tunnel_timer);
+    }
+}
+
+static void socket_client_tunnel_timeout(void *ctx) {
+    if (connected && tunnel != NULL) socket_client_tunnel_schedule();
+}
+
+static void socket_client_schedule() {
+    reactor_timer_start(connect_timer, retry_next(retry));
+}
+
+static void socket_client_disconnect() {
+    connected = false;
+    reactor_watch_delete(watch);
+    watch = NULL;
+    router_context_delete(router);
+    router = NULL;
+    reactor_timer_stop(send_timer);
+    reactor_timer_stop(tunnel_timer);
+    destroy_socket(&sock);
 
-    config_color_t status_led_color = config_get_color(CONF_ITEM(KEY_CONFIG_SOCKET_CLIENT_COLOR));
-    if (status_led_color.rgba != 0) status_led = status_led_add(status_led_color.rgba, STATUS_LED_FADE, 500, 2000, 0);
     if (status_led != NULL) status_led->active = false;
 
-    stream_stats = stream_stats_new("socket_client");
+    ESP_LOGW(TAG, "Disconnected from %s:%d", host, port);
+    uart_nmea("$PESP,SOCK,CLI,%s,DISCONNECTED,%s:%d", SOCKTYPE_NAME(socktype), host, port);
+
+    reconnects++;
+
+    // Nothing queued for the old connection is sent on the next one
+    pool_release(sending);
+    sending = NULL;
+    socket_client_chunk_t *queued;
+    while (socket_client_dequeue(&queued, 0)) pool_release(queued);
 
-    retry_delay_handle_t delay_handle = retry_init(true, 5, 2000, 0);
+    socket_client_schedule();
+}
 
+// Sends queued chunks until the socket is full, waiting for space up to SEND_TIMEOUT
+static void socket_client_send() {
     while (true) {
-        retry_delay(delay_handle);
+        if (sending == NULL) {
+            if (!socket_client_dequeue(&sending, 0)) break;
+
+            // Stale data is dropped rather than delivered late
+            if (!congestion_fresh(congestion, 0, sending->time)) {
+                pool_release(sending);
+                sending = NULL;
+                continue;
+            }
+
+            sending_offset = 0;
+        }
+
+        if (tunnel != NULL) {
+            xSemaphoreTake(tunnel_lock, portMAX_DELAY);
+            tunnel_send(tunnel, (uint8_t *) sending->data, sending->length, socket_client_now());
+            xSemaphoreGive(tunnel_lock);
+
+            sending_offset = sending->length;
+        } else {
+            int sent = send(sock, sending->data + sending_offset, sending->length - sending_offset, MSG_DONTWAIT);
+            if (sent < 0) {
+                if (errno != EWOULDBLOCK) {
+                    socket_client_disconnect();
+                    return;
+                }
+
+                // Resumed when the socket is writable
+                reactor_watch_events(watch, REACTOR_READ | REACTOR_WRITE);
+                if (!reactor_timer_active(send_timer)) reactor_timer_start(send_timer, SEND_TIMEOUT);
+                return;
+            }
+
+            reactor_timer_stop(send_timer);
+            stream_stats_increment(stream_stats, 0, sent);
+            sending_offset += sent;
+        }
 
-        wait_for_ip();
+        if (sending_offset < sending->length) continue;
 
-        char *host, *connect_message;
-        uint16_t port = config_get_u16(CONF_ITEM(KEY_CONFIG_SOCKET_CLIENT_PORT));
-        config_get_str_blob_alloc(CONF_ITEM(KEY_CONFIG_SOCKET_CLIENT_HOST), (void **) &host);
-        config_get_str_blob_alloc(CONF_ITEM(KEY_CONFIG_SOCKET_CLIENT_CONNECT_MESSAGE), (void **) &connect_message);
-        int socktype = config_get_bool1(CONF_ITEM(KEY_CONFIG_SOCKET_CLIENT_TYPE_TCP_UDP)) ? SOCK_STREAM : SOCK_DGRAM;
+        congestion_sent(congestion, sending->length, backlog);
+        pool_release(sending);
+        sending = NULL;
+    }
 
-        ESP_LOGI(TAG, "Connecting to %s host %s:%d", SOCKTYPE_NAME(socktype), host, port);
-        uart_nmea("$PESP,SOCK,CLI,%s,CONNECTING,%s:%d", SOCKTYPE_NAME(socktype), host, port);
-        sock = connect_socket(host, port, socktype);
-        ERROR_ACTION(TAG, sock == CONNECT_SOCKET_ERROR_RESOLVE, goto _error, "Could not resolve host");
-        ERROR_ACTION(TAG, sock == CONNECT_SOCKET_ERROR_CONNECT, goto _error, "Could not connect to host");
+    reactor_watch_events(watch, REACTOR_READ);
+    if (tunnel != NULL) socket_client_tunnel_schedule();
+}
 
-        int err = write(sock, connect_message, strlen(connect_message));
-        free(connect_message);
-        ERROR_ACTION(TAG, err < 0, goto _error, "Could not send connection message: %d %s", errno, strerror(errno));
+static void socket_client_send_queued(void *ctx) {
+    send_pending = false;
+
+    if (connected) socket_client_send();
+}
 
-        ESP_LOGI(TAG, "Successfully connected to %s:%d", host, port);
-        uart_nmea("$PESP,SOCK,CLI,%s,CONNECTED,%s:%d", SOCKTYPE_NAME(socktype), host, port);
+static void socket_client_send_timeout(void *ctx) {
+    ESP_LOGW(TAG, "Host has not accepted data for %ds", SEND_TIMEOUT / 1000);
+    socket_client_disconnect();
+}
 
-        retry_reset(delay_handle);
+static void socket_client_ready(void *ctx, int sock, uint8_t events) {
+    if (events & REACTOR_READ) {
+        int len = recv(sock, buffer, BUFFER_SIZE, MSG_DONTWAIT);
+        if (len == 0 || (len < 0 && errno != EWOULDBLOCK)) {
+            socket_client_disconnect();
+            return;
+        }
 
-        if (status_led != NULL) status_led->active = true;
+        bool tunneled = false;
+        if (len > 0 && tunnel != NULL) {
+            xSemaphoreTake(tunnel_lock, portMAX_DELAY);
+            tunneled = tunnel_receive(tunnel, (uint8_t *) buffer, len, socket_client_now());
+            xSemaphoreGive(tunnel_lock);
 
-        char *buffer = malloc(BUFFER_SIZE);
+            socket_client_tunnel_schedule();
+        }
 
-        int len;
-        while ((len = read(sock, buffer, BUFFER_SIZE)) >= 0) {
-            uart_write(buffer, len);
+        if (len > 0 && !tunneled) {
+            router_dispatch(router, buffer, len);
 
             stream_stats_increment(stream_stats, len, 0);
         }
+    }
+
+    if (events & REACTOR_WRITE) socket_client_send();
+}
+
+void socket_client_status(socket_client_status_t *status) {
+    if (queue == NULL) {
+        *status = (socket_client_status_t) {
+                .active = false
+        };
+        return;
+    }
+
+    *status = (socket_client_status_t) {
+            .active = true,
+            .connected = connected,
+            .queued = uxQueueMessagesWaiting(queue),
+            .backlog = backlog,
+            .drops = drops,
+            .reconnects = reconnects,
+            .congestion = congestion
+    };
+
+    xSemaphoreTake(tunnel_lock, portMAX_DELAY);
+    status->tunnel = tunnel != NULL;
+    if (tunnel != NULL) tunnel_stats(tunnel, &status->tunnel_stats);
+    xSemaphoreGive(tunnel_lock);
+}
+
+static void socket_client_connected(void *ctx, int connect_sock, const connect_socket_timing_t *timing) {
+    sock = connect_sock;
+    ERROR_ACTION(TAG, sock == CONNECT_SOCKET_ERROR_RESOLVE, goto _error, "Could not resolve host");
+    ERROR_ACTION(TAG, sock == CONNECT_SOCKET_ERROR_CONNECT, goto _error, "Could not connect to host");
+
+    ESP_LOGD(TAG, "Connected in %ums (resolve %ums, %d attempts)", timing->connect, timing->resolve, timing->attempts);
+
+    // Fits in the send buffer of a new connection
+    int err = send(sock, connect_message, strlen(connect_message), MSG_DONTWAIT);
+    ERROR_ACTION(TAG, err < 0, goto _error, "Could not send connection message: %d %s", errno, strerror(errno));
+
+    router = router_context_new(ROUTER_SOURCE_SOCKET_CLIENT);
+    ERROR_ACTION(TAG, router == NULL, goto _error, "Could not allocate routing context");
+
+    watch = reactor_watch_new(sock, REACTOR_READ, socket_client_ready, NULL);
+    ERROR_ACTION(TAG, watch == NULL, goto _error, "Could not watch socket");
 
-        free(buffer);
+    ESP_LOGI(TAG, "Successfully connected to %s:%d", host, port);
+    uart_nmea("$PESP,SOCK,CLI,%s,CONNECTED,%s:%d", SOCKTYPE_NAME(socktype), host, port);
 
-        if (status_led != NULL) status_led->active = false;
+    retry_reset(retry);
 
-        ESP_LOGW(TAG, "Disconnected from %s:%d: %d %s", host, port, errno, strerror(errno));
-        uart_nmea("$PESP,SOCK,CLI,%s,DISCONNECTED,%s:%d", SOCKTYPE_NAME(socktype), host, port);
+    if (status_led != NULL) status_led->active = true;
 
-        _error:
-        destroy_socket(&sock);
+    connected = true;
 
-        free(host);
-        free(connect_message);
+    if (tunnel != NULL) socket_client_tunnel_schedule();
+
+    return;
+
+    _error:
+    router_context_delete(router);
+    router = NULL;
+    destroy_socket(&sock);
+    socket_client_schedule();
+}
+
+static void socket_client_connect(void *ctx) {
+    if (!wifi_has_ip()) {
+        reactor_timer_start(connect_timer, POLL_INTERVAL);
+        return;
     }
 
-    vTaskDelete(NULL);
+    // Previous tunnel is kept until now so its statistics remain visible
+    xSemaphoreTake(tunnel_lock, portMAX_DELAY);
+    if (tunnel != NULL) tunnel_destroy(tunnel);
+    tunnel = tunnel_enabled ? tunnel_create(&tunnel_config, socket_client_tunnel_output, socket_client_tunnel_deliver, NULL) : NULL;
+    xSemaphoreGive(tunnel_lock);
+
+    ESP_LOGI(TAG, "Connecting to %s host %s:%d", SOCKTYPE_NAME(socktype), host, port);
+    uart_nmea("$PESP,SOCK,CLI,%s,CONNECTING,%s:%d", SOCKTYPE_NAME(socktype), host, port);
+    ERROR_ACTION(TAG, reactor_connect(host, port, socktype, SOCKET_BUDGET_SOCKET_CLIENT, socket_client_connected, NULL) == NULL,
+            socket_client_schedule(), "Could not start connection");
+}
+
+static void socket_client_start(void *ctx) {
+    connect_timer = reactor_timer_new(socket_client_connect, NULL);
+    send_timer = reactor_timer_new(socket_client_send_timeout, NULL);
+    tunnel_timer = reactor_timer_new(socket_client_tunnel_timeout, NULL);
+    ERROR_ACTION(TAG, connect_timer == NULL || send_timer == NULL || tunnel_timer == NULL, return,
+            "Could not create timers");
+
+    socket_client_schedule();
 }
 
 void socket_client_init() {
     if (!config_get_bool1(CONF_ITEM(KEY_CONFIG_SOCKET_CLIENT_ACTIVE))) return;
 
-    xTaskCreate(socket_client_task, "socket_client_task", 4096, NULL, TASK_PRIORITY_INTERFACE, NULL);
-}
\ No newline at end of file
+    socket_budget_enable(SOCKET_BUDGET_SOCKET_CLIENT);
+
+    port = config_get_u16(CONF_ITEM(KEY_CONFIG_SOCKET_CLIENT_PORT));
+    config_get_str_blob_alloc(CONF_ITEM(KEY_CONFIG_SOCKET_CLIENT_HOST), (void **) &host);
+    config_get_str_blob_alloc(CONF_ITEM(KEY_CONFIG_SOCKET_CLIENT_CONNECT_MESSAGE), (void **) &connect_message);
+    socktype = config_get_bool1(CONF_ITEM(KEY_CONFIG_SOCKET_CLIENT_TYPE_TCP_UDP)) ? SOCK_STREAM : SOCK_DGRAM;
+
+    tunnel_enabled = socktype == SOCK_DGRAM && config_get_bool1(CONF_ITEM(KEY_CONFIG_SOCKET_CLIENT_TUNNEL));
+    tunnel_config = (tunnel_config_t) {
+            .fec_group = config_get_u8(CONF_ITEM(KEY_CONFIG_SOCKET_CLIENT_FEC)),
+            .reorder_timeout = TUNNEL_REORDER_TIMEOUT,
+            .nack_interval = TUNNEL_NACK_INTERVAL
+    };
+
+    tunnel_lock = xSemaphoreCreateMutex();
+    queue = xQueueCreate(QUEUE_LENGTH, sizeof(socket_client_chunk_t *));
+    chunk_pool = pool_new("socket_client_chunks", CHUNK_POOL_SIZE, CHUNK_POOL_COUNT);
+    congestion = congestion_init("", MAX_AGE);
+    retry = retry_init(true, 5, 2000, 0);
+    buffer = malloc(BUFFER_SIZE);
+
+    router_register_sink(ROUTER_SINK_SOCKET_CLIENT, socket_client_uart_handler);
+
+    config_color_t status_led_color = config_get_color(CONF_ITEM(KEY_CONFIG_SOCKET_CLIENT_COLOR));
+    if (status_led_color.rgba != 0) status_led = status_led_add(status_led_color.rgba, STATUS_LED_FADE, 500, 2000, 0);
+    if (status_led != NULL) status_led->active = false;
+
+    stream_stats = stream_stats_new("socket_client");
+
+    ERROR_ACTION(TAG, !reactor_call(socket_client_start, NULL), return, "Could not start on reactor");
+}
@@ -15,8 +15,9 @@
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
  */
 #include <esp_log.h>
+#include <esp_timer.h>
 #include <freertos/FreeRTOS.h>
-#include <freertos/task.h>
+#include <freertos/semphr.h>
 #include <lwip/err.h>
 #include <lwip/sockets.h>
 #include <string.h>
@@ -25,6 +26,12 @@
 
 #include "config.h"
 #include "interface/socket_server.h"
+#include "protocol/tunnel.h"
+#include "pool.h"
+#include "reactor.h"
+#include "router.h"
+#include "send_buffer.h"
+#include "socket_budget.h"
 #include "status_led.h"
 #include "stream_stats.h"
 #include "uart.h"
@@ -34,20 +41,96 @@ static const char *TAG = "SOCKET_SERVER";
 
 #define BUFFER_SIZE 1024
 
-static int sock_tcp, sock_udp;
+// Milliseconds
+#define TUNNEL_REORDER_TIMEOUT 200
+#define TUNNEL_NACK_INTERVAL 50
+
+// Milliseconds before listening is retried after failing
+#define RESTART_DELAY 5000
+
+// As many clients as the socket budget allows
+#define CLIENT_POOL_COUNT 8
+
+// Each tunnel keeps two windows of TUNNEL_WINDOW full payloads (18 KB), further UDP clients are not tunnelled
+#define TUNNEL_PEERS_MAX 2
+
+// Output a TCP client has not taken yet, only allocated once it falls behind, larger writes are dropped
+#define CLIENT_OUTPUT_SIZE 4096
+
+static int sock_tcp = -1, sock_udp = -1;
+static reactor_timer_handle_t restart_timer, tunnel_timer;
 static char *buffer;
 
+static bool tunnel_active;
+static tunnel_config_t tunnel_config;
+static int tunnel_peers = 0;
+
+// TCP clients not accepting any data for this long are disconnected, 0 waits for TCP to give up
+static int64_t stall_timeout = 0;
+
+// Client list is shared between the UART handler and the reactor
+static SemaphoreHandle_t client_lock = NULL;
+
+// Clients the UART handler closed or left with queued output, updated on the reactor
+static volatile bool update_pending = false;
+
 static status_led_handle_t status_led = NULL;
 static stream_stats_handle_t stream_stats = NULL;
 
+// Datagrams from UDP clients that could not be given a socket, routed as one stream
+static router_context_handle_t refused_router = NULL;
+
 typedef struct socket_client_t {
     int socket;
     struct sockaddr_in6 addr;
     int type;
+    tunnel_handle_t tunnel;
+    router_context_handle_t router;
+    reactor_watch_handle_t watch;
+    bool closed;
+
+    // Also watched for writing while output is queued, only changed on the reactor
+    send_buffer_t output;
+    bool armed;
+
+    // When the client last accepted data while output was queued, 0 while it keeps up
+    int64_t stalled_since;
     SLIST_ENTRY(socket_client_t) next;
 } socket_client_t;
 
 static SLIST_HEAD(socket_client_list_t, socket_client_t) socket_client_list;
+static pool_handle_t client_pool;
+
+// Statistics of tunnels that have been closed
+static tunnel_stats_t tunnel_stats_closed;
+
+static uint32_t socket_server_now() {
+    return esp_timer_get_time() / 1000;
+}
+
+static void socket_client_tunnel_output(void *ctx, const uint8_t *packet, size_t length) {
+    socket_client_t *client = ctx;
+
+    // Lost datagrams are recovered by the tunnel, never wait for buffer space
+    int sent = send(client->socket, packet, length, MSG_DONTWAIT);
+    if (sent > 0) stream_stats_increment(stream_stats, 0, sent);
+}
+
+static void socket_client_tunnel_deliver(void *ctx, const uint8_t *data, size_t length) {
+    socket_client_t *client = ctx;
+
+    router_dispatch(client->router, data, length);
+
+    stream_stats_increment(stream_stats, length, 0);
+}
+
+static void socket_client_receive(socket_client_t *client, char *data, size_t length) {
+    if (client->tunnel != NULL && tunnel_receive(client->tunnel, (uint8_t *) data, length, socket_server_now())) return;
+
+    stream_stats_increment(stream_stats, length, 0);
+
+    router_dispatch(client->router, data, length);
+}
 
 static bool socket_address_equal(struct sockaddr_in6 *a, struct sockaddr_in6 *b) {
     if (a->sin6_family != b->sin6_family) return false;
@@ -64,13 +147,41 @@ static bool socket_address_equal(struct sockaddr_in6 *a, struct sockaddr_in6 *b)
     }
 }
 
+static void socket_client_ready(void *ctx, int sock, uint8_t events);
+
 static socket_client_t * socket_client_add(int sock, struct sockaddr_in6 addr, int socktype) {
-    socket_client_t *client = malloc(sizeof(socket_client_t));
+    socket_client_t *client = pool_alloc(client_pool, sizeof(socket_client_t));
+    ERROR_ACTION(TAG, client == NULL, destroy_socket(&sock); return NULL, "Could not allocate %s client", SOCKTYPE_NAME(socktype))
     *client = (socket_client_t) {
             .socket = sock,
             .addr = addr,
             .type = socktype
     };
+    send_buffer_init(&client->output, CLIENT_OUTPUT_SIZE);
+
+    client->router = router_context_new(ROUTER_SOURCE_SOCKET_SERVER);
+    ERROR_ACTION(TAG, client->router == NULL, destroy_socket(&sock); pool_release(client); return NULL,
+            "Could not allocate routing context for %s client", SOCKTYPE_NAME(socktype))
+
+    client->watch = reactor_watch_new(sock, REACTOR_READ, socket_client_ready, client);
+    ERROR_ACTION(TAG, client->watch == NULL, {
+        router_context_delete(client->router);
+        destroy_socket(&sock);
+        pool_release(client);
+        return NULL;
+    }, "Could not watch %s client", SOCKTYPE_NAME(socktype))
+
+    if (socktype == SOCK_DGRAM && tunnel_active) {
+        if (tunnel_peers < TUNNEL_PEERS_MAX) {
+            client->tunnel = tunnel_create(&tunnel_config, socket_client_tunnel_output, socket_client_tunnel_deliver, client);
+        }
+
+        if (client->tunnel != NULL) {
+            tunnel_peers++;
+        } else {
+            ESP_LOGW(TAG, "No tunnel for UDP client %s, %d tunnels in use", sockaddrtostr((struct sockaddr *) &addr), tunnel_peers);
+        }
+    }
 
     SLIST_INSERT_HEAD(&socket_client_list, client, next);
 
@@ -88,25 +199,104 @@ static void socket_client_remove(socket_client_t *socket_client) {
     ESP_LOGI(TAG, "Disconnected %s client %s", SOCKTYPE_NAME(socket_client->type), addr_str);
     uart_nmea("$PESP,SOCK,SRV,%s,DISCONNECTED,%s", SOCKTYPE_NAME(socket_client->type), addr_str);
 
+    reactor_watch_delete(socket_client->watch);
     destroy_socket(&socket_client->socket);
+    send_buffer_free(&socket_client->output);
+    router_context_delete(socket_client->router);
+
+    if (socket_client->tunnel != NULL) {
+        tunnel_stats_t stats;
+        tunnel_stats(socket_client->tunnel, &stats);
+        tunnel_stats_add(&tunnel_stats_closed, &stats);
+        tunnel_destroy(socket_client->tunnel);
+        tunnel_peers--;
+    }
 
     SLIST_REMOVE(&socket_client_list, socket_client, socket_client_t, next);
-    free(socket_client);
+    pool_release(socket_client);
 
     if (status_led != NULL && SLIST_EMPTY(&socket_client_list)) status_led->flashing_mode = STATUS_LED_STATIC;
 }
 
-static void socket_server_uart_handler(void* handler_args, esp_event_base_t base, int32_t length, void* buf) {
+// Removes closed clients and watches those with queued output for space to send it
+static void socket_server_update(void *ctx) {
+    update_pending = false;
+
+    xSemaphoreTake(client_lock, portMAX_DELAY);
     socket_client_t *client, *client_tmp;
     SLIST_FOREACH_SAFE(client, &socket_client_list, next, client_tmp) {
-        int sent = write(client->socket, buf, length);
+        if (client->closed) {
+            socket_client_remove(client);
+            continue;
+        }
+
+        client->armed = send_buffer_pending(&client->output);
+        reactor_watch_events(client->watch, REACTOR_READ | (client->armed ? REACTOR_WRITE : 0));
+    }
+    xSemaphoreGive(client_lock);
+}
+
+static void socket_server_update_schedule() {
+    if (update_pending) return;
+    update_pending = true;
+    if (!reactor_call(socket_server_update, NULL)) update_pending = false;
+}
+
+// Watches can only be changed on the reactor, the client is skipped until it is removed there
+static void socket_client_close(socket_client_t *client) {
+    client->closed = true;
+    socket_server_update_schedule();
+}
+
+static void socket_server_uart_handler(const void *buf, size_t length) {
+    if (client_lock == NULL) return;
+    xSemaphoreTake(client_lock, portMAX_DELAY);
+
+    struct iovec iov = {(void *) buf, length};
+    int64_t now = esp_timer_get_time();
+
+    socket_client_t *client;
+    SLIST_FOREACH(client, &socket_client_list, next) {
+        if (client->closed) continue;
+
+        if (client->tunnel != NULL) {
+            tunnel_send(client->tunnel, buf, length, socket_server_now());
+            continue;
+        }
+
+        // Datagrams that don't fit are lost like any other
+        if (client->type == SOCK_DGRAM) {
+            int sent = send(client->socket, buf, length, MSG_DONTWAIT);
+            if (sent > 0) stream_stats_increment(stream_stats, 0, sent);
+            continue;
+        }
+
+        // Never waits, what a client does not take is queued and sent once its socket is writable
+        uint32_t dropped = client->output.dropped;
+        int sent = send_buffer_write(&client->output, client->socket, &iov, 1);
         if (sent < 0) {
             ESP_LOGE(TAG, "Could not write to %s socket: %d %s", SOCKTYPE_NAME(client->type), errno, strerror(errno));
-            socket_client_remove(client);
-        } else {
-            stream_stats_increment(stream_stats, 0, sent);
+            socket_client_close(client);
+            continue;
         }
+
+        if (!send_buffer_pending(&client->output)) {
+            client->stalled_since = 0;
+        } else if (sent > 0 || client->stalled_since == 0) {
+            client->stalled_since = now;
+        } else if (stall_timeout > 0 && now - client->stalled_since > stall_timeout) {
+            ESP_LOGW(TAG, "%s client has not accepted data for %llds, disconnecting", SOCKTYPE_NAME(client->type),
+                    (now - client->stalled_since) / 1000000);
+            socket_client_close(client);
+            continue;
+        }
+
+        if (send_buffer_pending(&client->output) && !client->armed) socket_server_update_schedule();
+
+        if (client->output.dropped == dropped) stream_stats_increment(stream_stats, 0, length);
     }
+
+    xSemaphoreGive(client_lock);
 }
 
 static int socket_init(int socktype, int port) {
@@ -126,6 +316,8 @@ static int socket_init(int socktype, int port) {
     err = bind(sock, (struct sockaddr *)&srv_addr, sizeof(srv_addr));
     ERROR_ACTION(TAG, err != 0, close(sock); return -1, "Could not bind %s socket: %d %s", SOCKTYPE_NAME(socktype), errno, strerror(errno))
 
+    socket_budget_acquire(sock, SOCKET_BUDGET_SOCKET_SERVER);
+
     ESP_LOGI(TAG, "%s socket listening on port %d", SOCKTYPE_NAME(socktype), port);
     uart_nmea("$PESP,SOCK,SRV,%s,BIND,%d", SOCKTYPE_NAME(socktype), port);
 
@@ -150,6 +342,12 @@ static esp_err_t socket_tcp_accept() {
     int sock = accept(sock_tcp, (struct sockaddr *)&source_addr, &addr_len);
     ERROR_ACTION(TAG, sock < 0, return ESP_FAIL, "Could not accept new TCP connection: %d %s", errno, strerror(errno))
 
+    ERROR_ACTION(TAG, !socket_budget_acquire(sock, SOCKET_BUDGET_SOCKET_SERVER), destroy_socket(&sock); return ESP_OK,
+            "TCP connection from %s refused, no sockets available", sockaddrtostr((struct sockaddr *) &source_addr))
+
+    // Detect clients that disappear without closing the connection
+    socket_keepalive(sock);
+
     socket_client_add(sock, source_addr, SOCK_STREAM);
     return ESP_OK;
 }
@@ -161,40 +359,44 @@ static esp_err_t socket_udp_init() {
     return sock_udp < 0 ? ESP_FAIL : ESP_OK;
 }
 
-static bool socket_udp_has_client(struct sockaddr_in6 *source_addr) {
+static socket_client_t *socket_udp_find_client(struct sockaddr_in6 *source_addr) {
     socket_client_t *client;
     SLIST_FOREACH(client, &socket_client_list, next) {
         if (client->type != SOCK_DGRAM) continue;
 
         struct sockaddr_in6 *client_addr = ((struct sockaddr_in6 *) &client->addr);
 
-        if (socket_address_equal(source_addr, client_addr)) return true;
+        if (socket_address_equal(source_addr, client_addr)) return client;
     }
 
-    return false;
+    return NULL;
 }
 
-static esp_err_t socket_udp_client_accept(struct sockaddr_in6 source_addr) {
-    if (socket_udp_has_client(&source_addr)) return ESP_OK;
+static socket_client_t *socket_udp_client_accept(struct sockaddr_in6 source_addr) {
+    socket_client_t *client = socket_udp_find_client(&source_addr);
+    if (client != NULL) return client;
 
     int sock = socket(PF_INET6, SOCK_DGRAM, 0);
-    ERROR_ACTION(TAG, sock < 0, return sock, "Could not create client UDP socket: %d %s", errno, strerror(errno))
+    ERROR_ACTION(TAG, sock < 0, return NULL, "Could not create client UDP socket: %d %s", errno, strerror(errno))
+
+    // Data from refused clients is still forwarded, there is just no socket to reply on
+    ERROR_ACTION(TAG, !socket_budget_acquire(sock, SOCKET_BUDGET_SOCKET_SERVER), destroy_socket(&sock); return NULL,
+            "UDP client %s refused, no sockets available", sockaddrtostr((struct sockaddr *) &source_addr))
 
     int reuse = 1;
     int err = setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
-    ERROR_ACTION(TAG, err != 0, destroy_socket(&sock); return err, "Could not set client UDP socket options: %d %s", errno, strerror(errno))
+    ERROR_ACTION(TAG, err != 0, destroy_socket(&sock); return NULL, "Could not set client UDP socket options: %d %s", errno, strerror(errno))
 
     struct sockaddr_in6 server_addr;
     socklen_t socklen = sizeof(server_addr);
     getsockname(sock_udp, (struct sockaddr *)&server_addr, &socklen);
     err = bind(sock, (struct sockaddr *)&server_addr, sizeof(server_addr));
-    ERROR_ACTION(TAG, err != 0, destroy_socket(&sock); return err, "Could not bind client UDP socket: %d %s", errno, strerror(errno))
+    ERROR_ACTION(TAG, err != 0, destroy_socket(&sock); return NULL, "Could not bind client UDP socket: %d %s", errno, strerror(errno))
 
     err = connect(sock, (struct sockaddr *)&source_addr, sizeof(source_addr));
-    ERROR_ACTION(TAG, err != 0, destroy_socket(&sock); return err, "Could not connect client UDP socket: %d %s", errno, strerror(errno))
+    ERROR_ACTION(TAG, err != 0, destroy_socket(&sock); return NULL, "Could not connect client UDP socket: %d %s", errno, strerror(errno))
 
-    socket_client_add(sock, source_addr, SOCK_DGRAM);
-    return ESP_OK;
+    return socket_client_add(sock, source_addr, SOCK_DGRAM);
 }
 
 static esp_err_t socket_udp_accept() {
@@ -205,11 +407,15 @@ static esp_err_t socket_udp_accept() {
     int len;
     while ((len = recvfrom(sock_udp, buffer, BUFFER_SIZE, MSG_DONTWAIT, (struct sockaddr *)&source_addr, &socklen)) > 0) {
         // Multiple connections could have been made at once, so accept for every receive just in case
-        socket_udp_client_accept(source_addr);
+        socket_client_t *client = socket_udp_client_accept(source_addr);
 
-        stream_stats_increment(stream_stats, len, 0);
+        if (client != NULL) {
+            socket_client_receive(client, buffer, len);
+        } else {
+            stream_stats_increment(stream_stats, len, 0);
 
-        uart_write(buffer, len);
+            router_dispatch(refused_router, buffer, len);
+        }
     }
 
     // Error occurred during receiving
@@ -221,88 +427,163 @@ static esp_err_t socket_udp_accept() {
     return ESP_OK;
 }
 
-static void socket_clients_receive(fd_set *socket_set) {
-    socket_client_t *client, *client_tmp;
-    SLIST_FOREACH_SAFE(client, &socket_client_list, next, client_tmp) {
-        if (!FD_ISSET(client->socket, socket_set)) continue;
+// Handles tunnel timeouts, returns milliseconds until the next one or -1 if there are none
+static int socket_clients_poll() {
+    int next = -1;
 
+    socket_client_t *client;
+    SLIST_FOREACH(client, &socket_client_list, next) {
+        if (client->tunnel == NULL) continue;
+
+        int client_next = tunnel_poll(client->tunnel, socket_server_now());
+        if (client_next >= 0 && (next < 0 || client_next < next)) next = client_next;
+    }
+
+    return next;
+}
+
+// Wake up in time for tunnel retransmission requests and reordering timeouts, called holding the client lock
+static void socket_server_tunnel_schedule() {
+    int next = socket_clients_poll();
+    if (next >= 0) {
+        reactor_timer_start(tunnel_timer, next);
+    } else {
+        reactor_timer_stop(tunnel_timer);
+    }
+}
+
+static void socket_server_tunnel_timeout(void *ctx) {
+    xSemaphoreTake(client_lock, portMAX_DELAY);
+    socket_server_tunnel_schedule();
+    xSemaphoreGive(client_lock);
+}
+
+static void socket_client_ready(void *ctx, int sock, uint8_t events) {
+    socket_client_t *client = ctx;
+
+    xSemaphoreTake(client_lock, portMAX_DELAY);
+
+    bool remove = false;
+    if (events & REACTOR_WRITE) {
+        int sent = send_buffer_flush(&client->output, client->socket);
+        if (sent < 0) {
+            remove = true;
+        } else if (!send_buffer_pending(&client->output)) {
+            client->stalled_since = 0;
+            client->armed = false;
+            reactor_watch_events(client->watch, REACTOR_READ);
+        } else if (sent > 0) {
+            client->stalled_since = esp_timer_get_time();
+        }
+    }
+
+    if (!remove && (events & REACTOR_READ)) {
         // Receive until nothing left to receive
         int len;
         while ((len = recv(client->socket, buffer, BUFFER_SIZE, MSG_DONTWAIT)) > 0) {
-            stream_stats_increment(stream_stats, len, 0);
-
-            uart_write(buffer, len);
+            socket_client_receive(client, buffer, len);
         }
 
-        // Remove on error
-        if (len < 0 && errno != EWOULDBLOCK) {
-            socket_client_remove(client);
-        }
+        // Remove on error, or when a TCP client closes the connection
+        remove = (len < 0 && errno != EWOULDBLOCK) || (len == 0 && client->type == SOCK_STREAM);
     }
-}
 
-static void socket_server_task(void *ctx) {
-    uart_register_read_handler(socket_server_uart_handler);
+    if (remove) socket_client_remove(client);
 
-    config_color_t status_led_color = config_get_color(CONF_ITEM(KEY_CONFIG_SOCKET_SERVER_COLOR));
-    if (status_led_color.rgba != 0) status_led = status_led_add(status_led_color.rgba, STATUS_LED_STATIC, 500, 2000, 0);
+    socket_server_tunnel_schedule();
 
-    stream_stats = stream_stats_new("socket_server");
+    xSemaphoreGive(client_lock);
+}
+
+static void socket_server_accept(void *ctx, int sock, uint8_t events) {
+    xSemaphoreTake(client_lock, portMAX_DELAY);
 
-    while (true) {
-        SLIST_INIT(&socket_client_list);
+    if (sock == sock_tcp) {
+        socket_tcp_accept();
+    } else {
+        socket_udp_accept();
+        socket_server_tunnel_schedule();
+    }
 
-        socket_tcp_init();
-        socket_udp_init();
+    xSemaphoreGive(client_lock);
+}
 
-        // Accept/receive loop
-        buffer = malloc(BUFFER_SIZE);
-        fd_set socket_set;
-        while (true) {
-            // Reset all selected
-            FD_ZERO(&socket_set);
+void socket_server_tunnel_stats(tunnel_stats_t *stats) {
+    *stats = (tunnel_stats_t) {0};
+    if (client_lock == NULL) return;
 
-            // New TCP/UDP connections
-            FD_SET(sock_tcp, &socket_set);
-            FD_SET(sock_udp, &socket_set);
+    xSemaphoreTake(client_lock, portMAX_DELAY);
 
-            int maxfd = MAX(sock_tcp, sock_udp);
+    *stats = tunnel_stats_closed;
+    socket_client_t *client;
+    SLIST_FOREACH(client, &socket_client_list, next) {
+        if (client->tunnel == NULL) continue;
 
-            // Existing connections
-            socket_client_t *client;
-            SLIST_FOREACH(client, &socket_client_list, next) {
-                FD_SET(client->socket, &socket_set);
-                maxfd = MAX(maxfd, client->socket);
-            }
+        tunnel_stats_t client_stats;
+        tunnel_stats(client->tunnel, &client_stats);
+        tunnel_stats_add(stats, &client_stats);
+    }
 
-            // Wait for activity on one of selected
-            int err = select(maxfd + 1, &socket_set, NULL, NULL, NULL);
-            ERROR_ACTION(TAG, err < 0, goto _error, "Could not select socket to receive from: %d %s", errno, strerror(errno))
+    xSemaphoreGive(client_lock);
+}
 
-            // Accept new connections
-            if (FD_ISSET(sock_tcp, &socket_set)) socket_tcp_accept();
-            if (FD_ISSET(sock_udp, &socket_set)) socket_udp_accept();
+bool socket_server_tunnel_active() {
+    return tunnel_active;
+}
 
-            // Receive from existing connections
-            socket_clients_receive(&socket_set);
-        }
+static void socket_server_start(void *ctx) {
+    if (restart_timer == NULL) {
+        restart_timer = reactor_timer_new(socket_server_start, NULL);
+        tunnel_timer = reactor_timer_new(socket_server_tunnel_timeout, NULL);
+    }
+    ERROR_ACTION(TAG, restart_timer == NULL || tunnel_timer == NULL, return, "Could not create timers")
 
-        _error:
+    if (socket_tcp_init() != ESP_OK || socket_udp_init() != ESP_OK) {
         destroy_socket(&sock_tcp);
         destroy_socket(&sock_udp);
-        socket_client_t *client, *client_tmp;
-        SLIST_FOREACH_SAFE(client, &socket_client_list, next, client_tmp) {
-            destroy_socket(&client->socket);
-            SLIST_REMOVE(&socket_client_list, client, socket_client_t, next);
-            free(client);
-        }
 
-        free(buffer);
+        reactor_timer_start(restart_timer, RESTART_DELAY);
+        return;
     }
+
+    // Accept new connections, clients are watched as they are added
+    reactor_watch_handle_t watch_tcp = reactor_watch_new(sock_tcp, REACTOR_READ, socket_server_accept, NULL);
+    reactor_watch_handle_t watch_udp = reactor_watch_new(sock_udp, REACTOR_READ, socket_server_accept, NULL);
+    ERROR_ACTION(TAG, watch_tcp == NULL || watch_udp == NULL, {
+        reactor_watch_delete(watch_tcp);
+        reactor_watch_delete(watch_udp);
+        destroy_socket(&sock_tcp);
+        destroy_socket(&sock_udp);
+        reactor_timer_start(restart_timer, RESTART_DELAY);
+    }, "Could not watch listening sockets")
 }
 
 void socket_server_init() {
     if (!config_get_bool1(CONF_ITEM(KEY_CONFIG_SOCKET_SERVER_ACTIVE))) return;
 
-    xTaskCreate(socket_server_task, "socket_server_task", 4096, NULL, TASK_PRIORITY_INTERFACE, NULL);
-}
\ No newline at end of file
+    socket_budget_enable(SOCKET_BUDGET_SOCKET_SERVER);
+
+    tunnel_active = config_get_bool1(CONF_ITEM(KEY_CONFIG_SOCKET_SERVER_TUNNEL));
+    tunnel_config = (tunnel_config_t) {
+            .fec_group = config_get_u8(CONF_ITEM(KEY_CONFIG_SOCKET_SERVER_FEC)),
+            .reorder_timeout = TUNNEL_REORDER_TIMEOUT,
+            .nack_interval = TUNNEL_NACK_INTERVAL
+    };
+    stall_timeout = config_get_u16(CONF_ITEM(KEY_CONFIG_TCP_STALL_TIMEOUT)) * 1000000LL;
+
+    SLIST_INIT(&socket_client_list);
+    client_pool = pool_new("socket_server_clients", sizeof(socket_client_t), CLIENT_POOL_COUNT);
+    buffer = malloc(BUFFER_SIZE);
+
+    client_lock = xSemaphoreCreateMutex();
+    router_register_sink(ROUTER_SINK_SOCKET_SERVER, socket_server_uart_handler);
+    refused_router = router_context_new(ROUTER_SOURCE_SOCKET_SERVER);
+    if (refused_router == NULL) ESP_LOGE(TAG, "Could not allocate routing context for refused UDP clients");
+
+    config_color_t status_led_color = config_get_color(CONF_ITEM(KEY_CONFIG_SOCKET_SERVER_COLOR));
+    if (status_led_color.rgba != 0) status_led = status_led_add(status_led_color.rgba, STATUS_LED_STATIC, 500, 2000, 0);
+
+    stream_stats = stream_stats_new("socket_server");
+
+    ERROR_ACTION(TAG, !reactor_call(socket_server_start, NULL), return, "Could not start on reactor")
+}
@@ -23,6 +23,9 @@
 #include <core_dump.h>
 #include <esp_ota_ops.h>
 #include <stream_stats.h>
+#include <dns_cache.h>
+#include <reactor.h>
+#include <router.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "esp_system.h"
@@ -122,10 +125,14 @@ void app_main()
 
 
     net_init();
+    dns_cache_init();
+    reactor_init();
+    router_init();
     wifi_init();
 
     web_server_init();
 
+    ntrip_request_init();
     ntrip_caster_init();
     ntrip_server_init();
     ntrip_client_init();
@@ -0,0 +1,161 @@
+/*
+ * This file is part of the ESP32-XBee distribution (https://github.com/nebkat/esp32-xbee).
+ * Copyright (c) 2020 Nebojsa Cvetkovic.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <freertos/FreeRTOS.h>
+#include <sys/queue.h>
+#include "pool.h"
+
+typedef struct pool_block {
+    pool_handle_t pool;
+    uint8_t references;
+    // Blocks allocated when the pool could not serve the request are freed instead of returned
+    bool heap;
+
+    SLIST_ENTRY(pool_block) next;
+    uint8_t data[] __attribute__((aligned(8)));
+} pool_block_t;
+
+struct pool {
+    const char *name;
+    size_t size;
+    uint16_t count;
+
+    uint16_t used;
+    uint16_t peak;
+    uint32_t exhausted;
+    uint32_t failures;
+
+    SLIST_HEAD(pool_block_list_t, pool_block) free;
+    SLIST_ENTRY(pool) next;
+};
+
+static SLIST_HEAD(pool_list_t, pool) pool_list = SLIST_HEAD_INITIALIZER(pool_list);
+
+// Blocks are allocated, retained and released from every task and the UART handlers
+static portMUX_TYPE pool_lock = portMUX_INITIALIZER_UNLOCKED;
+
+#define POOL_BLOCK(data) ((pool_block_t *) ((uint8_t *) (data) - offsetof(pool_block_t, data)))
+
+pool_handle_t pool_new(const char *name, size_t size, uint16_t count) {
+    // Blocks start on 8 byte boundaries, like anything returned by malloc
+    size_t header = (sizeof(struct pool) + 7) & ~7;
+    size_t stride = (sizeof(pool_block_t) + size + 7) & ~7;
+
+    pool_handle_t pool = malloc(header + count * stride);
+    if (pool == NULL) return NULL;
+
+    *pool = (struct pool) {
+            .name = name,
+            .size = size,
+            .count = count
+    };
+
+    SLIST_INIT(&pool->free);
+    uint8_t *blocks = (uint8_t *) pool + header;
+    for (int i = 0; i < count; i++) {
+        pool_block_t *block = (pool_block_t *) (blocks + i * stride);
+        block->pool = pool;
+        block->heap = false;
+        SLIST_INSERT_HEAD(&pool->free, block, next);
+    }
+
+    // Pools are only created during init, before any are listed
+    SLIST_INSERT_HEAD(&pool_list, pool, next);
+
+    return pool;
+}
+
+void *pool_alloc(pool_handle_t pool, size_t size) {
+    pool_block_t *block = NULL;
+
+    portENTER_CRITICAL(&pool_lock);
+    if (pool != NULL && size <= pool->size) block = SLIST_FIRST(&pool->free);
+    if (block != NULL) {
+        SLIST_REMOVE_HEAD(&pool->free, next);
+        pool->used++;
+        if (pool->used > pool->peak) pool->peak = pool->used;
+    } else if (pool != NULL) {
+        pool->exhausted++;
+    }
+    portEXIT_CRITICAL(&pool_lock);
+
+    if (block == NULL) {
+        block = malloc(sizeof(pool_block_t) + size);
+        if (block == NULL) {
+            portENTER_CRITICAL(&pool_lock);
+            if (pool != NULL) pool->failures++;
+            portEXIT_CRITICAL(&pool_lock);
+
+            return NULL;
+        }
+
+        block->pool = pool;
+        block->heap = true;
+    }
+
+    block->references = 1;
+
+    return block->data;
+}
+
+void pool_retain(void *data) {
+    pool_block_t *block = POOL_BLOCK(data);
+
+    portENTER_CRITICAL(&pool_lock);
+    block->references++;
+    portEXIT_CRITICAL(&pool_lock);
+}
+
+void pool_release(void *data) {
+    if (data == NULL) return;
+
+    pool_block_t *block = POOL_BLOCK(data);
+
+    portENTER_CRITICAL(&pool_lock);
+    bool last = --block->references == 0;
+    if (last && !block->heap) {
+        SLIST_INSERT_HEAD(&block->pool->free, block, next);
+        block->pool->used--;
+    }
+    portEXIT_CRITICAL(&pool_lock);
+
+    if (last && block->heap) free(block);
+}
+
+void pool_stats(pool_handle_t pool, pool_stats_t *stats) {
+    portENTER_CRITICAL(&pool_lock);
+    *stats = (pool_stats_t) {
+            .name = pool->name,
+            .size = pool->size,
+            .count = pool->count,
+            .used = pool->used,
+            .peak = pool->peak,
+            .exhausted = pool->exhausted,
+            .failures = pool->failures
+    };
+    portEXIT_CRITICAL(&pool_lock);
+}
+
+pool_handle_t pool_first() {
+    return SLIST_FIRST(&pool_list);
+}
+
+pool_handle_t pool_next(pool_handle_t pool) {
+    return SLIST_NEXT(pool, next);
+}
@@ -0,0 +1,339 @@
+/*
+ * This file is part of the ESP32-XBee distribution (https://github.com/nebkat/esp32-xbee).
+ * Copyright (c) 2020 Nebojsa Cvetkovic.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdbool.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+
+#include "protocol/http.h"
+
+// Largest chunk size accepted, anything bigger is treated as a framing error
+#define HTTP_CHUNK_SIZE_MAX 0x1000000u
+
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+void http_chunked_init(http_chunked_t *chunked) {
+    *chunked = (http_chunked_t) {
+            .state = HTTP_CHUNKED_SIZE,
+            .remaining = 0
+    };
+}
+
+int http_chunked_decode(http_chunked_t *chunked, char *buffer, size_t length, http_chunked_data_handler_t handler, void *ctx) {
+    size_t i = 0;
+    while (i < length) {
+        char c = buffer[i];
+
+        switch (chunked->state) {
+            case HTTP_CHUNKED_SIZE: {
+                int value = hex_value(c);
+                if (value >= 0) {
+                    chunked->remaining = (chunked->remaining << 4u) | (uint32_t) value;
+                    if (chunked->remaining >= HTTP_CHUNK_SIZE_MAX) chunked->state = HTTP_CHUNKED_ERROR;
+                } else if (c == ';' || c == ' ' || c == '\t') {
+                    chunked->state = HTTP_CHUNKED_EXTENSION;
+                } else if (c == '\r') {
+                    chunked->state = HTTP_CHUNKED_SIZE_LF;
+                } else if (c == '\n') {
+                    // Tolerate bare LF line endings
+                    chunked->state = chunked->remaining == 0 ? HTTP_CHUNKED_TRAILER : HTTP_CHUNKED_DATA;
+                } else {
+                    chunked->state = HTTP_CHUNKED_ERROR;
+                }
+                i++;
+                break;
+            }
+            case HTTP_CHUNKED_EXTENSION:
+                // Chunk extensions are ignored
+                if (c == '\r') chunked->state = HTTP_CHUNKED_SIZE_LF;
+                if (c == '\n') chunked->state = chunked->remaining == 0 ? HTTP_CHUNKED_TRAILER : HTTP_CHUNKED_DATA;
+                i++;
+                break;
+            case HTTP_CHUNKED_SIZE_LF:
+                if (c != '\n') {
+                    chunked->state = HTTP_CHUNKED_ERROR;
+                    break;
+                }
+                chunked->state = chunked->remaining == 0 ? HTTP_CHUNKED_TRAILER : HTTP_CHUNKED_DATA;
+                i++;
+                break;
+            case HTTP_CHUNKED_DATA: {
+                // Pass payload through without copying
+                size_t available = length - i;
+                size_t data_length = available < chunked->remaining ? available : chunked->remaining;
+                handler(ctx, buffer + i, data_length);
+
+                chunked->remaining -= data_length;
+                if (chunked->remaining == 0) chunked->state = HTTP_CHUNKED_DATA_CR;
+                i += data_length;
+                break;
+            }
+            case HTTP_CHUNKED_DATA_CR:
+                if (c == '\r') {
+                    chunked->state = HTTP_CHUNKED_DATA_LF;
+                } else if (c == '\n') {
+                    chunked->state = HTTP_CHUNKED_SIZE;
+                } else {
+                    chunked->state = HTTP_CHUNKED_ERROR;
+                    break;
+                }
+                i++;
+                break;
+            case HTTP_CHUNKED_DATA_LF:
+                if (c != '\n') {
+                    chunked->state = HTTP_CHUNKED_ERROR;
+                    break;
+                }
+                chunked->state = HTTP_CHUNKED_SIZE;
+                i++;
+                break;
+            case HTTP_CHUNKED_TRAILER:
+                // Empty line ends the message, otherwise skip trailer header
+                if (c == '\r') {
+                    chunked->state = HTTP_CHUNKED_TRAILER_LF;
+                } else if (c == '\n') {
+                    chunked->state = HTTP_CHUNKED_DONE;
+                } else {
+                    chunked->state = HTTP_CHUNKED_TRAILER_LINE;
+                }
+                i++;
+                break;
+            case HTTP_CHUNKED_TRAILER_LINE:
+                if (c == '\n') chunked->state = HTTP_CHUNKED_TRAILER;
+                i++;
+                break;
+            case HTTP_CHUNKED_TRAILER_LF:
+                if (c != '\n') {
+                    chunked->state = HTTP_CHUNKED_ERROR;
+                    break;
+                }
+                chunked->state = HTTP_CHUNKED_DONE;
+                i++;
+                break;
+            case HTTP_CHUNKED_DONE:
+                return HTTP_CHUNKED_RESULT_DONE;
+            case HTTP_CHUNKED_ERROR:
+            default:
+                return HTTP_CHUNKED_RESULT_ERROR;
+        }
+    }
+
+    if (chunked->state == HTTP_CHUNKED_ERROR) return HTTP_CHUNKED_RESULT_ERROR;
+    if (chunked->state == HTTP_CHUNKED_DONE) return HTTP_CHUNKED_RESULT_DONE;
+    return HTTP_CHUNKED_RESULT_MORE;
+}
+
+void http_parser_init(http_parser_t *parser, http_parser_type_t type) {
+    memset(parser, 0, sizeof(*parser));
+    parser->type = type;
+    parser->state = HTTP_PARSER_START_LINE;
+}
+
+static http_span_t http_span_trim(const char *buffer, size_t start, size_t end) {
+    while (start < end && (buffer[start] == ' ' || buffer[start] == '\t')) start++;
+    while (end > start && (buffer[end - 1] == ' ' || buffer[end - 1] == '\t')) end--;
+
+    return (http_span_t) {
+            .offset = start,
+            .length = end - start
+    };
+}
+
+static void http_parser_parse_start_line(http_parser_t *parser, const char *buffer, size_t start, size_t end) {
+    // First two tokens are split on spaces, the rest of the line is the last
+    for (int i = 0; i < 3; i++) {
+        while (start < end && buffer[start] == ' ') start++;
+
+        size_t token_end = end;
+        if (i < 2) {
+            token_end = start;
+            while (token_end < end && buffer[token_end] != ' ') token_end++;
+        }
+
+        parser->start_line[i] = http_span_trim(buffer, start, token_end);
+        start = token_end;
+    }
+
+    if (parser->type != HTTP_PARSER_RESPONSE) return;
+
+    const http_span_t *status = &parser->start_line[HTTP_RESPONSE_STATUS];
+    parser->status = 0;
+    if (status->length != 3) return;
+
+    for (int i = 0; i < 3; i++) {
+        char c = buffer[status->offset + i];
+        if (!isdigit((unsigned char) c)) {
+            parser->status = 0;
+            return;
+        }
+
+        parser->status = parser->status * 10 + (c - '0');
+    }
+}
+
+static void http_parser_header_line(http_parser_t *parser, const char *buffer, size_t start, size_t end) {
+    // Extra headers and lines without a colon are ignored
+    if (parser->header_count >= HTTP_HEADERS_MAX) return;
+
+    const char *colon = memchr(buffer + start, ':', end - start);
+    if (colon == NULL) return;
+
+    size_t separator = colon - buffer;
+    http_header_t *header = &parser->headers[parser->header_count++];
+    header->name = http_span_trim(buffer, start, separator);
+    header->value = http_span_trim(buffer, separator + 1, end);
+}
+
+// Responses such as "ICY 200 OK" or "ERROR - Bad Password" may have no headers, data may follow directly
+static bool http_parser_headerless(const http_parser_t *parser, const char *buffer) {
+    if (parser->type != HTTP_PARSER_RESPONSE) return false;
+
+    const http_span_t *version = &parser->start_line[HTTP_RESPONSE_VERSION];
+    if (version->length >= 5 && strncasecmp(buffer + version->offset, "HTTP/", 5) == 0) return false;
+    if (http_span_equals(buffer, version, "SOURCETABLE")) return false;
+
+    return true;
+}
+
+static bool http_text(unsigned char c) {
+    return (c >= ' ' && c < 0x7F) || c == '\t';
+}
+
+// Header lines are printable text with a colon, anything else after a headerless status line is data
+static bool http_parser_header_text(const char *buffer, size_t start, size_t end) {
+    bool colon = false;
+    for (size_t i = start; i < end; i++) {
+        if (!http_text(buffer[i])) return false;
+        if (buffer[i] == ':') colon = true;
+    }
+
+    return colon;
+}
+
+static int http_parser_body(http_parser_t *parser, size_t body) {
+    parser->position = parser->line_start = parser->body = body;
+    parser->state = HTTP_PARSER_DONE;
+    return HTTP_PARSER_RESULT_DONE;
+}
+
+int http_parser_parse(http_parser_t *parser, const char *buffer, size_t length) {
+    if (parser->state == HTTP_PARSER_DONE) return HTTP_PARSER_RESULT_DONE;
+    if (parser->state == HTTP_PARSER_ERROR) return HTTP_PARSER_RESULT_ERROR;
+
+    // Spans are 16 bit
+    if (length > UINT16_MAX) {
+        parser->state = HTTP_PARSER_ERROR;
+        return HTTP_PARSER_RESULT_ERROR;
+    }
+
+    while (parser->position < length) {
+        // Data such as RTCM (0xD3) directly after a headerless status line
+        if (parser->headerless && parser->position == parser->line_start) {
+            char c = buffer[parser->position];
+            if (c != '\r' && c != '\n' && !http_text(c)) return http_parser_body(parser, parser->position);
+        }
+
+        const char *lf = memchr(buffer + parser->position, '\n', length - parser->position);
+        if (lf == NULL) {
+            parser->position = length;
+            return HTTP_PARSER_RESULT_MORE;
+        }
+
+        size_t start = parser->line_start;
+        size_t end = lf - buffer;
+        if (end > start && buffer[end - 1] == '\r') end--;
+
+        parser->position = parser->line_start = lf - buffer + 1;
+
+        if (parser->state == HTTP_PARSER_START_LINE) {
+            // Tolerate empty lines before the start line
+            if (end == start) continue;
+
+            http_parser_parse_start_line(parser, buffer, start, end);
+            parser->state = HTTP_PARSER_HEADERS;
+            parser->headerless = http_parser_headerless(parser, buffer);
+            continue;
+        }
+
+        // Empty line ends the headers
+        if (end == start) return http_parser_body(parser, parser->position);
+
+        // Text that is not a header is the start of the data
+        if (parser->headerless && !http_parser_header_text(buffer, start, end)) return http_parser_body(parser, start);
+
+        http_parser_header_line(parser, buffer, start, end);
+    }
+
+    // Casters may send "ICY 200 OK" alone and wait for data, only headers already started are waited for
+    if (parser->headerless && parser->header_count == 0 && parser->line_start == length) {
+        return http_parser_body(parser, length);
+    }
+
+    return HTTP_PARSER_RESULT_MORE;
+}
+
+http_span_t http_parser_start_line(const http_parser_t *parser) {
+    const http_span_t *first = &parser->start_line[0], *last = &parser->start_line[2];
+
+    return (http_span_t) {
+            .offset = first->offset,
+            .length = last->offset + last->length - first->offset
+    };
+}
+
+const http_span_t *http_parser_header(const http_parser_t *parser, const char *buffer, const char *name) {
+    for (int i = 0; i < parser->header_count; i++) {
+        if (http_span_equals(buffer, &parser->headers[i].name, name)) return &parser->headers[i].value;
+    }
+
+    return NULL;
+}
+
+bool http_span_equals(const char *buffer, const http_span_t *span, const char *str) {
+    if (span == NULL) return false;
+
+    return strlen(str) == span->length && strncasecmp(buffer + span->offset, str, span->length) == 0;
+}
+
+bool http_span_contains(const char *buffer, const http_span_t *span, const char *str) {
+    if (span == NULL) return false;
+
+    size_t length = strlen(str);
+    for (size_t i = 0; i + length <= span->length; i++) {
+        if (strncasecmp(buffer + span->offset + i, str, length) == 0) return true;
+    }
+
+    return false;
+}
+
+size_t http_span_copy(const char *buffer, const http_span_t *span, char *dest, size_t size) {
+    if (size == 0) return 0;
+
+    size_t length = span == NULL ? 0 : span->length;
+    if (length > size - 1) length = size - 1;
+
+    if (length > 0) memcpy(dest, buffer + span->offset, length);
+    dest[length] = '\0';
+
+    return length;
+}
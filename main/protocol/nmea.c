@@ -20,6 +20,7 @@
 #include <stdint.h>
 #include <string.h>
 #include <stdarg.h>
+#include <math.h>
 
 #include "protocol/nmea.h"
 
@@ -53,3 +54,82 @@ int nmea_vasprintf(char **strp, const char *fmt, va_list args) {
 
     return l;
 }
+
+int nmea_vsnprintf(char *str, size_t size, const char *fmt, va_list args) {
+    int l = vsnprintf(str, size, fmt, args);
+    if (l < 0) return l;
+
+    // Checksum and line ending
+    if (l + 5 >= size) return l + 5;
+
+    uint8_t checksum = nmea_calculate_checksum(str);
+    return l + snprintf(str + l, size - l, "*%02X\r\n", checksum);
+}
+
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    return -1;
+}
+
+// Converts [d]ddmm.mmmm with hemisphere to decimal degrees
+static bool nmea_parse_coordinate(const char *value, const char *hemisphere, double *degrees) {
+    char *end;
+    double raw = strtod(value, &end);
+    if (end == value || *end != ',') return false;
+
+    double whole = floor(raw / 100);
+    *degrees = whole + (raw - whole * 100) / 60;
+
+    if (*hemisphere == 'S' || *hemisphere == 'W') {
+        *degrees = -*degrees;
+    } else if (*hemisphere != 'N' && *hemisphere != 'E') {
+        return false;
+    }
+
+    return true;
+}
+
+bool nmea_gga_parse(const char *sentence, size_t length, nmea_gga_t *gga) {
+    // $xxGGA,time,lat,N/S,lon,E/W,quality,satellites,...*CS
+    if (length < 7 || length > NMEA_SENTENCE_LENGTH_MAX || sentence[0] != '$' || strncmp(sentence + 3, "GGA,", 4) != 0) {
+        return false;
+    }
+
+    const char *asterisk = memchr(sentence, '*', length);
+    if (asterisk == NULL || asterisk + 3 > sentence + length) return false;
+
+    uint8_t checksum = 0;
+    for (const char *c = sentence + 1; c < asterisk; c++) checksum ^= (uint8_t) *c;
+
+    int high = hex_value(asterisk[1]), low = hex_value(asterisk[2]);
+    if (high < 0 || low < 0 || checksum != (high << 4 | low)) return false;
+
+    // Locate start of the first 7 fields
+    const char *fields[8];
+    const char *c = sentence;
+    for (int i = 0; i < 8; i++) {
+        c = memchr(c, ',', asterisk - c);
+        if (c == NULL) return false;
+        fields[i] = ++c;
+    }
+
+    gga->fix_quality = atoi(fields[5]);
+    gga->satellites = atoi(fields[6]);
+    if (gga->fix_quality == 0) return true;
+
+    return nmea_parse_coordinate(fields[1], fields[2], &gga->latitude) &&
+           nmea_parse_coordinate(fields[3], fields[4], &gga->longitude);
+}
+
+// Equirectangular approximation in meters, accurate for the short distances between fixes
+double nmea_distance(double latitude1, double longitude1, double latitude2, double longitude2) {
+    const double earth_radius = 6371000;
+    const double radians = M_PI / 180;
+
+    double x = (longitude2 - longitude1) * radians * cos((latitude1 + latitude2) / 2 * radians);
+    double y = (latitude2 - latitude1) * radians;
+
+    return sqrt(x * x + y * y) * earth_radius;
+}
@@ -0,0 +1,172 @@
+/*
+ * This file is part of the ESP32-XBee distribution (https://github.com/nebkat/esp32-xbee).
+ * Copyright (c) 2020 Nebojsa Cvetkovic.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "protocol/rtcm.h"
+
+// CRC-24Q (polynomial 0x1864CFB) lookup table, one entry per leading byte
+static const uint32_t crc24q_table[256] = {
+    0x000000, 0x864CFB, 0x8AD50D, 0x0C99F6, 0x93E6E1, 0x15AA1A, 0x1933EC, 0x9F7F17,
+    0xA18139, 0x27CDC2, 0x2B5434, 0xAD18CF, 0x3267D8, 0xB42B23, 0xB8B2D5, 0x3EFE2E,
+    0xC54E89, 0x430272, 0x4F9B84, 0xC9D77F, 0x56A868, 0xD0E493, 0xDC7D65, 0x5A319E,
+    0x64CFB0, 0xE2834B, 0xEE1ABD, 0x685646, 0xF72951, 0x7165AA, 0x7DFC5C, 0xFBB0A7,
+    0x0CD1E9, 0x8A9D12, 0x8604E4, 0x00481F, 0x9F3708, 0x197BF3, 0x15E205, 0x93AEFE,
+    0xAD50D0, 0x2B1C2B, 0x2785DD, 0xA1C926, 0x3EB631, 0xB8FACA, 0xB4633C, 0x322FC7,
+    0xC99F60, 0x4FD39B, 0x434A6D, 0xC50696, 0x5A7981, 0xDC357A, 0xD0AC8C, 0x56E077,
+    0x681E59, 0xEE52A2, 0xE2CB54, 0x6487AF, 0xFBF8B8, 0x7DB443, 0x712DB5, 0xF7614E,
+    0x19A3D2, 0x9FEF29, 0x9376DF, 0x153A24, 0x8A4533, 0x0C09C8, 0x00903E, 0x86DCC5,
+    0xB822EB, 0x3E6E10, 0x32F7E6, 0xB4BB1D, 0x2BC40A, 0xAD88F1, 0xA11107, 0x275DFC,
+    0xDCED5B, 0x5AA1A0, 0x563856, 0xD074AD, 0x4F0BBA, 0xC94741, 0xC5DEB7, 0x43924C,
+    0x7D6C62, 0xFB2099, 0xF7B96F, 0x71F594, 0xEE8A83, 0x68C678, 0x645F8E, 0xE21375,
+    0x15723B, 0x933EC0, 0x9FA736, 0x19EBCD, 0x8694DA, 0x00D821, 0x0C41D7, 0x8A0D2C,
+    0xB4F302, 0x32BFF9, 0x3E260F, 0xB86AF4, 0x2715E3, 0xA15918, 0xADC0EE, 0x2B8C15,
+    0xD03CB2, 0x567049, 0x5AE9BF, 0xDCA544, 0x43DA53, 0xC596A8, 0xC90F5E, 0x4F43A5,
+    0x71BD8B, 0xF7F170, 0xFB6886, 0x7D247D, 0xE25B6A, 0x641791, 0x688E67, 0xEEC29C,
+    0x3347A4, 0xB50B5F, 0xB992A9, 0x3FDE52, 0xA0A145, 0x26EDBE, 0x2A7448, 0xAC38B3,
+    0x92C69D, 0x148A66, 0x181390, 0x9E5F6B, 0x01207C, 0x876C87, 0x8BF571, 0x0DB98A,
+    0xF6092D, 0x7045D6, 0x7CDC20, 0xFA90DB, 0x65EFCC, 0xE3A337, 0xEF3AC1, 0x69763A,
+    0x578814, 0xD1C4EF, 0xDD5D19, 0x5B11E2, 0xC46EF5, 0x42220E, 0x4EBBF8, 0xC8F703,
+    0x3F964D, 0xB9DAB6, 0xB54340, 0x330FBB, 0xAC70AC, 0x2A3C57, 0x26A5A1, 0xA0E95A,
+    0x9E1774, 0x185B8F, 0x14C279, 0x928E82, 0x0DF195, 0x8BBD6E, 0x872498, 0x016863,
+    0xFAD8C4, 0x7C943F, 0x700DC9, 0xF64132, 0x693E25, 0xEF72DE, 0xE3EB28, 0x65A7D3,
+    0x5B59FD, 0xDD1506, 0xD18CF0, 0x57C00B, 0xC8BF1C, 0x4EF3E7, 0x426A11, 0xC426EA,
+    0x2AE476, 0xACA88D, 0xA0317B, 0x267D80, 0xB90297, 0x3F4E6C, 0x33D79A, 0xB59B61,
+    0x8B654F, 0x0D29B4, 0x01B042, 0x87FCB9, 0x1883AE, 0x9ECF55, 0x9256A3, 0x141A58,
+    0xEFAAFF, 0x69E604, 0x657FF2, 0xE33309, 0x7C4C1E, 0xFA00E5, 0xF69913, 0x70D5E8,
+    0x4E2BC6, 0xC8673D, 0xC4FECB, 0x42B230, 0xDDCD27, 0x5B81DC, 0x57182A, 0xD154D1,
+    0x26359F, 0xA07964, 0xACE092, 0x2AAC69, 0xB5D37E, 0x339F85, 0x3F0673, 0xB94A88,
+    0x87B4A6, 0x01F85D, 0x0D61AB, 0x8B2D50, 0x145247, 0x921EBC, 0x9E874A, 0x18CBB1,
+    0xE37B16, 0x6537ED, 0x69AE1B, 0xEFE2E0, 0x709DF7, 0xF6D10C, 0xFA48FA, 0x7C0401,
+    0x42FA2F, 0xC4B6D4, 0xC82F22, 0x4E63D9, 0xD11CCE, 0x575035, 0x5BC9C3, 0xDD8538,
+};
+
+uint32_t rtcm_crc24q(uint32_t crc, const uint8_t *data, size_t length) {
+    for (size_t i = 0; i < length; i++) {
+        crc = ((crc << 8) ^ crc24q_table[((crc >> 16) ^ data[i]) & 0xFF]) & 0xFFFFFFu;
+    }
+
+    return crc;
+}
+
+#define DAY_MS 86400000u
+
+static uint32_t rtcm_bits(const uint8_t *data, int offset, int count) {
+    uint32_t value = 0;
+    for (int i = offset; i < offset + count; i++) {
+        value = (value << 1) | ((data[i / 8] >> (7 - i % 8)) & 1);
+    }
+
+    return value;
+}
+
+bool rtcm_epoch_utc(uint16_t type, const uint8_t *head, uint32_t *epoch) {
+    // Epoch follows the 12 bit message type and 12 bit reference station ID
+    uint32_t ms;
+    int32_t offset;
+    if ((type >= 1001 && type <= 1004) || (type >= 1071 && type <= 1077) ||
+            (type >= 1091 && type <= 1097) || (type >= 1111 && type <= 1117)) {
+        // GPS, Galileo and QZSS time of week
+        ms = rtcm_bits(head, 24, 30);
+        offset = -RTCM_GPS_LEAP_SECONDS * 1000;
+    } else if (type >= 1121 && type <= 1127) {
+        // BeiDou time of week, 14 seconds behind GPS
+        ms = rtcm_bits(head, 24, 30);
+        offset = (14 - RTCM_GPS_LEAP_SECONDS) * 1000;
+    } else if (type >= 1009 && type <= 1012) {
+        // GLONASS time of day, UTC+3
+        ms = rtcm_bits(head, 24, 27);
+        offset = -3 * 3600 * 1000;
+    } else if (type >= 1081 && type <= 1087) {
+        // GLONASS day of week followed by time of day
+        ms = rtcm_bits(head, 27, 27);
+        offset = -3 * 3600 * 1000;
+    } else {
+        return false;
+    }
+
+    *epoch = (uint32_t) ((ms % DAY_MS + DAY_MS + offset) % DAY_MS);
+    return true;
+}
+
+void rtcm_parser_init(rtcm_parser_t *parser) {
+    *parser = (rtcm_parser_t) {
+            .state = RTCM_PARSER_PREAMBLE
+    };
+}
+
+size_t rtcm_parser_pending(const rtcm_parser_t *parser) {
+    return parser->index;
+}
+
+void rtcm_parser_parse(rtcm_parser_t *parser, const uint8_t *data, size_t length, rtcm_frame_handler_t handler, void *ctx) {
+    for (size_t i = 0; i < length; i++) {
+        uint8_t c = data[i];
+
+        switch (parser->state) {
+            case RTCM_PARSER_PREAMBLE:
+                // Anything outside of a frame is passed over
+                if (c != RTCM_PREAMBLE) continue;
+
+                parser->index = 1;
+                parser->crc = rtcm_crc24q(0, &c, 1);
+                parser->state = RTCM_PARSER_LENGTH_1;
+                continue;
+            case RTCM_PARSER_LENGTH_1:
+                // Upper 6 bits are reserved and always zero
+                if (c & 0xFC) {
+                    parser->index = 0;
+                    parser->state = RTCM_PARSER_PREAMBLE;
+                    continue;
+                }
+
+                parser->length = (uint16_t) (c & 0x03) << 8;
+                parser->state = RTCM_PARSER_LENGTH_2;
+                break;
+            case RTCM_PARSER_LENGTH_2:
+                parser->length |= c;
+                parser->type = 0;
+                parser->crc_received = 0;
+                parser->state = parser->length == 0 ? RTCM_PARSER_CRC : RTCM_PARSER_PAYLOAD;
+                break;
+            case RTCM_PARSER_PAYLOAD:
+                // Message type is the first 12 bits of the payload
+                if (parser->index == RTCM_HEADER_LENGTH) parser->type = (uint16_t) c << 4;
+                if (parser->index == RTCM_HEADER_LENGTH + 1) parser->type |= c >> 4;
+
+                if (parser->index - RTCM_HEADER_LENGTH < RTCM_PAYLOAD_HEAD_LENGTH) {
+                    parser->head[parser->index - RTCM_HEADER_LENGTH] = c;
+                }
+
+                if (parser->index + 1 == RTCM_HEADER_LENGTH + parser->length) parser->state = RTCM_PARSER_CRC;
+                break;
+            case RTCM_PARSER_CRC:
+                parser->crc_received = (parser->crc_received << 8) | c;
+                parser->index++;
+                if (parser->index < RTCM_HEADER_LENGTH + parser->length + RTCM_CRC_LENGTH) continue;
+
+                if (parser->crc_received == parser->crc && handler != NULL) {
+                    handler(ctx, parser->type, parser->index, i + 1);
+                }
+
+                parser->index = 0;
+                parser->state = RTCM_PARSER_PREAMBLE;
+                continue;
+        }
+
+        parser->crc = rtcm_crc24q(parser->crc, &c, 1);
+        parser->index++;
+    }
+}
@@ -0,0 +1,424 @@
+/*
+ * This file is part of the ESP32-XBee distribution (https://github.com/nebkat/esp32-xbee).
+ * Copyright (c) 2020 Nebojsa Cvetkovic.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "protocol/tunnel.h"
+
+// Header: type (magic in upper nibble), group size, sequence, send time in milliseconds
+#define TUNNEL_MAGIC 0xA0
+#define TUNNEL_TYPE_DATA 0x0
+#define TUNNEL_TYPE_PARITY 0x1
+#define TUNNEL_TYPE_NACK 0x2
+
+#define TUNNEL_NACK_MAX 8
+
+#define WINDOW_INDEX(seq) ((seq) & (TUNNEL_WINDOW - 1))
+#define SEQ_DIFF(a, b) ((int16_t) (uint16_t) ((a) - (b)))
+
+typedef struct tunnel_packet {
+    bool present;
+    // Rebuilt from parity rather than received
+    bool rebuilt;
+    uint16_t seq;
+    uint16_t length;
+    uint32_t time;
+    uint8_t data[TUNNEL_PAYLOAD_MAX];
+} tunnel_packet_t;
+
+struct tunnel {
+    tunnel_config_t config;
+    tunnel_output_t output;
+    tunnel_deliver_t deliver;
+    void *ctx;
+
+    uint8_t packet[TUNNEL_PACKET_MAX];
+
+    // Sender
+    uint16_t next_seq;
+    tunnel_packet_t history[TUNNEL_WINDOW];
+
+    uint16_t parity_first;
+    uint8_t parity_count;
+    uint16_t parity_length;
+    uint16_t parity_size;
+    uint8_t parity[TUNNEL_PAYLOAD_MAX];
+
+    // Receiver
+    bool started;
+    uint16_t expected;
+    tunnel_packet_t window[TUNNEL_WINDOW];
+
+    uint32_t gap_time;
+    uint32_t nack_time;
+    bool nacked;
+
+    bool fec_present;
+    uint16_t fec_first;
+    uint8_t fec_count;
+    uint32_t fec_time;
+    uint16_t fec_length;
+    uint16_t fec_size;
+    uint8_t fec[TUNNEL_PAYLOAD_MAX];
+
+    int32_t offset_min;
+
+    tunnel_stats_t stats;
+};
+
+static void tunnel_header(uint8_t *packet, uint8_t type, uint8_t count, uint16_t seq, uint32_t time) {
+    packet[0] = TUNNEL_MAGIC | type;
+    packet[1] = count;
+    packet[2] = seq >> 8;
+    packet[3] = seq;
+    packet[4] = time >> 24;
+    packet[5] = time >> 16;
+    packet[6] = time >> 8;
+    packet[7] = time;
+}
+
+tunnel_handle_t tunnel_create(const tunnel_config_t *config, tunnel_output_t output, tunnel_deliver_t deliver, void *ctx) {
+    tunnel_handle_t tunnel = calloc(1, sizeof(struct tunnel));
+    if (tunnel == NULL) return NULL;
+
+    tunnel->config = *config;
+    if (tunnel->config.fec_group > TUNNEL_FEC_GROUP_MAX) tunnel->config.fec_group = TUNNEL_FEC_GROUP_MAX;
+    tunnel->output = output;
+    tunnel->deliver = deliver;
+    tunnel->ctx = ctx;
+    tunnel->offset_min = INT32_MAX;
+
+    return tunnel;
+}
+
+void tunnel_destroy(tunnel_handle_t tunnel) {
+    free(tunnel);
+}
+
+static void tunnel_send_parity(tunnel_handle_t tunnel, uint32_t now) {
+    uint8_t *packet = tunnel->packet;
+    tunnel_header(packet, TUNNEL_TYPE_PARITY, tunnel->parity_count, tunnel->parity_first, now);
+    packet[TUNNEL_HEADER_LENGTH] = tunnel->parity_length >> 8;
+    packet[TUNNEL_HEADER_LENGTH + 1] = tunnel->parity_length;
+    memcpy(packet + TUNNEL_HEADER_LENGTH + 2, tunnel->parity, tunnel->parity_size);
+    tunnel->output(tunnel->ctx, packet, TUNNEL_HEADER_LENGTH + 2 + tunnel->parity_size);
+
+    tunnel->parity_count = 0;
+}
+
+void tunnel_send(tunnel_handle_t tunnel, const uint8_t *data, size_t length, uint32_t now) {
+    while (length > 0) {
+        uint16_t size = length > TUNNEL_PAYLOAD_MAX ? TUNNEL_PAYLOAD_MAX : length;
+        uint16_t seq = tunnel->next_seq++;
+
+        // Kept for retransmission on NACK
+        tunnel_packet_t *sent = &tunnel->history[WINDOW_INDEX(seq)];
+        sent->present = true;
+        sent->seq = seq;
+        sent->length = size;
+        sent->time = now;
+        memcpy(sent->data, data, size);
+
+        tunnel_header(tunnel->packet, TUNNEL_TYPE_DATA, 0, seq, now);
+        memcpy(tunnel->packet + TUNNEL_HEADER_LENGTH, data, size);
+        tunnel->output(tunnel->ctx, tunnel->packet, TUNNEL_HEADER_LENGTH + size);
+        tunnel->stats.sent++;
+
+        // Parity is the XOR of the group's lengths and zero padded payloads
+        if (tunnel->config.fec_group > 0) {
+            if (tunnel->parity_count == 0) {
+                tunnel->parity_first = seq;
+                tunnel->parity_length = 0;
+                tunnel->parity_size = 0;
+            }
+
+            if (size > tunnel->parity_size) {
+                memset(tunnel->parity + tunnel->parity_size, 0, size - tunnel->parity_size);
+                tunnel->parity_size = size;
+            }
+
+            tunnel->parity_length ^= size;
+            for (int i = 0; i < size; i++) tunnel->parity[i] ^= data[i];
+
+            if (++tunnel->parity_count == tunnel->config.fec_group) tunnel_send_parity(tunnel, now);
+        }
+
+        data += size;
+        length -= size;
+    }
+}
+
+static void tunnel_retransmit(tunnel_handle_t tunnel, uint16_t seq) {
+    tunnel_packet_t *sent = &tunnel->history[WINDOW_INDEX(seq)];
+    if (!sent->present || sent->seq != seq) return;
+
+    // Original send time is kept so latency includes the retransmission
+    tunnel_header(tunnel->packet, TUNNEL_TYPE_DATA, 0, seq, sent->time);
+    memcpy(tunnel->packet + TUNNEL_HEADER_LENGTH, sent->data, sent->length);
+    tunnel->output(tunnel->ctx, tunnel->packet, TUNNEL_HEADER_LENGTH + sent->length);
+    tunnel->stats.retransmitted++;
+}
+
+static void tunnel_deliver(tunnel_handle_t tunnel, tunnel_packet_t *packet, uint32_t now) {
+    int32_t offset = (int32_t) (now - packet->time);
+    if (offset < tunnel->offset_min) tunnel->offset_min = offset;
+
+    uint32_t latency = offset - tunnel->offset_min;
+    tunnel->stats.latency = (tunnel->stats.latency * 7 + latency) / 8;
+    if (latency > tunnel->stats.latency_max) tunnel->stats.latency_max = latency;
+
+    tunnel->deliver(tunnel->ctx, packet->data, packet->length);
+    tunnel->stats.delivered++;
+}
+
+// Offset of the newest received packet from the next expected one, 0 if there is no gap
+static int tunnel_newest(tunnel_handle_t tunnel) {
+    for (int i = TUNNEL_WINDOW - 1; i > 0; i--) {
+        tunnel_packet_t *packet = &tunnel->window[WINDOW_INDEX(tunnel->expected + i)];
+        if (packet->present && packet->seq == (uint16_t) (tunnel->expected + i)) return i;
+    }
+
+    return 0;
+}
+
+static uint32_t tunnel_elapsed(uint32_t now, uint32_t since) {
+    int32_t elapsed = (int32_t) (now - since);
+    return elapsed > 0 ? elapsed : 0;
+}
+
+static void tunnel_send_nack(tunnel_handle_t tunnel, uint32_t now) {
+    uint8_t *packet = tunnel->packet;
+    size_t length = TUNNEL_HEADER_LENGTH;
+
+    // Everything missing before the newest received packet
+    int last = tunnel_newest(tunnel);
+
+    for (int i = 0; i < last && length < TUNNEL_HEADER_LENGTH + TUNNEL_NACK_MAX * 2; i++) {
+        uint16_t seq = tunnel->expected + i;
+        tunnel_packet_t *received = &tunnel->window[WINDOW_INDEX(seq)];
+        if (received->present && received->seq == seq) continue;
+
+        packet[length++] = seq >> 8;
+        packet[length++] = seq;
+    }
+
+    if (length == TUNNEL_HEADER_LENGTH) return;
+
+    tunnel_header(packet, TUNNEL_TYPE_NACK, 0, tunnel->expected, now);
+    tunnel->output(tunnel->ctx, packet, length);
+    tunnel->nack_time = now;
+    tunnel->nacked = true;
+}
+
+static void tunnel_deliver_ready(tunnel_handle_t tunnel, uint32_t now) {
+    while (true) {
+        tunnel_packet_t *packet = &tunnel->window[WINDOW_INDEX(tunnel->expected)];
+        if (!packet->present || packet->seq != tunnel->expected) break;
+
+        tunnel_deliver(tunnel, packet, now);
+        tunnel->expected++;
+        tunnel->gap_time = 0;
+        tunnel->nacked = false;
+    }
+
+    // Reordered packets usually arrive within a NACK interval, only ask for them once it has passed
+    if (tunnel->gap_time == 0 && tunnel_newest(tunnel) > 0) {
+        tunnel->gap_time = now;
+        tunnel->nack_time = now;
+    }
+}
+
+// Gives up on missing packets up to seq
+static void tunnel_skip(tunnel_handle_t tunnel, uint16_t seq, uint32_t now) {
+    while (SEQ_DIFF(seq, tunnel->expected) > 0) {
+        tunnel_packet_t *packet = &tunnel->window[WINDOW_INDEX(tunnel->expected)];
+        if (packet->present && packet->seq == tunnel->expected) {
+            tunnel_deliver(tunnel, packet, now);
+        } else {
+            tunnel->stats.lost++;
+        }
+        tunnel->expected++;
+    }
+
+    tunnel->gap_time = 0;
+    tunnel->nacked = false;
+}
+
+static tunnel_packet_t *tunnel_received(tunnel_handle_t tunnel, uint16_t seq) {
+    tunnel_packet_t *packet = &tunnel->window[WINDOW_INDEX(seq)];
+    return packet->present && packet->seq == seq ? packet : NULL;
+}
+
+// Rebuilds a single missing packet of the parity group
+static void tunnel_fec_recover(tunnel_handle_t tunnel) {
+    if (!tunnel->fec_present) return;
+
+    int missing = -1;
+    for (int i = 0; i < tunnel->fec_count; i++) {
+        uint16_t seq = tunnel->fec_first + i;
+        if (tunnel_received(tunnel, seq) != NULL) continue;
+
+        // Too late or too many missing
+        if (missing >= 0 || SEQ_DIFF(seq, tunnel->expected) < 0) return;
+        missing = i;
+    }
+
+    if (missing < 0) {
+        tunnel->fec_present = false;
+        return;
+    }
+
+    uint16_t length = tunnel->fec_length;
+    uint8_t *data = tunnel->fec;
+    for (int i = 0; i < tunnel->fec_count; i++) {
+        if (i == missing) continue;
+
+        tunnel_packet_t *packet = tunnel_received(tunnel, tunnel->fec_first + i);
+        length ^= packet->length;
+        for (int j = 0; j < packet->length; j++) data[j] ^= packet->data[j];
+    }
+
+    tunnel->fec_present = false;
+    if (length > tunnel->fec_size) return;
+
+    uint16_t seq = tunnel->fec_first + missing;
+    tunnel_packet_t *recovered = &tunnel->window[WINDOW_INDEX(seq)];
+    recovered->present = true;
+    recovered->rebuilt = true;
+    recovered->seq = seq;
+    recovered->length = length;
+    recovered->time = tunnel->fec_time;
+    memcpy(recovered->data, data, length);
+
+    tunnel->stats.recovered_fec++;
+}
+
+bool tunnel_receive(tunnel_handle_t tunnel, const uint8_t *packet, size_t length, uint32_t now) {
+    if (length < TUNNEL_HEADER_LENGTH || (packet[0] & 0xF0) != TUNNEL_MAGIC) return false;
+
+    uint8_t type = packet[0] & 0x0F;
+    uint8_t count = packet[1];
+    uint16_t seq = (uint16_t) packet[2] << 8 | packet[3];
+    uint32_t time = (uint32_t) packet[4] << 24 | (uint32_t) packet[5] << 16 | (uint32_t) packet[6] << 8 | packet[7];
+    const uint8_t *payload = packet + TUNNEL_HEADER_LENGTH;
+    size_t payload_length = length - TUNNEL_HEADER_LENGTH;
+
+    switch (type) {
+        case TUNNEL_TYPE_NACK:
+            for (size_t i = 0; i + 1 < payload_length; i += 2) {
+                tunnel_retransmit(tunnel, (uint16_t) payload[i] << 8 | payload[i + 1]);
+            }
+            return true;
+        case TUNNEL_TYPE_PARITY:
+            if (payload_length < 2 || payload_length - 2 > TUNNEL_PAYLOAD_MAX || count == 0 || count > TUNNEL_FEC_GROUP_MAX) return false;
+            if (!tunnel->started) return true;
+
+            tunnel->fec_present = true;
+            tunnel->fec_first = seq;
+            tunnel->fec_count = count;
+            tunnel->fec_time = time;
+            tunnel->fec_length = (uint16_t) payload[0] << 8 | payload[1];
+            tunnel->fec_size = payload_length - 2;
+            memcpy(tunnel->fec, payload + 2, tunnel->fec_size);
+            memset(tunnel->fec + tunnel->fec_size, 0, TUNNEL_PAYLOAD_MAX - tunnel->fec_size);
+
+            tunnel_fec_recover(tunnel);
+            tunnel_deliver_ready(tunnel, now);
+            return true;
+        case TUNNEL_TYPE_DATA:
+            break;
+        default:
+            return false;
+    }
+
+    if (payload_length > TUNNEL_PAYLOAD_MAX) return false;
+
+    if (!tunnel->started) {
+        tunnel->started = true;
+        tunnel->expected = seq;
+    }
+
+    int16_t diff = SEQ_DIFF(seq, tunnel->expected);
+    tunnel_packet_t *previous = tunnel_received(tunnel, seq);
+    if (previous != NULL && previous->rebuilt) {
+        // Parity overtook a reordered packet, nothing was lost
+        previous->rebuilt = false;
+        tunnel->stats.recovered_fec--;
+        return true;
+    }
+
+    if (diff < 0 || previous != NULL) {
+        tunnel->stats.duplicates++;
+        return true;
+    }
+
+    // Too far ahead to buffer, give up on whatever is missing before it
+    if (diff >= TUNNEL_WINDOW) tunnel_skip(tunnel, seq - TUNNEL_WINDOW + 1, now);
+
+    // Filling a hole that was asked for
+    if (tunnel->nacked && diff < tunnel_newest(tunnel)) tunnel->stats.recovered_nack++;
+
+    tunnel_packet_t *received = &tunnel->window[WINDOW_INDEX(seq)];
+    received->present = true;
+    received->rebuilt = false;
+    received->seq = seq;
+    received->length = payload_length;
+    received->time = time;
+    memcpy(received->data, payload, payload_length);
+
+    tunnel_fec_recover(tunnel);
+    tunnel_deliver_ready(tunnel, now);
+
+    return true;
+}
+
+int tunnel_poll(tunnel_handle_t tunnel, uint32_t now) {
+    if (tunnel->gap_time == 0) return -1;
+
+    // Waited long enough, skip to the next received packet
+    if (tunnel_elapsed(now, tunnel->gap_time) >= tunnel->config.reorder_timeout) {
+        uint16_t seq = tunnel->expected;
+        while (tunnel_received(tunnel, seq) == NULL) seq++;
+        tunnel_skip(tunnel, seq, now);
+        tunnel_deliver_ready(tunnel, now);
+
+        if (tunnel->gap_time == 0) return -1;
+    }
+
+    if (tunnel_elapsed(now, tunnel->nack_time) >= tunnel->config.nack_interval) tunnel_send_nack(tunnel, now);
+
+    uint32_t nack_in = tunnel->config.nack_interval - tunnel_elapsed(now, tunnel->nack_time);
+    uint32_t timeout_in = tunnel->config.reorder_timeout - tunnel_elapsed(now, tunnel->gap_time);
+    return nack_in < timeout_in ? nack_in : timeout_in;
+}
+
+void tunnel_stats(tunnel_handle_t tunnel, tunnel_stats_t *stats) {
+    *stats = tunnel->stats;
+}
+
+void tunnel_stats_add(tunnel_stats_t *total, const tunnel_stats_t *stats) {
+    total->sent += stats->sent;
+    total->retransmitted += stats->retransmitted;
+    total->delivered += stats->delivered;
+    total->recovered_fec += stats->recovered_fec;
+    total->recovered_nack += stats->recovered_nack;
+    total->lost += stats->lost;
+    total->duplicates += stats->duplicates;
+    if (stats->latency > total->latency) total->latency = stats->latency;
+    if (stats->latency_max > total->latency_max) total->latency_max = stats->latency_max;
+}
@@ -0,0 +1,510 @@
+/*
+ * This file is part of the ESP32-XBee distribution (https://github.com/nebkat/esp32-xbee).
+ * Copyright (c) 2020 Nebojsa Cvetkovic.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/queue.h>
+#include <lwip/sockets.h>
+#include <sys/param.h>
+#include <sys/queue.h>
+#include <tasks.h>
+
+#include "dns_cache.h"
+#include "pool.h"
+#include "reactor.h"
+
+static const char *TAG = "REACTOR";
+
+// Milliseconds
+#define CONNECT_RESOLVE_POLL 50
+#define CONNECT_RESOLVE_TIMEOUT 15000
+
+// Watches and timers come and go with connections, pools only run out under unusual load
+#define WATCH_POOL_COUNT 24
+#define TIMER_POOL_COUNT 32
+#define CONNECT_POOL_COUNT 4
+
+struct reactor_watch {
+    int sock;
+    uint8_t events;
+    reactor_socket_callback_t callback;
+    void *ctx;
+
+    // Only watches that were part of the last select are dispatched
+    bool armed;
+    bool deleted;
+    SLIST_ENTRY(reactor_watch) next;
+};
+
+struct reactor_timer {
+    reactor_callback_t callback;
+    void *ctx;
+
+    bool active;
+    int64_t deadline;
+
+    bool deleted;
+    SLIST_ENTRY(reactor_timer) next;
+};
+
+typedef struct reactor_call_entry {
+    reactor_callback_t callback;
+    void *ctx;
+} reactor_call_entry_t;
+
+static SLIST_HEAD(reactor_watch_list_t, reactor_watch) watches = SLIST_HEAD_INITIALIZER(watches);
+static SLIST_HEAD(reactor_timer_list_t, reactor_timer) timers = SLIST_HEAD_INITIALIZER(timers);
+static pool_handle_t watch_pool, timer_pool, connect_pool;
+
+// Other tasks queue calls and send a datagram to themselves through the wake socket to interrupt select
+static QueueHandle_t calls = NULL;
+static int wake_sock = -1;
+static volatile bool wake_pending = false;
+
+bool reactor_call(reactor_callback_t callback, void *ctx) {
+    if (calls == NULL) return false;
+
+    reactor_call_entry_t entry = {callback, ctx};
+    if (xQueueSend(calls, &entry, 0) != pdTRUE) return false;
+
+    if (!wake_pending) {
+        wake_pending = true;
+        send(wake_sock, "", 1, MSG_DONTWAIT);
+    }
+
+    return true;
+}
+
+reactor_watch_handle_t reactor_watch_new(int sock, uint8_t events, reactor_socket_callback_t callback, void *ctx) {
+    reactor_watch_handle_t watch = pool_alloc(watch_pool, sizeof(struct reactor_watch));
+    if (watch == NULL) return NULL;
+
+    *watch = (struct reactor_watch) {
+            .sock = sock,
+            .events = events,
+            .callback = callback,
+            .ctx = ctx
+    };
+
+    SLIST_INSERT_HEAD(&watches, watch, next);
+
+    return watch;
+}
+
+void reactor_watch_events(reactor_watch_handle_t watch, uint8_t events) {
+    watch->events = events;
+}
+
+void reactor_watch_delete(reactor_watch_handle_t watch) {
+    if (watch != NULL) watch->deleted = true;
+}
+
+reactor_timer_handle_t reactor_timer_new(reactor_callback_t callback, void *ctx) {
+    reactor_timer_handle_t timer = pool_alloc(timer_pool, sizeof(struct reactor_timer));
+    if (timer == NULL) return NULL;
+
+    *timer = (struct reactor_timer) {
+            .callback = callback,
+            .ctx = ctx
+    };
+
+    SLIST_INSERT_HEAD(&timers, timer, next);
+
+    return timer;
+}
+
+void reactor_timer_start(reactor_timer_handle_t timer, uint32_t delay) {
+    if (timer == NULL) return;
+
+    timer->deadline = esp_timer_get_time() + (int64_t) delay * 1000;
+    timer->active = true;
+}
+
+void reactor_timer_stop(reactor_timer_handle_t timer) {
+    if (timer != NULL) timer->active = false;
+}
+
+bool reactor_timer_active(reactor_timer_handle_t timer) {
+    return timer != NULL && timer->active;
+}
+
+void reactor_timer_delete(reactor_timer_handle_t timer) {
+    if (timer == NULL) return;
+
+    timer->active = false;
+    timer->deleted = true;
+}
+
+typedef struct reactor_connect_attempt {
+    struct reactor_connect *connect;
+
+    int sock;
+    int64_t deadline;
+    reactor_watch_handle_t watch;
+} reactor_connect_attempt_t;
+
+struct reactor_connect {
+    char host[64];
+    uint16_t port;
+    int socktype;
+    socket_budget_owner_t owner;
+
+    reactor_connect_callback_t callback;
+    void *ctx;
+
+    connect_socket_timing_t timing;
+    int64_t start;
+    int64_t resolved;
+
+    struct sockaddr_storage resolved_addrs[CONNECT_SOCKET_ATTEMPTS_MAX];
+    struct sockaddr_storage *addrs[CONNECT_SOCKET_ATTEMPTS_MAX];
+    int addr_count;
+
+    // Attempts run in parallel, each started CONNECT_SOCKET_ATTEMPT_DELAY after the previous
+    reactor_connect_attempt_t attempts[CONNECT_SOCKET_ATTEMPTS_MAX];
+    int started;
+    int64_t next_start;
+
+    reactor_timer_handle_t timer;
+};
+
+static void reactor_connect_attempt_close(reactor_connect_attempt_t *attempt) {
+    if (attempt->sock < 0) return;
+
+    reactor_watch_delete(attempt->watch);
+    attempt->watch = NULL;
+    close(attempt->sock);
+    attempt->sock = -1;
+}
+
+static void reactor_connect_free(reactor_connect_handle_t connect) {
+    for (int i = 0; i < connect->started; i++) reactor_connect_attempt_close(&connect->attempts[i]);
+
+    reactor_timer_delete(connect->timer);
+    pool_release(connect);
+}
+
+static void reactor_connect_finish(reactor_connect_handle_t connect, int sock) {
+    reactor_connect_callback_t callback = connect->callback;
+    void *ctx = connect->ctx;
+    connect_socket_timing_t timing = connect->timing;
+
+    reactor_connect_free(connect);
+
+    callback(ctx, sock, &timing);
+}
+
+static void reactor_connect_won(reactor_connect_handle_t connect, reactor_connect_attempt_t *attempt) {
+    int sock = attempt->sock;
+    reactor_watch_delete(attempt->watch);
+    attempt->watch = NULL;
+    attempt->sock = -1;
+
+    connect->timing.family = connect->addrs[attempt - connect->attempts]->ss_family;
+    connect->timing.connect = (esp_timer_get_time() - connect->resolved) / 1000;
+
+    if (!socket_budget_acquire(sock, connect->owner)) {
+        ESP_LOGW(TAG, "Connected to %s:%d but no socket available", connect->host, connect->port);
+        close(sock);
+        sock = CONNECT_SOCKET_ERROR_CONNECT;
+    }
+
+    reactor_connect_finish(connect, sock);
+}
+
+static void reactor_connect_attempt_ready(void *ctx, int sock, uint8_t events) {
+    reactor_connect_attempt_t *attempt = ctx;
+    reactor_connect_handle_t connect = attempt->connect;
+
+    int sock_err = 0;
+    socklen_t len = sizeof(sock_err);
+    getsockopt(sock, SOL_SOCKET, SO_ERROR, &sock_err, &len);
+    if (sock_err == 0) {
+        reactor_connect_won(connect, attempt);
+        return;
+    }
+
+    // Failed, the next address can start right away
+    reactor_connect_attempt_close(attempt);
+    connect->next_start = esp_timer_get_time();
+    reactor_timer_start(connect->timer, 0);
+}
+
+static void reactor_connect_step(void *ctx) {
+    reactor_connect_handle_t connect = ctx;
+    int64_t now = esp_timer_get_time();
+
+    // Waiting for the DNS cache to look host up in the background
+    if (connect->addr_count == 0) {
+        int count = dns_cache_resolve_nowait(connect->host, connect->socktype, connect->resolved_addrs, CONNECT_SOCKET_ATTEMPTS_MAX);
+        if (count < 0 || (count == 0 && now - connect->start > CONNECT_RESOLVE_TIMEOUT * 1000)) {
+            reactor_connect_finish(connect, CONNECT_SOCKET_ERROR_RESOLVE);
+            return;
+        }
+
+        if (count == 0) {
+            reactor_timer_start(connect->timer, CONNECT_RESOLVE_POLL);
+            return;
+        }
+
+        connect->resolved = now;
+        connect->timing.resolve = (now - connect->start) / 1000;
+        connect->addr_count = connect_socket_order(connect->resolved_addrs, count, connect->addrs);
+        connect->next_start = now;
+    }
+
+    // Give up on attempts past their deadline
+    for (int i = 0; i < connect->started; i++) {
+        reactor_connect_attempt_t *attempt = &connect->attempts[i];
+        if (attempt->sock >= 0 && now >= attempt->deadline) {
+            reactor_connect_attempt_close(attempt);
+            connect->next_start = now;
+        }
+    }
+
+    while (connect->started < connect->addr_count && now >= connect->next_start) {
+        reactor_connect_attempt_t *attempt = &connect->attempts[connect->started++];
+
+        bool connected;
+        attempt->connect = connect;
+        attempt->sock = connect_socket_start(connect->addrs[connect->started - 1], connect->port, connect->socktype, &connected);
+        attempt->deadline = now + CONNECT_SOCKET_TIMEOUT * 1000;
+        connect->timing.attempts++;
+
+        if (connected) {
+            reactor_connect_won(connect, attempt);
+            return;
+        }
+
+        if (attempt->sock < 0) continue;
+
+        attempt->watch = reactor_watch_new(attempt->sock, REACTOR_WRITE, reactor_connect_attempt_ready, attempt);
+        if (attempt->watch == NULL) {
+            // Out of memory, count the address as failed and move on to the next
+            close(attempt->sock);
+            attempt->sock = -1;
+            continue;
+        }
+
+        connect->next_start = now + CONNECT_SOCKET_ATTEMPT_DELAY * 1000;
+    }
+
+    // Wake for the next attempt to be due or the earliest deadline
+    int64_t wake = connect->started < connect->addr_count ? connect->next_start : INT64_MAX;
+    for (int i = 0; i < connect->started; i++) {
+        if (connect->attempts[i].sock >= 0) wake = MIN(wake, connect->attempts[i].deadline);
+    }
+
+    // Nothing pending and nothing left to try
+    if (wake == INT64_MAX) {
+        reactor_connect_finish(connect, CONNECT_SOCKET_ERROR_CONNECT);
+        return;
+    }
+
+    reactor_timer_start(connect->timer, (MAX(wake - now, 0) + 999) / 1000);
+}
+
+reactor_connect_handle_t reactor_connect(const char *host, uint16_t port, int socktype, socket_budget_owner_t owner,
+        reactor_connect_callback_t callback, void *ctx) {
+    reactor_connect_handle_t connect = pool_alloc(connect_pool, sizeof(struct reactor_connect));
+    if (connect == NULL) return NULL;
+
+    memset(connect, 0, sizeof(struct reactor_connect));
+    strlcpy(connect->host, host, sizeof(connect->host));
+    connect->port = port;
+    connect->socktype = socktype;
+    connect->owner = owner;
+    connect->callback = callback;
+    connect->ctx = ctx;
+    connect->start = esp_timer_get_time();
+
+    for (int i = 0; i < CONNECT_SOCKET_ATTEMPTS_MAX; i++) connect->attempts[i].sock = -1;
+
+    // Never call back before returning, callers store the handle first
+    connect->timer = reactor_timer_new(reactor_connect_step, connect);
+    if (connect->timer == NULL) {
+        pool_release(connect);
+        return NULL;
+    }
+
+    reactor_timer_start(connect->timer, 0);
+
+    return connect;
+}
+
+void reactor_connect_cancel(reactor_connect_handle_t connect) {
+    if (connect != NULL) reactor_connect_free(connect);
+}
+
+// Microseconds until the next timer is due, or -1 if none are running
+static int64_t reactor_timers_next(int64_t now) {
+    int64_t next = -1;
+
+    reactor_timer_handle_t timer;
+    SLIST_FOREACH(timer, &timers, next) {
+        if (!timer->active) continue;
+
+        int64_t wait = MAX(timer->deadline - now, 0);
+        if (next < 0 || wait < next) next = wait;
+    }
+
+    return next;
+}
+
+static void reactor_timers_run() {
+    int64_t now = esp_timer_get_time();
+
+    reactor_timer_handle_t timer;
+    SLIST_FOREACH(timer, &timers, next) {
+        if (!timer->active || timer->deadline > now) continue;
+
+        // Callback may start the timer again
+        timer->active = false;
+        timer->callback(timer->ctx);
+    }
+}
+
+static void reactor_calls_run() {
+    // Cleared first, so a call queued while draining still sends a wake up
+    wake_pending = false;
+
+    char discard[8];
+    while (recv(wake_sock, discard, sizeof(discard), MSG_DONTWAIT) > 0);
+
+    reactor_call_entry_t entry;
+    while (xQueueReceive(calls, &entry, 0) == pdTRUE) entry.callback(entry.ctx);
+}
+
+// Deleted watches and timers are only freed once nothing can be iterating over them
+static void reactor_reap() {
+    reactor_watch_handle_t watch, watch_tmp;
+    SLIST_FOREACH_SAFE(watch, &watches, next, watch_tmp) {
+        if (!watch->deleted) continue;
+
+        SLIST_REMOVE(&watches, watch, reactor_watch, next);
+        pool_release(watch);
+    }
+
+    reactor_timer_handle_t timer, timer_tmp;
+    SLIST_FOREACH_SAFE(timer, &timers, next, timer_tmp) {
+        if (!timer->deleted) continue;
+
+        SLIST_REMOVE(&timers, timer, reactor_timer, next);
+        pool_release(timer);
+    }
+}
+
+static void reactor_task(void *ctx) {
+    while (true) {
+        fd_set read_set, write_set;
+        FD_ZERO(&read_set);
+        FD_ZERO(&write_set);
+
+        FD_SET(wake_sock, &read_set);
+        int maxfd = wake_sock;
+
+        reactor_watch_handle_t watch;
+        SLIST_FOREACH(watch, &watches, next) {
+            watch->armed = watch->events != 0;
+            if (!watch->armed) continue;
+
+            if (watch->events & REACTOR_READ) FD_SET(watch->sock, &read_set);
+            if (watch->events & REACTOR_WRITE) FD_SET(watch->sock, &write_set);
+            maxfd = MAX(maxfd, watch->sock);
+        }
+
+        int64_t next = reactor_timers_next(esp_timer_get_time());
+        struct timeval timeout = {
+                .tv_sec = next / 1000000,
+                .tv_usec = next % 1000000
+        };
+
+        int ready = select(maxfd + 1, &read_set, &write_set, NULL, next >= 0 ? &timeout : NULL);
+        if (ready < 0) {
+            // A socket was closed without deleting its watch, drop it rather than failing every select
+            ESP_LOGE(TAG, "Could not select sockets: %d %s", errno, strerror(errno));
+            SLIST_FOREACH(watch, &watches, next) {
+                if (!watch->deleted && fcntl(watch->sock, F_GETFL, 0) < 0) {
+                    ESP_LOGE(TAG, "Dropping watch of closed socket %d", watch->sock);
+                    watch->deleted = true;
+                }
+            }
+
+            reactor_reap();
+            continue;
+        }
+
+        reactor_calls_run();
+        reactor_timers_run();
+
+        SLIST_FOREACH(watch, &watches, next) {
+            if (ready <= 0) break;
+            if (!watch->armed || watch->deleted) continue;
+
+            uint8_t events = 0;
+            if (FD_ISSET(watch->sock, &read_set)) events |= REACTOR_READ;
+            if (FD_ISSET(watch->sock, &write_set)) events |= REACTOR_WRITE;
+
+            // Events may have changed since the select was set up
+            events &= watch->events;
+            if (events != 0) watch->callback(watch->ctx, watch->sock, events);
+        }
+
+        reactor_reap();
+    }
+}
+
+static int reactor_wake_socket() {
+    int sock = socket(PF_INET, SOCK_DGRAM, 0);
+    ERROR_ACTION(TAG, sock < 0, return -1, "Could not create wake socket: %d %s", errno, strerror(errno))
+
+    struct sockaddr_in addr = {
+            .sin_family = PF_INET,
+            .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+            .sin_port = 0
+    };
+    socklen_t addr_len = sizeof(addr);
+
+    // Connected to itself, so sending from any task wakes the reactor
+    int err = bind(sock, (struct sockaddr *) &addr, sizeof(addr));
+    if (err == 0) err = getsockname(sock, (struct sockaddr *) &addr, &addr_len);
+    if (err == 0) err = connect(sock, (struct sockaddr *) &addr, addr_len);
+    ERROR_ACTION(TAG, err != 0, close(sock); return -1, "Could not set up wake socket: %d %s", errno, strerror(errno))
+
+    socket_budget_acquire(sock, SOCKET_BUDGET_REACTOR);
+
+    return sock;
+}
+
+void reactor_init() {
+    socket_budget_enable(SOCKET_BUDGET_REACTOR);
+
+    watch_pool = pool_new("reactor_watches", sizeof(struct reactor_watch), WATCH_POOL_COUNT);
+    timer_pool = pool_new("reactor_timers", sizeof(struct reactor_timer), TIMER_POOL_COUNT);
+    connect_pool = pool_new("reactor_connects", sizeof(struct reactor_connect), CONNECT_POOL_COUNT);
+
+    wake_sock = reactor_wake_socket();
+    if (wake_sock < 0) return;
+
+    calls = xQueueCreate(REACTOR_CALL_QUEUE_LENGTH, sizeof(reactor_call_entry_t));
+
+    // Hosts every socket interface, callbacks must never block
+    xTaskCreatePinnedToCore(reactor_task, "reactor_task", 6144, NULL, TASK_PRIORITY_INTERFACE, NULL, TASK_CORE_NETWORK);
+}
@@ -59,7 +59,7 @@ retry_delay_handle_t retry_init(bool first_instant, uint8_t short_count, int sho
     return handle;
 }
 
-int retry_delay(retry_delay_handle_t handle) {
+int retry_next(retry_delay_handle_t handle) {
     int attempts = handle->attempts;
     int delay;
     if (attempts == 0 && handle->first_instant) {
@@ -81,6 +81,11 @@ int retry_delay(retry_delay_handle_t handle) {
 
     handle->attempts++;
 
+    return delay;
+}
+
+int retry_delay(retry_delay_handle_t handle) {
+    int delay = retry_next(handle);
     if (delay > 0) vTaskDelay(pdMS_TO_TICKS(delay));
 
     return handle->attempts;
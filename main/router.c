@@ -0,0 +1,362 @@
+/*
+ * This file is part of the ESP32-XBee distribution (https://github.com/nebkat/esp32-xbee).
+ * Copyright (c) 2020 Nebojsa Cvetkovic.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <ctype.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <esp_log.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <sys/param.h>
+#include <interface/ntrip.h>
+#include <protocol/nmea.h>
+#include <protocol/rtcm.h>
+#include "config.h"
+#include "pool.h"
+#include "router.h"
+#include "uart.h"
+#include "util.h"
+
+static const char *TAG = "ROUTER";
+
+// Milliseconds a source waits for a sink another source is delivering to. Sink handlers never block, so this is
+// only reached when the other task is starved, and the UART task drops the data rather than stalling ingest.
+#define ROUTER_SINK_WAIT 10
+
+// Connections of each source open at once, contexts beyond these fall back to the heap. The NTRIP client holds two
+// while failing back, the socket server has a pool of 8 clients and routes refused datagrams on their own context.
+static const uint8_t source_connections[ROUTER_SOURCES] = {
+        [ROUTER_SOURCE_UART] = 1,
+        [ROUTER_SOURCE_NTRIP_CLIENT] = 2,
+        [ROUTER_SOURCE_NTRIP_CASTER] = NTRIP_CASTER_MAX_SOURCES,
+        [ROUTER_SOURCE_SOCKET_SERVER] = 8 + 1,
+        [ROUTER_SOURCE_SOCKET_CLIENT] = 1,
+};
+
+static const char *source_names[ROUTER_SOURCES] = {
+        [ROUTER_SOURCE_UART] = "uart",
+        [ROUTER_SOURCE_NTRIP_CLIENT] = "ntrip_client",
+        [ROUTER_SOURCE_NTRIP_CASTER] = "ntrip_caster",
+        [ROUTER_SOURCE_SOCKET_SERVER] = "socket_server",
+        [ROUTER_SOURCE_SOCKET_CLIENT] = "socket_client",
+};
+
+static const char *sink_names[ROUTER_SINKS] = {
+        [ROUTER_SINK_UART] = "uart",
+        [ROUTER_SINK_NTRIP_SERVER] = "ntrip_server",
+        [ROUTER_SINK_NTRIP_CASTER] = "ntrip_caster",
+        [ROUTER_SINK_NTRIP_CLIENT] = "ntrip_client",
+        [ROUTER_SINK_SOCKET_SERVER] = "socket_server",
+        [ROUTER_SINK_SOCKET_CLIENT] = "socket_client",
+};
+
+static const char *filter_names[ROUTER_FILTERS] = {
+        [ROUTER_FILTER_NONE] = "",
+        [ROUTER_FILTER_RTCM] = "rtcm",
+        [ROUTER_FILTER_NMEA] = "nmea",
+};
+
+typedef struct router_sink_entry {
+    router_sink_handler_t handler;
+
+    // Only created for sinks fed by more than one source
+    SemaphoreHandle_t lock;
+} router_sink_entry_t;
+
+typedef struct router_rtcm_filter {
+    rtcm_parser_t parser;
+
+    // Read being parsed, and the start of a frame that spans reads
+    const uint8_t *data;
+    uint8_t carry[RTCM_FRAME_LENGTH_MAX];
+    size_t carry_length;
+} router_rtcm_filter_t;
+
+typedef struct router_nmea_filter {
+    char line[NMEA_SENTENCE_LENGTH_MAX];
+    size_t length;
+} router_nmea_filter_t;
+
+// Sink lists are fixed at init so dispatch is a walk over a few bytes per filter
+typedef struct router_route {
+    uint8_t sinks[ROUTER_FILTERS][ROUTER_SINKS];
+    uint8_t count[ROUTER_FILTERS];
+
+    // Deliveries given up on because the sink stayed busy, only written by the task dispatching the source
+    uint32_t dropped;
+} router_route_t;
+
+// Filters only exist for sources with filtered routes, so partial frames never mix between connections.
+// Contexts and filters come from pools sized at init, as they are set up for every connection.
+struct router_context {
+    router_route_t *route;
+
+    router_rtcm_filter_t *rtcm;
+    router_nmea_filter_t *nmea;
+};
+
+static router_sink_entry_t sinks[ROUTER_SINKS];
+static router_route_t routes[ROUTER_SOURCES];
+
+static pool_handle_t context_pool, rtcm_pool, nmea_pool;
+static router_context_handle_t uart_context = NULL;
+
+static void router_deliver(router_route_t *route, router_filter_t filter, const void *data, size_t length) {
+    for (int i = 0; i < route->count[filter]; i++) {
+        router_sink_entry_t *sink = &sinks[route->sinks[filter][i]];
+        if (sink->handler == NULL) continue;
+
+        if (sink->lock != NULL && xSemaphoreTake(sink->lock, pdMS_TO_TICKS(ROUTER_SINK_WAIT)) != pdTRUE) {
+            route->dropped++;
+            continue;
+        }
+        sink->handler(data, length);
+        if (sink->lock != NULL) xSemaphoreGive(sink->lock);
+    }
+}
+
+static void router_rtcm_frame(void *ctx, uint16_t type, size_t frame_length, size_t end) {
+    router_context_handle_t context = ctx;
+    router_rtcm_filter_t *rtcm = context->rtcm;
+
+    if (frame_length <= end) {
+        router_deliver(context->route, ROUTER_FILTER_RTCM, rtcm->data + end - frame_length, frame_length);
+        return;
+    }
+
+    // Frame started in an earlier read, complete it behind the carried head
+    size_t head_length = frame_length - end;
+    memmove(rtcm->carry, rtcm->carry + rtcm->carry_length - head_length, head_length);
+    memcpy(rtcm->carry + head_length, rtcm->data, end);
+    router_deliver(context->route, ROUTER_FILTER_RTCM, rtcm->carry, frame_length);
+}
+
+static void router_rtcm_filter(router_context_handle_t context, const uint8_t *data, size_t length) {
+    router_rtcm_filter_t *rtcm = context->rtcm;
+
+    rtcm->data = data;
+    rtcm_parser_parse(&rtcm->parser, data, length, router_rtcm_frame, context);
+
+    // Keep the incomplete trailing frame for the next read
+    size_t pending = MIN(rtcm_parser_pending(&rtcm->parser), rtcm->carry_length + length);
+    if (pending > length) {
+        memmove(rtcm->carry, rtcm->carry + rtcm->carry_length + length - pending, pending - length);
+        memcpy(rtcm->carry + pending - length, data, length);
+    } else {
+        memcpy(rtcm->carry, data + length - pending, pending);
+    }
+    rtcm->carry_length = pending;
+}
+
+static void router_nmea_filter(router_context_handle_t context, const char *data, size_t length) {
+    router_nmea_filter_t *nmea = context->nmea;
+
+    // Assemble sentences which may be split across reads
+    const char *end = data + length;
+    while (data < end) {
+        if (nmea->length == 0) {
+            data = memchr(data, '$', end - data);
+            if (data == NULL) return;
+        }
+
+        const char *lf = memchr(data, '\n', end - data);
+        size_t size = (lf == NULL ? end : lf + 1) - data;
+
+        // Too long to be a sentence, look for the next start
+        if (nmea->length + size > sizeof(nmea->line)) {
+            nmea->length = 0;
+            data++;
+            continue;
+        }
+
+        memcpy(nmea->line + nmea->length, data, size);
+        nmea->length += size;
+        data += size;
+
+        if (lf != NULL) {
+            router_deliver(context->route, ROUTER_FILTER_NMEA, nmea->line, nmea->length);
+            nmea->length = 0;
+        }
+    }
+}
+
+router_context_handle_t router_context_new(router_source_t source) {
+    router_route_t *route = &routes[source];
+
+    router_context_handle_t context = pool_alloc(context_pool, sizeof(struct router_context));
+    if (context == NULL) return NULL;
+    *context = (struct router_context) {
+            .route = route
+    };
+
+    if (route->count[ROUTER_FILTER_RTCM] > 0) {
+        context->rtcm = pool_alloc(rtcm_pool, sizeof(router_rtcm_filter_t));
+        if (context->rtcm == NULL) goto _error;
+        rtcm_parser_init(&context->rtcm->parser);
+        context->rtcm->carry_length = 0;
+    }
+
+    if (route->count[ROUTER_FILTER_NMEA] > 0) {
+        context->nmea = pool_alloc(nmea_pool, sizeof(router_nmea_filter_t));
+        if (context->nmea == NULL) goto _error;
+        context->nmea->length = 0;
+    }
+
+    return context;
+
+    _error:
+    router_context_delete(context);
+    return NULL;
+}
+
+void router_context_delete(router_context_handle_t context) {
+    if (context == NULL) return;
+
+    pool_release(context->rtcm);
+    pool_release(context->nmea);
+    pool_release(context);
+}
+
+void router_dispatch(router_context_handle_t context, const void *data, size_t length) {
+    if (context == NULL) return;
+
+    router_deliver(context->route, ROUTER_FILTER_NONE, data, length);
+    if (context->rtcm != NULL) router_rtcm_filter(context, data, length);
+    if (context->nmea != NULL) router_nmea_filter(context, data, length);
+}
+
+uint32_t router_dropped(router_source_t source) {
+    return routes[source].dropped;
+}
+
+void router_register_sink(router_sink_t sink, router_sink_handler_t handler) {
+    sinks[sink].handler = handler;
+}
+
+static int router_name_find(const char **names, int count, const char *name) {
+    for (int i = 0; i < count; i++) {
+        if (strcasecmp(names[i], name) == 0) return i;
+    }
+
+    return -1;
+}
+
+static void router_route_add(router_source_t source, router_sink_t sink, router_filter_t filter) {
+    router_route_t *route = &routes[source];
+
+    for (int i = 0; i < route->count[filter]; i++) {
+        if (route->sinks[filter][i] == sink) return;
+    }
+
+    route->sinks[filter][route->count[filter]++] = sink;
+
+    ESP_LOGI(TAG, "Routing %s to %s%s%s", source_names[source], sink_names[sink],
+            filter == ROUTER_FILTER_NONE ? "" : " as ", filter_names[filter]);
+}
+
+// One source per line as source>sink[:filter],sink[:filter]...
+static void router_routes_parse(char *list) {
+    char *line, *save = NULL;
+    for (line = strtok_r(list, "\r\n", &save); line != NULL; line = strtok_r(NULL, "\r\n", &save)) {
+        while (isspace((unsigned char) *line)) line++;
+        if (*line == '\0') continue;
+
+        char *arrow = strchr(line, '>');
+        ERROR_ACTION(TAG, arrow == NULL, continue, "Route %s has no sinks", line)
+        *arrow = '\0';
+
+        char *end = arrow;
+        while (end > line && isspace((unsigned char) end[-1])) *--end = '\0';
+
+        int source = router_name_find(source_names, ROUTER_SOURCES, line);
+        ERROR_ACTION(TAG, source < 0, continue, "Unknown route source %s", line)
+
+        char *target, *target_save = NULL;
+        for (target = strtok_r(arrow + 1, ", ", &target_save); target != NULL; target = strtok_r(NULL, ", ", &target_save)) {
+            router_filter_t filter = ROUTER_FILTER_NONE;
+            char *colon = strchr(target, ':');
+            if (colon != NULL) {
+                *colon = '\0';
+                int found = router_name_find(filter_names, ROUTER_FILTERS, colon + 1);
+                ERROR_ACTION(TAG, found < 0, continue, "Unknown route filter %s", colon + 1)
+                filter = found;
+            }
+
+            int sink = router_name_find(sink_names, ROUTER_SINKS, target);
+            ERROR_ACTION(TAG, sink < 0, continue, "Unknown route sink %s", target)
+
+            // Interfaces hold their own locks while dispatching received data
+            ERROR_ACTION(TAG, strcmp(source_names[source], sink_names[sink]) == 0, continue,
+                    "Route from %s to itself is not allowed", target)
+
+            router_route_add(source, sink, filter);
+        }
+    }
+}
+
+static void router_uart_read_handler(void* handler_args, esp_event_base_t base, int32_t length, void* buffer) {
+    router_dispatch(uart_context, buffer, length);
+}
+
+static void router_uart_write(const void *data, size_t length) {
+    uart_write((char *) data, length);
+}
+
+void router_init() {
+    char *list;
+    config_get_str_blob_alloc(CONF_ITEM(KEY_CONFIG_ROUTES), (void **) &list);
+    router_routes_parse(list);
+    free(list);
+
+    uint8_t feeds[ROUTER_SINKS] = {0};
+    uint16_t contexts[ROUTER_FILTERS] = {0};
+    for (int source = 0; source < ROUTER_SOURCES; source++) {
+        router_route_t *route = &routes[source];
+
+        bool fed[ROUTER_SINKS] = {false};
+        for (int filter = 0; filter < ROUTER_FILTERS; filter++) {
+            for (int i = 0; i < route->count[filter]; i++) fed[route->sinks[filter][i]] = true;
+
+            // Every connection has a context, filters only where the source has routes using them
+            if (filter == ROUTER_FILTER_NONE || route->count[filter] > 0) contexts[filter] += source_connections[source];
+        }
+        for (int sink = 0; sink < ROUTER_SINKS; sink++) feeds[sink] += fed[sink];
+    }
+
+    context_pool = pool_new("router_contexts", sizeof(struct router_context), contexts[ROUTER_FILTER_NONE]);
+    if (contexts[ROUTER_FILTER_RTCM] > 0) {
+        rtcm_pool = pool_new("router_rtcm_filters", sizeof(router_rtcm_filter_t), contexts[ROUTER_FILTER_RTCM]);
+    }
+    if (contexts[ROUTER_FILTER_NMEA] > 0) {
+        nmea_pool = pool_new("router_nmea_filters", sizeof(router_nmea_filter_t), contexts[ROUTER_FILTER_NMEA]);
+    }
+
+    // Sources are dispatched from different tasks, UART writes are already safe from any task
+    for (int sink = 0; sink < ROUTER_SINKS; sink++) {
+        if (sink != ROUTER_SINK_UART && feeds[sink] > 1) sinks[sink].lock = xSemaphoreCreateMutex();
+    }
+
+    router_register_sink(ROUTER_SINK_UART, router_uart_write);
+
+    // UART is a single connection for as long as the device runs
+    uart_context = router_context_new(ROUTER_SOURCE_UART);
+    ERROR_ACTION(TAG, uart_context == NULL, return, "Could not allocate UART routing context")
+
+    uart_register_read_handler(router_uart_read_handler);
+}
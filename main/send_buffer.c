@@ -0,0 +1,108 @@
+/*
+ * This file is part of the ESP32-XBee distribution (https://github.com/nebkat/esp32-xbee).
+ * Copyright (c) 2020 Nebojsa Cvetkovic.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include "send_buffer.h"
+
+void send_buffer_init(send_buffer_t *buffer, size_t size) {
+    *buffer = (send_buffer_t) {
+            .size = size
+    };
+}
+
+void send_buffer_free(send_buffer_t *buffer) {
+    free(buffer->data);
+    buffer->data = NULL;
+    buffer->offset = 0;
+    buffer->length = 0;
+}
+
+// Makes room for length more bytes after the queued data
+static bool send_buffer_reserve(send_buffer_t *buffer, size_t length) {
+    if (length > buffer->size - buffer->length) return false;
+
+    if (buffer->data == NULL) {
+        buffer->data = malloc(buffer->size);
+        if (buffer->data == NULL) return false;
+    }
+
+    if (buffer->offset + buffer->length + length > buffer->size) {
+        memmove(buffer->data, buffer->data + buffer->offset, buffer->length);
+        buffer->offset = 0;
+    }
+
+    return true;
+}
+
+int send_buffer_write(send_buffer_t *buffer, int sock, const struct iovec *iov, int iovcnt) {
+    size_t total = 0;
+    for (int i = 0; i < iovcnt; i++) total += iov[i].iov_len;
+
+    // Queued data has to go first
+    size_t sent = 0;
+    if (buffer->length == 0) {
+        struct msghdr msg = {
+                .msg_iov = (struct iovec *) iov,
+                .msg_iovlen = iovcnt
+        };
+        int ret = sendmsg(sock, &msg, MSG_DONTWAIT);
+        if (ret < 0 && errno != EWOULDBLOCK && errno != EAGAIN) return -1;
+        if (ret > 0) sent = ret;
+        if (sent == total) return sent;
+    }
+
+    if (!send_buffer_reserve(buffer, total - sent)) {
+        // Rest of a partially sent write can't be dropped without corrupting the stream
+        if (sent > 0) return -1;
+
+        buffer->dropped++;
+        return 0;
+    }
+
+    uint8_t *tail = buffer->data + buffer->offset + buffer->length;
+    size_t skip = sent;
+    for (int i = 0; i < iovcnt; i++) {
+        if (skip >= iov[i].iov_len) {
+            skip -= iov[i].iov_len;
+            continue;
+        }
+
+        size_t part = iov[i].iov_len - skip;
+        memcpy(tail, (const uint8_t *) iov[i].iov_base + skip, part);
+        tail += part;
+        skip = 0;
+    }
+    buffer->length += total - sent;
+
+    return sent;
+}
+
+int send_buffer_flush(send_buffer_t *buffer, int sock) {
+    if (buffer->length == 0) return 0;
+
+    int sent = send(sock, buffer->data + buffer->offset, buffer->length, MSG_DONTWAIT);
+    if (sent < 0) return errno == EWOULDBLOCK || errno == EAGAIN ? 0 : -1;
+
+    buffer->offset += sent;
+    buffer->length -= sent;
+    if (buffer->length == 0) buffer->offset = 0;
+
+    return sent;
+}
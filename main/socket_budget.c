@@ -0,0 +1,153 @@
+/*
+ * This file is part of the ESP32-XBee distribution (https://github.com/nebkat/esp32-xbee).
+ * Copyright (c) 2020 Nebojsa Cvetkovic.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <freertos/FreeRTOS.h>
+#include <lwip/sockets.h>
+#include "socket_budget.h"
+
+/*
+ * lwIP is built with CONFIG_LWIP_MAX_SOCKETS = 16, the most ESP-IDF 4.x allows:
+ *
+ *   web_server      6  3 clients, httpd keeps 3 more for its listener, control socket and refusals
+ *   reactor         1  wake-up socket
+ *   spare           1  SOCKET_BUDGET_SPARE
+ *                  --
+ *                   8  always taken, leaving 8 for the interfaces
+ *
+ *   ntrip_caster    2  listener and one client
+ *   ntrip_server    1  first caster
+ *   ntrip_client    1
+ *   socket_server   2  listener and one client
+ *   socket_client   1
+ *                  --
+ *                   7  reserved with every interface enabled, 1 socket shared
+ *
+ * The limits below are reached with only that interface enabled, caster and socket server clients can
+ * use all 8 interface sockets then. Enabling an owner lowers every cap to its reservation plus the
+ * sockets nobody has reserved, so /status never promises more than can be granted.
+ */
+static struct socket_budget_owner {
+    const char *name;
+
+    // Sockets guaranteed to the owner, and the most it asks for from the shared pool
+    uint8_t reserved;
+    uint8_t limit;
+    // Limit lowered to what the reservations of the enabled owners leave available
+    uint8_t cap;
+
+    bool enabled;
+    // Sockets not created through this module are counted as always in use
+    bool external;
+    uint8_t used;
+    uint32_t denied;
+} owners[SOCKET_BUDGET_OWNERS] = {
+        [SOCKET_BUDGET_WEB_SERVER] = {"web_server", SOCKET_BUDGET_WEB_SERVER_CLIENTS + 3, SOCKET_BUDGET_WEB_SERVER_CLIENTS + 3, .external = true},
+        [SOCKET_BUDGET_NTRIP_CASTER] = {"ntrip_caster", 2, 8},
+        [SOCKET_BUDGET_NTRIP_SERVER] = {"ntrip_server", 1, 3},
+        [SOCKET_BUDGET_NTRIP_CLIENT] = {"ntrip_client", 1, 3},
+        [SOCKET_BUDGET_SOCKET_SERVER] = {"socket_server", 2, 8},
+        [SOCKET_BUDGET_SOCKET_CLIENT] = {"socket_client", 1, 1},
+        [SOCKET_BUDGET_REACTOR] = {"reactor", 1, 1},
+};
+
+// Owner of each socket by number, -1 when not counted
+static int8_t sockets[CONFIG_LWIP_MAX_SOCKETS] = {[0 ... CONFIG_LWIP_MAX_SOCKETS - 1] = -1};
+
+// Sockets are acquired and released from several tasks and the UART event loop
+static portMUX_TYPE budget_lock = portMUX_INITIALIZER_UNLOCKED;
+
+void socket_budget_enable(socket_budget_owner_t owner) {
+    portENTER_CRITICAL(&budget_lock);
+    owners[owner].enabled = true;
+    if (owners[owner].external) owners[owner].used = owners[owner].reserved;
+
+    int unreserved = CONFIG_LWIP_MAX_SOCKETS - SOCKET_BUDGET_SPARE;
+    for (int i = 0; i < SOCKET_BUDGET_OWNERS; i++) {
+        if (owners[i].enabled) unreserved -= owners[i].reserved;
+    }
+
+    for (int i = 0; i < SOCKET_BUDGET_OWNERS; i++) {
+        int grantable = owners[i].reserved + (unreserved > 0 ? unreserved : 0);
+        owners[i].cap = owners[i].limit < grantable ? owners[i].limit : grantable;
+    }
+    portEXIT_CRITICAL(&budget_lock);
+}
+
+// Sockets not held by any reservation, including unused reservations as taken
+static int socket_budget_shared_free() {
+    int committed = SOCKET_BUDGET_SPARE;
+    for (int i = 0; i < SOCKET_BUDGET_OWNERS; i++) {
+        if (!owners[i].enabled) continue;
+        committed += owners[i].used > owners[i].reserved ? owners[i].used : owners[i].reserved;
+    }
+
+    return CONFIG_LWIP_MAX_SOCKETS - committed;
+}
+
+bool socket_budget_acquire(int sock, socket_budget_owner_t owner) {
+    int index = sock - LWIP_SOCKET_OFFSET;
+    if (index < 0 || index >= CONFIG_LWIP_MAX_SOCKETS) return false;
+
+    struct socket_budget_owner *budget = &owners[owner];
+
+    portENTER_CRITICAL(&budget_lock);
+    bool admitted = budget->enabled && budget->used < budget->cap &&
+            (budget->used < budget->reserved || socket_budget_shared_free() > 0);
+    if (admitted) {
+        budget->used++;
+        sockets[index] = owner;
+    } else {
+        budget->denied++;
+    }
+    portEXIT_CRITICAL(&budget_lock);
+
+    return admitted;
+}
+
+void socket_budget_release(int sock) {
+    int index = sock - LWIP_SOCKET_OFFSET;
+    if (index < 0 || index >= CONFIG_LWIP_MAX_SOCKETS) return;
+
+    portENTER_CRITICAL(&budget_lock);
+    if (sockets[index] >= 0) {
+        owners[sockets[index]].used--;
+        sockets[index] = -1;
+    }
+    portEXIT_CRITICAL(&budget_lock);
+}
+
+void socket_budget_owner_status(socket_budget_owner_t owner, socket_budget_owner_status_t *status) {
+    struct socket_budget_owner *budget = &owners[owner];
+
+    portENTER_CRITICAL(&budget_lock);
+    *status = (socket_budget_owner_status_t) {
+            .name = budget->name,
+            .enabled = budget->enabled,
+            .used = budget->used,
+            .reserved = budget->reserved,
+            .cap = budget->cap,
+            .denied = budget->denied
+    };
+    portEXIT_CRITICAL(&budget_lock);
+}
+
+int socket_budget_socket_owner(int sock) {
+    int index = sock - LWIP_SOCKET_OFFSET;
+    if (index < 0 || index >= CONFIG_LWIP_MAX_SOCKETS) return -1;
+
+    return sockets[index];
+}
@@ -205,7 +205,7 @@ void status_led_init() {
 
     ledc_fade_func_install(0);
 
-    xTaskCreate(status_led_task, "status_led", 2048, NULL, TASK_PRIORITY_STATUS_LED, &led_task);
+    xTaskCreatePinnedToCore(status_led_task, "status_led", 2048, NULL, TASK_PRIORITY_STATUS_LED, &led_task, TASK_CORE_NETWORK);
 }
 
 void rssi_led_set(uint8_t value) {
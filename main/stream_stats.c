@@ -21,6 +21,8 @@
 
 #include <sys/queue.h>
 #include <freertos/task.h>
+#include <stdbool.h>
+#include <esp_timer.h>
 #include <tasks.h>
 
 #define RUNNING_AVERAGE_PERIOD 1000
@@ -39,6 +41,10 @@ struct stream_stats {
     uint32_t rate_in_period_count;
     uint32_t rate_out_period_count;
 
+    bool correction_valid;
+    int32_t correction_age;
+    int64_t correction_time;
+
     SLIST_ENTRY(stream_stats) next;
 };
 
@@ -62,7 +68,7 @@ static void stream_stats_task(void *ctx) {
 
 void stream_stats_init() {
     SLIST_INIT(&stream_stats_list);
-    xTaskCreate(stream_stats_task, "stream_stats_task", 2048, NULL, TASK_PRIORITY_STATS, NULL);
+    xTaskCreatePinnedToCore(stream_stats_task, "stream_stats_task", 2048, NULL, TASK_PRIORITY_STATS, NULL, TASK_CORE_NETWORK);
 }
 
 stream_stats_handle_t stream_stats_new(const char *name) {
@@ -80,13 +86,26 @@ void stream_stats_increment(stream_stats_handle_t stats, uint32_t in, uint32_t o
     stats->rate_out_period_count += out;
 }
 
+void stream_stats_correction(stream_stats_handle_t stats, int32_t age) {
+    stats->correction_age = age;
+    stats->correction_time = esp_timer_get_time();
+    stats->correction_valid = true;
+}
+
 void stream_stats_values(stream_stats_handle_t stats, stream_stats_values_t *values) {
+    // Corrections keep ageing after they are received
+    int32_t correction_age = -1;
+    if (stats->correction_valid) {
+        correction_age = stats->correction_age + (int32_t) ((esp_timer_get_time() - stats->correction_time) / 1000);
+    }
+
     *values = (stream_stats_values_t) {
             .name = stats->name,
             .total_in = stats->total_in,
             .total_out = stats->total_out,
             .rate_in = stats->rate_in,
-            .rate_out = stats->rate_out
+            .rate_out = stats->rate_out,
+            .correction_age = correction_age
     };
 }
 
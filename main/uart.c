@@ -19,7 +19,10 @@
 #include <driver/gpio.h>
 #include <esp_event.h>
 #include <esp_log.h>
+#include <esp_timer.h>
+#include <stdlib.h>
 #include <string.h>
+#include <freertos/semphr.h>
 #include <protocol/nmea.h>
 #include <stream_stats.h>
 
@@ -33,12 +36,38 @@ static const char *TAG = "UART";
 ESP_EVENT_DEFINE_BASE(UART_EVENT_READ);
 ESP_EVENT_DEFINE_BASE(UART_EVENT_WRITE);
 
+// Reads are handled on the UART task rather than posted to the event loop, so framing stays on the UART core
+#define UART_READ_HANDLERS_MAX 4
+
+static esp_event_handler_t read_handlers[UART_READ_HANDLERS_MAX];
+static int read_handler_count = 0;
+static SemaphoreHandle_t read_lock;
+
 void uart_register_read_handler(esp_event_handler_t event_handler) {
-    ESP_ERROR_CHECK(esp_event_handler_register(UART_EVENT_READ, ESP_EVENT_ANY_ID, event_handler, NULL));
+    xSemaphoreTake(read_lock, portMAX_DELAY);
+    ESP_ERROR_CHECK(read_handler_count < UART_READ_HANDLERS_MAX ? ESP_OK : ESP_ERR_NO_MEM);
+    read_handlers[read_handler_count++] = event_handler;
+    xSemaphoreGive(read_lock);
 }
 
 void uart_unregister_read_handler(esp_event_handler_t event_handler) {
-    ESP_ERROR_CHECK(esp_event_handler_unregister(UART_EVENT_READ, ESP_EVENT_ANY_ID, event_handler));
+    xSemaphoreTake(read_lock, portMAX_DELAY);
+    for (int i = 0; i < read_handler_count; i++) {
+        if (read_handlers[i] != event_handler) continue;
+
+        memmove(&read_handlers[i], &read_handlers[i + 1], (read_handler_count - i - 1) * sizeof(esp_event_handler_t));
+        read_handler_count--;
+        break;
+    }
+    xSemaphoreGive(read_lock);
+}
+
+static void uart_read_dispatch(void *buffer, int32_t length) {
+    xSemaphoreTake(read_lock, portMAX_DELAY);
+    for (int i = 0; i < read_handler_count; i++) {
+        read_handlers[i](NULL, UART_EVENT_READ, length, buffer);
+    }
+    xSemaphoreGive(read_lock);
 }
 
 void uart_register_write_handler(esp_event_handler_t event_handler) {
@@ -51,9 +80,33 @@ void uart_unregister_write_handler(esp_event_handler_t event_handler) {
 
 static int uart_port = -1;
 static bool uart_log_forward = false;
+static TaskHandle_t uart_task_handle = NULL;
 
 static stream_stats_handle_t stream_stats;
 
+// Average and jitter are kept 16 times larger, each sample moves them by 1/16 as for RTP interarrival jitter
+static uart_dispatch_stats_t dispatch_stats;
+static portMUX_TYPE dispatch_stats_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static void uart_dispatch_record(uint32_t time) {
+    portENTER_CRITICAL(&dispatch_stats_lock);
+    dispatch_stats.reads++;
+    int32_t deviation = (int32_t) (time * 16) - (int32_t) dispatch_stats.average;
+    dispatch_stats.average += deviation / 16;
+    dispatch_stats.jitter += ((int32_t) abs(deviation) - (int32_t) dispatch_stats.jitter) / 16;
+    if (time > dispatch_stats.max) dispatch_stats.max = time;
+    portEXIT_CRITICAL(&dispatch_stats_lock);
+}
+
+void uart_dispatch_stats(uart_dispatch_stats_t *stats) {
+    portENTER_CRITICAL(&dispatch_stats_lock);
+    *stats = dispatch_stats;
+    portEXIT_CRITICAL(&dispatch_stats_lock);
+
+    stats->average /= 16;
+    stats->jitter /= 16;
+}
+
 static void uart_task(void *ctx);
 
 void uart_init() {
@@ -93,12 +146,16 @@ void uart_init() {
 
     stream_stats = stream_stats_new("uart");
 
-    xTaskCreate(uart_task, "uart_task", 8192, NULL, TASK_PRIORITY_UART, NULL);
+    read_lock = xSemaphoreCreateMutex();
+
+    xTaskCreatePinnedToCore(uart_task, "uart_task", 8192, NULL, TASK_PRIORITY_UART, &uart_task_handle, TASK_CORE_UART);
 }
 
 static void uart_task(void *ctx) {
     uint8_t buffer[UART_BUFFER_SIZE];
 
+    dispatch_stats.core = xPortGetCoreID();
+
     while (true) {
         int32_t len = uart_read_bytes(uart_port, buffer, sizeof(buffer), pdMS_TO_TICKS(50));
         if (len < 0) {
@@ -109,26 +166,41 @@ static void uart_task(void *ctx) {
 
         stream_stats_increment(stream_stats, len, 0);
 
-        esp_event_post(UART_EVENT_READ, len, &buffer, len, portMAX_DELAY);
+        int64_t start = esp_timer_get_time();
+        uart_read_dispatch(buffer, len);
+        uart_dispatch_record(esp_timer_get_time() - start);
     }
 }
 
 void uart_inject(void *buf, size_t len) {
-    esp_event_post(UART_EVENT_READ, len,  buf, len, portMAX_DELAY);
+    uart_read_dispatch(buf, len);
 }
 
 int uart_log(char *buf, size_t len) {
     if (!uart_log_forward) return 0;
+
+    // Waiting for TX space would hold up reads, logs from read handlers only go to the web log
+    if (uart_task_handle != NULL && xTaskGetCurrentTaskHandle() == uart_task_handle) return 0;
     return uart_write(buf, len);
 }
 
 int uart_nmea(const char *fmt, ...) {
+    // Status sentences are formatted on the stack, only unusually long ones are allocated
+    char sentence[NMEA_SENTENCE_LENGTH_MAX];
+
     va_list args;
+    va_start(args, fmt);
+    int l = nmea_vsnprintf(sentence, sizeof(sentence), fmt, args);
+    va_end(args);
+
+    if (l < 0) return l;
+    if (l < sizeof(sentence)) return uart_write(sentence, l);
+
     va_start(args, fmt);
 
     char *nmea;
     nmea_vasprintf(&nmea, fmt, args);
-    int l = uart_write(nmea, strlen(nmea));
+    l = uart_write(nmea, strlen(nmea));
     free(nmea);
 
     va_end(args);
@@ -145,7 +217,8 @@ int uart_write(char *buf, size_t len) {
 
     stream_stats_increment(stream_stats, 0, len);
 
-    esp_event_post(UART_EVENT_WRITE, len, buf, len, portMAX_DELAY);
+    // Write events are informational, never wait for room in the event loop
+    esp_event_post(UART_EVENT_WRITE, len, buf, len, 0);
 
     return written;
 }
\ No newline at end of file
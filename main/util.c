@@ -18,14 +18,19 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <mbedtls/base64.h>
 #include <sys/socket.h>
 #include <lwip/netdb.h>
 
+#include "config.h"
+#include "socket_budget.h"
 #include "util.h"
 
 void destroy_socket(int *socket) {
     if (*socket < 0) return;
+    socket_budget_release(*socket);
     shutdown(*socket, SHUT_RDWR);
     close(*socket);
     *socket = -1;
@@ -75,87 +80,57 @@ char *sockaddrtostr(struct sockaddr *a) {
     return addr_str;
 }
 
-char *extract_http_header(const char *buffer, const char *key) {
-    // Need space for key, at least 1 character, and newline
-    if (strlen(key) + 2 > strlen(buffer)) return NULL;
+// Orders addresses alternating between families, keeping the resolver's preference for the first
+int connect_socket_order(struct sockaddr_storage *resolved, int resolved_count, struct sockaddr_storage **addrs) {
+    int count = 0;
+    int family = resolved[0].ss_family;
 
-    // Cheap search ignores potential problems where searched key is suffix of another longer key
-    char *start = strcasestr(buffer, key);
-    if (!start) return NULL;
-    start += strlen(key);
+    for (int a = 0, b = 0; a < resolved_count || b < resolved_count;) {
+        while (a < resolved_count && resolved[a].ss_family != family) a++;
+        while (b < resolved_count && resolved[b].ss_family == family) b++;
 
-    char *end = strstr(start, "\r\n");
-    if (!end) return NULL;
-
-    // Trim whitespace at start and end
-    while (isspace((unsigned char) *start) && start < end) start++;
-    while (isspace((unsigned char) *(end - 1)) && start < end) end--;
-
-    int len = (int) (end - start);
-    if (len == 0) return NULL;
-
-    char *header_value = malloc(len + 1);
-    if (header_value == NULL) return NULL;
+        if (a < resolved_count) addrs[count++] = &resolved[a++];
+        if (b < resolved_count) addrs[count++] = &resolved[b++];
+    }
 
-    memcpy(header_value, start, len);
-    header_value[len] = '\0';
-    return header_value;
+    return count;
 }
 
-int connect_socket(char *host, int port, int socktype) {
-    int err;
-    struct addrinfo addr_hints;
-    struct addrinfo *addr_results;
-
-    // Obtain address(es) matching host/port
-    memset(&addr_hints, 0, sizeof(struct addrinfo));
-    addr_hints.ai_family = AF_UNSPEC;
-    addr_hints.ai_socktype = socktype;
-    addr_hints.ai_flags = AI_NUMERICSERV;
-    addr_hints.ai_protocol = 0;
-
-    char port_string[6];
-    sprintf(port_string, "%u", port);
-    err = getaddrinfo(host, port_string, &addr_hints, &addr_results);
-    if (err < 0) return CONNECT_SOCKET_ERROR_RESOLVE;
-
-    int sock = -1;
-
-    // Try all resolved hosts
-    for (struct addrinfo *addr_result = addr_results; addr_result != NULL; addr_result = addr_result->ai_next) {
-        sock = socket(addr_result->ai_family, addr_result->ai_socktype, addr_result->ai_protocol);
-        if (sock < 0) continue;
-
-        if (connect(sock, addr_result->ai_addr, addr_result->ai_addrlen) == 0) break;
-
-        close(sock);
-
-        sock = -1;
+// Starts a non-blocking connection attempt, returns the socket or -1 if it failed immediately
+int connect_socket_start(struct sockaddr_storage *addr, int port, int socktype, bool *connected) {
+    socklen_t addr_len;
+    if (addr->ss_family == AF_INET) {
+        ((struct sockaddr_in *) addr)->sin_port = htons(port);
+        addr_len = sizeof(struct sockaddr_in);
+    } else {
+        ((struct sockaddr_in6 *) addr)->sin6_port = htons(port);
+        addr_len = sizeof(struct sockaddr_in6);
     }
 
-    freeaddrinfo(addr_results);
+    int sock = socket(addr->ss_family, socktype, 0);
+    if (sock < 0) return -1;
 
-    if (sock < 0) return CONNECT_SOCKET_ERROR_CONNECT;
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
 
-    // Read/write timeouts
-    struct timeval timeout;
-    timeout.tv_sec = 10;
-    timeout.tv_usec = 0;
-    err = setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (char *)&timeout, sizeof(timeout));
-    if (err != 0) goto _opts_error;
-    err = setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, (char *)&timeout, sizeof(timeout));
-    if (err != 0) goto _opts_error;
+    *connected = connect(sock, (struct sockaddr *) addr, addr_len) == 0;
+    if (*connected || errno == EINPROGRESS) return sock;
 
-    // Reuse address
-    int reuse = 1;
-    err = setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
-    if (err != 0) goto _opts_error;
+    close(sock);
+    return -1;
+}
 
-    return sock;
+void socket_keepalive(int sock) {
+    int idle = config_get_u16(CONF_ITEM(KEY_CONFIG_TCP_KEEPALIVE_IDLE));
+    int interval = config_get_u16(CONF_ITEM(KEY_CONFIG_TCP_KEEPALIVE_INTERVAL));
+    int count = config_get_u8(CONF_ITEM(KEY_CONFIG_TCP_KEEPALIVE_COUNT));
 
-    _opts_error:
-    close(sock);
-    return CONNECT_SOCKET_ERROR_OPTS;
+    int keepalive = idle > 0;
+    setsockopt(sock, SOL_SOCKET, SO_KEEPALIVE, &keepalive, sizeof(keepalive));
+    if (!keepalive) return;
+
+    setsockopt(sock, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+    setsockopt(sock, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval));
+    setsockopt(sock, IPPROTO_TCP, TCP_KEEPCNT, &count, sizeof(count));
 }
 
 char *http_auth_basic_header(const char *username, const char *password) {
@@ -33,6 +33,15 @@
 #include <stream_stats.h>
 #include <esp32/rom/crc.h>
 #include <lwip/sockets.h>
+#include <interface/ntrip.h>
+#include <interface/socket_client.h>
+#include <interface/socket_server.h>
+#include <dns_cache.h>
+#include <pool.h>
+#include <router.h>
+#include <socket_budget.h>
+#include <tasks.h>
+#include <uart.h>
 #include "web_server.h"
 
 // Max length a file path can have on storage
@@ -41,7 +50,7 @@
 
 #define WWW_PARTITION_PATH "/www"
 #define WWW_PARTITION_LABEL "www"
-#define BUFFER_SIZE 2048
+#define BUFFER_SIZE 3072
 
 static const char *TAG = "WEB";
 
@@ -613,6 +622,19 @@ static esp_err_t config_post_handler(httpd_req_t *req) {
     return json_response(req, root);
 }
 
+static void status_tunnel(cJSON *parent, const tunnel_stats_t *stats) {
+    cJSON *tunnel = cJSON_AddObjectToObject(parent, "tunnel");
+    cJSON_AddNumberToObject(tunnel, "sent", stats->sent);
+    cJSON_AddNumberToObject(tunnel, "retransmitted", stats->retransmitted);
+    cJSON_AddNumberToObject(tunnel, "delivered", stats->delivered);
+    cJSON_AddNumberToObject(tunnel, "recovered_fec", stats->recovered_fec);
+    cJSON_AddNumberToObject(tunnel, "recovered_nack", stats->recovered_nack);
+    cJSON_AddNumberToObject(tunnel, "lost", stats->lost);
+    cJSON_AddNumberToObject(tunnel, "duplicates", stats->duplicates);
+    cJSON_AddNumberToObject(tunnel, "latency", stats->latency);
+    cJSON_AddNumberToObject(tunnel, "latency_max", stats->latency_max);
+}
+
 static esp_err_t status_get_handler(httpd_req_t *req) {
     if (check_auth(req) == ESP_FAIL) return ESP_FAIL;
 
@@ -626,6 +648,46 @@ static esp_err_t status_get_handler(httpd_req_t *req) {
     cJSON_AddNumberToObject(heap, "total", heap_caps_get_total_size(MALLOC_CAP_8BIT));
     cJSON_AddNumberToObject(heap, "free", heap_caps_get_free_size(MALLOC_CAP_8BIT));
 
+    // Fixed size pools, allocations only reach the heap once a pool is exhausted
+    cJSON *pools = cJSON_AddArrayToObject(root, "pools");
+    pool_stats_t pool_values;
+    for (pool_handle_t pool = pool_first(); pool != NULL; pool = pool_next(pool)) {
+        pool_stats(pool, &pool_values);
+
+        cJSON *pool_item = cJSON_CreateObject();
+        cJSON_AddStringToObject(pool_item, "name", pool_values.name);
+        cJSON_AddNumberToObject(pool_item, "size", pool_values.size);
+        cJSON_AddNumberToObject(pool_item, "count", pool_values.count);
+        cJSON_AddNumberToObject(pool_item, "used", pool_values.used);
+        cJSON_AddNumberToObject(pool_item, "peak", pool_values.peak);
+        cJSON_AddNumberToObject(pool_item, "exhausted", pool_values.exhausted);
+        cJSON_AddNumberToObject(pool_item, "failures", pool_values.failures);
+        cJSON_AddItemToArray(pools, pool_item);
+    }
+
+    // DNS cache
+    dns_cache_stats_t dns_stats;
+    dns_cache_stats(&dns_stats);
+    cJSON *dns = cJSON_AddObjectToObject(root, "dns");
+    cJSON_AddNumberToObject(dns, "entries", dns_stats.entries);
+    cJSON_AddNumberToObject(dns, "hits", dns_stats.hits);
+    cJSON_AddNumberToObject(dns, "stale_hits", dns_stats.stale_hits);
+    cJSON_AddNumberToObject(dns, "misses", dns_stats.misses);
+    cJSON_AddNumberToObject(dns, "failures", dns_stats.failures);
+    cJSON_AddNumberToObject(dns, "refreshes", dns_stats.refreshes);
+
+    // UART read dispatch, compare with and without task affinity while loading the web UI
+    uart_dispatch_stats_t uart_stats;
+    uart_dispatch_stats(&uart_stats);
+    cJSON *uart = cJSON_AddObjectToObject(root, "uart");
+    cJSON_AddNumberToObject(uart, "core", uart_stats.core);
+    cJSON_AddNumberToObject(uart, "reads", uart_stats.reads);
+    cJSON *dispatch = cJSON_AddObjectToObject(uart, "dispatch");
+    cJSON_AddNumberToObject(dispatch, "average", uart_stats.average);
+    cJSON_AddNumberToObject(dispatch, "jitter", uart_stats.jitter);
+    cJSON_AddNumberToObject(dispatch, "max", uart_stats.max);
+    cJSON_AddNumberToObject(dispatch, "dropped", router_dropped(ROUTER_SOURCE_UART));
+
     // Streams
     cJSON *streams = cJSON_AddObjectToObject(root, "streams");
     stream_stats_values_t values;
@@ -639,11 +701,171 @@ static esp_err_t status_get_handler(httpd_req_t *req) {
         cJSON *rate = cJSON_AddObjectToObject(stream, "rate");
         cJSON_AddNumberToObject(rate, "in", values.rate_in);
         cJSON_AddNumberToObject(rate, "out", values.rate_out);
+
+        if (values.correction_age >= 0) cJSON_AddNumberToObject(stream, "correction_age", values.correction_age);
+    }
+
+    // NTRIP server targets
+    cJSON *server_targets = cJSON_AddArrayToObject(root, "ntrip_servers");
+    ntrip_server_target_status_t target_status;
+    for (int i = 0; i < NTRIP_SERVER_TARGETS_MAX; i++) {
+        if (!ntrip_server_target_status(i, &target_status)) continue;
+
+        cJSON *target = cJSON_CreateObject();
+        cJSON_AddStringToObject(target, "host", target_status.host);
+        cJSON_AddNumberToObject(target, "port", target_status.port);
+        cJSON_AddStringToObject(target, "mountpoint", target_status.mountpoint);
+        cJSON_AddBoolToObject(target, "connected", target_status.connected);
+        cJSON_AddNumberToObject(target, "queued", target_status.queued);
+        cJSON_AddNumberToObject(target, "drops", target_status.drops);
+
+        stream_stats_values(target_status.stream_stats, &values);
+        cJSON_AddNumberToObject(target, "total_out", values.total_out);
+        cJSON_AddNumberToObject(target, "rate_out", values.rate_out);
+        cJSON_AddNumberToObject(target, "bandwidth", congestion_bandwidth(target_status.congestion));
+
+        // Messages shed by type when the uplink could not keep up
+        cJSON *shed = cJSON_AddArrayToObject(target, "shed");
+        congestion_shed_t shed_counts[CONGESTION_TYPES_MAX + 1];
+        int shed_count = congestion_shed_counts(target_status.congestion, shed_counts, CONGESTION_TYPES_MAX + 1);
+        for (int j = 0; j < shed_count; j++) {
+            cJSON *shed_type = cJSON_CreateObject();
+            cJSON_AddNumberToObject(shed_type, "type", shed_counts[j].type);
+            cJSON_AddNumberToObject(shed_type, "count", shed_counts[j].count);
+            cJSON_AddItemToArray(shed, shed_type);
+        }
+
+        cJSON_AddItemToArray(server_targets, target);
+    }
+
+    // Socket client queue
+    socket_client_status_t socket_client_values;
+    socket_client_status(&socket_client_values);
+    if (socket_client_values.active) {
+        cJSON *socket_client = cJSON_AddObjectToObject(root, "socket_client");
+        cJSON_AddBoolToObject(socket_client, "connected", socket_client_values.connected);
+        cJSON_AddNumberToObject(socket_client, "queued", socket_client_values.queued);
+        cJSON_AddNumberToObject(socket_client, "backlog", socket_client_values.backlog);
+        cJSON_AddNumberToObject(socket_client, "drops", socket_client_values.drops);
+        cJSON_AddNumberToObject(socket_client, "reconnects", socket_client_values.reconnects);
+
+        congestion_shed_t shed_counts[1];
+        int shed_count = congestion_shed_counts(socket_client_values.congestion, shed_counts, 1);
+        cJSON_AddNumberToObject(socket_client, "shed", shed_count > 0 ? shed_counts[0].count : 0);
+
+        if (socket_client_values.tunnel) status_tunnel(socket_client, &socket_client_values.tunnel_stats);
+    }
+
+    // Socket server UDP tunnels
+    if (socket_server_tunnel_active()) {
+        tunnel_stats_t socket_server_tunnel;
+        socket_server_tunnel_stats(&socket_server_tunnel);
+
+        cJSON *socket_server = cJSON_AddObjectToObject(root, "socket_server");
+        status_tunnel(socket_server, &socket_server_tunnel);
+    }
+
+    // NTRIP client sources
+    ntrip_client_status_t client_status;
+    ntrip_client_status(&client_status);
+    if (client_status.sources > 0) {
+        cJSON *client = cJSON_AddObjectToObject(root, "ntrip_client");
+        cJSON_AddNumberToObject(client, "active", client_status.active);
+        cJSON_AddNumberToObject(client, "failovers", client_status.failovers);
+        cJSON_AddNumberToObject(client, "sourcetable", client_status.sourcetable);
+
+        cJSON *sources = cJSON_AddArrayToObject(client, "sources");
+        ntrip_client_source_status_t source_status;
+        for (int i = 0; i < client_status.sources; i++) {
+            if (!ntrip_client_source_status(i, &source_status)) continue;
+
+            cJSON *source = cJSON_CreateObject();
+            cJSON_AddStringToObject(source, "host", source_status.host);
+            cJSON_AddNumberToObject(source, "port", source_status.port);
+            cJSON_AddStringToObject(source, "mountpoint", source_status.mountpoint);
+            cJSON_AddBoolToObject(source, "active", source_status.active);
+            cJSON_AddNumberToObject(source, "connections", source_status.connections);
+            cJSON_AddNumberToObject(source, "failures", source_status.failures);
+            cJSON_AddNumberToObject(source, "resolve_time", source_status.resolve_time);
+            cJSON_AddNumberToObject(source, "connect_time", source_status.connect_time);
+            cJSON_AddNumberToObject(source, "connect_attempts", source_status.connect_attempts);
+            cJSON_AddNumberToObject(source, "first_byte_time", source_status.first_byte_time);
+            cJSON_AddNumberToObject(source, "last_frame_age", source_status.last_frame_age);
+            cJSON_AddNumberToObject(source, "retry_in", source_status.retry_in);
+
+            cJSON_AddItemToArray(sources, source);
+        }
     }
 
-    // Sockets
+    // NTRIP caster relay
+    ntrip_caster_relay_status_t relay_status;
+    ntrip_caster_relay_status(&relay_status);
+    if (relay_status.active) {
+        cJSON *relay = cJSON_AddObjectToObject(root, "relay");
+        cJSON_AddBoolToObject(relay, "upstream", relay_status.upstream_connected);
+        cJSON_AddNumberToObject(relay, "packets", relay_status.packets);
+        cJSON_AddNumberToObject(relay, "hits", relay_status.hits);
+        cJSON_AddNumberToObject(relay, "outages", relay_status.outages);
+        cJSON_AddNumberToObject(relay, "outage_time", relay_status.outage_time);
+    }
+
+    // NTRIP caster mountpoints
+    cJSON *mountpoints = cJSON_AddArrayToObject(root, "mountpoints");
+    ntrip_caster_mountpoint_status_t mountpoint_status;
+    for (int i = 0; i < NTRIP_CASTER_MOUNTPOINTS; i++) {
+        if (!ntrip_caster_mountpoint_status(i, &mountpoint_status)) continue;
+
+        cJSON *mountpoint = cJSON_CreateObject();
+        cJSON_AddStringToObject(mountpoint, "name", mountpoint_status.name);
+        if (mountpoint_status.upload) {
+            cJSON_AddStringToObject(mountpoint, "source", mountpoint_status.source);
+
+            stream_stats_values(mountpoint_status.stream_stats, &values);
+            cJSON_AddNumberToObject(mountpoint, "total_in", values.total_in);
+            cJSON_AddNumberToObject(mountpoint, "rate_in", values.rate_in);
+        }
+        cJSON_AddNumberToObject(mountpoint, "clients", mountpoint_status.clients);
+        cJSON_AddNumberToObject(mountpoint, "stalled", mountpoint_status.stalled);
+
+        cJSON_AddItemToArray(mountpoints, mountpoint);
+    }
+
+    // NTRIP caster authentication failures
+    cJSON *auth_failures = cJSON_AddArrayToObject(root, "auth_failures");
+    ntrip_caster_auth_failure_status_t auth_failure_status;
+    for (int i = 0; i < NTRIP_CASTER_AUTH_FAILURES; i++) {
+        if (!ntrip_caster_auth_failure_status(i, &auth_failure_status)) continue;
+
+        cJSON *auth_failure = cJSON_CreateObject();
+        cJSON_AddStringToObject(auth_failure, "address", auth_failure_status.address);
+        cJSON_AddNumberToObject(auth_failure, "failures", auth_failure_status.failures);
+        cJSON_AddNumberToObject(auth_failure, "age", auth_failure_status.age);
+
+        cJSON_AddItemToArray(auth_failures, auth_failure);
+    }
+
+    // Socket budget
+    cJSON *socket_budget = cJSON_AddArrayToObject(root, "socket_budget");
+    for (int i = 0; i < SOCKET_BUDGET_OWNERS; i++) {
+        socket_budget_owner_status_t budget_status;
+        socket_budget_owner_status(i, &budget_status);
+        if (!budget_status.enabled) continue;
+
+        cJSON *budget = cJSON_CreateObject();
+        cJSON_AddStringToObject(budget, "name", budget_status.name);
+        cJSON_AddNumberToObject(budget, "used", budget_status.used);
+        cJSON_AddNumberToObject(budget, "reserved", budget_status.reserved);
+        cJSON_AddNumberToObject(budget, "cap", budget_status.cap);
+        cJSON_AddNumberToObject(budget, "denied", budget_status.denied);
+        cJSON_AddItemToArray(socket_budget, budget);
+    }
+
+    // Sockets, only those counted by the budget are looked up
     cJSON *sockets = cJSON_AddArrayToObject(root, "sockets");
     for (int s = LWIP_SOCKET_OFFSET; s < LWIP_SOCKET_OFFSET + CONFIG_LWIP_MAX_SOCKETS; s++) {
+        int owner = socket_budget_socket_owner(s);
+        if (owner < 0) continue;
+
         int err;
 
         int socktype;
@@ -655,6 +877,10 @@ static esp_err_t status_get_handler(httpd_req_t *req) {
 
         cJSON_AddStringToObject(socket, "type", SOCKTYPE_NAME(socktype));
 
+        socket_budget_owner_status_t budget_status;
+        socket_budget_owner_status(owner, &budget_status);
+        cJSON_AddStringToObject(socket, "owner", budget_status.name);
+
         struct sockaddr_in6 addr;
         socklen_t socklen = sizeof(addr);
 
@@ -755,6 +981,13 @@ static httpd_handle_t web_server_start(void)
     httpd_handle_t server = NULL;
     httpd_config_t config = HTTPD_DEFAULT_CONFIG();
     config.uri_match_fn = httpd_uri_match_wildcard;
+    config.task_priority = TASK_PRIORITY_WEB_SERVER;
+    config.core_id = TASK_CORE_NETWORK;
+
+    // Stay within the socket budget, the least recently used connection is closed to make room for a new one
+    config.max_open_sockets = SOCKET_BUDGET_WEB_SERVER_CLIENTS;
+    config.lru_purge_enable = true;
+    socket_budget_enable(SOCKET_BUDGET_WEB_SERVER);
 
     // Start the httpd server
     ESP_LOGI(TAG, "Starting server on port: '%d'", config.server_port);
@@ -261,6 +261,10 @@ void wait_for_ip() {
     xEventGroupWaitBits(wifi_event_group, WIFI_STA_GOT_IPV4_BIT, false, false, portMAX_DELAY);
 }
 
+bool wifi_has_ip() {
+    return (xEventGroupGetBits(wifi_event_group) & WIFI_STA_GOT_IPV4_BIT) != 0;
+}
+
 void wait_for_network() {
     xEventGroupWaitBits(wifi_event_group, WIFI_STA_GOT_IPV4_BIT | WIFI_AP_STA_CONNECTED_BIT, false, false, portMAX_DELAY);
 }
@@ -429,11 +433,13 @@ void wifi_init() {
         ESP_ERROR_CHECK(esp_wifi_set_bandwidth(WIFI_IF_STA, WIFI_BW_HT20));
 
         // Keep track of connection for RSSI indicator, but suspend until connected
-        xTaskCreate(wifi_sta_status_task, "wifi_sta_status", 2048, NULL, TASK_PRIORITY_WIFI_STATUS, &sta_status_task);
+        xTaskCreatePinnedToCore(wifi_sta_status_task, "wifi_sta_status", 2048, NULL, TASK_PRIORITY_WIFI_STATUS, &sta_status_task,
+                TASK_CORE_NETWORK);
         vTaskSuspend(sta_status_task);
 
         // Reconnect when disconnected
-        xTaskCreate(wifi_sta_reconnect_task, "wifi_sta_reconnect", 4096, NULL, TASK_PRIORITY_WIFI_STATUS, &sta_reconnect_task);
+        xTaskCreatePinnedToCore(wifi_sta_reconnect_task, "wifi_sta_reconnect", 4096, NULL, TASK_PRIORITY_WIFI_STATUS,
+                &sta_reconnect_task, TASK_CORE_NETWORK);
         vTaskSuspend(sta_reconnect_task);
 
         config_color_t sta_led_color = config_get_color(CONF_ITEM(KEY_CONFIG_WIFI_STA_COLOR));
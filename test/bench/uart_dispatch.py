@@ -0,0 +1,121 @@
+#!/usr/bin/env python3
+# Streams RTCM into the UART while loading the web UI, and samples the UART dispatch statistics from /status
+
+import argparse
+import base64
+import json
+import os
+import random
+import threading
+import time
+import urllib.request
+
+import serial
+
+
+def crc24q(data):
+    crc = 0
+    for byte in data:
+        crc ^= byte << 16
+        for _ in range(8):
+            crc <<= 1
+            if crc & 0x1000000:
+                crc ^= 0x1864CFB
+    return crc & 0xFFFFFF
+
+
+def frame(message_type, length):
+    payload = bytes([message_type >> 4, (message_type << 4) & 0xFF]) + os.urandom(length - 2)
+    head = bytes([0xD3, length >> 8, length & 0xFF]) + payload
+    return head + crc24q(head).to_bytes(3, 'big')
+
+
+# One epoch of a multi-constellation base: station, MSM7 per constellation and biases
+EPOCH = [frame(t, l) for t, l in [(1005, 19), (1077, 460), (1087, 330), (1097, 420), (1127, 390), (1230, 11)]]
+
+
+def writer(port, rate, stop):
+    sent = 0
+    start = time.monotonic()
+    while not stop.is_set():
+        for f in EPOCH:
+            port.write(f)
+            sent += len(f)
+
+        # Pace to the requested rate
+        ahead = sent / rate - (time.monotonic() - start)
+        if ahead > 0:
+            time.sleep(ahead)
+
+
+def request(url, auth):
+    req = urllib.request.Request(url)
+    if auth:
+        req.add_header('Authorization', auth)
+    with urllib.request.urlopen(req, timeout=5) as response:
+        return response.read()
+
+
+def web_load(base, auth, stop, counts):
+    paths = ['/', '/status', '/config', '/log']
+    while not stop.is_set():
+        try:
+            request(base + random.choice(paths), auth)
+            counts[0] += 1
+        except Exception:
+            counts[1] += 1
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument('--serial', required=True)
+    parser.add_argument('--baud', type=int, default=460800)
+    parser.add_argument('--host', required=True)
+    parser.add_argument('--user', default='')
+    parser.add_argument('--password', default='')
+    parser.add_argument('--rate', type=int, default=20000, help='UART bytes per second')
+    parser.add_argument('--web', type=int, default=4, help='web UI threads, 0 for no load')
+    parser.add_argument('--duration', type=int, default=60, help='seconds')
+    args = parser.parse_args()
+
+    base = 'http://' + args.host
+    auth = None
+    if args.user:
+        auth = 'Basic ' + base64.b64encode((args.user + ':' + args.password).encode()).decode()
+
+    stop = threading.Event()
+    port = serial.Serial(args.serial, args.baud)
+    threads = [threading.Thread(target=writer, args=(port, args.rate, stop), daemon=True)]
+    counts = [0, 0]
+    threads += [threading.Thread(target=web_load, args=(base, auth, stop, counts), daemon=True) for _ in range(args.web)]
+    for thread in threads:
+        thread.start()
+
+    samples = []
+    print('%6s %6s %8s %8s %8s %8s %8s' % ('time', 'core', 'rate_in', 'average', 'jitter', 'max', 'dropped'))
+    try:
+        for second in range(args.duration):
+            time.sleep(1)
+            status = json.loads(request(base + '/status', auth))
+            uart = status['uart']
+            dispatch = uart['dispatch']
+            rate_in = status['streams']['uart']['rate']['in']
+            samples.append((rate_in, dispatch['average'], dispatch['jitter'], dispatch['max'], dispatch.get('dropped', 0)))
+            print('%6d %6d %8d %8d %8d %8d %8d' % ((second + 1, uart['core']) + samples[-1]))
+    finally:
+        stop.set()
+
+    if not samples:
+        return
+
+    def mean(values):
+        return sum(values) / len(values)
+
+    print()
+    print('rate_in %.0f B/s, average %.0f us, jitter %.0f us, max %d us, dropped %d, web requests %d (%d failed)' % (
+        mean([s[0] for s in samples]), mean([s[1] for s in samples]), mean([s[2] for s in samples]),
+        samples[-1][3], samples[-1][4], counts[0], counts[1]))
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,117 @@
+/*
+ * This file is part of the ESP32-XBee distribution (https://github.com/nebkat/esp32-xbee).
+ * Copyright (c) 2020 Nebojsa Cvetkovic.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Cost of the RTCM framing done on the UART task for every read. The router RTCM filter, the NTRIP server and
+// the caster's chunking each parse the read once. Numbers are for the host CPU, on the device compare
+// uart.dispatch in /status as described in test/bench/README.md.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "protocol/rtcm.h"
+
+#define STREAM_LENGTH (1024 * 1024)
+#define PASSES 20
+// Parses per read on the UART task with every RTCM consumer enabled
+#define PARSERS 3
+
+static uint8_t stream[STREAM_LENGTH];
+static size_t frames_seen;
+
+static size_t frame_build(uint8_t *frame, uint16_t type, size_t payload_length) {
+    frame[0] = 0xD3;
+    frame[1] = payload_length >> 8;
+    frame[2] = payload_length;
+    frame[3] = type >> 4;
+    frame[4] = type << 4;
+    for (size_t i = 2; i < payload_length; i++) frame[3 + i] = rand();
+
+    uint32_t crc = rtcm_crc24q(0, frame, 3 + payload_length);
+    frame[3 + payload_length] = crc >> 16;
+    frame[4 + payload_length] = crc >> 8;
+    frame[5 + payload_length] = crc;
+
+    return payload_length + 6;
+}
+
+static void frame_count(void *ctx, uint16_t type, size_t frame_length, size_t end) {
+    (void) ctx;
+    (void) type;
+    (void) frame_length;
+    (void) end;
+    frames_seen++;
+}
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main() {
+    // One epoch of a multi-constellation base: station, MSM7 per constellation and biases
+    static const struct {
+        uint16_t type;
+        size_t length;
+    } epoch[] = {{1005, 19}, {1077, 460}, {1087, 330}, {1097, 420}, {1127, 390}, {1230, 11}};
+
+    srand(1);
+    size_t length = 0, frames = 0;
+    while (true) {
+        uint8_t frame[RTCM_FRAME_LENGTH_MAX];
+        size_t frame_length = frame_build(frame, epoch[frames % 6].type, epoch[frames % 6].length);
+        if (length + frame_length > STREAM_LENGTH) break;
+
+        memcpy(stream + length, frame, frame_length);
+        length += frame_length;
+        frames++;
+    }
+
+    static const size_t reads[] = {64, 512, 4096};
+    for (size_t r = 0; r < sizeof(reads) / sizeof(reads[0]); r++) {
+        size_t read_length = reads[r];
+
+        frames_seen = 0;
+        double start = now();
+        for (int pass = 0; pass < PASSES; pass++) {
+            rtcm_parser_t parsers[PARSERS];
+            for (int p = 0; p < PARSERS; p++) rtcm_parser_init(&parsers[p]);
+
+            for (size_t offset = 0; offset < length; offset += read_length) {
+                size_t chunk = length - offset < read_length ? length - offset : read_length;
+                for (int p = 0; p < PARSERS; p++) rtcm_parser_parse(&parsers[p], stream + offset, chunk, frame_count, NULL);
+            }
+        }
+        double elapsed = now() - start;
+
+        if (frames_seen != frames * PASSES * PARSERS) {
+            fprintf(stderr, "parsed %zu of %zu frames\n", frames_seen, frames * PASSES * PARSERS);
+            return 1;
+        }
+
+        double bytes = (double) length * PASSES;
+        double per_byte = elapsed / bytes * 1e9;
+        printf("%4zu byte reads: %6.1f MB/s, %5.2f ns/byte, %6.2f us per read, %.3f%% of a core at 921600 baud\n",
+                read_length, bytes / elapsed / 1e6, per_byte, per_byte * read_length / 1000,
+                per_byte * 92160 / 1e9 * 100);
+    }
+
+    return 0;
+}
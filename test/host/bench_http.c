@@ -0,0 +1,182 @@
+/*
+ * This file is part of the ESP32-XBee distribution (https://github.com/nebkat/esp32-xbee).
+ * Copyright (c) 2020 Nebojsa Cvetkovic.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Cost of reading the fields the caster and NTRIP client use from each corpus input, with protocol/http.c and with
+// extract_http_header as it was before the parser replaced it. Numbers are for the host CPU.
+
+#define _GNU_SOURCE
+
+#include <ctype.h>
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "protocol/http.h"
+
+#define INPUT_MAX 4096
+#define INPUTS_MAX 64
+#define PASSES 100000
+
+typedef struct input {
+    char name[256];
+    http_parser_type_t type;
+    size_t length;
+    char buffer[INPUT_MAX + 1];
+} input_t;
+
+static input_t inputs[INPUTS_MAX];
+static int input_count;
+
+// Fields looked up for a request and for a response, the target or status line comes first
+static const char *request_fields[] = {"Authorization", "User-Agent", "Ntrip-Version", "Transfer-Encoding"};
+static const char *response_fields[] = {"Content-Type"};
+
+#define FIELDS(type) ((type) == HTTP_PARSER_REQUEST ? request_fields : response_fields)
+#define FIELD_COUNT(type) ((type) == HTTP_PARSER_REQUEST ? sizeof(request_fields) / sizeof(request_fields[0]) : \
+        sizeof(response_fields) / sizeof(response_fields[0]))
+
+// Baseline copied from main/util.c before the parser was added
+static char *extract_http_header(const char *buffer, const char *key) {
+    // Need space for key, at least 1 character, and newline
+    if (strlen(key) + 2 > strlen(buffer)) return NULL;
+
+    // Cheap search ignores potential problems where searched key is suffix of another longer key
+    char *start = strcasestr(buffer, key);
+    if (!start) return NULL;
+    start += strlen(key);
+
+    char *end = strstr(start, "\r\n");
+    if (!end) return NULL;
+
+    // Trim whitespace at start and end
+    while (isspace((unsigned char) *start) && start < end) start++;
+    while (isspace((unsigned char) *(end - 1)) && start < end) end--;
+
+    int len = (int) (end - start);
+    if (len == 0) return NULL;
+
+    char *header_value = malloc(len + 1);
+    if (header_value == NULL) return NULL;
+
+    memcpy(header_value, start, len);
+    header_value[len] = '\0';
+    return header_value;
+}
+
+// Both return the total length of the values found, so the work can't be optimised away
+static size_t fields_extract(const input_t *input) {
+    size_t total = 0;
+
+    char *value = extract_http_header(input->buffer, input->type == HTTP_PARSER_REQUEST ? "GET " : "");
+    if (value != NULL) total += strlen(value);
+    free(value);
+
+    for (size_t i = 0; i < FIELD_COUNT(input->type); i++) {
+        char key[32];
+        snprintf(key, sizeof(key), "%s:", FIELDS(input->type)[i]);
+
+        value = extract_http_header(input->buffer, key);
+        if (value != NULL) total += strlen(value);
+        free(value);
+    }
+
+    return total;
+}
+
+static size_t fields_parse(const input_t *input) {
+    http_parser_t parser;
+    http_parser_init(&parser, input->type);
+    if (http_parser_parse(&parser, input->buffer, input->length) != HTTP_PARSER_RESULT_DONE) return 0;
+
+    size_t total = input->type == HTTP_PARSER_REQUEST ? parser.start_line[HTTP_REQUEST_TARGET].length :
+            http_parser_start_line(&parser).length;
+
+    for (size_t i = 0; i < FIELD_COUNT(input->type); i++) {
+        const http_span_t *value = http_parser_header(&parser, input->buffer, FIELDS(input->type)[i]);
+        if (value != NULL) total += value->length;
+    }
+
+    return total;
+}
+
+static void corpus_load(const char *directory, http_parser_type_t type) {
+    DIR *dir = opendir(directory);
+    if (dir == NULL) {
+        fprintf(stderr, "Could not open corpus %s\n", directory);
+        return;
+    }
+
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL && input_count < INPUTS_MAX) {
+        if (entry->d_name[0] == '.') continue;
+
+        char path[512];
+        snprintf(path, sizeof(path), "%s/%s", directory, entry->d_name);
+        FILE *file = fopen(path, "rb");
+        if (file == NULL) continue;
+
+        input_t *input = &inputs[input_count++];
+        snprintf(input->name, sizeof(input->name), "%s", entry->d_name);
+        input->type = type;
+        input->length = fread(input->buffer, 1, INPUT_MAX, file);
+        input->buffer[input->length] = '\0';
+        fclose(file);
+    }
+    closedir(dir);
+}
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double bench(size_t (*fields)(const input_t *), const input_t *input, size_t *total) {
+    double start = now();
+    for (int pass = 0; pass < PASSES; pass++) *total += fields(input);
+    return (now() - start) / PASSES * 1e9;
+}
+
+int main(int argc, char **argv) {
+    const char *corpus = argc > 1 ? argv[1] : "corpus";
+    char path[256];
+
+    snprintf(path, sizeof(path), "%s/http_request", corpus);
+    corpus_load(path, HTTP_PARSER_REQUEST);
+    snprintf(path, sizeof(path), "%s/http_response", corpus);
+    corpus_load(path, HTTP_PARSER_RESPONSE);
+    if (input_count == 0) return 1;
+
+    size_t total = 0;
+    double parse_sum = 0, extract_sum = 0;
+    printf("%-24s %10s %10s\n", "input", "parser ns", "helper ns");
+    for (int i = 0; i < input_count; i++) {
+        double parse = bench(fields_parse, &inputs[i], &total);
+        double extract = bench(fields_extract, &inputs[i], &total);
+        parse_sum += parse;
+        extract_sum += extract;
+
+        printf("%-24s %10.1f %10.1f\n", inputs[i].name, parse, extract);
+    }
+
+    printf("%-24s %10.1f %10.1f  (%.1fx, checksum %zu)\n", "average", parse_sum / input_count,
+            extract_sum / input_count, extract_sum / parse_sum, total);
+
+    return 0;
+}
@@ -0,0 +1,293 @@
+/*
+ * This file is part of the ESP32-XBee distribution (https://github.com/nebkat/esp32-xbee).
+ * Copyright (c) 2020 Nebojsa Cvetkovic.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Host tests for protocol/http.c, every input is also parsed split at each byte boundary
+
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "protocol/http.h"
+
+#define INPUT_MAX 4096
+#define FUZZ_ITERATIONS 2000
+
+static int failures = 0;
+
+#define CHECK(condition, format, ...) if (!(condition)) { \
+            fprintf(stderr, "%s:%d: " format "\n", __FILE__, __LINE__, ##__VA_ARGS__); \
+            failures++; \
+        }
+
+static int parse_split(http_parser_t *parser, http_parser_type_t type, const char *buffer, size_t length, size_t split) {
+    http_parser_init(parser, type);
+
+    int ret = http_parser_parse(parser, buffer, split);
+    if (ret != HTTP_PARSER_RESULT_MORE) return ret;
+
+    return http_parser_parse(parser, buffer, length);
+}
+
+static int parse_bytewise(http_parser_t *parser, http_parser_type_t type, const char *buffer, size_t length) {
+    http_parser_init(parser, type);
+
+    int ret = HTTP_PARSER_RESULT_MORE;
+    for (size_t i = 1; i <= length && ret == HTTP_PARSER_RESULT_MORE; i++) ret = http_parser_parse(parser, buffer, i);
+
+    return ret;
+}
+
+static bool span_valid(const http_span_t *span, size_t length) {
+    return (size_t) span->offset + span->length <= length;
+}
+
+static void check_invariants(const char *name, const http_parser_t *parser, int ret, size_t length) {
+    CHECK(ret >= HTTP_PARSER_RESULT_ERROR && ret <= HTTP_PARSER_RESULT_DONE, "%s: result %d", name, ret);
+    CHECK(parser->header_count <= HTTP_HEADERS_MAX, "%s: %d headers", name, parser->header_count);
+    if (ret != HTTP_PARSER_RESULT_DONE) return;
+
+    CHECK(parser->body <= length, "%s: body %zu past end %zu", name, parser->body, length);
+    for (int i = 0; i < 3; i++) CHECK(span_valid(&parser->start_line[i], length), "%s: start line span %d", name, i);
+    for (int i = 0; i < parser->header_count; i++) {
+        CHECK(span_valid(&parser->headers[i].name, length) && span_valid(&parser->headers[i].value, length),
+                "%s: header span %d", name, i);
+    }
+}
+
+// Splitting the input must not change anything but when a headerless response with nothing after it completes
+static void check_same(const char *name, size_t split, const http_parser_t *a, int ret_a, const http_parser_t *b, int ret_b) {
+    CHECK(ret_a == ret_b, "%s split %zu: result %d != %d", name, split, ret_b, ret_a);
+    if (ret_a != HTTP_PARSER_RESULT_DONE || ret_b != HTTP_PARSER_RESULT_DONE) return;
+
+    CHECK(a->body == b->body, "%s split %zu: body %zu != %zu", name, split, b->body, a->body);
+    CHECK(a->status == b->status, "%s split %zu: status %d != %d", name, split, b->status, a->status);
+    CHECK(a->header_count == b->header_count, "%s split %zu: %d headers != %d", name, split, b->header_count, a->header_count);
+    CHECK(memcmp(a->start_line, b->start_line, sizeof(a->start_line)) == 0, "%s split %zu: start line differs", name, split);
+    CHECK(memcmp(a->headers, b->headers, a->header_count * sizeof(http_header_t)) == 0, "%s split %zu: headers differ", name, split);
+}
+
+// A bare headerless status line is complete, so a split straight after one legitimately ends there
+static bool split_after_headerless(const http_parser_t *parser, size_t split) {
+    return parser->headerless && parser->header_count == 0 && parser->body == split;
+}
+
+static void check_input(const char *name, http_parser_type_t type, const char *buffer, size_t length) {
+    http_parser_t whole, split;
+    int ret = parse_split(&whole, type, buffer, length, length);
+    check_invariants(name, &whole, ret, length);
+
+    for (size_t i = 0; i < length; i++) {
+        int ret_split = parse_split(&split, type, buffer, length, i);
+        check_invariants(name, &split, ret_split, length);
+        if (split_after_headerless(&split, i)) continue;
+
+        check_same(name, i, &whole, ret, &split, ret_split);
+    }
+
+    int ret_bytewise = parse_bytewise(&split, type, buffer, length);
+    check_invariants(name, &split, ret_bytewise, length);
+    if (!split.headerless) check_same(name, 0, &whole, ret, &split, ret_bytewise);
+}
+
+static const char *header(const http_parser_t *parser, const char *buffer, const char *name) {
+    static char value[128];
+    const http_span_t *span = http_parser_header(parser, buffer, name);
+    if (span == NULL) return NULL;
+
+    http_span_copy(buffer, span, value, sizeof(value));
+    return value;
+}
+
+static void test_cases() {
+    http_parser_t parser;
+    const char *buffer;
+
+    buffer = "ICY 200 OK\r\nServer: SNIP\r\n\r\n\xd3";
+    CHECK(parse_split(&parser, HTTP_PARSER_RESPONSE, buffer, strlen(buffer), strlen(buffer)) == HTTP_PARSER_RESULT_DONE, "icy headers");
+    CHECK(parser.status == 200 && parser.header_count == 1 && parser.body == strlen(buffer) - 1, "icy headers: body %zu", parser.body);
+    CHECK(header(&parser, buffer, "server") != NULL && strcmp(header(&parser, buffer, "server"), "SNIP") == 0, "icy headers: server");
+
+    buffer = "ICY 200 OK\r\n\xd3\x00\x13";
+    CHECK(parse_split(&parser, HTTP_PARSER_RESPONSE, buffer, strlen(buffer), strlen(buffer)) == HTTP_PARSER_RESULT_DONE, "icy rtcm");
+    CHECK(parser.body == 12 && parser.header_count == 0, "icy rtcm: body %zu", parser.body);
+
+    buffer = "ICY 200 OK\r\nServer: SNIP\r\n";
+    CHECK(parse_split(&parser, HTTP_PARSER_RESPONSE, buffer, strlen(buffer), strlen(buffer)) == HTTP_PARSER_RESULT_MORE, "icy waits for blank line");
+
+    buffer = "ICY 200 OK\r\n";
+    CHECK(parse_split(&parser, HTTP_PARSER_RESPONSE, buffer, strlen(buffer), strlen(buffer)) == HTTP_PARSER_RESULT_DONE, "icy alone");
+
+    buffer = "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\nNtrip-Version: Ntrip/2.0\r\n\r\n";
+    CHECK(parse_split(&parser, HTTP_PARSER_RESPONSE, buffer, strlen(buffer), 20) == HTTP_PARSER_RESULT_DONE, "v2 response");
+    CHECK(http_span_contains(buffer, http_parser_header(&parser, buffer, "transfer-encoding"), "chunked"), "v2 chunked");
+    CHECK(http_parser_header(&parser, buffer, "Transfer") == NULL, "header names match exactly");
+
+    buffer = "HTTP/1.1 200 OK\r\nContent-Type: gnss/data";
+    CHECK(parse_split(&parser, HTTP_PARSER_RESPONSE, buffer, strlen(buffer), strlen(buffer)) == HTTP_PARSER_RESULT_MORE, "incomplete");
+
+    buffer = "SOURCE letmein /MOUNT\r\nSource-Agent: NTRIP test\r\n\r\n";
+    CHECK(parse_split(&parser, HTTP_PARSER_REQUEST, buffer, strlen(buffer), 7) == HTTP_PARSER_RESULT_DONE, "source request");
+    CHECK(http_span_equals(buffer, &parser.start_line[HTTP_REQUEST_TARGET], "letmein"), "source password");
+    CHECK(http_span_equals(buffer, &parser.start_line[HTTP_REQUEST_VERSION], "/MOUNT"), "source mountpoint");
+
+    char large[UINT16_MAX + 2];
+    memset(large, 'a', sizeof(large));
+    CHECK(parse_split(&parser, HTTP_PARSER_REQUEST, large, sizeof(large), sizeof(large)) == HTTP_PARSER_RESULT_ERROR, "oversized");
+}
+
+static void chunked_collect(void *ctx, char *data, size_t length) {
+    char *out = ctx;
+    size_t used = strlen(out);
+    memcpy(out + used, data, length);
+    out[used + length] = '\0';
+}
+
+static int chunked_split(const char *encoded, size_t length, size_t split, char *out) {
+    char buffer[INPUT_MAX];
+    memcpy(buffer, encoded, length);
+    out[0] = '\0';
+
+    http_chunked_t chunked;
+    http_chunked_init(&chunked);
+    int ret = http_chunked_decode(&chunked, buffer, split, chunked_collect, out);
+    if (ret != HTTP_CHUNKED_RESULT_MORE) return ret;
+
+    return http_chunked_decode(&chunked, buffer + split, length - split, chunked_collect, out);
+}
+
+static void test_chunked() {
+    const char *encoded = "4\r\nWiki\r\n5;ext=1\r\npedia\r\nE\r\n in\r\n\r\nchunks.\r\n0\r\nTrailer: x\r\n\r\n";
+    const char *decoded = "Wikipedia in\r\n\r\nchunks.";
+
+    char out[INPUT_MAX];
+    for (size_t i = 0; i <= strlen(encoded); i++) {
+        int ret = chunked_split(encoded, strlen(encoded), i, out);
+        CHECK(ret == HTTP_CHUNKED_RESULT_DONE && strcmp(out, decoded) == 0, "chunked split %zu: %d '%s'", i, ret, out);
+    }
+
+    CHECK(chunked_split("4\nWiki\n0\n\n", 11, 3, out) == HTTP_CHUNKED_RESULT_DONE && strcmp(out, "Wiki") == 0, "chunked bare LF");
+    CHECK(chunked_split("4\r\nWikiX\r\n", 10, 5, out) == HTTP_CHUNKED_RESULT_ERROR, "chunked missing CRLF");
+    CHECK(chunked_split("zz\r\n", 4, 1, out) == HTTP_CHUNKED_RESULT_ERROR, "chunked bad size");
+    CHECK(chunked_split("1000000\r\n", 9, 9, out) == HTTP_CHUNKED_RESULT_ERROR, "chunked oversized");
+}
+
+static uint32_t fuzz_state = 2463534242u;
+
+static uint32_t fuzz_random() {
+    fuzz_state ^= fuzz_state << 13;
+    fuzz_state ^= fuzz_state >> 17;
+    fuzz_state ^= fuzz_state << 5;
+    return fuzz_state;
+}
+
+// Mutates with bytes that matter to the parser as well as random ones
+static size_t fuzz_mutate(char *buffer, size_t length) {
+    static const char interesting[] = {'\r', '\n', ':', ' ', '\t', '\0', (char) 0xD3, (char) 0xFF};
+
+    int mutations = 1 + fuzz_random() % 4;
+    for (int i = 0; i < mutations && length > 0; i++) {
+        size_t position = fuzz_random() % length;
+        char value = fuzz_random() % 2 ? interesting[fuzz_random() % sizeof(interesting)] : (char) fuzz_random();
+
+        switch (fuzz_random() % 3) {
+            case 0:
+                buffer[position] = value;
+                break;
+            case 1:
+                if (length < INPUT_MAX) {
+                    memmove(buffer + position + 1, buffer + position, length - position);
+                    buffer[position] = value;
+                    length++;
+                }
+                break;
+            default:
+                memmove(buffer + position, buffer + position + 1, length - position - 1);
+                length--;
+                break;
+        }
+    }
+
+    return length;
+}
+
+static void fuzz_input(const char *name, http_parser_type_t type, const char *input, size_t length) {
+    char buffer[INPUT_MAX];
+    http_parser_t parser;
+
+    for (int i = 0; i < FUZZ_ITERATIONS; i++) {
+        memcpy(buffer, input, length);
+        size_t fuzzed = fuzz_mutate(buffer, length);
+
+        int ret = parse_split(&parser, type, buffer, fuzzed, fuzzed == 0 ? 0 : fuzz_random() % fuzzed);
+        check_invariants(name, &parser, ret, fuzzed);
+
+        ret = parse_bytewise(&parser, type, buffer, fuzzed);
+        check_invariants(name, &parser, ret, fuzzed);
+
+        http_chunked_t chunked;
+        http_chunked_init(&chunked);
+        char out[INPUT_MAX] = "";
+        ret = http_chunked_decode(&chunked, buffer, fuzzed < INPUT_MAX / 2 ? fuzzed : INPUT_MAX / 2, chunked_collect, out);
+        CHECK(ret >= HTTP_CHUNKED_RESULT_ERROR && ret <= HTTP_CHUNKED_RESULT_DONE, "%s: chunked result %d", name, ret);
+    }
+}
+
+static int test_corpus(const char *directory, http_parser_type_t type) {
+    DIR *dir = opendir(directory);
+    if (dir == NULL) {
+        fprintf(stderr, "Could not open corpus %s\n", directory);
+        return -1;
+    }
+
+    int count = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.') continue;
+
+        char path[512], buffer[INPUT_MAX];
+        snprintf(path, sizeof(path), "%s/%s", directory, entry->d_name);
+        FILE *file = fopen(path, "rb");
+        if (file == NULL) continue;
+        size_t length = fread(buffer, 1, sizeof(buffer), file);
+        fclose(file);
+
+        check_input(path, type, buffer, length);
+        fuzz_input(path, type, buffer, length);
+        count++;
+    }
+    closedir(dir);
+
+    return count;
+}
+
+int main(int argc, char **argv) {
+    const char *corpus = argc > 1 ? argv[1] : "corpus";
+    char path[256];
+
+    test_cases();
+    test_chunked();
+
+    snprintf(path, sizeof(path), "%s/http_response", corpus);
+    int responses = test_corpus(path, HTTP_PARSER_RESPONSE);
+    snprintf(path, sizeof(path), "%s/http_request", corpus);
+    int requests = test_corpus(path, HTTP_PARSER_REQUEST);
+    if (responses <= 0 || requests <= 0) return 1;
+
+    printf("test_http: %d responses, %d requests, %d failures\n", responses, requests, failures);
+    return failures == 0 ? 0 : 1;
+}
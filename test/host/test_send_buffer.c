@@ -0,0 +1,229 @@
+/*
+ * This file is part of the ESP32-XBee distribution (https://github.com/nebkat/esp32-xbee).
+ * Copyright (c) 2020 Nebojsa Cvetkovic.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Harness for send_buffer.c over TCP loopback, with a reader that keeps up, falls behind and stops altogether
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "send_buffer.h"
+
+#define OUTPUT_SIZE 4096
+// Default lwIP send buffer
+#define SOCKET_BUFFER 8192
+#define WRITE_LENGTH_MAX 1500
+#define WRITES 2000
+#define EXPECTED_MAX (WRITES * WRITE_LENGTH_MAX)
+
+static int failures = 0;
+
+#define CHECK(condition, format, ...) if (!(condition)) { \
+            fprintf(stderr, "%s:%d: " format "\n", __FILE__, __LINE__, ##__VA_ARGS__); \
+            failures++; \
+        }
+
+static uint32_t random_state = 2463534242u;
+
+static uint32_t test_random() {
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 17;
+    random_state ^= random_state << 5;
+    return random_state;
+}
+
+typedef struct scenario {
+    const char *name;
+    // Percent of steps the reader reads on, and most bytes it reads each time
+    int read_chance;
+    size_t read_max;
+    // Milliseconds the reader waits for data, and writes it stops for every thousand
+    int wait;
+    int pause;
+} scenario_t;
+
+static uint8_t *expected;
+static size_t expected_length, received_length;
+
+static bool wait_for(int sock, short events, int timeout) {
+    struct pollfd fd = {.fd = sock, .events = events};
+    return poll(&fd, 1, timeout) > 0;
+}
+
+static void reader(int sock, size_t max, int wait) {
+    if (!wait_for(sock, POLLIN, wait)) return;
+
+    uint8_t data[16384];
+    int len = recv(sock, data, max < sizeof(data) ? max : sizeof(data), MSG_DONTWAIT);
+    if (len <= 0) return;
+
+    CHECK(received_length + len <= expected_length, "received %zu bytes more than accepted", received_length + len - expected_length)
+    if (received_length + len > expected_length) return;
+
+    CHECK(memcmp(data, expected + received_length, len) == 0, "stream differs after %zu bytes", received_length)
+    received_length += len;
+}
+
+// Connected pair with small buffers, like an lwIP socket with a slow peer
+static void tcp_pair(int socks[2]) {
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr = {
+            .sin_family = AF_INET,
+            .sin_addr.s_addr = htonl(INADDR_LOOPBACK)
+    };
+    socklen_t addr_len = sizeof(addr);
+    if (listener < 0 || bind(listener, (struct sockaddr *) &addr, sizeof(addr)) != 0 || listen(listener, 1) != 0 ||
+            getsockname(listener, (struct sockaddr *) &addr, &addr_len) != 0) {
+        perror("listen");
+        exit(1);
+    }
+
+    int size = SOCKET_BUFFER;
+    socks[0] = socket(AF_INET, SOCK_STREAM, 0);
+    setsockopt(socks[0], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+    if (connect(socks[0], (struct sockaddr *) &addr, sizeof(addr)) != 0 || (socks[1] = accept(listener, NULL, NULL)) < 0) {
+        perror("connect");
+        exit(1);
+    }
+    setsockopt(socks[1], SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+
+    close(listener);
+}
+
+static void run(const scenario_t *scenario) {
+    int socks[2];
+    tcp_pair(socks);
+
+    send_buffer_t buffer;
+    send_buffer_init(&buffer, OUTPUT_SIZE);
+
+    expected_length = 0;
+    received_length = 0;
+
+    uint8_t data[WRITE_LENGTH_MAX];
+    uint32_t accepted = 0, partial = 0;
+    for (int i = 0; i < WRITES; i++) {
+        size_t length = 1 + test_random() % WRITE_LENGTH_MAX;
+        for (size_t j = 0; j < length; j++) data[j] = i * 31 + j;
+
+        // Split over up to three parts like a chunk header, payload and trailer
+        struct iovec iov[3];
+        size_t first = test_random() % (length + 1), second = first + test_random() % (length - first + 1);
+        iov[0] = (struct iovec) {data, first};
+        iov[1] = (struct iovec) {data + first, second - first};
+        iov[2] = (struct iovec) {data + second, length - second};
+
+        uint32_t dropped = buffer.dropped;
+        int sent = send_buffer_write(&buffer, socks[0], iov, 3);
+        CHECK(sent >= 0, "%s: write failed: %d %s", scenario->name, errno, strerror(errno))
+        if (sent < 0) break;
+
+        if (buffer.dropped == dropped) {
+            memcpy(expected + expected_length, data, length);
+            expected_length += length;
+            accepted++;
+            if (sent > 0 && (size_t) sent < length) partial++;
+        } else {
+            CHECK(sent == 0, "%s: dropped write sent %d bytes", scenario->name, sent)
+        }
+
+        // Socket would be reported writable
+        CHECK(send_buffer_flush(&buffer, socks[0]) >= 0, "%s: flush failed", scenario->name)
+
+        bool paused = i % 1000 < scenario->pause;
+        if (!paused && (int) (test_random() % 100) < scenario->read_chance) {
+            reader(socks[1], 1 + test_random() % scenario->read_max, scenario->wait);
+        }
+    }
+
+    // Drain what is left
+    while (received_length < expected_length && wait_for(socks[1], POLLIN, 1000)) {
+        CHECK(send_buffer_flush(&buffer, socks[0]) >= 0, "%s: flush failed", scenario->name)
+        reader(socks[1], 16384, 0);
+        if (send_buffer_pending(&buffer)) wait_for(socks[0], POLLOUT, 10);
+    }
+
+    CHECK(!send_buffer_pending(&buffer), "%s: %zu bytes left queued", scenario->name, buffer.length)
+    CHECK(received_length == expected_length, "%s: received %zu of %zu bytes", scenario->name, received_length, expected_length)
+    CHECK(buffer.dropped + accepted == WRITES, "%s: %u dropped and %u accepted of %d writes", scenario->name, buffer.dropped, accepted, WRITES)
+
+    printf("%-12s accepted %5u, dropped %5u, partially sent %5u, %zu bytes\n", scenario->name, accepted, buffer.dropped, partial, received_length);
+
+    send_buffer_free(&buffer);
+    close(socks[0]);
+    close(socks[1]);
+}
+
+static void run_oversized() {
+    int socks[2];
+    tcp_pair(socks);
+
+    send_buffer_t buffer;
+    send_buffer_init(&buffer, 16);
+
+    // Fill the socket so that nothing more is sent
+    uint8_t data[65536] = {0};
+    while (send(socks[0], data, sizeof(data), MSG_DONTWAIT) > 0);
+
+    struct iovec iov = {data, 17};
+    CHECK(send_buffer_write(&buffer, socks[0], &iov, 1) == 0 && buffer.dropped == 1, "oversized write was not dropped")
+    CHECK(buffer.data == NULL, "buffer allocated for a dropped write")
+
+    iov.iov_len = 16;
+    CHECK(send_buffer_write(&buffer, socks[0], &iov, 1) == 0 && buffer.length == 16, "write was not queued")
+    iov.iov_len = 1;
+    CHECK(send_buffer_write(&buffer, socks[0], &iov, 1) == 0 && buffer.dropped == 2, "write past a full buffer was not dropped")
+
+    // Partially sent write with a rest that does not fit fails rather than leaving half of it in the stream
+    send_buffer_free(&buffer);
+    close(socks[0]);
+    close(socks[1]);
+
+    tcp_pair(socks);
+    iov.iov_len = sizeof(data);
+    CHECK(send_buffer_write(&buffer, socks[0], &iov, 1) == -1, "partially sent oversized write did not fail")
+
+    send_buffer_free(&buffer);
+    close(socks[0]);
+    close(socks[1]);
+}
+
+int main() {
+    static const scenario_t scenarios[] = {
+            {"fast", 100, 16384, 1, 0},
+            {"slow", 50, 1024, 1, 0},
+            {"stalls", 100, 16384, 1, 300},
+            {"trickle", 10, 256, 0, 0},
+    };
+
+    expected = malloc(EXPECTED_MAX);
+
+    for (size_t i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]); i++) run(&scenarios[i]);
+    run_oversized();
+
+    free(expected);
+
+    printf("test_send_buffer: %d failures\n", failures);
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,250 @@
+/*
+ * This file is part of the ESP32-XBee distribution (https://github.com/nebkat/esp32-xbee).
+ * Copyright (c) 2020 Nebojsa Cvetkovic.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Loopback harness for protocol/tunnel.c, two tunnels over a simulated link that drops, delays and reorders datagrams
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "protocol/tunnel.h"
+
+#define LINK_QUEUE_MAX 4096
+#define MESSAGE_HEADER 4
+// Milliseconds between messages, 100 per second is well above a busy RTCM stream
+#define MESSAGE_INTERVAL 10
+
+static int failures = 0;
+
+#define CHECK(condition, format, ...) if (!(condition)) { \
+            fprintf(stderr, "%s:%d: " format "\n", __FILE__, __LINE__, ##__VA_ARGS__); \
+            failures++; \
+        }
+
+static uint32_t random_state = 88172645u;
+
+static uint32_t link_random() {
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 17;
+    random_state ^= random_state << 5;
+    return random_state;
+}
+
+typedef struct link_packet {
+    uint32_t arrival;
+    int to;
+    size_t length;
+    uint8_t data[TUNNEL_PACKET_MAX];
+} link_packet_t;
+
+typedef struct scenario {
+    const char *name;
+    uint32_t messages;
+    // Percent of datagrams dropped in each direction, and most milliseconds a datagram is delayed by
+    int drop;
+    int jitter;
+    uint8_t fec_group;
+    // Messages are up to this long, longer than TUNNEL_PAYLOAD_MAX splits them over several packets on lossless links
+    size_t message_max;
+    // Every lost packet must be recovered
+    bool lossless;
+    // Nothing is dropped, reordering alone must not be mistaken for loss
+    bool quiet;
+} scenario_t;
+
+static struct {
+    const scenario_t *scenario;
+    bool reliable;
+    uint32_t now;
+
+    tunnel_handle_t tunnels[2];
+    link_packet_t queue[LINK_QUEUE_MAX];
+    int queued;
+    uint32_t dropped;
+
+    // Receiver side checks
+    uint32_t next_message;
+    uint32_t delivered_messages;
+    size_t message_offset;
+    size_t message_length;
+} link;
+
+static void link_output(void *ctx, const uint8_t *packet, size_t length) {
+    int from = (int) (intptr_t) ctx;
+
+    if (!link.reliable && (int) (link_random() % 100) < link.scenario->drop) {
+        link.dropped++;
+        return;
+    }
+
+    if (link.queued == LINK_QUEUE_MAX) {
+        link.dropped++;
+        return;
+    }
+
+    link_packet_t *queued = &link.queue[link.queued++];
+    queued->arrival = link.now + 1 + (link.scenario->jitter > 0 ? link_random() % link.scenario->jitter : 0);
+    queued->to = 1 - from;
+    queued->length = length;
+    memcpy(queued->data, packet, length);
+}
+
+static uint8_t message_byte(uint32_t message, size_t offset) {
+    return (uint8_t) (message * 131 + offset * 7 + (offset >> 8));
+}
+
+static size_t message_length(uint32_t message) {
+    return MESSAGE_HEADER + message * 2654435761u % (link.scenario->message_max - MESSAGE_HEADER + 1);
+}
+
+// Messages longer than a packet are only sent over lossless links, so a packet always continues the current message
+static void link_deliver(void *ctx, const uint8_t *data, size_t length) {
+    (void) ctx;
+
+    size_t i = 0;
+    while (i < length) {
+        if (link.message_offset == 0) {
+            if (length - i < MESSAGE_HEADER) {
+                CHECK(false, "%s: truncated message header", link.scenario->name);
+                return;
+            }
+
+            uint32_t message = (uint32_t) data[i] << 24 | (uint32_t) data[i + 1] << 16 | (uint32_t) data[i + 2] << 8 | data[i + 3];
+            CHECK(message >= link.next_message, "%s: message %u after %u", link.scenario->name, message, link.next_message);
+            link.next_message = message + 1;
+            link.message_length = message_length(message);
+            link.message_offset = MESSAGE_HEADER;
+            i += MESSAGE_HEADER;
+        }
+
+        uint32_t message = link.next_message - 1;
+        for (; i < length && link.message_offset < link.message_length; i++, link.message_offset++) {
+            if (data[i] != message_byte(message, link.message_offset)) {
+                CHECK(false, "%s: message %u corrupt at %zu", link.scenario->name, message, link.message_offset);
+                link.message_offset = 0;
+                return;
+            }
+        }
+
+        if (link.message_offset == link.message_length) {
+            link.delivered_messages++;
+            link.message_offset = 0;
+        }
+    }
+}
+
+static void link_send(uint32_t message) {
+    uint8_t data[4096];
+    size_t length = message_length(message);
+
+    data[0] = message >> 24;
+    data[1] = message >> 16;
+    data[2] = message >> 8;
+    data[3] = message;
+    for (size_t i = MESSAGE_HEADER; i < length; i++) data[i] = message_byte(message, i);
+
+    tunnel_send(link.tunnels[0], data, length, link.now);
+}
+
+static void link_step() {
+    // Datagrams due at the same time keep their order, receiving may queue replies behind them
+    for (int i = 0; i < link.queued;) {
+        if (link.queue[i].arrival > link.now) {
+            i++;
+            continue;
+        }
+
+        link_packet_t packet = link.queue[i];
+        memmove(&link.queue[i], &link.queue[i + 1], (link.queued - i - 1) * sizeof(link_packet_t));
+        link.queued--;
+
+        tunnel_receive(link.tunnels[packet.to], packet.data, packet.length, link.now);
+    }
+
+    for (int i = 0; i < 2; i++) tunnel_poll(link.tunnels[i], link.now);
+
+    link.now++;
+}
+
+static void run(const scenario_t *scenario) {
+    memset(&link, 0, sizeof(link));
+    link.scenario = scenario;
+    link.now = 0xFFFF0000u; // Clock wraps during the run
+
+    tunnel_config_t config = {
+            .fec_group = scenario->fec_group,
+            .reorder_timeout = 200,
+            .nack_interval = 50
+    };
+    link.tunnels[0] = tunnel_create(&config, link_output, link_deliver, (void *) 0);
+    link.tunnels[1] = tunnel_create(&config, link_output, link_deliver, (void *) 1);
+
+    for (uint32_t message = 0; message < scenario->messages; message++) {
+        // Head and tail are sent reliably, the receiver starts at the first packet and only notices gaps before the last
+        link.reliable = message < 16 || message + 16 >= scenario->messages;
+        link_send(message);
+        for (int i = 0; i < MESSAGE_INTERVAL; i++) link_step();
+    }
+
+    // Drain the link and let outstanding gaps time out
+    link.reliable = true;
+    for (int i = 0; i < 1000; i++) link_step();
+
+    tunnel_stats_t sent, received;
+    tunnel_stats(link.tunnels[0], &sent);
+    tunnel_stats(link.tunnels[1], &received);
+
+    CHECK(link.next_message == scenario->messages, "%s: last message %u of %u", scenario->name, link.next_message, scenario->messages);
+    CHECK(received.delivered + received.lost == sent.sent, "%s: %u delivered + %u lost != %u sent",
+            scenario->name, received.delivered, received.lost, sent.sent);
+    if (scenario->lossless) {
+        CHECK(received.lost == 0 && link.delivered_messages == scenario->messages, "%s: %u packets lost, %u of %u messages",
+                scenario->name, received.lost, link.delivered_messages, scenario->messages);
+    }
+    if (scenario->quiet) {
+        CHECK(sent.retransmitted == 0 && received.duplicates == 0 && received.recovered_fec == 0,
+                "%s: %u retransmitted, %u duplicates, %u rebuilt", scenario->name, sent.retransmitted, received.duplicates,
+                received.recovered_fec);
+    }
+
+    printf("%-16s %6u messages %6u packets, %5u dropped: %6u delivered %4u FEC %5u NACK %4u lost %4u duplicate "
+           "%5u retransmitted, latency %ums max %ums\n", scenario->name, scenario->messages, sent.sent, link.dropped,
+           received.delivered, received.recovered_fec, received.recovered_nack, received.lost, received.duplicates,
+           sent.retransmitted, received.latency, received.latency_max);
+
+    tunnel_destroy(link.tunnels[0]);
+    tunnel_destroy(link.tunnels[1]);
+}
+
+int main() {
+    static const scenario_t scenarios[] = {
+            {"clean", 20000, 0, 0, 0, 200, true, true},
+            // Sequence numbers wrap
+            {"clean_split", 40000, 0, 0, 4, 1500, true, true},
+            // Jitter stays below the NACK interval
+            {"reorder", 20000, 0, 30, 4, 200, true, true},
+            {"drop_1_fec", 20000, 1, 10, 4, 200, true, false},
+            {"drop_5_nack", 20000, 5, 10, 0, 200, false, false},
+            {"drop_5_fec", 20000, 5, 30, 4, TUNNEL_PAYLOAD_MAX, false, false},
+            {"drop_20", 20000, 20, 30, 2, TUNNEL_PAYLOAD_MAX, false, false},
+    };
+
+    for (size_t i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]); i++) run(&scenarios[i]);
+
+    printf("test_tunnel: %d failures\n", failures);
+    return failures == 0 ? 0 : 1;
+}